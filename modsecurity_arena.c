@@ -0,0 +1,94 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "modsecurity_arena.h"
+
+#define MODSECURITY_ARENA_ALIGN 8
+
+void ModsecurityArenaInit(modsecurity_arena_t *arena, uint32_t size)
+{
+    arena->base = NULL;
+    arena->size = size;
+    arena->used = 0;
+}
+
+/*
+ * Bump allocate len bytes. The backing block is only allocated the first
+ * time something is asked for, so idle flows cost nothing. Returns NULL
+ * once the arena is exhausted; callers degrade instead of growing it.
+ */
+void *ModsecurityArenaAlloc(modsecurity_arena_t *arena, uint32_t len)
+{
+    uint32_t start = (arena->used + MODSECURITY_ARENA_ALIGN - 1) & ~(MODSECURITY_ARENA_ALIGN - 1);
+
+    if (len > arena->size || start > arena->size - len)
+        return NULL;
+
+    if (arena->base == NULL)
+    {
+        arena->base = (uint8_t *) malloc(arena->size);
+
+        if (arena->base == NULL)
+            return NULL;
+    }
+
+    arena->used = start + len;
+
+    return arena->base + start;
+}
+
+void ModsecurityArenaReset(modsecurity_arena_t *arena)
+{
+    arena->used = 0;
+}
+
+/* Reset, but keep the first used bytes */
+void ModsecurityArenaRewind(modsecurity_arena_t *arena, uint32_t used)
+{
+    if (used < arena->used)
+        arena->used = used;
+}
+
+void ModsecurityArenaFree(modsecurity_arena_t *arena)
+{
+    free(arena->base);
+    arena->base = NULL;
+    arena->used = 0;
+}
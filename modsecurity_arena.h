@@ -0,0 +1,20 @@
+#ifndef MODSECURITY_ARENA_H
+#define MODSECURITY_ARENA_H
+
+#include "sf_types.h"
+
+/* Fixed size bump allocator, reset as a whole */
+typedef struct _modsecurity_arena
+{
+    uint8_t *base;
+    uint32_t size;
+    uint32_t used;
+} modsecurity_arena_t;
+
+void ModsecurityArenaInit(modsecurity_arena_t *, uint32_t);
+void *ModsecurityArenaAlloc(modsecurity_arena_t *, uint32_t);
+void ModsecurityArenaReset(modsecurity_arena_t *);
+void ModsecurityArenaRewind(modsecurity_arena_t *, uint32_t);
+void ModsecurityArenaFree(modsecurity_arena_t *);
+
+#endif
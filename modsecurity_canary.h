@@ -0,0 +1,24 @@
+#ifndef MODSECURITY_CANARY_H
+#define MODSECURITY_CANARY_H
+
+#include "sf_types.h"
+#include "modsecurity_rules.h"
+
+/* Default time the canary runs on a reload, msec */
+#define MODSECURITY_CANARY_TIME      250
+
+/* Slowdowns smaller than this are noise, whatever the ratio */
+#define MODSECURITY_CANARY_FLOOR_NS  2000
+
+typedef struct _modsecurity_canary_result
+{
+    uint32_t runs;               /* corpus requests timed, per ruleset */
+    uint32_t differ;             /* corpus requests with a different verdict */
+    uint64_t p50[2];             /* live, candidate */
+    uint64_t p99[2];
+} modsecurity_canary_result_t;
+
+int ModsecurityCanaryRun(const modsecurity_ruleset_t *, const modsecurity_ruleset_t *,
+        uint32_t, uint32_t, modsecurity_canary_result_t *);
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Length of the leading run of bytes in a set. On x86 the set is looked
+ * up 32 bytes at once when the CPU has SSSE3 or AVX2: the low nibble of
+ * each byte picks its row of the set with pshufb, the high nibble picks
+ * the bit to test in that row. Those functions are built for their
+ * instruction set whatever the build targets, and the first call picks
+ * the widest the CPU runs.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) \
+    && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define MODSECURITY_CHARSET_VECTOR
+#include <immintrin.h>
+#endif
+
+#include "sf_types.h"
+#include "modsecurity_charset.h"
+
+/* From i on, eight bytes between branches, then the one that failed */
+static inline uint32_t ModsecurityCharsetSpanTail(const modsecurity_charset_lut_t *lut, const uint8_t *data,
+        uint32_t len, uint32_t i)
+{
+    for (; i + 8 <= len; i += 8)
+    {
+        uint32_t j, in = 1;
+
+        for (j = 0; j < 8; j++)
+            in &= ModsecurityCharsetLutHas(lut, data[i + j]) != 0;
+
+        if (!in)
+            break;
+    }
+
+    for (; i < len; i++)
+    {
+        if (!ModsecurityCharsetLutHas(lut, data[i]))
+            break;
+    }
+
+    return i;
+}
+
+static uint32_t ModsecurityCharsetSpanScalar(const modsecurity_charset_lut_t *lut, const uint8_t *data,
+        uint32_t len)
+{
+    return ModsecurityCharsetSpanTail(lut, data, len, 0);
+}
+
+#ifdef MODSECURITY_CHARSET_VECTOR
+static const uint8_t charset_bits[16] =
+{
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80
+};
+
+__attribute__((target("avx2")))
+static uint32_t ModsecurityCharsetSpanAvx2(const modsecurity_charset_lut_t *lut, const uint8_t *data,
+        uint32_t len)
+{
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) lut->low));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) lut->high));
+    const __m256i bits = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) charset_bits));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i seven = _mm256_set1_epi8(7);
+    uint32_t i, miss;
+
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i lo = _mm256_and_si256(x, nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+        __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(low, lo), _mm256_shuffle_epi8(high, lo),
+                _mm256_cmpgt_epi8(hi, seven));
+        __m256i bit = _mm256_shuffle_epi8(bits, hi);
+
+        miss = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit));
+
+        if (miss)
+            return i + __builtin_ctz(miss);
+    }
+
+    return ModsecurityCharsetSpanTail(lut, data, len, i);
+}
+
+__attribute__((target("ssse3")))
+static uint32_t ModsecurityCharsetSpanSsse3(const modsecurity_charset_lut_t *lut, const uint8_t *data,
+        uint32_t len)
+{
+    const __m128i low = _mm_loadu_si128((const __m128i *) lut->low);
+    const __m128i high = _mm_loadu_si128((const __m128i *) lut->high);
+    const __m128i bits = _mm_loadu_si128((const __m128i *) charset_bits);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i seven = _mm_set1_epi8(7);
+    uint32_t i, miss;
+
+    /* Two vectors a round, 32 bytes per test of the mask */
+    for (i = 0; i + 32 <= len; i += 32)
+    {
+        __m128i x0 = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i x1 = _mm_loadu_si128((const __m128i *) (data + i + 16));
+        __m128i lo0 = _mm_and_si128(x0, nibble), lo1 = _mm_and_si128(x1, nibble);
+        __m128i hi0 = _mm_and_si128(_mm_srli_epi16(x0, 4), nibble);
+        __m128i hi1 = _mm_and_si128(_mm_srli_epi16(x1, 4), nibble);
+        __m128i up0 = _mm_cmpgt_epi8(hi0, seven), up1 = _mm_cmpgt_epi8(hi1, seven);
+        __m128i row0 = _mm_or_si128(_mm_and_si128(up0, _mm_shuffle_epi8(high, lo0)),
+                _mm_andnot_si128(up0, _mm_shuffle_epi8(low, lo0)));
+        __m128i row1 = _mm_or_si128(_mm_and_si128(up1, _mm_shuffle_epi8(high, lo1)),
+                _mm_andnot_si128(up1, _mm_shuffle_epi8(low, lo1)));
+        __m128i bit0 = _mm_shuffle_epi8(bits, hi0), bit1 = _mm_shuffle_epi8(bits, hi1);
+
+        miss = ~((uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row0, bit0), bit0))
+                | (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row1, bit1), bit1)) << 16);
+
+        if (miss)
+            return i + __builtin_ctz(miss);
+    }
+
+    return ModsecurityCharsetSpanTail(lut, data, len, i);
+}
+#endif
+
+typedef uint32_t (*modsecurity_charset_span_t)(const modsecurity_charset_lut_t *, const uint8_t *, uint32_t);
+
+static uint32_t ModsecurityCharsetSpanPick(const modsecurity_charset_lut_t *, const uint8_t *, uint32_t);
+
+static modsecurity_charset_span_t modsecurity_charset_span = ModsecurityCharsetSpanPick;
+
+/* Every thread picks the same, so racing first calls are harmless */
+static uint32_t ModsecurityCharsetSpanPick(const modsecurity_charset_lut_t *lut, const uint8_t *data,
+        uint32_t len)
+{
+    modsecurity_charset_span_t span = ModsecurityCharsetSpanScalar;
+
+#ifdef MODSECURITY_CHARSET_VECTOR
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        span = ModsecurityCharsetSpanAvx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        span = ModsecurityCharsetSpanSsse3;
+#endif
+
+    __atomic_store_n(&modsecurity_charset_span, span, __ATOMIC_RELAXED);
+
+    return span(lut, data, len);
+}
+
+uint32_t ModsecurityCharsetSpan(const modsecurity_charset_lut_t *lut, const uint8_t *data, uint32_t len)
+{
+    return __atomic_load_n(&modsecurity_charset_span, __ATOMIC_RELAXED)(lut, data, len);
+}
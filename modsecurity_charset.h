@@ -0,0 +1,116 @@
+#ifndef MODSECURITY_CHARSET_H
+#define MODSECURITY_CHARSET_H
+
+#include <string.h>
+
+#include "sf_types.h"
+
+/* A set of byte values */
+typedef struct _modsecurity_charset
+{
+    uint8_t bits[32];
+} modsecurity_charset_t;
+
+static inline void ModsecurityCharsetAdd(modsecurity_charset_t *set, uint8_t c)
+{
+    set->bits[c >> 3] |= 1 << (c & 7);
+}
+
+static inline int ModsecurityCharsetHas(const modsecurity_charset_t *set, uint8_t c)
+{
+    return set->bits[c >> 3] & (1 << (c & 7));
+}
+
+static inline void ModsecurityCharsetFill(modsecurity_charset_t *set)
+{
+    memset(set->bits, 0xff, sizeof(set->bits));
+}
+
+static inline void ModsecurityCharsetUnion(modsecurity_charset_t *to, const modsecurity_charset_t *from)
+{
+    int i;
+
+    for (i = 0; i < 32; i++)
+        to->bits[i] |= from->bits[i];
+}
+
+static inline int ModsecurityCharsetMeets(const modsecurity_charset_t *a, const modsecurity_charset_t *b)
+{
+    int i;
+
+    for (i = 0; i < 32; i++)
+    {
+        if (a->bits[i] & b->bits[i])
+            return 1;
+    }
+
+    return 0;
+}
+
+static inline void ModsecurityCharsetInvert(modsecurity_charset_t *set)
+{
+    int i;
+
+    for (i = 0; i < 32; i++)
+        set->bits[i] = ~set->bits[i];
+}
+
+/* Whether every byte of a is also in b */
+static inline int ModsecurityCharsetWithin(const modsecurity_charset_t *a, const modsecurity_charset_t *b)
+{
+    int i;
+
+    for (i = 0; i < 32; i++)
+    {
+        if (a->bits[i] & ~b->bits[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * A set also laid out for nibble lookups: bit h of low[n] says whether
+ * byte h << 4 | n is in the set, high[n] the same for h + 8.
+ */
+typedef struct _modsecurity_charset_lut
+{
+    uint8_t low[16];
+    uint8_t high[16];
+    modsecurity_charset_t set;
+} modsecurity_charset_lut_t;
+
+static inline void ModsecurityCharsetLut(const modsecurity_charset_t *set, modsecurity_charset_lut_t *lut)
+{
+    int c;
+
+    memset(lut, 0, sizeof(*lut));
+    lut->set = *set;
+
+    for (c = 0; c < 256; c++)
+    {
+        if (ModsecurityCharsetHas(set, (uint8_t) c))
+            (c & 0x80 ? lut->high : lut->low)[c & 15] |= 1 << ((c >> 4) & 7);
+    }
+}
+
+static inline int ModsecurityCharsetLutHas(const modsecurity_charset_lut_t *lut, uint8_t c)
+{
+    return ModsecurityCharsetHas(&lut->set, c);
+}
+
+/* Add every byte is() holds for, or does not when negate is set */
+static inline void ModsecurityCharsetClass(modsecurity_charset_t *set, int (*is)(int), int negate)
+{
+    int c;
+
+    for (c = 0; c < 256; c++)
+    {
+        if ((is(c) != 0) != negate)
+            ModsecurityCharsetAdd(set, (uint8_t) c);
+    }
+}
+
+uint32_t ModsecurityCharsetSpan(const modsecurity_charset_lut_t *, const uint8_t *, uint32_t);
+
+#endif
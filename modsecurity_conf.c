@@ -0,0 +1,297 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Lexer for Apache style configuration files. A directive is a logical
+ * line: physical lines ending in a backslash continue on the next one,
+ * the backslash standing for a space. Tokens are split on whitespace,
+ * double quoted ones may hold it and \" is a quote inside them; every
+ * other backslash is kept, regexes need theirs. Lines starting with '#'
+ * are comments.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "sf_dynamic_preprocessor.h"
+#include "spp_modsecurity.h"
+#include "modsecurity_conf.h"
+
+int ModsecurityConfOpen(modsecurity_conf_t *conf, const char *path, char *errbuf, size_t errlen)
+{
+    struct stat st;
+    void *map = NULL;
+    int fd;
+
+    memset(conf, 0, sizeof(*conf));
+    conf->next_line = 1;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    {
+        snprintf(errbuf, errlen, "%s: %s", path, strerror(errno));
+
+        if (fd >= 0)
+            close(fd);
+
+        return MODSECURITY_FAILURE;
+    }
+
+    if (!S_ISREG(st.st_mode) || (uint64_t) st.st_size > MODSECURITY_CONF_MAX_FILE)
+    {
+        snprintf(errbuf, errlen, "%s: %s", path, S_ISREG(st.st_mode) ? "too large" : "not a regular file");
+        close(fd);
+        return MODSECURITY_FAILURE;
+    }
+
+    if (st.st_size > 0 && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        snprintf(errbuf, errlen, "%s: %s", path, strerror(errno));
+        close(fd);
+        return MODSECURITY_FAILURE;
+    }
+
+    close(fd);
+
+    if (map != NULL)
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    if ((conf->buf = (char *) malloc(MODSECURITY_CONF_MAX_DIRECTIVE)) == NULL)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+    conf->map = (const char *) map;
+    conf->size = st.st_size;
+    conf->mapped = map != NULL;
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* Lex directives from text the caller keeps until ModsecurityConfClose */
+void ModsecurityConfText(modsecurity_conf_t *conf, const char *text, size_t len)
+{
+    memset(conf, 0, sizeof(*conf));
+    conf->next_line = 1;
+
+    if ((conf->buf = (char *) malloc(MODSECURITY_CONF_MAX_DIRECTIVE)) == NULL)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+    conf->map = text;
+    conf->size = len;
+}
+
+void ModsecurityConfClose(modsecurity_conf_t *conf)
+{
+    if (conf->mapped)
+        munmap((void *) conf->map, conf->size);
+
+    free(conf->buf);
+    memset(conf, 0, sizeof(*conf));
+}
+
+/*
+ * Past the end of line if the backslash at p continues the directive,
+ * else NULL. One ending the file continues it into nothing.
+ */
+static inline const char *ConfContinues(const char *p, const char *end)
+{
+    for (p++; p < end && *p == '\r'; p++);
+
+    if (p == end)
+        return end;
+
+    return *p == '\n' ? p + 1 : NULL;
+}
+
+static inline int ConfSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* Skip the rest of a logical line, continuations included */
+static const char *ConfSkipLine(modsecurity_conf_t *conf, const char *p, const char *end)
+{
+    const char *eol, *q;
+
+    while (p < end)
+    {
+        if ((eol = memchr(p, '\n', end - p)) == NULL)
+            return end;
+
+        conf->next_line++;
+
+        for (q = eol; q > p && q[-1] == '\r'; q--);
+
+        if (q == p || q[-1] != '\\')
+            return eol + 1;
+
+        p = eol + 1;
+    }
+
+    return p;
+}
+
+/*
+ * Lex the next directive into tokens, at most max of them. Returns the
+ * token count, MODSECURITY_CONF_END after the last directive, or one of
+ * the errors; line says where the directive started either way.
+ */
+int ModsecurityConfNext(modsecurity_conf_t *conf, char **tokens, int max)
+{
+    const char *p = conf->map + conf->pos, *end = conf->map + conf->size, *next;
+    char *out = conf->buf, *limit = conf->buf + MODSECURITY_CONF_MAX_DIRECTIVE - 1;
+    int n = 0, result;
+
+    conf->line = conf->next_line;
+
+    for (;;)
+    {
+        /* Whitespace between tokens, continuations are some too */
+        for (; p < end; p++)
+        {
+            if (*p == '\\' && (next = ConfContinues(p, end)) != NULL)
+            {
+                conf->next_line++;
+                p = next - 1;
+            }
+            else if (!ConfSpace(*p))
+            {
+                break;
+            }
+        }
+
+        if (p == end || *p == '\n')
+        {
+            if (p < end)
+            {
+                conf->next_line++;
+                p++;
+            }
+
+            if (n > 0 || p == end)
+            {
+                result = n;
+                break;
+            }
+
+            conf->line = conf->next_line;
+            continue;
+        }
+
+        if (n == 0 && *p == '#')
+        {
+            p = ConfSkipLine(conf, p, end);
+            conf->line = conf->next_line;
+            continue;
+        }
+
+        if (n == max)
+        {
+            result = MODSECURITY_CONF_TOO_MANY;
+            break;
+        }
+
+        if (out >= limit)
+        {
+            result = MODSECURITY_CONF_TOO_LONG;
+            break;
+        }
+
+        tokens[n++] = out;
+
+        if (*p == '"')
+        {
+            for (p++; p < end && *p != '"' && *p != '\n' && out < limit; p++)
+            {
+                if (*p == '\\' && (next = ConfContinues(p, end)) != NULL)
+                {
+                    conf->next_line++;
+                    p = next - 1;
+                    *out++ = ' ';
+                }
+                else
+                {
+                    if (*p == '\\' && p + 1 < end && p[1] == '"')
+                        p++;
+
+                    *out++ = *p;
+                }
+            }
+
+            if (out >= limit)
+            {
+                result = MODSECURITY_CONF_TOO_LONG;
+                break;
+            }
+
+            if (p == end || *p != '"')
+            {
+                result = MODSECURITY_CONF_BAD_QUOTE;
+                break;
+            }
+
+            p++;
+        }
+        else
+        {
+            for (; p < end && !ConfSpace(*p) && *p != '\n' && out < limit; p++)
+            {
+                if (*p == '\\' && ConfContinues(p, end) != NULL)
+                    break;
+
+                *out++ = *p;
+            }
+
+            if (out >= limit)
+            {
+                result = MODSECURITY_CONF_TOO_LONG;
+                break;
+            }
+        }
+
+        *out++ = '\0';
+    }
+
+    conf->pos = p - conf->map;
+
+    return result;
+}
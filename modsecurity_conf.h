@@ -0,0 +1,41 @@
+#ifndef MODSECURITY_CONF_H
+#define MODSECURITY_CONF_H
+
+#include <stddef.h>
+
+#include "sf_types.h"
+
+/* Longest directive, continuation lines joined */
+#define MODSECURITY_CONF_MAX_DIRECTIVE  65536
+
+/* Largest configuration file we map */
+#define MODSECURITY_CONF_MAX_FILE       (1U << 30)
+
+/* ModsecurityConfNext results other than a token count */
+#define MODSECURITY_CONF_END        0
+#define MODSECURITY_CONF_BAD_QUOTE  (-1)
+#define MODSECURITY_CONF_TOO_MANY   (-2)
+#define MODSECURITY_CONF_TOO_LONG   (-3)
+
+/*
+ * A configuration file, mapped read only, or text already in memory.
+ * Directives are lexed one at a time into a single scratch buffer, so
+ * their tokens are only good until the next call.
+ */
+typedef struct _modsecurity_conf
+{
+    const char *map;
+    size_t size;
+    size_t pos;
+    uint32_t line;              /* where the last directive started */
+    uint32_t next_line;
+    char *buf;
+    int mapped;                 /* map is ours to unmap */
+} modsecurity_conf_t;
+
+int ModsecurityConfOpen(modsecurity_conf_t *, const char *, char *, size_t);
+void ModsecurityConfText(modsecurity_conf_t *, const char *, size_t);
+int ModsecurityConfNext(modsecurity_conf_t *, char **, int);
+void ModsecurityConfClose(modsecurity_conf_t *);
+
+#endif
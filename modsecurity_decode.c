@@ -0,0 +1,322 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Streaming gzip, deflate, brotli and zstd decoders for message bodies.
+ * A decoder is only set up when its body's first byte arrives, and its
+ * memory comes from an arena that is reset when the body ends; only a
+ * zstd context has to be torn down. Output goes out in pieces of a scratch
+ * buffer; decoding stops at the depth or once the output outgrows the
+ * input by more than the ratio.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <brotli/decode.h>
+
+#include <zstd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "modsecurity_decode.h"
+
+#define MODSECURITY_DECODE_OUT      16384
+
+/* zstd's own buffers next to its window, counted against the arena size */
+#define MODSECURITY_DECODE_ZSTD_OVERHEAD  (256 * 1024)
+#define MODSECURITY_DECODE_ZSTD_WINDOW_MIN 10
+
+modsecurity_decode_stats_t modsecurity_decode_stats;
+
+/* Engine state is single threaded, one scratch buffer for all decoders */
+static uint8_t decode_out[MODSECURITY_DECODE_OUT];
+
+/* Content-Encoding value, only a single coding is decoded */
+int ModsecurityDecodeType(const uint8_t *value, uint32_t len)
+{
+    while (len && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+        len--;
+
+    if (len == 0 || (len == 8 && !strncasecmp((const char *) value, "identity", 8)))
+        return MODSECURITY_DECODE_NONE;
+
+    if ((len == 4 && !strncasecmp((const char *) value, "gzip", 4))
+            || (len == 6 && !strncasecmp((const char *) value, "x-gzip", 6)))
+        return MODSECURITY_DECODE_GZIP;
+
+    if (len == 7 && !strncasecmp((const char *) value, "deflate", 7))
+        return MODSECURITY_DECODE_DEFLATE;
+
+    if (len == 2 && !strncasecmp((const char *) value, "br", 2))
+        return MODSECURITY_DECODE_BROTLI;
+
+    if (len == 4 && !strncasecmp((const char *) value, "zstd", 4))
+        return MODSECURITY_DECODE_ZSTD;
+
+    return MODSECURITY_DECODE_OTHER;
+}
+
+void ModsecurityDecoderInit(modsecurity_decoder_t *decoder, int type)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->type = type;
+}
+
+/* What of a decoder's state is not in the arena, before the arena is reset */
+void ModsecurityDecoderEnd(modsecurity_decoder_t *decoder)
+{
+    if (decoder->type == MODSECURITY_DECODE_ZSTD && decoder->state != NULL)
+        ZSTD_freeDCtx((ZSTD_DCtx *) decoder->state);
+
+    decoder->state = NULL;
+}
+
+/* Allocators over the arena, frees wait for the reset */
+static voidpf DecodeZalloc(voidpf arena, uInt items, uInt size)
+{
+    return ModsecurityArenaAlloc((modsecurity_arena_t *) arena, items * size);
+}
+
+static void DecodeZfree(voidpf arena, voidpf ptr)
+{
+}
+
+static void *DecodeAlloc(void *arena, size_t size)
+{
+    return size > UINT32_MAX ? NULL : ModsecurityArenaAlloc((modsecurity_arena_t *) arena, (uint32_t) size);
+}
+
+static void DecodeFree(void *arena, void *ptr)
+{
+}
+
+static void *DecodeState(modsecurity_decoder_t *decoder, modsecurity_arena_t *arena, int raw)
+{
+    z_stream *zs;
+    ZSTD_DCtx *zd;
+    int log;
+
+    switch (decoder->type)
+    {
+        case MODSECURITY_DECODE_GZIP:
+        case MODSECURITY_DECODE_DEFLATE:
+            if ((zs = (z_stream *) ModsecurityArenaAlloc(arena, sizeof(*zs))) == NULL)
+                return NULL;
+
+            memset(zs, 0, sizeof(*zs));
+            zs->zalloc = DecodeZalloc;
+            zs->zfree = DecodeZfree;
+            zs->opaque = arena;
+
+            /* 32 takes gzip or zlib headers, raw is deflate sent without one */
+            if (inflateInit2(zs, raw ? -MAX_WBITS : MAX_WBITS + 32) != Z_OK)
+                return NULL;
+
+            return zs;
+
+        case MODSECURITY_DECODE_BROTLI:
+            return BrotliDecoderCreateInstance(DecodeAlloc, DecodeFree, arena);
+
+        case MODSECURITY_DECODE_ZSTD:
+            /*
+             * The stable API gives zstd no allocator, so its state is its
+             * own, freed by ModsecurityDecoderEnd. Windows the arena could
+             * not hold are refused up front all the same.
+             */
+            if ((zd = ZSTD_createDCtx()) == NULL)
+                return NULL;
+
+            for (log = MODSECURITY_DECODE_ZSTD_WINDOW_MIN; log < 31
+                    && (1u << (log + 1)) + MODSECURITY_DECODE_ZSTD_OVERHEAD <= arena->size; log++);
+
+            if (ZSTD_isError(ZSTD_DCtx_setParameter(zd, ZSTD_d_windowLogMax, log)))
+            {
+                ZSTD_freeDCtx(zd);
+                return NULL;
+            }
+
+            return zd;
+    }
+
+    return NULL;
+}
+
+/* One step over the input into decode_out, the bytes written or -1 */
+static int DecodeStep(modsecurity_decoder_t *decoder, const uint8_t **data, uint32_t *len)
+{
+    size_t avail_in = *len, avail_out = MODSECURITY_DECODE_OUT;
+    const uint8_t *next_in = *data;
+    uint8_t *next_out = decode_out;
+    BrotliDecoderResult br;
+    ZSTD_inBuffer zin;
+    ZSTD_outBuffer zout;
+    z_stream *zs;
+    size_t ret;
+    int rc;
+
+    switch (decoder->type)
+    {
+        case MODSECURITY_DECODE_GZIP:
+        case MODSECURITY_DECODE_DEFLATE:
+            zs = (z_stream *) decoder->state;
+            zs->next_in = (Bytef *) next_in;
+            zs->avail_in = *len;
+            zs->next_out = decode_out;
+            zs->avail_out = MODSECURITY_DECODE_OUT;
+
+            rc = inflate(zs, Z_SYNC_FLUSH);
+
+            if (rc == Z_STREAM_END)
+                decoder->flags |= MODSECURITY_DECODE_END;
+            else if (rc != Z_OK && rc != Z_BUF_ERROR)
+                return -1;
+
+            *data = zs->next_in;
+            *len = zs->avail_in;
+
+            return MODSECURITY_DECODE_OUT - zs->avail_out;
+
+        case MODSECURITY_DECODE_BROTLI:
+            br = BrotliDecoderDecompressStream((BrotliDecoderState *) decoder->state,
+                    &avail_in, &next_in, &avail_out, &next_out, NULL);
+
+            if (br == BROTLI_DECODER_RESULT_SUCCESS)
+                decoder->flags |= MODSECURITY_DECODE_END;
+            else if (br == BROTLI_DECODER_RESULT_ERROR)
+                return -1;
+
+            *data = next_in;
+            *len = avail_in;
+
+            return MODSECURITY_DECODE_OUT - avail_out;
+
+        case MODSECURITY_DECODE_ZSTD:
+            zin.src = next_in;
+            zin.size = *len;
+            zin.pos = 0;
+            zout.dst = decode_out;
+            zout.size = MODSECURITY_DECODE_OUT;
+            zout.pos = 0;
+
+            ret = ZSTD_decompressStream((ZSTD_DCtx *) decoder->state, &zout, &zin);
+
+            if (ZSTD_isError(ret))
+                return -1;
+
+            if (ret == 0)
+                decoder->flags |= MODSECURITY_DECODE_END;
+
+            *data += zin.pos;
+            *len -= zin.pos;
+
+            return zout.pos;
+    }
+
+    return -1;
+}
+
+/* Is a deflate body zlib wrapped, as it should be, or bare as some servers send it */
+static int DecodeRaw(const uint8_t *data, uint32_t len)
+{
+    if (len < 2)
+        return 0;
+
+    return (data[0] & 0x0f) != Z_DEFLATED || ((data[0] << 8) | data[1]) % 31 != 0;
+}
+
+void ModsecurityDecode(modsecurity_decoder_t *decoder, modsecurity_arena_t *arena,
+        const modsecurity_decode_limits_t *limits, const uint8_t *data, uint32_t len,
+        ModsecurityDecodeFunc func, void *ctx)
+{
+    const uint8_t *start = data, *last;
+    int n;
+
+    if (decoder->flags || len == 0)
+        return;
+
+    if (decoder->state == NULL)
+    {
+        modsecurity_decode_stats.bodies[decoder->type]++;
+        decoder->state = DecodeState(decoder, arena,
+                decoder->type == MODSECURITY_DECODE_DEFLATE && DecodeRaw(data, len));
+
+        if (decoder->state == NULL)
+        {
+            decoder->flags |= MODSECURITY_DECODE_ERROR;
+            modsecurity_decode_stats.errors++;
+            return;
+        }
+    }
+
+    do
+    {
+        last = data;
+
+        if ((n = DecodeStep(decoder, &data, &len)) < 0)
+        {
+            decoder->flags |= MODSECURITY_DECODE_ERROR;
+            modsecurity_decode_stats.errors++;
+            break;
+        }
+
+        if (decoder->out + n >= limits->depth)
+        {
+            n = limits->depth - decoder->out;
+            decoder->flags |= MODSECURITY_DECODE_DEPTH;
+            modsecurity_decode_stats.depth_reached++;
+        }
+
+        decoder->out += n;
+
+        if (n > 0)
+            func(ctx, decode_out, n);
+
+        if (decoder->flags)
+            break;
+
+        if (limits->ratio && decoder->out > (decoder->in + (data - start)) * limits->ratio
+                + MODSECURITY_DECODE_SLACK)
+        {
+            decoder->flags |= MODSECURITY_DECODE_RATIO;
+            modsecurity_decode_stats.ratio_exceeded++;
+            break;
+        }
+    }
+    while ((len > 0 && data != last) || n == MODSECURITY_DECODE_OUT);
+
+    decoder->in += data - start;
+}
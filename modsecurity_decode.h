@@ -0,0 +1,66 @@
+#ifndef MODSECURITY_DECODE_H
+#define MODSECURITY_DECODE_H
+
+#include "sf_types.h"
+#include "modsecurity_arena.h"
+
+/* Content codings */
+#define MODSECURITY_DECODE_NONE      0
+#define MODSECURITY_DECODE_GZIP      1
+#define MODSECURITY_DECODE_DEFLATE   2
+#define MODSECURITY_DECODE_BROTLI    3
+#define MODSECURITY_DECODE_ZSTD      4
+#define MODSECURITY_DECODE_OTHER     5      /* unknown or stacked, left as is */
+#define MODSECURITY_DECODE_TYPES     6
+
+/* Decoder flags, any of them stops decoding for the rest of the body */
+#define MODSECURITY_DECODE_END       0x01   /* end of the compressed stream */
+#define MODSECURITY_DECODE_ERROR     0x02   /* corrupt, or out of decoder memory */
+#define MODSECURITY_DECODE_DEPTH     0x04   /* decompress_depth bytes decoded */
+#define MODSECURITY_DECODE_RATIO     0x08   /* decoded too much for what came in */
+
+/* Defaults, as decompress_depth, decompress_ratio and decompress_memory */
+#define MODSECURITY_DECODE_DEPTH_DEFAULT   65535
+#define MODSECURITY_DECODE_RATIO_DEFAULT   100
+#define MODSECURITY_DECODE_MEMORY_DEFAULT  (4 * 1024 * 1024)
+#define MODSECURITY_DECODE_MEMORY_MIN      (64 * 1024)
+
+/* Output allowed past the ratio, small bodies compress well too */
+#define MODSECURITY_DECODE_SLACK     4096
+
+typedef struct _modsecurity_decode_limits
+{
+    uint32_t depth;             /* decoded bytes per body */
+    uint32_t ratio;             /* decoded bytes per compressed byte */
+} modsecurity_decode_limits_t;
+
+/* One body's decoder, its state lives in an arena reset with the body */
+typedef struct _modsecurity_decoder
+{
+    int type;
+    uint32_t flags;
+    void *state;                /* created on the first body byte */
+    uint64_t in;
+    uint64_t out;
+} modsecurity_decoder_t;
+
+typedef struct _modsecurity_decode_stats
+{
+    uint64_t bodies[MODSECURITY_DECODE_TYPES];
+    uint64_t depth_reached;
+    uint64_t ratio_exceeded;
+    uint64_t errors;
+} modsecurity_decode_stats_t;
+
+extern modsecurity_decode_stats_t modsecurity_decode_stats;
+
+/* Decoded bytes; NULL data marks the end of a body or head */
+typedef void (*ModsecurityDecodeFunc)(void *, const uint8_t *, uint32_t);
+
+int ModsecurityDecodeType(const uint8_t *, uint32_t);
+void ModsecurityDecoderInit(modsecurity_decoder_t *, int);
+void ModsecurityDecoderEnd(modsecurity_decoder_t *);
+void ModsecurityDecode(modsecurity_decoder_t *, modsecurity_arena_t *, const modsecurity_decode_limits_t *,
+        const uint8_t *, uint32_t, ModsecurityDecodeFunc, void *);
+
+#endif
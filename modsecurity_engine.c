@@ -0,0 +1,1314 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <ctype.h>
+#include <pcre.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "sf_dynamic_preprocessor.h"
+#include "spp_modsecurity.h"
+#include "modsecurity_engine.h"
+#include "modsecurity_regex.h"
+#include "modsecurity_injection.h"
+#include "modsecurity_iptable.h"
+
+/* Values longer than this are truncated before transformation */
+#define MODSECURITY_MAX_VALUE  65536
+#define MODSECURITY_OVECTOR    30
+#define MODSECURITY_DFA_WORKSPACE  4096
+
+/* Presence bitmaps remembered per evaluation, direct mapped on the value */
+#define MODSECURITY_PRESENCE_SLOTS 256
+
+modsecurity_engine_stats_t modsecurity_engine_stats;
+
+typedef struct _modsecurity_presence
+{
+    const uint8_t *data;
+    uint32_t len;
+    uint32_t gen;
+    modsecurity_charset_t set;
+} modsecurity_presence_t;
+
+struct _modsecurity_engine_scratch
+{
+    uint8_t transform[2][MODSECURITY_MAX_VALUE];
+    int dfa_workspace[MODSECURITY_DFA_WORKSPACE];
+
+    /* Values only stay put for one ModsecurityEngineEval, gen tells them apart */
+    modsecurity_presence_t presence[MODSECURITY_PRESENCE_SLOTS];
+    uint32_t presence_gen;
+    const modsecurity_charset_t *safe;  /* safe set of the ruleset being run */
+
+    modsecurity_regex_scratch_t *regex;
+    modsecurity_engine_stats_t *stats;
+    modsecurity_engine_stats_t own;     /* when the caller keeps none */
+
+    /* Parallel to the rules of the last shadow ruleset run */
+    modsecurity_rule_stats_t *rule_stats;
+    uint64_t rule_stats_generation;
+};
+
+/* Counts go to stats and regex_stats, either NULL if nobody looks */
+modsecurity_engine_scratch_t *ModsecurityEngineScratchNew(modsecurity_engine_stats_t *stats,
+        modsecurity_regex_stats_t *regex_stats)
+{
+    modsecurity_engine_scratch_t *scratch;
+
+    if ((scratch = (modsecurity_engine_scratch_t *) calloc(1, sizeof(*scratch))) == NULL)
+        return NULL;
+
+    scratch->stats = stats ? stats : &scratch->own;
+
+    if ((scratch->regex = ModsecurityRegexScratchNew(regex_stats)) == NULL)
+    {
+        free(scratch);
+        return NULL;
+    }
+
+    return scratch;
+}
+
+void ModsecurityEngineScratchFree(modsecurity_engine_scratch_t *scratch)
+{
+    if (scratch == NULL)
+        return;
+
+    ModsecurityRegexScratchFree(scratch->regex);
+    free(scratch->rule_stats);
+    free(scratch);
+}
+
+/* What running ruleset as a shadow cost in this scratch, NULL if it never ran here */
+const modsecurity_rule_stats_t *ModsecurityEngineRuleStats(const modsecurity_engine_scratch_t *scratch,
+        const modsecurity_ruleset_t *ruleset)
+{
+    if (scratch == NULL || scratch->rule_stats_generation != ruleset->generation)
+        return NULL;
+
+    return scratch->rule_stats;
+}
+
+/* Counts start over for each new shadow ruleset, NULL if there is no room for them */
+static modsecurity_rule_stats_t *ModsecurityEngineRuleStatsFor(modsecurity_engine_scratch_t *scratch,
+        const modsecurity_ruleset_t *ruleset)
+{
+    if (scratch->rule_stats != NULL && scratch->rule_stats_generation == ruleset->generation)
+        return scratch->rule_stats;
+
+    free(scratch->rule_stats);
+    scratch->rule_stats_generation = 0;
+
+    if ((scratch->rule_stats = (modsecurity_rule_stats_t *)
+                calloc(ruleset->count + 1, sizeof(modsecurity_rule_stats_t))) != NULL)
+        scratch->rule_stats_generation = ruleset->generation;
+
+    return scratch->rule_stats;
+}
+
+void ModsecurityTxInit(modsecurity_tx_t *tx, const modsecurity_http_request_t *request,
+        modsecurity_arena_t *arena)
+{
+    tx->flags = MODSECURITY_TX_ACTIVE | (tx->flags & MODSECURITY_TX_SHADOW);
+    tx->verdict = MODSECURITY_ACTION_PASS;
+    tx->rule = NULL;
+    tx->request = request;
+    tx->arena = arena;
+    tx->body.data = NULL;
+    tx->body.len = 0;
+    tx->args = tx->post_args = tx->headers = tx->cookies = NULL;
+    tx->nargs = tx->npost_args = tx->nheaders = tx->ncookies = 0;
+}
+
+/* Urlencoded bodies are split into ARGS_POST only if some rule wants them */
+static void ModsecurityTxForm(const modsecurity_ruleset_t *ruleset, modsecurity_tx_t *tx)
+{
+    if (tx->body_limit == 0 || !(ruleset->vars & MODSECURITY_VARS_FORM)
+            || !ModsecurityFormIs(&tx->request->header))
+        return;
+
+    tx->flags |= MODSECURITY_TX_FORM;
+    ModsecurityFormInit(&tx->form, tx->arena, MODSECURITY_MAX_ARGS, tx->body_limit);
+}
+
+/* ARGS_POST as the form parser finds them */
+static void ModsecurityTxPostArg(void *ctx, const modsecurity_buf_t *name, const modsecurity_buf_t *value)
+{
+    modsecurity_tx_t *tx = (modsecurity_tx_t *) ctx;
+
+    if (tx->post_args == NULL && (tx->post_args = (modsecurity_pair_t *)
+                ModsecurityArenaAlloc(tx->arena, MODSECURITY_MAX_ARGS * sizeof(modsecurity_pair_t))) == NULL)
+        return;
+
+    tx->post_args[tx->npost_args].name = *name;
+    tx->post_args[tx->npost_args].value = *value;
+    tx->npost_args++;
+}
+
+/* The body is complete, ARGS_POST with it; what phase 1 built lacks them */
+static void ModsecurityTxBodyEnd(modsecurity_tx_t *tx)
+{
+    tx->flags &= ~(MODSECURITY_TX_FULL_BUILT | MODSECURITY_TX_SIZE_BUILT);
+
+    if (!(tx->flags & MODSECURITY_TX_FORM))
+        return;
+
+    ModsecurityFormEnd(&tx->form, ModsecurityTxPostArg, tx);
+
+    if (tx->form.truncated)
+        tx->scratch->stats->forms_truncated++;
+}
+
+/*
+ * Append a body segment to what phase 2 gets to see, up to body_limit.
+ * Urlencoded bodies are split into ARGS_POST on the way, past the limit
+ * too, until MODSECURITY_MAX_ARGS of them or body_limit decoded bytes.
+ */
+void ModsecurityTxBody(modsecurity_tx_t *tx, const modsecurity_buf_t *segment)
+{
+    uint32_t n;
+
+    if (tx->flags & MODSECURITY_TX_FORM)
+        ModsecurityFormParse(&tx->form, segment->data, segment->len, ModsecurityTxPostArg, tx);
+
+    if (tx->body_limit == 0 || tx->body.len == tx->body_limit)
+        return;
+
+    if (tx->body.data == NULL
+            && (tx->body.data = (const uint8_t *) ModsecurityArenaAlloc(tx->arena, tx->body_limit)) == NULL)
+        return;
+
+    n = tx->body_limit - tx->body.len;
+
+    if (n > segment->len)
+        n = segment->len;
+
+    memcpy((uint8_t *) tx->body.data + tx->body.len, segment->data, n);
+    tx->body.len += n;
+}
+
+static inline int ModsecurityNameIs(const modsecurity_buf_t *name, const char *want)
+{
+    return want == NULL || (strlen(want) == name->len
+            && !strncasecmp((const char *) name->data, want, name->len));
+}
+
+static modsecurity_buf_t ModsecurityQueryString(const modsecurity_http_request_t *request)
+{
+    modsecurity_buf_t query = { NULL, 0 };
+    const uint8_t *q = memchr(request->raw_uri.data, '?', request->raw_uri.len);
+
+    if (q != NULL)
+    {
+        query.data = q + 1;
+        query.len = request->raw_uri.len - (q + 1 - request->raw_uri.data);
+    }
+
+    return query;
+}
+
+/* Decode one name or value into the arena; NULL arena space keeps it raw */
+static void ModsecurityDecodeInto(modsecurity_tx_t *tx, const uint8_t *data, uint32_t len,
+        modsecurity_buf_t *out)
+{
+    uint8_t *buf;
+
+    out->data = data;
+    out->len = len;
+
+    if (memchr(data, '%', len) == NULL && memchr(data, '+', len) == NULL)
+        return;
+
+    if ((buf = (uint8_t *) ModsecurityArenaAlloc(tx->arena, len)) == NULL)
+        return;
+
+    out->len = ModsecurityHttpUrlDecode(data, len, buf, 1);
+    out->data = buf;
+}
+
+static void ModsecurityParseArgs(modsecurity_tx_t *tx)
+{
+    modsecurity_buf_t query = ModsecurityQueryString(tx->request);
+    const uint8_t *p = query.data, *end = query.data + query.len, *amp, *eq;
+    uint32_t count = 1, i;
+
+    tx->flags |= MODSECURITY_TX_ARGS_PARSED;
+
+    if (query.len == 0)
+        return;
+
+    for (i = 0; i < query.len; i++)
+        count += query.data[i] == '&';
+
+    if (count > MODSECURITY_MAX_ARGS)
+        count = MODSECURITY_MAX_ARGS;
+
+    if (tx->args == NULL && (tx->args = (modsecurity_pair_t *)
+                ModsecurityArenaAlloc(tx->arena, count * sizeof(modsecurity_pair_t))) == NULL)
+        return;
+
+    while (p < end && tx->nargs < count)
+    {
+        if ((amp = memchr(p, '&', end - p)) == NULL)
+            amp = end;
+
+        if (amp > p)
+        {
+            if ((eq = memchr(p, '=', amp - p)) == NULL)
+                eq = amp;
+
+            ModsecurityDecodeInto(tx, p, eq - p, &tx->args[tx->nargs].name);
+            ModsecurityDecodeInto(tx, eq < amp ? eq + 1 : amp, eq < amp ? amp - eq - 1 : 0,
+                    &tx->args[tx->nargs].value);
+            tx->nargs++;
+        }
+
+        p = amp + 1;
+    }
+}
+
+static void ModsecurityParseHeaders(modsecurity_tx_t *tx)
+{
+    const modsecurity_buf_t *block = &tx->request->header;
+    const uint8_t *p = block->data, *end = block->data + block->len, *eol, *colon, *v, *le;
+
+    tx->flags |= MODSECURITY_TX_HEADERS_PARSED;
+
+    if (block->len == 0)
+        return;
+
+    if (tx->headers == NULL && (tx->headers = (modsecurity_pair_t *)
+                ModsecurityArenaAlloc(tx->arena, MODSECURITY_MAX_HEADERS * sizeof(modsecurity_pair_t))) == NULL)
+        return;
+
+    while (p < end && tx->nheaders < MODSECURITY_MAX_HEADERS)
+    {
+        if ((eol = memchr(p, '\n', end - p)) == NULL)
+            eol = end;
+
+        le = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+
+        if ((colon = memchr(p, ':', le - p)) != NULL)
+        {
+            for (v = colon + 1; v < le && (*v == ' ' || *v == '\t'); v++);
+
+            tx->headers[tx->nheaders].name.data = p;
+            tx->headers[tx->nheaders].name.len = colon - p;
+            tx->headers[tx->nheaders].value.data = v;
+            tx->headers[tx->nheaders].value.len = le - v;
+            tx->nheaders++;
+        }
+
+        p = eol + 1;
+    }
+}
+
+static void ModsecurityParseCookies(modsecurity_tx_t *tx)
+{
+    const modsecurity_buf_t *cookie = &tx->request->cookie;
+    const uint8_t *p = cookie->data, *end = cookie->data + cookie->len, *semi, *eq;
+    uint32_t count = 1, i;
+
+    tx->flags |= MODSECURITY_TX_COOKIES_PARSED;
+
+    if (cookie->len == 0)
+        return;
+
+    for (i = 0; i < cookie->len; i++)
+        count += cookie->data[i] == ';';
+
+    if (count > MODSECURITY_MAX_ARGS)
+        count = MODSECURITY_MAX_ARGS;
+
+    if (tx->cookies == NULL && (tx->cookies = (modsecurity_pair_t *)
+                ModsecurityArenaAlloc(tx->arena, count * sizeof(modsecurity_pair_t))) == NULL)
+        return;
+
+    while (p < end && tx->ncookies < count)
+    {
+        while (p < end && *p == ' ')
+            p++;
+
+        if ((semi = memchr(p, ';', end - p)) == NULL)
+            semi = end;
+
+        if (semi > p)
+        {
+            if ((eq = memchr(p, '=', semi - p)) == NULL)
+                eq = semi;
+
+            tx->cookies[tx->ncookies].name.data = p;
+            tx->cookies[tx->ncookies].name.len = eq - p;
+            tx->cookies[tx->ncookies].value.data = eq < semi ? eq + 1 : semi;
+            tx->cookies[tx->ncookies].value.len = eq < semi ? semi - eq - 1 : 0;
+            tx->ncookies++;
+        }
+
+        p = semi + 1;
+    }
+}
+
+/* REQUEST_LINE, put back together when http_inspect gave only its parts */
+static void ModsecurityBuildLine(modsecurity_tx_t *tx)
+{
+    const modsecurity_http_request_t *request = tx->request;
+    uint8_t *buf;
+
+    tx->flags |= MODSECURITY_TX_LINE_BUILT;
+    tx->request_line = request->line;
+
+    if (request->line.len || request->method.len == 0)
+        return;
+
+    if ((buf = (uint8_t *) ModsecurityArenaAlloc(tx->arena, request->method.len + 1 + request->raw_uri.len)) == NULL)
+        return;
+
+    memcpy(buf, request->method.data, request->method.len);
+    buf[request->method.len] = ' ';
+
+    if (request->raw_uri.len)
+        memcpy(buf + request->method.len + 1, request->raw_uri.data, request->raw_uri.len);
+
+    tx->request_line.data = buf;
+    tx->request_line.len = request->method.len + 1 + request->raw_uri.len;
+}
+
+/* FULL_REQUEST: request line, headers, blank line and what body there is */
+static void ModsecurityBuildFullRequest(modsecurity_tx_t *tx)
+{
+    static const modsecurity_buf_t crlf = { (const uint8_t *) "\r\n", 2 };
+    modsecurity_buf_t parts[5];
+    uint32_t len = 0, i;
+    uint8_t *buf;
+
+    tx->flags |= MODSECURITY_TX_FULL_BUILT;
+    tx->full_request.data = NULL;
+    tx->full_request.len = 0;
+
+    if (!(tx->flags & MODSECURITY_TX_LINE_BUILT))
+        ModsecurityBuildLine(tx);
+
+    parts[0] = tx->request_line;
+    parts[1] = crlf;
+    parts[2] = tx->request->header;
+    parts[3] = crlf;
+    parts[4] = tx->body;
+
+    for (i = 0; i < 5; i++)
+        len += parts[i].len;
+
+    if ((buf = (uint8_t *) ModsecurityArenaAlloc(tx->arena, len)) == NULL)
+        return;
+
+    for (i = 0, len = 0; i < 5; i++)
+    {
+        if (parts[i].len)
+            memcpy(buf + len, parts[i].data, parts[i].len);
+
+        len += parts[i].len;
+    }
+
+    tx->full_request.data = buf;
+    tx->full_request.len = len;
+}
+
+/* ARGS_COMBINED_SIZE: decoded bytes of all argument names and values */
+static void ModsecurityBuildArgsSize(modsecurity_tx_t *tx)
+{
+    uint32_t size = 0, i;
+
+    tx->flags |= MODSECURITY_TX_SIZE_BUILT;
+
+    if (!(tx->flags & MODSECURITY_TX_ARGS_PARSED))
+        ModsecurityParseArgs(tx);
+
+    for (i = 0; i < tx->nargs; i++)
+        size += tx->args[i].name.len + tx->args[i].value.len;
+
+    for (i = 0; i < tx->npost_args; i++)
+        size += tx->post_args[i].name.len + tx->post_args[i].value.len;
+
+    tx->args_size.data = tx->args_size_text;
+    tx->args_size.len = snprintf((char *) tx->args_size_text, sizeof(tx->args_size_text), "%u", size);
+}
+
+/*
+ * The request head moved out of the packet (ModsecurityHttpParserRetain),
+ * so collections split from it are stale. They are split again, into the
+ * same arrays, if a phase 2 rule asks for them.
+ */
+void ModsecurityTxRetain(modsecurity_tx_t *tx)
+{
+    if (!(tx->flags & MODSECURITY_TX_ACTIVE))
+        return;
+
+    tx->flags &= ~(MODSECURITY_TX_ARGS_PARSED | MODSECURITY_TX_HEADERS_PARSED
+            | MODSECURITY_TX_COOKIES_PARSED | MODSECURITY_TX_LINE_BUILT);
+    tx->nargs = tx->nheaders = tx->ncookies = 0;
+}
+
+/* Run the rule's transformation pipeline, ping-ponging between scratch buffers */
+static void ModsecurityTransform(modsecurity_engine_scratch_t *scratch, const modsecurity_rule_t *rule,
+        modsecurity_buf_t *value)
+{
+    uint32_t len = value->len < MODSECURITY_MAX_VALUE ? value->len : MODSECURITY_MAX_VALUE;
+    const uint8_t *in = value->data;
+    uint8_t *out;
+    uint32_t i, n;
+    int t, which = 0;
+
+    for (t = 0; t < rule->ntransforms; t++)
+    {
+        out = scratch->transform[which];
+        n = 0;
+
+        switch (rule->transforms[t])
+        {
+            case MODSECURITY_T_LOWERCASE:
+                for (i = 0; i < len; i++)
+                    out[i] = (uint8_t) tolower(in[i]);
+                n = len;
+                break;
+
+            case MODSECURITY_T_URLDECODE:
+                n = ModsecurityHttpUrlDecode(in, len, out, 1);
+                break;
+
+            case MODSECURITY_T_COMPRESSWHITESPACE:
+                for (i = 0; i < len; i++)
+                {
+                    if (isspace(in[i]))
+                    {
+                        if (n == 0 || out[n - 1] != ' ')
+                            out[n++] = ' ';
+                    }
+                    else
+                    {
+                        out[n++] = in[i];
+                    }
+                }
+                break;
+
+            case MODSECURITY_T_REMOVENULLS:
+                for (i = 0; i < len; i++)
+                {
+                    if (in[i] != '\0')
+                        out[n++] = in[i];
+                }
+                break;
+
+            case MODSECURITY_T_TRIM:
+                for (i = 0; i < len && isspace(in[i]); i++);
+                while (len > i && isspace(in[len - 1]))
+                    len--;
+                memmove(out, in + i, len - i);
+                n = len - i;
+                break;
+        }
+
+        in = out;
+        len = n;
+        which ^= 1;
+    }
+
+    value->data = in;
+    value->len = len;
+}
+
+static int ModsecuritySearch(const uint8_t *data, uint32_t len, const uint8_t *pat, uint32_t plen, int nocase)
+{
+    const uint8_t *p, *end;
+
+    if (plen == 0)
+        return 1;
+
+    if (plen > len)
+        return 0;
+
+    end = data + len - plen;
+
+    for (p = data; p <= end; p++)
+    {
+        if (nocase ? (tolower(*p) == pat[0] && !strncasecmp((const char *) p, (const char *) pat, plen))
+                : (*p == pat[0] && !memcmp(p, pat, plen)))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int64_t ModsecurityNumber(const uint8_t *data, uint32_t len)
+{
+    int64_t value = 0;
+    uint32_t i = 0;
+    int negative = 0;
+
+    while (i < len && isspace(data[i]))
+        i++;
+
+    if (i < len && (data[i] == '-' || data[i] == '+'))
+        negative = data[i++] == '-';
+
+    for (; i < len && data[i] >= '0' && data[i] <= '9'; i++)
+        value = value * 10 + (data[i] - '0');
+
+    return negative ? -value : value;
+}
+
+static int ModsecurityOperator(modsecurity_tx_t *tx, const modsecurity_rule_t *rule,
+        const uint8_t *data, uint32_t len)
+{
+    int ovector[MODSECURITY_OVECTOR];
+    uint32_t i;
+    int rc;
+
+    switch (rule->op)
+    {
+        case MODSECURITY_OP_RX:
+            if (rule->regex != NULL)
+                return ModsecurityRegexMatch((const modsecurity_regex_t *) rule->regex, tx->scratch->regex, data, len);
+
+            if (rule->dfa)
+            {
+                rc = pcre_dfa_exec((const pcre *) rule->re, (const pcre_extra *) rule->re_extra,
+                        (const char *) data, (int) len, 0, PCRE_DFA_SHORTEST, ovector, MODSECURITY_OVECTOR,
+                        tx->scratch->dfa_workspace, MODSECURITY_DFA_WORKSPACE);
+
+                if (rc >= 0 || rc == PCRE_ERROR_NOMATCH)
+                    return rc >= 0;
+
+                /* Out of workspace or an item it can't do, match limits still apply below */
+                tx->scratch->stats->rx_dfa_fallbacks++;
+            }
+
+            rc = pcre_exec((const pcre *) rule->re, (const pcre_extra *) rule->re_extra,
+                    (const char *) data, (int) len, 0, 0, ovector, MODSECURITY_OVECTOR);
+
+            if (rc == PCRE_ERROR_MATCHLIMIT || rc == PCRE_ERROR_RECURSIONLIMIT)
+                tx->scratch->stats->rx_limit_hits++;
+
+            return rc >= 0;
+
+        case MODSECURITY_OP_CONTAINS:
+            return ModsecuritySearch(data, len, (const uint8_t *) rule->param, rule->param_len, 0);
+
+        case MODSECURITY_OP_STREQ:
+            return len == rule->param_len && !memcmp(data, rule->param, len);
+
+        case MODSECURITY_OP_BEGINSWITH:
+            return len >= rule->param_len && !memcmp(data, rule->param, rule->param_len);
+
+        case MODSECURITY_OP_ENDSWITH:
+            return len >= rule->param_len
+                && !memcmp(data + len - rule->param_len, rule->param, rule->param_len);
+
+        case MODSECURITY_OP_PM:
+            for (i = 0; i < rule->nphrases; i++)
+            {
+                if (ModsecuritySearch(data, len, (const uint8_t *) rule->phrases[i],
+                            strlen(rule->phrases[i]), 1))
+                    return 1;
+            }
+            return 0;
+
+        case MODSECURITY_OP_EQ:
+            return ModsecurityNumber(data, len) == rule->number;
+
+        case MODSECURITY_OP_GT:
+            return ModsecurityNumber(data, len) > rule->number;
+
+        case MODSECURITY_OP_LT:
+            return ModsecurityNumber(data, len) < rule->number;
+
+        case MODSECURITY_OP_GE:
+            return ModsecurityNumber(data, len) >= rule->number;
+
+        case MODSECURITY_OP_LE:
+            return ModsecurityNumber(data, len) <= rule->number;
+
+        case MODSECURITY_OP_UNCONDITIONAL:
+            return 1;
+
+        case MODSECURITY_OP_DETECTSQLI:
+            return ModsecurityDetectSqli(data, len, NULL);
+
+        case MODSECURITY_OP_DETECTXSS:
+            return ModsecurityDetectXss(data, len);
+
+        case MODSECURITY_OP_VALIDATEBYTERANGE:
+            return ModsecurityCharsetSpan(&rule->allowed, data, len) < len;
+
+        case MODSECURITY_OP_IPMATCH:
+        case MODSECURITY_OP_IPMATCHFROMFILE:
+            return ModsecurityIptableMatch((const modsecurity_iptable_t *) rule->iptable, data, len);
+    }
+
+    return 0;
+}
+
+/*
+ * The bytes present in data. They are flagged in a byte table, which has
+ * no dependency between iterations, then packed down to bits.
+ */
+static void ModsecurityPresenceScan(const uint8_t *data, uint32_t len, modsecurity_charset_t *set)
+{
+    uint8_t seen[256] __attribute__((aligned(16)));
+    uint32_t i;
+
+    memset(seen, 0, sizeof(seen));
+
+    for (i = 0; i < len; i++)
+        seen[data[i]] = 0x80;
+
+#ifdef __SSE2__
+    for (i = 0; i < 256; i += 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_load_si128((const __m128i *) &seen[i]));
+
+        set->bits[i / 8] = (uint8_t) mask;
+        set->bits[i / 8 + 1] = (uint8_t) (mask >> 8);
+    }
+#else
+    memset(set, 0, sizeof(*set));
+
+    for (i = 0; i < 256; i++)
+    {
+        if (seen[i])
+            ModsecurityCharsetAdd(set, (uint8_t) i);
+    }
+#endif
+}
+
+static const modsecurity_charset_t *ModsecurityPresence(modsecurity_engine_scratch_t *scratch,
+        const uint8_t *data, uint32_t len)
+{
+    modsecurity_presence_t *slot;
+
+    slot = &scratch->presence[(((uintptr_t) data >> 3) ^ len) & (MODSECURITY_PRESENCE_SLOTS - 1)];
+
+    if (slot->gen != scratch->presence_gen || slot->data != data || slot->len != len)
+    {
+        ModsecurityPresenceScan(data, len, &slot->set);
+        slot->data = data;
+        slot->len = len;
+        slot->gen = scratch->presence_gen;
+    }
+
+    return &slot->set;
+}
+
+/* Bytes the rule's transformations can turn a value with the bytes in set into */
+static void ModsecurityPresenceTransform(const modsecurity_rule_t *rule, modsecurity_charset_t *set)
+{
+    int t, c;
+
+    for (t = 0; t < rule->ntransforms; t++)
+    {
+        switch (rule->transforms[t])
+        {
+            case MODSECURITY_T_LOWERCASE:
+                for (c = 'A'; c <= 'Z'; c++)
+                {
+                    if (ModsecurityCharsetHas(set, (uint8_t) c))
+                        ModsecurityCharsetAdd(set, (uint8_t) tolower(c));
+                }
+                break;
+
+            case MODSECURITY_T_URLDECODE:
+                if (ModsecurityCharsetHas(set, '%'))
+                    ModsecurityCharsetFill(set);
+                if (ModsecurityCharsetHas(set, '+'))
+                    ModsecurityCharsetAdd(set, ' ');
+                break;
+
+            case MODSECURITY_T_COMPRESSWHITESPACE:
+                for (c = 0; c < 256; c++)
+                {
+                    if (isspace(c) && ModsecurityCharsetHas(set, (uint8_t) c))
+                    {
+                        ModsecurityCharsetAdd(set, ' ');
+                        break;
+                    }
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+/* Whether a value holding the bytes in present might satisfy the rule */
+static int ModsecurityPrefilter(const modsecurity_rule_t *rule, const modsecurity_charset_t *present)
+{
+    modsecurity_charset_t set = *present;
+    int i;
+
+    ModsecurityPresenceTransform(rule, &set);
+
+    for (i = 0; i < rule->nrequired; i++)
+    {
+        if (!ModsecurityCharsetMeets(&set, &rule->required[i]))
+            return 0;
+    }
+
+    return 1;
+}
+
+static int ModsecurityRuleValue(modsecurity_tx_t *tx, const modsecurity_rule_t *rule,
+        const modsecurity_buf_t *value)
+{
+    modsecurity_buf_t v = *value;
+    int match;
+
+    if (v.data == NULL)
+    {
+        v.data = (const uint8_t *) "";
+        v.len = 0;
+    }
+
+    if (rule->safe_skip || rule->nrequired)
+    {
+        const modsecurity_charset_t *present = ModsecurityPresence(tx->scratch, v.data, v.len);
+
+        if (rule->safe_skip && ModsecurityCharsetWithin(present, tx->scratch->safe))
+        {
+            tx->scratch->stats->safe_skipped++;
+            return 0;
+        }
+
+        if (rule->nrequired && !ModsecurityPrefilter(rule, present))
+        {
+            tx->scratch->stats->prefiltered++;
+            return 0;
+        }
+    }
+
+    if (rule->ntransforms)
+        ModsecurityTransform(tx->scratch, rule, &v);
+
+    match = ModsecurityOperator(tx, rule, v.data, v.len);
+
+    return rule->negated ? !match : match;
+}
+
+static int ModsecurityRulePairs(modsecurity_tx_t *tx, const modsecurity_rule_t *rule,
+        const modsecurity_target_t *target, const modsecurity_pair_t *pairs, uint32_t n, int names)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!ModsecurityNameIs(&pairs[i].name, target->name))
+            continue;
+
+        if (ModsecurityRuleValue(tx, rule, names ? &pairs[i].name : &pairs[i].value))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int ModsecurityRuleTarget(const modsecurity_rule_t *rule, const modsecurity_target_t *target,
+        modsecurity_tx_t *tx)
+{
+    const modsecurity_http_request_t *request = tx->request;
+    modsecurity_buf_t value;
+
+    switch (target->var)
+    {
+        case MODSECURITY_VAR_ARGS:
+        case MODSECURITY_VAR_ARGS_NAMES:
+            if (ModsecurityRulePairs(tx, rule, target, tx->post_args, tx->npost_args,
+                        target->var == MODSECURITY_VAR_ARGS_NAMES))
+                return 1;
+
+            /* fall through */
+        case MODSECURITY_VAR_ARGS_GET:
+        case MODSECURITY_VAR_ARGS_GET_NAMES:
+            if (!(tx->flags & MODSECURITY_TX_ARGS_PARSED))
+                ModsecurityParseArgs(tx);
+
+            return ModsecurityRulePairs(tx, rule, target, tx->args, tx->nargs,
+                    target->var & (MODSECURITY_VAR_ARGS_NAMES | MODSECURITY_VAR_ARGS_GET_NAMES));
+
+        case MODSECURITY_VAR_ARGS_POST:
+        case MODSECURITY_VAR_ARGS_POST_NAMES:
+            return ModsecurityRulePairs(tx, rule, target, tx->post_args, tx->npost_args,
+                    target->var == MODSECURITY_VAR_ARGS_POST_NAMES);
+
+        case MODSECURITY_VAR_ARGS_COMBINED_SIZE:
+            if (!(tx->flags & MODSECURITY_TX_SIZE_BUILT))
+                ModsecurityBuildArgsSize(tx);
+
+            return ModsecurityRuleValue(tx, rule, &tx->args_size);
+
+        case MODSECURITY_VAR_REQUEST_HEADERS:
+        case MODSECURITY_VAR_REQUEST_HEADERS_NAMES:
+            if (!(tx->flags & MODSECURITY_TX_HEADERS_PARSED))
+                ModsecurityParseHeaders(tx);
+
+            return ModsecurityRulePairs(tx, rule, target, tx->headers, tx->nheaders,
+                    target->var == MODSECURITY_VAR_REQUEST_HEADERS_NAMES);
+
+        case MODSECURITY_VAR_REQUEST_COOKIES:
+        case MODSECURITY_VAR_REQUEST_COOKIES_NAMES:
+            if (!(tx->flags & MODSECURITY_TX_COOKIES_PARSED))
+                ModsecurityParseCookies(tx);
+
+            return ModsecurityRulePairs(tx, rule, target, tx->cookies, tx->ncookies,
+                    target->var == MODSECURITY_VAR_REQUEST_COOKIES_NAMES);
+
+        case MODSECURITY_VAR_REQUEST_LINE:
+            if (!(tx->flags & MODSECURITY_TX_LINE_BUILT))
+                ModsecurityBuildLine(tx);
+
+            return ModsecurityRuleValue(tx, rule, &tx->request_line);
+
+        case MODSECURITY_VAR_FULL_REQUEST:
+            if (!(tx->flags & MODSECURITY_TX_FULL_BUILT))
+                ModsecurityBuildFullRequest(tx);
+
+            return ModsecurityRuleValue(tx, rule, &tx->full_request);
+
+        case MODSECURITY_VAR_QUERY_STRING:
+            value = ModsecurityQueryString(request);
+            return ModsecurityRuleValue(tx, rule, &value);
+
+        case MODSECURITY_VAR_REQUEST_METHOD:
+            return ModsecurityRuleValue(tx, rule, &request->method);
+
+        case MODSECURITY_VAR_REQUEST_URI:
+            return ModsecurityRuleValue(tx, rule, &request->uri);
+
+        case MODSECURITY_VAR_REQUEST_URI_RAW:
+            return ModsecurityRuleValue(tx, rule, &request->raw_uri);
+
+        case MODSECURITY_VAR_REQUEST_BODY:
+            return ModsecurityRuleValue(tx, rule, &tx->body);
+
+        case MODSECURITY_VAR_REMOTE_ADDR:
+            return ModsecurityRuleValue(tx, rule, &tx->remote_addr);
+    }
+
+    return 0;
+}
+
+static int ModsecurityRuleMatch(const modsecurity_rule_t *rule, modsecurity_tx_t *tx)
+{
+    int i;
+
+    for (i = 0; i < rule->ntargets; i++)
+    {
+        if (ModsecurityRuleTarget(rule, &rule->targets[i], tx))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Run the rules of one phase in order. Matching rules that log are handed
+ * to on_match; with SecRuleEngine On the first matching deny rule ends
+ * the phase and is the verdict.
+ */
+int ModsecurityEngineEval(const modsecurity_ruleset_t *ruleset, modsecurity_tx_t *tx, int phase)
+{
+    const modsecurity_rule_t *rule = &ruleset->rules[ruleset->phase_start[phase]];
+    const modsecurity_rule_t *end = &ruleset->rules[ruleset->phase_start[phase + 1]];
+    modsecurity_engine_scratch_t *scratch = tx->scratch;
+    int shadow = tx->flags & MODSECURITY_TX_SHADOW;
+    modsecurity_rule_stats_t *stats = NULL, *stat;
+    uint64_t start = 0, ns;
+    int matched;
+
+    if (ruleset->engine == MODSECURITY_ENGINE_OFF)
+        return MODSECURITY_ACTION_PASS;
+
+    if (++scratch->presence_gen == 0)
+    {
+        memset(scratch->presence, 0, sizeof(scratch->presence));
+        scratch->presence_gen = 1;
+    }
+
+    scratch->safe = &ruleset->safe;
+
+    if (shadow)
+        stats = ModsecurityEngineRuleStatsFor(scratch, ruleset);
+
+    for (; rule < end; rule++)
+    {
+        /* Flipped by the control socket while packets are inspected */
+        if (__atomic_load_n(&rule->disabled, __ATOMIC_RELAXED))
+            continue;
+
+        if (tx->trace != NULL || stats != NULL)
+            start = ModsecurityTraceNow();
+
+        matched = ModsecurityRuleMatch(rule, tx);
+
+        if (tx->trace != NULL || stats != NULL)
+        {
+            ns = ModsecurityTraceNow() - start;
+
+            if (tx->trace != NULL)
+                ModsecurityTraceRule(tx->trace, rule->id, ns);
+
+            if (stats != NULL)
+            {
+                stat = &stats[rule - ruleset->rules];
+                stat->evals++;
+                stat->matches += matched;
+                stat->ns += ns;
+            }
+        }
+
+        if (!matched)
+            continue;
+
+        /* A shadow ruleset is only measured, it alerts and counts nothing */
+        if (shadow)
+        {
+            if (rule->action == MODSECURITY_ACTION_DENY && ruleset->engine == MODSECURITY_ENGINE_ON)
+            {
+                tx->rule = rule;
+                return MODSECURITY_ACTION_DENY;
+            }
+
+            continue;
+        }
+
+        scratch->stats->matches++;
+        tx->flags |= MODSECURITY_TX_MATCHED;
+
+        if (rule->log && tx->on_match != NULL)
+            tx->on_match(tx->match_ctx, rule);
+
+        if (rule->action != MODSECURITY_ACTION_DENY)
+            continue;
+
+        scratch->stats->denied++;
+
+        /* DetectionOnly: note it and keep going, as ModSecurity does */
+        if (ruleset->engine == MODSECURITY_ENGINE_ON)
+        {
+            tx->rule = rule;
+            return MODSECURITY_ACTION_DENY;
+        }
+    }
+
+    return MODSECURITY_ACTION_PASS;
+}
+
+/*
+ * Flag the rules no value made only of bytes from safe can ever satisfy,
+ * transformed or not, so the engine skips them for such values. Patterns
+ * left to PCRE are only judged by their required bytes. Returns how many
+ * rules were flagged.
+ */
+uint32_t ModsecurityEngineSafe(modsecurity_ruleset_t *ruleset, const modsecurity_charset_t *safe)
+{
+    modsecurity_regex_scratch_t *scratch = NULL;
+    modsecurity_charset_t transformed;
+    modsecurity_rule_t *rule;
+    uint32_t i, flagged = 0;
+    int r, same = !memcmp(&ruleset->safe, safe, sizeof(*safe));
+
+    ruleset->safe = *safe;
+
+    for (i = 0; i < ruleset->count; i++)
+    {
+        rule = &ruleset->rules[i];
+
+        /* Already judged against these bytes for the generation it came from */
+        if (rule->carried && same)
+        {
+            flagged += rule->safe_skip;
+            continue;
+        }
+
+        rule->safe_skip = 0;
+
+        if (rule->negated)
+            continue;
+
+        transformed = *safe;
+        ModsecurityPresenceTransform(rule, &transformed);
+
+        for (r = 0; r < rule->nrequired; r++)
+        {
+            if (!ModsecurityCharsetMeets(&transformed, &rule->required[r]))
+                rule->safe_skip = 1;
+        }
+
+        if (rule->op == MODSECURITY_OP_RX && rule->regex != NULL && !rule->safe_skip)
+        {
+            if (scratch == NULL && (scratch = ModsecurityRegexScratchNew(NULL)) == NULL)
+                DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate regex scratch\n");
+
+            rule->safe_skip = !ModsecurityRegexAccepts((const modsecurity_regex_t *) rule->regex,
+                    scratch, &transformed);
+        }
+
+        flagged += rule->safe_skip;
+    }
+
+    ModsecurityRegexScratchFree(scratch);
+
+    return flagged;
+}
+
+static void ModsecurityEnginePhase(const modsecurity_ruleset_t *ruleset, modsecurity_tx_t *tx,
+        int phase, int stage)
+{
+    uint64_t start = 0;
+
+    if (tx->trace != NULL)
+        start = ModsecurityTraceNow();
+
+    tx->verdict = ModsecurityEngineEval(ruleset, tx, phase);
+
+    if (tx->trace != NULL)
+        ModsecurityTraceStage(tx->trace, stage, ModsecurityTraceNow() - start);
+}
+
+static int ModsecurityProfilePairs(modsecurity_profile_t *profile, int kind, const modsecurity_pair_t *pairs,
+        uint32_t n, uint32_t max, int learn)
+{
+    uint32_t i;
+
+    /* Values the collection had no room for are still in the raw request */
+    if (n == max && !learn)
+        return 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (learn)
+            ModsecurityProfileLearn(profile, kind, &pairs[i].name, &pairs[i].value);
+        else if (!ModsecurityProfileFits(profile, kind, &pairs[i].name, &pairs[i].value))
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Check the head's values (arguments, headers and cookies) against the
+ * endpoint's profile, or with learn widen the profile to take them.
+ */
+static int ModsecurityProfileHead(modsecurity_tx_t *tx, modsecurity_profile_t *profile, int learn)
+{
+    if (!(tx->flags & MODSECURITY_TX_ARGS_PARSED))
+        ModsecurityParseArgs(tx);
+
+    if (!(tx->flags & MODSECURITY_TX_HEADERS_PARSED))
+        ModsecurityParseHeaders(tx);
+
+    if (!(tx->flags & MODSECURITY_TX_COOKIES_PARSED))
+        ModsecurityParseCookies(tx);
+
+    return ModsecurityProfilePairs(profile, MODSECURITY_PROFILE_ARG, tx->args, tx->nargs,
+            MODSECURITY_MAX_ARGS, learn)
+        && ModsecurityProfilePairs(profile, MODSECURITY_PROFILE_HEADER, tx->headers, tx->nheaders,
+            MODSECURITY_MAX_HEADERS, learn)
+        && ModsecurityProfilePairs(profile, MODSECURITY_PROFILE_COOKIE, tx->cookies, tx->ncookies,
+            MODSECURITY_MAX_ARGS, learn);
+}
+
+/* The endpoint's profile, if it has seen enough clean requests to go by */
+static modsecurity_profile_t *ModsecurityProfileTrusted(modsecurity_tx_t *tx)
+{
+    modsecurity_profile_t *profile = ModsecurityProfileFind(tx->profiles, tx->endpoint, 0);
+
+    if (profile == NULL || profile->samples < tx->profiles->min_samples
+            || (profile->flags & MODSECURITY_PROFILE_FULL))
+        return NULL;
+
+    return profile;
+}
+
+/* Whether the head fits; only in enforcing mode does that make it fast */
+static void ModsecurityProfileCheckHead(modsecurity_tx_t *tx)
+{
+    modsecurity_profile_t *profile;
+
+    tx->endpoint = ModsecurityProfileKey(tx->request);
+
+    if ((profile = ModsecurityProfileTrusted(tx)) == NULL)
+        return;
+
+    if (!ModsecurityProfileHead(tx, profile, 0))
+    {
+        modsecurity_profile_stats.misfits++;
+        return;
+    }
+
+    tx->flags |= MODSECURITY_TX_FITS;
+
+    if (tx->profiles->mode == MODSECURITY_PROFILE_ENFORCE)
+        tx->flags |= MODSECURITY_TX_FAST;
+}
+
+/* The body decides whether a fitting head makes a fitting request */
+static void ModsecurityProfileCheckBody(modsecurity_tx_t *tx)
+{
+    modsecurity_profile_t *profile = ModsecurityProfileTrusted(tx);
+
+    if (profile == NULL || !ModsecurityProfileFits(profile, MODSECURITY_PROFILE_BODY, NULL, &tx->body))
+    {
+        modsecurity_profile_stats.misfits++;
+        tx->flags &= ~(MODSECURITY_TX_FITS | MODSECURITY_TX_FAST);
+        return;
+    }
+
+    if (tx->flags & MODSECURITY_TX_FAST)
+        modsecurity_profile_stats.fast++;
+    else
+        modsecurity_profile_stats.would_fit++;
+}
+
+/* A request the rules saw in full and found nothing in */
+static void ModsecurityProfileClean(modsecurity_tx_t *tx)
+{
+    modsecurity_profile_t *profile = ModsecurityProfileFind(tx->profiles, tx->endpoint, 1);
+
+    ModsecurityProfileHead(tx, profile, 1);
+    ModsecurityProfileLearn(profile, MODSECURITY_PROFILE_BODY, NULL, &tx->body);
+    profile->samples++;
+    modsecurity_profile_stats.learned++;
+}
+
+/*
+ * Both phases on a request that is already complete, with the profile fast
+ * path when there are profiles.
+ */
+int ModsecurityEngineRequest(const modsecurity_ruleset_t *ruleset, modsecurity_tx_t *tx)
+{
+    if (tx->profiles != NULL)
+    {
+        ModsecurityProfileCheckHead(tx);
+
+        if (tx->flags & MODSECURITY_TX_FITS)
+            ModsecurityProfileCheckBody(tx);
+
+        if (tx->flags & MODSECURITY_TX_FAST)
+            return MODSECURITY_ACTION_PASS;
+    }
+
+    ModsecurityTxForm(ruleset, tx);
+
+    if (tx->flags & MODSECURITY_TX_FORM)
+        ModsecurityFormParse(&tx->form, tx->body.data, tx->body.len, ModsecurityTxPostArg, tx);
+
+    ModsecurityTxBodyEnd(tx);
+
+    tx->verdict = ModsecurityEngineEval(ruleset, tx, MODSECURITY_PHASE_REQUEST_HEADERS);
+
+    if (tx->verdict == MODSECURITY_ACTION_PASS)
+        tx->verdict = ModsecurityEngineEval(ruleset, tx, MODSECURITY_PHASE_REQUEST_BODY);
+
+    if (tx->profiles != NULL && tx->verdict == MODSECURITY_ACTION_PASS && !(tx->flags & MODSECURITY_TX_MATCHED))
+        ModsecurityProfileClean(tx);
+
+    return tx->verdict;
+}
+
+/*
+ * Feed one parser step to the engine: phase 1 once the head is in, body
+ * segments into the phase 2 buffer, phase 2 when the request is complete
+ * (or cut short by a gap). Returns the transaction's verdict so far.
+ */
+int ModsecurityEngineStep(const modsecurity_ruleset_t *ruleset, modsecurity_tx_t *tx,
+        const modsecurity_http_parser_t *parser, uint32_t events)
+{
+    if (events & MODSECURITY_HTTP_EV_HEADERS)
+    {
+        ModsecurityTxInit(tx, &parser->request, parser->arena);
+        ModsecurityTxForm(ruleset, tx);
+
+        if (tx->profiles != NULL)
+            ModsecurityProfileCheckHead(tx);
+
+        if (!(tx->flags & MODSECURITY_TX_FAST))
+            ModsecurityEnginePhase(ruleset, tx, MODSECURITY_PHASE_REQUEST_HEADERS, MODSECURITY_STAGE_PHASE1);
+    }
+
+    if (!(tx->flags & MODSECURITY_TX_ACTIVE) || tx->verdict == MODSECURITY_ACTION_DENY)
+        return tx->verdict;
+
+    if (events & MODSECURITY_HTTP_EV_BODY)
+        ModsecurityTxBody(tx, &parser->request.body);
+
+    if (events & MODSECURITY_HTTP_EV_DONE)
+    {
+        int skipped = tx->flags & MODSECURITY_TX_FAST;
+
+        tx->flags &= ~MODSECURITY_TX_ACTIVE;
+        ModsecurityTxBodyEnd(tx);
+
+        if (tx->flags & MODSECURITY_TX_FITS)
+            ModsecurityProfileCheckBody(tx);
+
+        if (tx->flags & MODSECURITY_TX_FAST)
+            return tx->verdict;
+
+        /* The head looked fine but the body does not, the rules get all of it */
+        if (skipped)
+            ModsecurityEnginePhase(ruleset, tx, MODSECURITY_PHASE_REQUEST_HEADERS, MODSECURITY_STAGE_PHASE1);
+
+        if (tx->verdict == MODSECURITY_ACTION_PASS)
+            ModsecurityEnginePhase(ruleset, tx, MODSECURITY_PHASE_REQUEST_BODY, MODSECURITY_STAGE_PHASE2);
+
+        if (tx->profiles != NULL && tx->verdict == MODSECURITY_ACTION_PASS
+                && !(tx->flags & MODSECURITY_TX_MATCHED))
+            ModsecurityProfileClean(tx);
+    }
+    else if (events & (MODSECURITY_HTTP_EV_ERROR | MODSECURITY_HTTP_EV_GAP))
+    {
+        /* Aborted, there is no request left to run phase 2 on */
+        tx->flags &= ~MODSECURITY_TX_ACTIVE;
+    }
+
+    return tx->verdict;
+}
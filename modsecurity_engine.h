@@ -0,0 +1,120 @@
+#ifndef MODSECURITY_ENGINE_H
+#define MODSECURITY_ENGINE_H
+
+#include "sf_types.h"
+#include "modsecurity_arena.h"
+#include "modsecurity_http.h"
+#include "modsecurity_rules.h"
+#include "modsecurity_trace.h"
+#include "modsecurity_profile.h"
+#include "modsecurity_form.h"
+#include "modsecurity_regex.h"
+
+/* Default request body buffered for phase 2 */
+#define MODSECURITY_BODY_LIMIT   8192
+
+#define MODSECURITY_MAX_ARGS     256
+#define MODSECURITY_MAX_HEADERS  128
+
+/* Transaction flags */
+#define MODSECURITY_TX_ACTIVE          0x01
+#define MODSECURITY_TX_ARGS_PARSED     0x02
+#define MODSECURITY_TX_HEADERS_PARSED  0x04
+#define MODSECURITY_TX_COOKIES_PARSED  0x08
+#define MODSECURITY_TX_SHADOW          0x10   /* verdict only compared, rules profiled */
+#define MODSECURITY_TX_MATCHED         0x20   /* some rule matched */
+#define MODSECURITY_TX_FITS            0x40   /* head fits the endpoint's profile */
+#define MODSECURITY_TX_FAST            0x80   /* and the rules are skipped for it */
+#define MODSECURITY_TX_FORM            0x100  /* urlencoded body, parsed as it comes */
+#define MODSECURITY_TX_LINE_BUILT      0x200
+#define MODSECURITY_TX_FULL_BUILT      0x400
+#define MODSECURITY_TX_SIZE_BUILT      0x800
+
+typedef struct _modsecurity_pair
+{
+    modsecurity_buf_t name;
+    modsecurity_buf_t value;
+} modsecurity_pair_t;
+
+typedef void (*ModsecurityMatchFunc)(void *, const modsecurity_rule_t *);
+
+/*
+ * What running the rules writes outside the transaction. Every thread that
+ * evaluates has its own and hands it over in tx->scratch; rulesets are
+ * only read, so generations can share them between threads.
+ */
+typedef struct _modsecurity_engine_scratch modsecurity_engine_scratch_t;
+
+/*
+ * What the rules see of one request. Collections are split out of the
+ * request views, and derived variables built, the first time a rule asks
+ * for them.
+ */
+typedef struct _modsecurity_tx
+{
+    uint32_t flags;
+    int verdict;
+    const modsecurity_rule_t *rule;     /* rule that denied */
+    const modsecurity_http_request_t *request;
+    modsecurity_arena_t *arena;
+    modsecurity_engine_scratch_t *scratch;
+    modsecurity_buf_t body;             /* buffered for phase 2 */
+    modsecurity_buf_t remote_addr;      /* client address, as text */
+    uint32_t body_limit;
+    modsecurity_pair_t *args;
+    uint32_t nargs;
+    modsecurity_pair_t *post_args;
+    uint32_t npost_args;
+    modsecurity_form_t form;
+    modsecurity_pair_t *headers;
+    uint32_t nheaders;
+    modsecurity_pair_t *cookies;
+    uint32_t ncookies;
+    modsecurity_buf_t request_line;
+    modsecurity_buf_t full_request;
+    modsecurity_buf_t args_size;        /* ARGS_COMBINED_SIZE, as text */
+    uint8_t args_size_text[12];
+    modsecurity_trace_t *trace;         /* NULL unless tracing */
+    ModsecurityMatchFunc on_match;
+    void *match_ctx;
+    modsecurity_profiles_t *profiles;   /* NULL unless profiling */
+    uint64_t endpoint;
+} modsecurity_tx_t;
+
+typedef struct _modsecurity_engine_stats
+{
+    uint64_t matches;
+    uint64_t denied;
+    uint64_t rx_limit_hits;
+    uint64_t rx_dfa_fallbacks;          /* DFA matcher gave up, backtracked instead */
+    uint64_t prefiltered;               /* values skipped, required bytes absent */
+    uint64_t safe_skipped;              /* values skipped, safe bytes only */
+    uint64_t forms_truncated;           /* ARGS_POST cut short, too many or too long */
+} modsecurity_engine_stats_t;
+
+/* Counts of the packet thread's evaluations */
+extern modsecurity_engine_stats_t modsecurity_engine_stats;
+
+/* Per rule cost of a shadow ruleset, kept in the scratch that ran it */
+typedef struct _modsecurity_rule_stats
+{
+    uint64_t evals;
+    uint64_t matches;
+    uint64_t ns;
+} modsecurity_rule_stats_t;
+
+modsecurity_engine_scratch_t *ModsecurityEngineScratchNew(modsecurity_engine_stats_t *,
+        modsecurity_regex_stats_t *);
+void ModsecurityEngineScratchFree(modsecurity_engine_scratch_t *);
+const modsecurity_rule_stats_t *ModsecurityEngineRuleStats(const modsecurity_engine_scratch_t *,
+        const modsecurity_ruleset_t *);
+void ModsecurityTxInit(modsecurity_tx_t *, const modsecurity_http_request_t *, modsecurity_arena_t *);
+void ModsecurityTxRetain(modsecurity_tx_t *);
+void ModsecurityTxBody(modsecurity_tx_t *, const modsecurity_buf_t *);
+int ModsecurityEngineEval(const modsecurity_ruleset_t *, modsecurity_tx_t *, int);
+uint32_t ModsecurityEngineSafe(modsecurity_ruleset_t *, const modsecurity_charset_t *);
+int ModsecurityEngineRequest(const modsecurity_ruleset_t *, modsecurity_tx_t *);
+int ModsecurityEngineStep(const modsecurity_ruleset_t *, modsecurity_tx_t *,
+        const modsecurity_http_parser_t *, uint32_t);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * ARGS_POST out of urlencoded bodies as their segments arrive. A name or
+ * value that ends in the segment it started in is decoded straight into
+ * its place in the arena; one that runs into the next segment is decoded
+ * into the carry buffer meanwhile and moved when it ends. Escapes decode
+ * as ModsecurityHttpUrlDecode does, '+' is a space, a bad %XX stays as is.
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "modsecurity_form.h"
+
+static inline int FormHex(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+
+    c |= 0x20;
+
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+/* Content-Type of the request head says urlencoded form */
+int ModsecurityFormIs(const modsecurity_buf_t *header)
+{
+    const uint8_t *p = header->data, *end = header->data + header->len, *eol;
+
+    for (; p < end; p = eol + 1)
+    {
+        if ((eol = memchr(p, '\n', end - p)) == NULL)
+            eol = end;
+
+        if (eol - p < 13 || strncasecmp((const char *) p, "Content-Type:", 13))
+            continue;
+
+        for (p += 13; p < eol && (*p == ' ' || *p == '\t'); p++);
+
+        return eol - p >= 33 && !strncasecmp((const char *) p, "application/x-www-form-urlencoded", 33);
+    }
+
+    return 0;
+}
+
+void ModsecurityFormInit(modsecurity_form_t *form, modsecurity_arena_t *arena, uint32_t limit, uint32_t room)
+{
+    memset(form, 0, sizeof(*form));
+    form->arena = arena;
+    form->limit = limit;
+    form->room = room;
+}
+
+/* Decode into out, keeping at most room bytes; an escape cut by the end stays open */
+static uint32_t FormDecode(modsecurity_form_t *form, const uint8_t *in, uint32_t len,
+        uint8_t *out, uint32_t room)
+{
+    uint32_t i, n = 0;
+    int v;
+
+#define FORM_PUT(c) do { if (n < room) out[n++] = (c); } while (0)
+
+    for (i = 0; i < len; i++)
+    {
+        if (form->escape == 1)
+        {
+            if (FormHex(in[i]) >= 0)
+            {
+                form->hi = in[i];
+                form->escape = 2;
+                continue;
+            }
+
+            FORM_PUT('%');
+            form->escape = 0;
+        }
+        else if (form->escape == 2)
+        {
+            if ((v = FormHex(in[i])) >= 0)
+            {
+                FORM_PUT((uint8_t) ((FormHex(form->hi) << 4) | v));
+                form->escape = 0;
+                continue;
+            }
+
+            /* Not an escape after all, its bytes stand for themselves */
+            FORM_PUT('%');
+            FORM_PUT(form->hi);
+            form->escape = 0;
+        }
+
+        if (in[i] == '%')
+            form->escape = 1;
+        else if (in[i] == '+')
+            FORM_PUT(' ');
+        else
+            FORM_PUT(in[i]);
+    }
+
+#undef FORM_PUT
+
+    return n;
+}
+
+/* The token ends here, a '%' or '%X' left open is literal */
+static uint32_t FormClose(modsecurity_form_t *form, uint8_t *out, uint32_t n, uint32_t room)
+{
+    if (form->escape && n < room)
+        out[n++] = '%';
+
+    if (form->escape == 2 && n < room)
+        out[n++] = form->hi;
+
+    form->escape = 0;
+
+    return n;
+}
+
+/*
+ * Finish a name or value whose last bytes are in..in+len. Decoded bytes
+ * never outnumber raw ones, so a token seen whole is decoded in place;
+ * one begun in an earlier segment is finished in the carry and copied.
+ * Returns 0 once the room or the arena runs out.
+ */
+static int FormToken(modsecurity_form_t *form, const uint8_t *in, uint32_t len, modsecurity_buf_t *out)
+{
+    uint8_t *buf;
+    uint32_t n;
+
+    if (form->carry_len == 0 && !form->escape)
+    {
+        if (len == 0)
+        {
+            out->data = (const uint8_t *) "";
+            out->len = 0;
+            return 1;
+        }
+
+        if (len > form->room || (buf = (uint8_t *) ModsecurityArenaAlloc(form->arena, len)) == NULL)
+            return 0;
+
+        n = FormClose(form, buf, FormDecode(form, in, len, buf, len), len);
+    }
+    else
+    {
+        n = FormDecode(form, in, len, form->carry + form->carry_len,
+                MODSECURITY_FORM_CARRY - form->carry_len);
+        n = FormClose(form, form->carry, form->carry_len + n, MODSECURITY_FORM_CARRY);
+        form->carry_len = 0;
+
+        if (n > form->room || (buf = (uint8_t *) ModsecurityArenaAlloc(form->arena, n + 1)) == NULL)
+            return 0;
+
+        memcpy(buf, form->carry, n);
+    }
+
+    form->room -= n;
+    out->data = buf;
+    out->len = n;
+
+    return 1;
+}
+
+/* Keep the unfinished start of a token for the next segment */
+static int FormCarry(modsecurity_form_t *form, const uint8_t *in, uint32_t len)
+{
+    if (form->carry == NULL
+            && (form->carry = (uint8_t *) ModsecurityArenaAlloc(form->arena, MODSECURITY_FORM_CARRY)) == NULL)
+        return 0;
+
+    form->carry_len += FormDecode(form, in, len, form->carry + form->carry_len,
+            MODSECURITY_FORM_CARRY - form->carry_len);
+
+    return 1;
+}
+
+/* A pair ends at '&' or at the end of the body; empty ones are skipped */
+static void FormPair(modsecurity_form_t *form, const modsecurity_buf_t *value,
+        ModsecurityFormFunc func, void *ctx)
+{
+    static const modsecurity_buf_t none = { (const uint8_t *) "", 0 };
+
+    if (!form->started)
+        return;
+
+    func(ctx, &form->name, value != NULL ? value : &none);
+    form->started = 0;
+    form->state = MODSECURITY_FORM_NAME;
+
+    if (++form->count == form->limit)
+        form->state = MODSECURITY_FORM_STOP;
+    form->name = none;
+}
+
+void ModsecurityFormParse(modsecurity_form_t *form, const uint8_t *data, uint32_t len,
+        ModsecurityFormFunc func, void *ctx)
+{
+    const uint8_t *p = data, *end = data + len, *q;
+    modsecurity_buf_t token;
+
+    for (; p < end; p = q + 1)
+    {
+        /* Out of pairs with body left */
+        if (form->state == MODSECURITY_FORM_STOP)
+        {
+            form->truncated |= form->count == form->limit;
+            return;
+        }
+
+        if (form->state == MODSECURITY_FORM_NAME)
+        {
+            for (q = p; q < end && *q != '&' && *q != '='; q++);
+        }
+        else if ((q = memchr(p, '&', end - p)) == NULL)
+        {
+            q = end;
+        }
+
+        if (q == end)
+        {
+            form->started = 1;
+
+            if (!FormCarry(form, p, end - p))
+            {
+                form->state = MODSECURITY_FORM_STOP;
+                form->truncated = 1;
+            }
+
+            return;
+        }
+
+        if (q > p || *q == '=')
+            form->started = 1;
+
+        if (!FormToken(form, p, q - p, &token))
+        {
+            form->state = MODSECURITY_FORM_STOP;
+            form->truncated = 1;
+            return;
+        }
+
+        if (form->state == MODSECURITY_FORM_NAME && *q == '=')
+        {
+            form->name = token;
+            form->state = MODSECURITY_FORM_VALUE;
+        }
+        else if (form->state == MODSECURITY_FORM_NAME)
+        {
+            form->name = token;
+            FormPair(form, NULL, func, ctx);
+        }
+        else
+        {
+            FormPair(form, &token, func, ctx);
+        }
+    }
+}
+
+/* The body is complete, the pair it ends in has no '&' after it */
+void ModsecurityFormEnd(modsecurity_form_t *form, ModsecurityFormFunc func, void *ctx)
+{
+    modsecurity_buf_t token;
+
+    if (form->state == MODSECURITY_FORM_STOP)
+        return;
+
+    if (!FormToken(form, NULL, 0, &token))
+    {
+        form->state = MODSECURITY_FORM_STOP;
+        form->truncated = 1;
+        return;
+    }
+
+    if (form->state == MODSECURITY_FORM_NAME)
+    {
+        form->name = token;
+        FormPair(form, NULL, func, ctx);
+    }
+    else
+    {
+        FormPair(form, &token, func, ctx);
+    }
+
+    form->state = MODSECURITY_FORM_STOP;
+}
@@ -0,0 +1,44 @@
+#ifndef MODSECURITY_FORM_H
+#define MODSECURITY_FORM_H
+
+#include "sf_types.h"
+#include "modsecurity_arena.h"
+#include "modsecurity_http.h"
+
+/* Decoded bytes of a name or value carried over to the next segment */
+#define MODSECURITY_FORM_CARRY  4096
+
+/* Form parser states */
+#define MODSECURITY_FORM_NAME   0
+#define MODSECURITY_FORM_VALUE  1
+#define MODSECURITY_FORM_STOP   2   /* ended, or out of pairs or room */
+
+typedef void (*ModsecurityFormFunc)(void *, const modsecurity_buf_t *, const modsecurity_buf_t *);
+
+/*
+ * Resumable application/x-www-form-urlencoded parser. Finished names and
+ * values are decoded into the arena and handed out as views; only the
+ * token a segment ends in is carried, along with a %XX cut in two.
+ */
+typedef struct _modsecurity_form
+{
+    int state;
+    uint8_t escape;             /* bytes of a %XX seen, 0 when none is open */
+    uint8_t hi;                 /* its first hex digit, as sent */
+    uint8_t started;            /* some byte of the current pair was seen */
+    uint8_t truncated;          /* stopped before the end of the body */
+    uint8_t *carry;             /* from the arena, on the first split token */
+    uint32_t carry_len;
+    modsecurity_buf_t name;     /* finished name waiting for its value */
+    uint32_t count;
+    uint32_t limit;             /* pairs to hand out before stopping */
+    uint32_t room;              /* decoded bytes left to allocate */
+    modsecurity_arena_t *arena;
+} modsecurity_form_t;
+
+int ModsecurityFormIs(const modsecurity_buf_t *);
+void ModsecurityFormInit(modsecurity_form_t *, modsecurity_arena_t *, uint32_t, uint32_t);
+void ModsecurityFormParse(modsecurity_form_t *, const uint8_t *, uint32_t, ModsecurityFormFunc, void *);
+void ModsecurityFormEnd(modsecurity_form_t *, ModsecurityFormFunc, void *);
+
+#endif
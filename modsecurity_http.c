@@ -0,0 +1,686 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "sf_dynamic_preprocessor.h"
+#include "spp_modsecurity.h"
+#include "modsecurity_http.h"
+
+#define MODSECURITY_HTTP_MAX_METHOD 16
+
+void ModsecurityHttpParserInit(modsecurity_http_parser_t *parser, modsecurity_arena_t *arena)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->arena = arena;
+}
+
+/*
+ * Start a new transaction; the previous one's views become invalid, except
+ * those published to Snort for this PDU, which its detection still reads.
+ */
+static void ModsecurityHttpStart(modsecurity_http_parser_t *parser)
+{
+    ModsecurityArenaRewind(parser->arena, parser->published);
+
+    parser->state = MODSECURITY_HTTP_STATE_HEADERS;
+    parser->flags = 0;
+    parser->body_left = 0;
+    parser->line_len = 0;
+    parser->head = NULL;
+    parser->head_len = 0;
+    parser->head_buf = NULL;
+    parser->head_buf_len = 0;
+    memset(&parser->request, 0, sizeof(parser->request));
+}
+
+static inline int ModsecurityHttpHexValue(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Offset just past the blank line ending the head, 0 if not there yet */
+static uint32_t ModsecurityHttpHeadEnd(const uint8_t *data, uint32_t len, uint32_t from)
+{
+    const uint8_t *end = data + len;
+    const uint8_t *p = data + from;
+
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL)
+    {
+        if (p + 1 < end && p[1] == '\n')
+            return p + 2 - data;
+
+        if (p + 2 < end && p[1] == '\r' && p[2] == '\n')
+            return p + 3 - data;
+
+        p++;
+    }
+
+    return 0;
+}
+
+static inline int ModsecurityHttpNameIs(const uint8_t *name, uint32_t len, const char *want)
+{
+    return len == strlen(want) && !strncasecmp((const char *) name, want, len);
+}
+
+/*
+ * Decode %XX escapes (and '+' when plus is set, for form values) from in to
+ * out, which must hold len bytes. Bad escapes are copied as they are.
+ */
+uint32_t ModsecurityHttpUrlDecode(const uint8_t *in, uint32_t len, uint8_t *out, int plus)
+{
+    uint32_t i, n = 0;
+    int hi, lo;
+
+    for (i = 0; i < len; i++)
+    {
+        if (in[i] == '%' && i + 2 < len
+                && (hi = ModsecurityHttpHexValue(in[i + 1])) >= 0
+                && (lo = ModsecurityHttpHexValue(in[i + 2])) >= 0)
+        {
+            out[n++] = (uint8_t) ((hi << 4) | lo);
+            i += 2;
+        }
+        else if (plus && in[i] == '+')
+        {
+            out[n++] = ' ';
+        }
+        else
+        {
+            out[n++] = in[i];
+        }
+    }
+
+    return n;
+}
+
+/* Decode %XX escapes into the arena; the raw URI is reused when there are none */
+static void ModsecurityHttpNormalizeUri(modsecurity_http_parser_t *parser)
+{
+    modsecurity_http_request_t *req = &parser->request;
+    uint8_t *out;
+
+    req->uri = req->raw_uri;
+
+    if (memchr(req->raw_uri.data, '%', req->raw_uri.len) == NULL)
+        return;
+
+    if ((out = (uint8_t *) ModsecurityArenaAlloc(parser->arena, req->raw_uri.len)) == NULL)
+        return;
+
+    req->uri.len = ModsecurityHttpUrlDecode(req->raw_uri.data, req->raw_uri.len, out, 0);
+    req->uri.data = out;
+}
+
+static int ModsecurityHttpParseHead(modsecurity_http_parser_t *parser)
+{
+    modsecurity_http_request_t *req = &parser->request;
+    const uint8_t *p = parser->head;
+    const uint8_t *end = p + parser->head_len;
+    const uint8_t *eol, *line_end, *sp, *colon, *value;
+    uint64_t content_length = 0;
+    uint32_t i, value_len;
+
+    /* Request line */
+    if ((eol = memchr(p, '\n', end - p)) == NULL)
+        return MODSECURITY_FAILURE;
+
+    line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+
+    if ((sp = memchr(p, ' ', line_end - p)) == NULL || sp == p
+            || sp - p > MODSECURITY_HTTP_MAX_METHOD)
+        return MODSECURITY_FAILURE;
+
+    for (i = 0; i < (uint32_t) (sp - p); i++)
+    {
+        if (!((p[i] >= 'A' && p[i] <= 'Z') || p[i] == '-' || p[i] == '_'))
+            return MODSECURITY_FAILURE;
+    }
+
+    req->method.data = p;
+    req->method.len = sp - p;
+
+    while (sp < line_end && *sp == ' ')
+        sp++;
+
+    req->raw_uri.data = sp;
+
+    if ((p = memchr(sp, ' ', line_end - sp)) == NULL)
+        p = line_end;
+
+    if (p == sp)
+        return MODSECURITY_FAILURE;
+
+    req->raw_uri.len = p - sp;
+    req->line.data = req->method.data;
+    req->line.len = line_end - req->line.data;
+
+    /* Header lines, up to the blank line */
+    p = eol + 1;
+    req->header.data = p;
+
+    while (p < end && (eol = memchr(p, '\n', end - p)) != NULL)
+    {
+        line_end = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+
+        if (line_end == p)
+            break;
+
+        if ((colon = memchr(p, ':', line_end - p)) != NULL)
+        {
+            value = colon + 1;
+
+            while (value < line_end && (*value == ' ' || *value == '\t'))
+                value++;
+
+            value_len = line_end - value;
+
+            while (value_len && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+                value_len--;
+
+            if (ModsecurityHttpNameIs(p, colon - p, "Content-Length"))
+            {
+                if (value_len == 0 || value_len > 15)
+                    return MODSECURITY_FAILURE;
+
+                for (i = 0, content_length = 0; i < value_len; i++)
+                {
+                    if (value[i] < '0' || value[i] > '9')
+                        return MODSECURITY_FAILURE;
+
+                    content_length = content_length * 10 + (value[i] - '0');
+                }
+            }
+            else if (ModsecurityHttpNameIs(p, colon - p, "Transfer-Encoding"))
+            {
+                if (value_len >= 7 && !strncasecmp((const char *) value + value_len - 7, "chunked", 7))
+                    parser->flags |= MODSECURITY_HTTP_CHUNKED;
+            }
+            else if (ModsecurityHttpNameIs(p, colon - p, "Cookie") && req->cookie.data == NULL)
+            {
+                req->cookie.data = value;
+                req->cookie.len = value_len;
+            }
+        }
+
+        p = eol + 1;
+    }
+
+    req->header.len = p - req->header.data;
+
+    ModsecurityHttpNormalizeUri(parser);
+
+    if (parser->flags & MODSECURITY_HTTP_CHUNKED)
+    {
+        parser->state = MODSECURITY_HTTP_STATE_CHUNK_SIZE;
+        parser->body_left = 0;
+    }
+    else if (content_length > 0)
+    {
+        parser->state = MODSECURITY_HTTP_STATE_BODY;
+        parser->body_left = content_length;
+    }
+    else
+    {
+        parser->state = MODSECURITY_HTTP_STATE_IDLE;
+    }
+
+    return MODSECURITY_SUCCESS;
+}
+
+/*
+ * Collect the head. When it fits in one PDU the views point straight into
+ * the packet; only a head split across PDUs is copied into the arena.
+ */
+static uint32_t ModsecurityHttpHeaders(modsecurity_http_parser_t *parser,
+        const uint8_t *data, uint32_t len, uint32_t *events)
+{
+    uint32_t end, from, n;
+
+    if (parser->head_buf_len == 0 && (end = ModsecurityHttpHeadEnd(data, len, 0)) != 0)
+    {
+        parser->head = data;
+        parser->head_len = end;
+    }
+    else
+    {
+        if (parser->head_buf == NULL)
+        {
+            parser->head_buf = (uint8_t *) ModsecurityArenaAlloc(parser->arena, MODSECURITY_HTTP_MAX_HEADER);
+
+            if (parser->head_buf == NULL)
+                goto error;
+        }
+
+        from = parser->head_buf_len > 2 ? parser->head_buf_len - 2 : 0;
+        n = MODSECURITY_HTTP_MAX_HEADER - parser->head_buf_len;
+
+        if (n > len)
+            n = len;
+
+        memcpy(parser->head_buf + parser->head_buf_len, data, n);
+        parser->head_buf_len += n;
+
+        if ((end = ModsecurityHttpHeadEnd(parser->head_buf, parser->head_buf_len, from)) == 0)
+        {
+            if (parser->head_buf_len == MODSECURITY_HTTP_MAX_HEADER)
+                goto error;
+
+            return n;
+        }
+
+        /* Hand back what belongs to the body or the next request */
+        n -= parser->head_buf_len - end;
+        parser->head_buf_len = end;
+        parser->head = parser->head_buf;
+        parser->head_len = end;
+        parser->flags |= MODSECURITY_HTTP_HEAD_SAVED;
+        end = n;
+    }
+
+    if (ModsecurityHttpParseHead(parser) != MODSECURITY_SUCCESS)
+        goto error;
+
+    *events |= MODSECURITY_HTTP_EV_HEADERS;
+
+    if (parser->state == MODSECURITY_HTTP_STATE_IDLE)
+        *events |= MODSECURITY_HTTP_EV_DONE;
+
+    return end;
+
+error:
+    parser->state = MODSECURITY_HTTP_STATE_RESYNC;
+    *events |= MODSECURITY_HTTP_EV_ERROR;
+    return len;
+}
+
+static uint32_t ModsecurityHttpBodyData(modsecurity_http_parser_t *parser,
+        const uint8_t *data, uint32_t len, uint32_t *events)
+{
+    uint32_t n = (parser->body_left < len) ? (uint32_t) parser->body_left : len;
+
+    parser->request.body.data = data;
+    parser->request.body.len = n;
+    parser->body_left -= n;
+    *events |= MODSECURITY_HTTP_EV_BODY;
+
+    return n;
+}
+
+/*
+ * Does data look like the start of a request line: a method token and a
+ * space. A token running into the end of the data is given the benefit of
+ * the doubt, the rest of it is in the next PDU.
+ */
+static int ModsecurityHttpIsRequestStart(const uint8_t *data, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < len && i <= MODSECURITY_HTTP_MAX_METHOD; i++)
+    {
+        if (data[i] == ' ')
+            return i > 0;
+
+        if (!((data[i] >= 'A' && data[i] <= 'Z') || data[i] == '-' || data[i] == '_'))
+            return 0;
+    }
+
+    return i == len;
+}
+
+/* Offset of the next line that starts a request, or len if there is none */
+static uint32_t ModsecurityHttpResync(const uint8_t *data, uint32_t len)
+{
+    const uint8_t *end = data + len;
+    const uint8_t *p = data;
+
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL)
+    {
+        p++;
+
+        if (p < end && ModsecurityHttpIsRequestStart(p, end - p))
+            return p - data;
+    }
+
+    return len;
+}
+
+/*
+ * Reassembly left a hole in front of the next PDU. Whatever the request was
+ * waiting for is gone: a request in its body is finished now and marked
+ * partial, one still in its head is aborted. Either way the buffered state
+ * is let go at once and parsing picks up again at the next request line,
+ * rather than holding the flow's memory until the session times out.
+ */
+uint32_t ModsecurityHttpGap(modsecurity_http_parser_t *parser)
+{
+    uint32_t events = 0;
+
+    switch (parser->state)
+    {
+        case MODSECURITY_HTTP_STATE_IDLE:
+        case MODSECURITY_HTTP_STATE_RESYNC:
+            break;
+
+        case MODSECURITY_HTTP_STATE_HEADERS:
+            events = MODSECURITY_HTTP_EV_ERROR | MODSECURITY_HTTP_EV_GAP;
+            memset(&parser->request, 0, sizeof(parser->request));
+            break;
+
+        default:
+            events = MODSECURITY_HTTP_EV_DONE | MODSECURITY_HTTP_EV_GAP;
+            parser->flags |= MODSECURITY_HTTP_PARTIAL;
+            parser->request.body.data = NULL;
+            parser->request.body.len = 0;
+            break;
+    }
+
+    parser->state = MODSECURITY_HTTP_STATE_RESYNC;
+    parser->body_left = 0;
+    parser->head_buf_len = 0;
+
+    return events;
+}
+
+/*
+ * Parse as much of data as makes up the next step of the request: the head,
+ * one body segment, or the end of a chunked body. Returns the number of bytes
+ * consumed with what happened in events; the caller loops until the PDU is
+ * used up. Views stay valid until the next call or the end of the packet,
+ * see ModsecurityHttpParserRetain.
+ */
+uint32_t ModsecurityHttpParse(modsecurity_http_parser_t *parser, const uint8_t *data,
+        uint32_t len, uint32_t *events)
+{
+    uint32_t used = 0;
+    int v;
+
+    *events = 0;
+
+    if (parser->state == MODSECURITY_HTTP_STATE_IDLE
+            || parser->state == MODSECURITY_HTTP_STATE_RESYNC)
+    {
+        while (used < len && (data[used] == '\r' || data[used] == '\n'))
+            used++;
+
+        if (used == len)
+            return used;
+
+        if (!ModsecurityHttpIsRequestStart(data + used, len - used))
+        {
+            if (parser->state == MODSECURITY_HTTP_STATE_IDLE)
+                *events |= MODSECURITY_HTTP_EV_ERROR;
+
+            parser->state = MODSECURITY_HTTP_STATE_RESYNC;
+
+            return used + ModsecurityHttpResync(data + used, len - used);
+        }
+
+        ModsecurityHttpStart(parser);
+    }
+
+    parser->request.body.data = NULL;
+    parser->request.body.len = 0;
+
+    while (used < len && *events == 0)
+    {
+        switch (parser->state)
+        {
+            case MODSECURITY_HTTP_STATE_HEADERS:
+                used += ModsecurityHttpHeaders(parser, data + used, len - used, events);
+                break;
+
+            case MODSECURITY_HTTP_STATE_BODY:
+                used += ModsecurityHttpBodyData(parser, data + used, len - used, events);
+
+                if (parser->body_left == 0)
+                {
+                    parser->state = MODSECURITY_HTTP_STATE_IDLE;
+                    *events |= MODSECURITY_HTTP_EV_DONE;
+                }
+                break;
+
+            case MODSECURITY_HTTP_STATE_CHUNK_SIZE:
+                v = data[used++];
+
+                if (v == '\n')
+                {
+                    parser->flags &= ~MODSECURITY_HTTP_CHUNK_EXT;
+                    parser->state = parser->body_left ?
+                        MODSECURITY_HTTP_STATE_CHUNK_DATA : MODSECURITY_HTTP_STATE_TRAILER;
+                    parser->line_len = 0;
+                }
+                else if (parser->flags & MODSECURITY_HTTP_CHUNK_EXT)
+                {
+                    /* chunk extensions are ignored */
+                }
+                else if ((v = ModsecurityHttpHexValue((uint8_t) v)) >= 0)
+                {
+                    if (parser->body_left >> 28)
+                        goto error;
+
+                    parser->body_left = (parser->body_left << 4) | v;
+                }
+                else if (data[used - 1] == ';' || data[used - 1] == ' '
+                        || data[used - 1] == '\t' || data[used - 1] == '\r')
+                {
+                    parser->flags |= MODSECURITY_HTTP_CHUNK_EXT;
+                }
+                else
+                {
+                    goto error;
+                }
+                break;
+
+            case MODSECURITY_HTTP_STATE_CHUNK_DATA:
+                used += ModsecurityHttpBodyData(parser, data + used, len - used, events);
+
+                if (parser->body_left == 0)
+                    parser->state = MODSECURITY_HTTP_STATE_CHUNK_END;
+                break;
+
+            case MODSECURITY_HTTP_STATE_CHUNK_END:
+                if (data[used++] == '\n')
+                    parser->state = MODSECURITY_HTTP_STATE_CHUNK_SIZE;
+                break;
+
+            case MODSECURITY_HTTP_STATE_TRAILER:
+                v = data[used++];
+
+                if (v == '\n')
+                {
+                    if (parser->line_len == 0)
+                    {
+                        parser->state = MODSECURITY_HTTP_STATE_IDLE;
+                        *events |= MODSECURITY_HTTP_EV_DONE;
+                    }
+
+                    parser->line_len = 0;
+                }
+                else if (v != '\r')
+                {
+                    parser->line_len++;
+                }
+                break;
+
+            default:
+                goto error;
+        }
+    }
+
+    return used;
+
+error:
+    parser->state = MODSECURITY_HTTP_STATE_RESYNC;
+    *events |= MODSECURITY_HTTP_EV_ERROR;
+    return len;
+}
+
+static inline void ModsecurityHttpRebase(modsecurity_buf_t *buf, const uint8_t *from,
+        uint32_t len, const uint8_t *to)
+{
+    if (buf->data >= from && buf->data < from + len)
+        buf->data = to + (buf->data - from);
+}
+
+/*
+ * Called once the PDU is done with. A request still waiting for its body
+ * keeps views into the packet, so copy the head into the arena now; requests
+ * that complete within one PDU never pay for the copy.
+ */
+void ModsecurityHttpParserRetain(modsecurity_http_parser_t *parser)
+{
+    modsecurity_http_request_t *req = &parser->request;
+    uint32_t published = parser->published;
+    uint8_t *buf;
+
+    req->body.data = NULL;
+    req->body.len = 0;
+    parser->published = 0;
+
+    /*
+     * Nothing worth keeping after a gap, give the memory back now, unless
+     * Snort has yet to read what was published from it
+     */
+    if (parser->state == MODSECURITY_HTTP_STATE_RESYNC)
+    {
+        memset(req, 0, sizeof(*req));
+        parser->head = NULL;
+        parser->head_len = 0;
+        parser->head_buf = NULL;
+
+        if (published)
+            ModsecurityArenaReset(parser->arena);
+        else
+            ModsecurityArenaFree(parser->arena);
+        return;
+    }
+
+    if (parser->state == MODSECURITY_HTTP_STATE_IDLE
+            || parser->state == MODSECURITY_HTTP_STATE_HEADERS
+            || (parser->flags & MODSECURITY_HTTP_HEAD_SAVED))
+        return;
+
+    if ((buf = (uint8_t *) ModsecurityArenaAlloc(parser->arena, parser->head_len)) == NULL)
+    {
+        memset(req, 0, sizeof(*req));
+        parser->head = NULL;
+        parser->head_len = 0;
+        return;
+    }
+
+    memcpy(buf, parser->head, parser->head_len);
+
+    ModsecurityHttpRebase(&req->line, parser->head, parser->head_len, buf);
+    ModsecurityHttpRebase(&req->method, parser->head, parser->head_len, buf);
+    ModsecurityHttpRebase(&req->uri, parser->head, parser->head_len, buf);
+    ModsecurityHttpRebase(&req->raw_uri, parser->head, parser->head_len, buf);
+    ModsecurityHttpRebase(&req->header, parser->head, parser->head_len, buf);
+    ModsecurityHttpRebase(&req->cookie, parser->head, parser->head_len, buf);
+
+    parser->head = buf;
+    parser->flags |= MODSECURITY_HTTP_HEAD_SAVED;
+}
+
+static inline void ModsecurityHttpSetBuffer(HTTP_BUFFER type, const modsecurity_buf_t *buf)
+{
+    if (buf->len)
+        _dpd.setHttpBuffer(type, buf->data, buf->len);
+}
+
+/*
+ * Fill Snort's HTTP buffers from our own views so http_uri, http_header and
+ * friends work without http_inspect. Snort resets them after each packet;
+ * until then a pipelined request starting in the same PDU leaves the arena
+ * under the published head alone. Call it before the rules allocate for
+ * the request, so that is all it keeps.
+ */
+void ModsecurityHttpPublish(modsecurity_http_parser_t *parser, uint32_t events)
+{
+    const modsecurity_http_request_t *req = &parser->request;
+
+    if (events & MODSECURITY_HTTP_EV_HEADERS)
+    {
+        parser->published = parser->arena->used;
+        ModsecurityHttpSetBuffer(HTTP_BUFFER_METHOD, &req->method);
+        ModsecurityHttpSetBuffer(HTTP_BUFFER_URI, &req->uri);
+        ModsecurityHttpSetBuffer(HTTP_BUFFER_RAW_URI, &req->raw_uri);
+        ModsecurityHttpSetBuffer(HTTP_BUFFER_HEADER, &req->header);
+        ModsecurityHttpSetBuffer(HTTP_BUFFER_RAW_HEADER, &req->header);
+        ModsecurityHttpSetBuffer(HTTP_BUFFER_COOKIE, &req->cookie);
+        ModsecurityHttpSetBuffer(HTTP_BUFFER_RAW_COOKIE, &req->cookie);
+    }
+
+    if (events & MODSECURITY_HTTP_EV_BODY)
+        ModsecurityHttpSetBuffer(HTTP_BUFFER_CLIENT_BODY, &req->body);
+}
+
+static void ModsecurityHttpGetBuffer(HTTP_BUFFER type, modsecurity_buf_t *buf)
+{
+    unsigned len = 0;
+
+    buf->data = _dpd.getHttpBuffer(type, &len);
+    buf->len = buf->data ? len : 0;
+}
+
+/*
+ * Take the request from the buffers http_inspect decoded for the current
+ * packet. Nothing is copied, the views are only valid for this packet.
+ * Returns 0 when http_inspect did not see a request here.
+ */
+int ModsecurityHttpFromInspect(modsecurity_http_request_t *req)
+{
+    memset(req, 0, sizeof(*req));
+
+    ModsecurityHttpGetBuffer(HTTP_BUFFER_METHOD, &req->method);
+    ModsecurityHttpGetBuffer(HTTP_BUFFER_URI, &req->uri);
+    ModsecurityHttpGetBuffer(HTTP_BUFFER_RAW_URI, &req->raw_uri);
+    ModsecurityHttpGetBuffer(HTTP_BUFFER_HEADER, &req->header);
+    ModsecurityHttpGetBuffer(HTTP_BUFFER_COOKIE, &req->cookie);
+    ModsecurityHttpGetBuffer(HTTP_BUFFER_CLIENT_BODY, &req->body);
+
+    return req->method.len || req->uri.len || req->header.len || req->body.len;
+}
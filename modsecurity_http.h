@@ -0,0 +1,83 @@
+#ifndef MODSECURITY_HTTP_H
+#define MODSECURITY_HTTP_H
+
+#include "sf_types.h"
+#include "modsecurity_arena.h"
+
+/* Largest request line plus header block we are willing to buffer */
+#define MODSECURITY_HTTP_MAX_HEADER 8192
+
+/* A view into a buffer owned by someone else (packet, http_inspect, ...) */
+typedef struct _modsecurity_buf
+{
+    const uint8_t *data;
+    uint32_t len;
+} modsecurity_buf_t;
+
+/* The parts of a request the rules look at */
+typedef struct _modsecurity_http_request
+{
+    modsecurity_buf_t line;         /* request line, empty from http_inspect */
+    modsecurity_buf_t method;
+    modsecurity_buf_t uri;
+    modsecurity_buf_t raw_uri;
+    modsecurity_buf_t header;
+    modsecurity_buf_t cookie;
+    modsecurity_buf_t body;
+} modsecurity_http_request_t;
+
+/* Parser states */
+#define MODSECURITY_HTTP_STATE_IDLE        0
+#define MODSECURITY_HTTP_STATE_HEADERS     1
+#define MODSECURITY_HTTP_STATE_BODY        2
+#define MODSECURITY_HTTP_STATE_CHUNK_SIZE  3
+#define MODSECURITY_HTTP_STATE_CHUNK_DATA  4
+#define MODSECURITY_HTTP_STATE_CHUNK_END   5
+#define MODSECURITY_HTTP_STATE_TRAILER     6
+#define MODSECURITY_HTTP_STATE_RESYNC      7   /* looking for the next request line */
+
+/* Events returned by ModsecurityHttpParse */
+#define MODSECURITY_HTTP_EV_HEADERS  0x01   /* request line and headers parsed */
+#define MODSECURITY_HTTP_EV_BODY     0x02   /* request.body holds a body segment */
+#define MODSECURITY_HTTP_EV_DONE     0x04   /* request complete */
+#define MODSECURITY_HTTP_EV_ERROR    0x08   /* malformed, rest of the data dropped */
+#define MODSECURITY_HTTP_EV_GAP      0x10   /* ended or aborted by a reassembly gap */
+
+/* Parser flags */
+#define MODSECURITY_HTTP_CHUNKED     0x01
+#define MODSECURITY_HTTP_CHUNK_EXT   0x02
+#define MODSECURITY_HTTP_HEAD_SAVED  0x04   /* head lives in head_buf, not the packet */
+#define MODSECURITY_HTTP_PARTIAL     0x08   /* part of the body was never seen */
+
+/* Per flow request parser */
+typedef struct _modsecurity_http_parser
+{
+    int state;
+    uint32_t flags;
+    uint64_t body_left;          /* Content-Length or chunk bytes still expected */
+    uint32_t line_len;           /* trailer line length so far */
+    const uint8_t *head;         /* request line and headers */
+    uint32_t head_len;
+    uint8_t *head_buf;           /* head split across PDUs */
+    uint32_t head_buf_len;
+    modsecurity_http_request_t request;
+    modsecurity_arena_t *arena;
+    uint32_t published;          /* arena bytes under views published for this PDU */
+} modsecurity_http_parser_t;
+
+/* No request in progress */
+static inline int ModsecurityHttpParserIdle(const modsecurity_http_parser_t *parser)
+{
+    return parser->state == MODSECURITY_HTTP_STATE_IDLE
+        || parser->state == MODSECURITY_HTTP_STATE_RESYNC;
+}
+
+void ModsecurityHttpParserInit(modsecurity_http_parser_t *, modsecurity_arena_t *);
+uint32_t ModsecurityHttpParse(modsecurity_http_parser_t *, const uint8_t *, uint32_t, uint32_t *);
+void ModsecurityHttpParserRetain(modsecurity_http_parser_t *);
+uint32_t ModsecurityHttpGap(modsecurity_http_parser_t *);
+uint32_t ModsecurityHttpUrlDecode(const uint8_t *, uint32_t, uint8_t *, int);
+void ModsecurityHttpPublish(modsecurity_http_parser_t *, uint32_t);
+int ModsecurityHttpFromInspect(modsecurity_http_request_t *);
+
+#endif
@@ -0,0 +1,935 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * @detectSQLi and @detectXSS, after libinjection. SQL is split into tokens
+ * by a table driven scanner, the first few are folded into a fingerprint
+ * such as "s&1o1" and the fingerprint is looked up in a set of known
+ * injection shapes. A value is tried as it is and as if it started inside
+ * a quoted string. XSS is a cut down HTML tokenizer that looks for script
+ * capable tags, event handlers and javascript: URLs, from the data state
+ * and from inside an attribute value. Tokens are views into the value,
+ * nothing is copied.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "modsecurity_charset.h"
+#include "modsecurity_injection.h"
+
+/* Byte classes driving the SQL scanner */
+#define MODSECURITY_SQLI_WHITE     0
+#define MODSECURITY_SQLI_QUOTE     1
+#define MODSECURITY_SQLI_BACKTICK  2
+#define MODSECURITY_SQLI_DIGIT     3
+#define MODSECURITY_SQLI_WORD      4
+#define MODSECURITY_SQLI_OPERATOR  5
+#define MODSECURITY_SQLI_DASH      6
+#define MODSECURITY_SQLI_SLASH     7
+#define MODSECURITY_SQLI_HASH      8
+#define MODSECURITY_SQLI_VARIABLE  9
+#define MODSECURITY_SQLI_PUNCT     10
+#define MODSECURITY_SQLI_DOT       11
+#define MODSECURITY_SQLI_CLASSES   12
+
+/* Keyword types resolved by what follows them */
+#define MODSECURITY_SQLI_NEEDS_BY     'G'   /* group, order */
+#define MODSECURITY_SQLI_NEEDS_PAREN  'F'   /* function names */
+
+/* Longest keyword */
+#define MODSECURITY_SQLI_WORD_MAX  32
+
+#define MODSECURITY_SQLI_KEYWORD_SLOTS      512
+#define MODSECURITY_SQLI_FINGERPRINT_SLOTS  2048
+
+typedef struct _modsecurity_sqli_token
+{
+    const uint8_t *data;
+    uint32_t len;
+    char type;
+} modsecurity_sqli_token_t;
+
+typedef uint32_t (*ModsecuritySqliScanFunc)(const uint8_t *, uint32_t, uint32_t, modsecurity_sqli_token_t *);
+
+typedef struct _modsecurity_sqli_keyword
+{
+    const char *word;
+    char type;
+} modsecurity_sqli_keyword_t;
+
+/*
+ * Token types: s string, 1 number, n bareword, v variable, k keyword,
+ * U union, E select, B group by and friends, T statement, f function,
+ * o operator, & logical operator, c comment, and ( ) , ; . as themselves.
+ */
+static const modsecurity_sqli_keyword_t sqli_keywords[] =
+{
+    { "select", 'E' }, { "union", 'U' },
+    { "and", '&' }, { "or", '&' }, { "xor", '&' },
+    { "not", 'o' }, { "like", 'o' }, { "rlike", 'o' }, { "regexp", 'o' }, { "between", 'o' },
+    { "is", 'o' }, { "in", 'o' }, { "div", 'o' }, { "mod", 'o' }, { "sounds", 'o' },
+    { "null", '1' }, { "true", '1' }, { "false", '1' },
+    { "from", 'k' }, { "where", 'k' }, { "into", 'k' }, { "as", 'k' }, { "on", 'k' },
+    { "join", 'k' }, { "case", 'k' }, { "when", 'k' }, { "then", 'k' }, { "else", 'k' },
+    { "end", 'k' }, { "all", 'k' }, { "distinct", 'k' }, { "outfile", 'k' }, { "dumpfile", 'k' },
+    { "values", 'k' }, { "set", 'k' }, { "table", 'k' }, { "top", 'k' }, { "offset", 'k' },
+    { "asc", 'k' }, { "desc", 'k' }, { "exists", 'k' }, { "delay", 'k' }, { "escape", 'k' },
+    { "group", 'G' }, { "order", 'G' },
+    { "having", 'B' }, { "limit", 'B' }, { "procedure", 'B' },
+    { "drop", 'T' }, { "delete", 'T' }, { "insert", 'T' }, { "update", 'T' }, { "exec", 'T' },
+    { "execute", 'T' }, { "declare", 'T' }, { "create", 'T' }, { "alter", 'T' }, { "truncate", 'T' },
+    { "shutdown", 'T' }, { "waitfor", 'T' }, { "grant", 'T' }, { "rename", 'T' }, { "call", 'T' },
+    { "sleep", 'F' }, { "benchmark", 'F' }, { "concat", 'F' }, { "concat_ws", 'F' },
+    { "group_concat", 'F' }, { "char", 'F' }, { "chr", 'F' }, { "ascii", 'F' }, { "ord", 'F' },
+    { "substring", 'F' }, { "substr", 'F' }, { "mid", 'F' }, { "left", 'F' }, { "right", 'F' },
+    { "length", 'F' }, { "char_length", 'F' }, { "version", 'F' }, { "database", 'F' },
+    { "schema", 'F' }, { "user", 'F' }, { "current_user", 'F' }, { "system_user", 'F' },
+    { "session_user", 'F' }, { "load_file", 'F' }, { "extractvalue", 'F' }, { "updatexml", 'F' },
+    { "count", 'F' }, { "if", 'F' }, { "ifnull", 'F' }, { "iif", 'F' }, { "nullif", 'F' },
+    { "coalesce", 'F' }, { "hex", 'F' }, { "unhex", 'F' }, { "md5", 'F' }, { "sha1", 'F' },
+    { "pg_sleep", 'F' }, { "cast", 'F' }, { "convert", 'F' }, { "floor", 'F' }, { "rand", 'F' },
+    { "randomblob", 'F' }, { "name_const", 'F' }, { "exp", 'F' }, { "row", 'F' }, { "lower", 'F' },
+    { "upper", 'F' }, { "elt", 'F' }, { "make_set", 'F' }, { "sys_eval", 'F' }, { "sys_exec", 'F' },
+    { "instr", 'F' }, { "locate", 'F' }, { "reverse", 'F' }, { "replace", 'F' }, { "repeat", 'F' },
+    { "bin", 'F' }, { "conv", 'F' }, { "json_extract", 'F' }, { "json_keys", 'F' },
+    { "gtid_subset", 'F' }, { "polygon", 'F' }, { "multipoint", 'F' }, { "linestring", 'F' },
+    { "geometrycollection", 'F' }, { "to_char", 'F' }, { "xp_cmdshell", 'F' },
+    { "utl_inaddr.get_host_address", 'F' }, { "utl_http.request", 'F' },
+    { "dbms_pipe.receive_message", 'F' }, { "sqlite_version", 'F' }, { "@@version", 'v' },
+    { NULL, 0 }
+};
+
+/* Fingerprints of known injections */
+static const char *sqli_fingerprints[] =
+{
+    "&1o1c", "&1osc", "&1ovc", "&so1c", "&sosc", "&sovc", "&vo1c", "&vosc", "&vovc", "(E1kn",
+    "(Eskn", "(Evkn", "1&(E1", "1&(Ef", "1&(Eo", "1&(Es", "1&(Ev", "1&1B1", "1&1Bc", "1&1Bs",
+    "1&1Bv", "1&1UE", "1&1c", "1&1o(", "1&1o1", "1&1of", "1&1os", "1&1ov", "1&f(", "1&f((", "1&f(1",
+    "1&f(c", "1&f(f", "1&f(s", "1&f(v", "1&k(E", "1&no1", "1&nos", "1&nov", "1&s", "1&sB1", "1&sBc",
+    "1&sBs", "1&sBv", "1&sUE", "1&sc", "1&so(", "1&so1", "1&sof", "1&sos", "1&sov", "1&v", "1&vB1",
+    "1&vBc", "1&vBs", "1&vBv", "1&vUE", "1&vc", "1&vo(", "1&vo1", "1&vof", "1&vos", "1&vov",
+    "1)&(1", "1)&(s", "1)&(v", "1)&1o", "1)&f(", "1)&so", "1)&vo", "1))&(", "1))&1", "1))&s",
+    "1))&v", "1))UE", "1)B1c", "1)Bsc", "1)Bvc", "1)UE", "1)UE1", "1)UEc", "1)UEs", "1)UEv",
+    "1,(E1", "1,(Es", "1,(Ev", "1;E", "1;E1", "1;E1c", "1;Ec", "1;Ef(", "1;Es", "1;Esc", "1;Ev",
+    "1;Evc", "1;T", "1;T1n", "1;Tc", "1;Tf(", "1;Tk1", "1;Tkn", "1;Tks", "1;Tkv", "1;Tn1", "1;Tnk",
+    "1;Tns", "1;Tnv", "1;Tsn", "1;Tvn", "1B1", "1B1,1", "1B1,s", "1B1,v", "1B1c", "1B1o1", "1B1os",
+    "1B1ov", "1Bn(", "1Bn(c", "1BnB1", "1BnBs", "1BnBv", "1Bs", "1Bs,1", "1Bs,s", "1Bs,v", "1Bsc",
+    "1Bso1", "1Bsos", "1Bsov", "1Bv", "1Bv,1", "1Bv,s", "1Bv,v", "1Bvc", "1Bvo1", "1Bvos", "1Bvov",
+    "1Tk1", "1Tk1c", "1Tks", "1Tksc", "1Tkv", "1Tkvc", "1UE", "1UE1", "1UE1,", "1UE1c", "1UE1k",
+    "1UEc", "1UEf(", "1UEn,", "1UEok", "1UEs", "1UEs,", "1UEsc", "1UEsk", "1UEv", "1UEv,", "1UEvc",
+    "1UEvk", "1c", "1kk1", "1kk1c", "1kks", "1kksc", "1kkv", "1kkvc", "1o(E1", "1o(Ef", "1o(Es",
+    "1o(Ev", "1o1&1", "1o1&s", "1o1&v", "1o1UE", "1o1c", "1of(1", "1of(s", "1of(v", "1os", "1os&1",
+    "1os&s", "1os&v", "1osUE", "1osc", "1ov", "1ov&1", "1ov&s", "1ov&v", "1ovUE", "1ovc", "f(1)c",
+    "f(f()", "f(s)c", "f(v)c", "s&(E1", "s&(Ef", "s&(Eo", "s&(Es", "s&(Ev", "s&1", "s&1B1", "s&1Bc",
+    "s&1Bs", "s&1Bv", "s&1UE", "s&1c", "s&1o(", "s&1o1", "s&1of", "s&1os", "s&1ov", "s&f(", "s&f((",
+    "s&f(1", "s&f(c", "s&f(f", "s&f(s", "s&f(v", "s&k(E", "s&no1", "s&nos", "s&nov", "s&s", "s&sB1",
+    "s&sBc", "s&sBs", "s&sBv", "s&sUE", "s&sc", "s&so(", "s&so1", "s&sof", "s&sos", "s&sov", "s&v",
+    "s&vB1", "s&vBc", "s&vBs", "s&vBv", "s&vUE", "s&vc", "s&vo(", "s&vo1", "s&vof", "s&vos",
+    "s&vov", "s)&(1", "s)&(s", "s)&(v", "s)&1o", "s)&f(", "s)&so", "s)&vo", "s))&(", "s))&1",
+    "s))&s", "s))&v", "s))UE", "s)B1c", "s)Bsc", "s)Bvc", "s)UE", "s)UE1", "s)UEc", "s)UEs",
+    "s)UEv", "s,(E1", "s,(Es", "s,(Ev", "s;E", "s;E1", "s;E1c", "s;Ec", "s;Ef(", "s;Es", "s;Esc",
+    "s;Ev", "s;Evc", "s;T", "s;T1n", "s;Tc", "s;Tf(", "s;Tk1", "s;Tkn", "s;Tks", "s;Tkv", "s;Tn1",
+    "s;Tnk", "s;Tns", "s;Tnv", "s;Tsn", "s;Tvn", "sB1", "sB1,1", "sB1,s", "sB1,v", "sB1c", "sB1o1",
+    "sB1os", "sB1ov", "sBn(", "sBn(c", "sBnB1", "sBnBs", "sBnBv", "sBs", "sBs,1", "sBs,s", "sBs,v",
+    "sBsc", "sBso1", "sBsos", "sBsov", "sBv", "sBv,1", "sBv,s", "sBv,v", "sBvc", "sBvo1", "sBvos",
+    "sBvov", "sTk1", "sTk1c", "sTks", "sTksc", "sTkv", "sTkvc", "sUE", "sUE1", "sUE1,", "sUE1c",
+    "sUE1k", "sUEc", "sUEf(", "sUEn,", "sUEok", "sUEs", "sUEs,", "sUEsc", "sUEsk", "sUEv", "sUEv,",
+    "sUEvc", "sUEvk", "sc", "skk1", "skk1c", "skks", "skksc", "skkv", "skkvc", "so(E1", "so(Ef",
+    "so(Es", "so(Ev", "so1", "so1&1", "so1&s", "so1&v", "so1UE", "so1c", "sof(1", "sof(s", "sof(v",
+    "sos", "sos&1", "sos&s", "sos&v", "sosUE", "sosc", "sov", "sov&1", "sov&s", "sov&v", "sovUE",
+    "sovc", "v&(E1", "v&(Ef", "v&(Eo", "v&(Es", "v&(Ev", "v&1", "v&1B1", "v&1Bc", "v&1Bs", "v&1Bv",
+    "v&1UE", "v&1c", "v&1o(", "v&1o1", "v&1of", "v&1os", "v&1ov", "v&f(", "v&f((", "v&f(1", "v&f(c",
+    "v&f(f", "v&f(s", "v&f(v", "v&k(E", "v&no1", "v&nos", "v&nov", "v&s", "v&sB1", "v&sBc", "v&sBs",
+    "v&sBv", "v&sUE", "v&sc", "v&so(", "v&so1", "v&sof", "v&sos", "v&sov", "v&v", "v&vB1", "v&vBc",
+    "v&vBs", "v&vBv", "v&vUE", "v&vc", "v&vo(", "v&vo1", "v&vof", "v&vos", "v&vov", "v)&(1",
+    "v)&(s", "v)&(v", "v)&1o", "v)&f(", "v)&so", "v)&vo", "v))&(", "v))&1", "v))&s", "v))&v",
+    "v))UE", "v)B1c", "v)Bsc", "v)Bvc", "v)UE", "v)UE1", "v)UEc", "v)UEs", "v)UEv", "v,(E1",
+    "v,(Es", "v,(Ev", "v;E", "v;E1", "v;E1c", "v;Ec", "v;Ef(", "v;Es", "v;Esc", "v;Ev", "v;Evc",
+    "v;T", "v;T1n", "v;Tc", "v;Tf(", "v;Tk1", "v;Tkn", "v;Tks", "v;Tkv", "v;Tn1", "v;Tnk", "v;Tns",
+    "v;Tnv", "v;Tsn", "v;Tvn", "vB1", "vB1,1", "vB1,s", "vB1,v", "vB1c", "vB1o1", "vB1os", "vB1ov",
+    "vBn(", "vBn(c", "vBnB1", "vBnBs", "vBnBv", "vBs", "vBs,1", "vBs,s", "vBs,v", "vBsc", "vBso1",
+    "vBsos", "vBsov", "vBv", "vBv,1", "vBv,s", "vBv,v", "vBvc", "vBvo1", "vBvos", "vBvov", "vTk1",
+    "vTk1c", "vTks", "vTksc", "vTkv", "vTkvc", "vUE", "vUE1", "vUE1,", "vUE1c", "vUE1k", "vUEc",
+    "vUEf(", "vUEn,", "vUEok", "vUEs", "vUEs,", "vUEsc", "vUEsk", "vUEv", "vUEv,", "vUEvc", "vUEvk",
+    "vc", "vkk1", "vkk1c", "vkks", "vkksc", "vkkv", "vkkvc", "vo(E1", "vo(Ef", "vo(Es", "vo(Ev",
+    "vo1", "vo1&1", "vo1&s", "vo1&v", "vo1UE", "vo1c", "vof(1", "vof(s", "vof(v", "vos", "vos&1",
+    "vos&s", "vos&v", "vosUE", "vosc", "vov", "vov&1", "vov&s", "vov&v", "vovUE", "vovc",
+    NULL
+};
+
+/* Tags that run script or pull in other documents */
+static const char *xss_tags[] =
+{
+    "applet", "base", "comment", "embed", "frame", "frameset", "handler", "iframe", "import",
+    "isindex", "link", "listener", "meta", "noscript", "object", "script", "style", "vmlframe",
+    "xml", "xss", NULL
+};
+
+/* Attributes whose value is a URL */
+static const char *xss_url_attributes[] =
+{
+    "href", "src", "action", "formaction", "data", "xlink:href", "background", "dynsrc",
+    "lowsrc", "poster", "codebase", "from", "to", "values", "by", NULL
+};
+
+/* Attributes that are trouble whatever their value */
+static const char *xss_attributes[] =
+{
+    "style", "srcdoc", "xmlns", "attributename", NULL
+};
+
+static const char *xss_schemes[] =
+{
+    "javascript:", "vbscript:", "livescript:", "data:", "view-source:", NULL
+};
+
+static uint8_t sqli_classes[256];
+static uint8_t sqli_words[256];
+static modsecurity_charset_lut_t alnum;
+
+static struct
+{
+    char word[MODSECURITY_SQLI_WORD_MAX];
+    char type;
+} sqli_keyword_set[MODSECURITY_SQLI_KEYWORD_SLOTS];
+
+static uint64_t sqli_fingerprint_set[MODSECURITY_SQLI_FINGERPRINT_SLOTS];
+
+static inline uint32_t ModsecurityInjectionHash(const uint8_t *data, uint32_t len)
+{
+    uint32_t hash = 2166136261U;
+    uint32_t i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ data[i]) * 16777619U;
+
+    return hash;
+}
+
+static inline uint32_t ModsecurityFingerprintSlot(uint64_t key)
+{
+    return (uint32_t) ((key * 0x9e3779b97f4a7c15ULL) >> 53) & (MODSECURITY_SQLI_FINGERPRINT_SLOTS - 1);
+}
+
+/* Type bytes packed into an integer, never zero */
+static inline uint64_t ModsecurityFingerprintKey(const char *fingerprint)
+{
+    uint64_t key = 0;
+
+    for (; *fingerprint; fingerprint++)
+        key = (key << 8) | (uint8_t) *fingerprint;
+
+    return key;
+}
+
+void ModsecurityInjectionInit(void)
+{
+    modsecurity_charset_t letters;
+    uint32_t i, slot;
+    uint64_t key;
+    int c;
+
+    if (sqli_classes['a'] != 0)
+        return;
+
+    memset(&letters, 0, sizeof(letters));
+
+    for (c = 0; c < 256; c++)
+    {
+        if (isalpha(c) || c == '_' || c == '$' || c >= 0x80)
+            sqli_classes[c] = MODSECURITY_SQLI_WORD;
+        else if (isdigit(c))
+            sqli_classes[c] = MODSECURITY_SQLI_DIGIT;
+        else if (c == '\'' || c == '"')
+            sqli_classes[c] = MODSECURITY_SQLI_QUOTE;
+        else if (c == '`')
+            sqli_classes[c] = MODSECURITY_SQLI_BACKTICK;
+        else if (c && strchr("=<>!|&^~+*%:", c))
+            sqli_classes[c] = MODSECURITY_SQLI_OPERATOR;
+        else if (c == '-')
+            sqli_classes[c] = MODSECURITY_SQLI_DASH;
+        else if (c == '/')
+            sqli_classes[c] = MODSECURITY_SQLI_SLASH;
+        else if (c == '#')
+            sqli_classes[c] = MODSECURITY_SQLI_HASH;
+        else if (c == '@')
+            sqli_classes[c] = MODSECURITY_SQLI_VARIABLE;
+        else if (c == '(' || c == ')' || c == ',' || c == ';')
+            sqli_classes[c] = MODSECURITY_SQLI_PUNCT;
+        else if (c == '.')
+            sqli_classes[c] = MODSECURITY_SQLI_DOT;
+        else
+            sqli_classes[c] = MODSECURITY_SQLI_WHITE;
+
+        sqli_words[c] = isalnum(c) || c == '_' || c == '$' || c == '.' || c >= 0x80;
+
+        if (isalnum(c))
+            ModsecurityCharsetAdd(&letters, (uint8_t) c);
+    }
+
+    ModsecurityCharsetLut(&letters, &alnum);
+
+    for (i = 0; sqli_keywords[i].word != NULL; i++)
+    {
+        const char *word = sqli_keywords[i].word;
+
+        slot = ModsecurityInjectionHash((const uint8_t *) word, strlen(word));
+
+        for (slot &= MODSECURITY_SQLI_KEYWORD_SLOTS - 1; sqli_keyword_set[slot].type;
+                slot = (slot + 1) & (MODSECURITY_SQLI_KEYWORD_SLOTS - 1));
+
+        strcpy(sqli_keyword_set[slot].word, word);
+        sqli_keyword_set[slot].type = sqli_keywords[i].type;
+    }
+
+    for (i = 0; sqli_fingerprints[i] != NULL; i++)
+    {
+        key = ModsecurityFingerprintKey(sqli_fingerprints[i]);
+
+        for (slot = ModsecurityFingerprintSlot(key); sqli_fingerprint_set[slot] && sqli_fingerprint_set[slot] != key;
+                slot = (slot + 1) & (MODSECURITY_SQLI_FINGERPRINT_SLOTS - 1));
+
+        sqli_fingerprint_set[slot] = key;
+    }
+}
+
+/* Values of letters and digits alone are neither */
+static inline int ModsecurityInjectionPlain(const uint8_t *data, uint32_t len)
+{
+    return ModsecurityCharsetSpan(&alnum, data, len) == len;
+}
+
+static char ModsecuritySqliKeyword(const uint8_t *data, uint32_t len)
+{
+    uint8_t word[MODSECURITY_SQLI_WORD_MAX];
+    uint32_t i, slot;
+
+    if (len >= MODSECURITY_SQLI_WORD_MAX)
+        return 'n';
+
+    for (i = 0; i < len; i++)
+        word[i] = (uint8_t) tolower(data[i]);
+
+    word[len] = '\0';
+    slot = ModsecurityInjectionHash(word, len);
+
+    for (slot &= MODSECURITY_SQLI_KEYWORD_SLOTS - 1; sqli_keyword_set[slot].type;
+            slot = (slot + 1) & (MODSECURITY_SQLI_KEYWORD_SLOTS - 1))
+    {
+        if (!strcmp(sqli_keyword_set[slot].word, (const char *) word))
+            return sqli_keyword_set[slot].type;
+    }
+
+    return 'n';
+}
+
+static inline uint32_t ModsecuritySqliSkipWhite(const uint8_t *data, uint32_t len, uint32_t pos)
+{
+    while (pos < len && sqli_classes[data[pos]] == MODSECURITY_SQLI_WHITE)
+        pos++;
+
+    return pos;
+}
+
+/* The word at pos is one of the given lowercase words */
+static int ModsecuritySqliNextWord(const uint8_t *data, uint32_t len, uint32_t *pos, const char *a, const char *b)
+{
+    uint32_t start = ModsecuritySqliSkipWhite(data, len, *pos), end;
+
+    for (end = start; end < len && sqli_words[data[end]]; end++);
+
+    if ((end - start == strlen(a) && !strncasecmp((const char *) data + start, a, end - start))
+            || (b != NULL && end - start == strlen(b) && !strncasecmp((const char *) data + start, b, end - start)))
+    {
+        *pos = end;
+        return 1;
+    }
+
+    return 0;
+}
+
+static uint32_t ModsecuritySqliQuoted(const uint8_t *data, uint32_t len, uint32_t pos, uint8_t quote,
+        modsecurity_sqli_token_t *tok)
+{
+    uint32_t i;
+
+    for (i = pos; i < len; i++)
+    {
+        if (data[i] == '\\')
+            i++;
+        else if (data[i] == quote && i + 1 < len && data[i + 1] == quote)
+            i++;
+        else if (data[i] == quote)
+            break;
+    }
+
+    if (i > len)
+        i = len;
+
+    tok->type = 's';
+    tok->data = data + pos;
+    tok->len = i - pos;
+
+    return i < len ? i + 1 : len;
+}
+
+static uint32_t ModsecuritySqliWhite(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    return pos + 1;
+}
+
+static uint32_t ModsecuritySqliString(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    return ModsecuritySqliQuoted(data, len, pos + 1, data[pos], tok);
+}
+
+static uint32_t ModsecuritySqliBacktick(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    pos = ModsecuritySqliQuoted(data, len, pos + 1, '`', tok);
+    tok->type = 'n';
+
+    return pos;
+}
+
+static uint32_t ModsecuritySqliNumber(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    uint32_t i = pos, j;
+
+    if (data[i] == '0' && i + 1 < len && (data[i + 1] | 0x20) == 'x')
+    {
+        for (i += 2; i < len && isxdigit(data[i]); i++);
+    }
+    else if (data[i] == '0' && i + 1 < len && (data[i + 1] | 0x20) == 'b')
+    {
+        for (i += 2; i < len && (data[i] == '0' || data[i] == '1'); i++);
+    }
+    else
+    {
+        for (; i < len && isdigit(data[i]); i++);
+
+        if (i < len && data[i] == '.')
+            for (i++; i < len && isdigit(data[i]); i++);
+
+        if (i < len && (data[i] | 0x20) == 'e')
+        {
+            j = i + 1;
+
+            if (j < len && (data[j] == '+' || data[j] == '-'))
+                j++;
+
+            if (j < len && isdigit(data[j]))
+                for (i = j; i < len && isdigit(data[i]); i++);
+        }
+    }
+
+    tok->type = '1';
+    tok->data = data + pos;
+    tok->len = i - pos;
+
+    return i;
+}
+
+static uint32_t ModsecuritySqliWord(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    uint32_t i, next;
+
+    for (i = pos; i < len && sqli_words[data[i]]; i++);
+
+    tok->data = data + pos;
+    tok->len = i - pos;
+    tok->type = ModsecuritySqliKeyword(tok->data, tok->len);
+
+    switch (tok->type)
+    {
+        case MODSECURITY_SQLI_NEEDS_BY:
+            tok->type = ModsecuritySqliNextWord(data, len, &i, "by", NULL) ? 'B' : 'n';
+            break;
+
+        case MODSECURITY_SQLI_NEEDS_PAREN:
+            next = ModsecuritySqliSkipWhite(data, len, i);
+            tok->type = next < len && data[next] == '(' ? 'f' : 'n';
+            break;
+
+        case 'U':
+            ModsecuritySqliNextWord(data, len, &i, "all", "distinct");
+            break;
+    }
+
+    return i;
+}
+
+static uint32_t ModsecuritySqliOperator(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    uint8_t c = data[pos], n = pos + 1 < len ? data[pos + 1] : 0;
+
+    tok->type = 'o';
+    tok->data = data + pos;
+    tok->len = 1;
+
+    if ((c == '|' && n == '|') || (c == '&' && n == '&'))
+    {
+        tok->type = '&';
+        tok->len = 2;
+    }
+    else if (c == '<' && n == '=' && pos + 2 < len && data[pos + 2] == '>')
+    {
+        tok->len = 3;
+    }
+    else if ((n == '=' && strchr("<>!:=", c)) || (c == '<' && (n == '>' || n == '<'))
+            || (c == '>' && n == '>') || (c == '!' && (n == '<' || n == '>')))
+    {
+        tok->len = 2;
+    }
+    else if (c == '*' && n == '/')
+    {
+        /* End of a MySQL executable comment */
+        tok->type = 0;
+        tok->len = 2;
+    }
+
+    return pos + tok->len;
+}
+
+static uint32_t ModsecuritySqliLineComment(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    const uint8_t *end = (const uint8_t *) memchr(data + pos, '\n', len - pos);
+    uint32_t i = end != NULL ? (uint32_t) (end - data) : len;
+
+    tok->type = 'c';
+    tok->data = data + pos;
+    tok->len = i - pos;
+
+    return i;
+}
+
+static uint32_t ModsecuritySqliDash(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    if (pos + 1 < len && data[pos + 1] == '-')
+        return ModsecuritySqliLineComment(data, len, pos, tok);
+
+    return ModsecuritySqliOperator(data, len, pos, tok);
+}
+
+static uint32_t ModsecuritySqliSlash(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    uint32_t i;
+
+    if (pos + 1 >= len || data[pos + 1] != '*')
+        return ModsecuritySqliOperator(data, len, pos, tok);
+
+    /* MySQL runs the inside of a comment starting with a bang, skip its marker */
+    if (pos + 2 < len && data[pos + 2] == '!')
+    {
+        for (i = pos + 3; i < len && isdigit(data[i]); i++);
+        return i;
+    }
+
+    for (i = pos + 2; i + 1 < len && !(data[i] == '*' && data[i + 1] == '/'); i++);
+
+    tok->type = 'c';
+    tok->data = data + pos;
+    tok->len = i + 1 < len ? i + 2 - pos : len - pos;
+
+    return pos + tok->len;
+}
+
+static uint32_t ModsecuritySqliVariable(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    uint32_t i = pos + 1;
+
+    if (i < len && data[i] == '@')
+        i++;
+
+    for (; i < len && sqli_words[data[i]]; i++);
+
+    tok->type = 'v';
+    tok->data = data + pos;
+    tok->len = i - pos;
+
+    return i;
+}
+
+static uint32_t ModsecuritySqliPunct(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    tok->type = (char) data[pos];
+    tok->data = data + pos;
+    tok->len = 1;
+
+    return pos + 1;
+}
+
+static uint32_t ModsecuritySqliDot(const uint8_t *data, uint32_t len, uint32_t pos,
+        modsecurity_sqli_token_t *tok)
+{
+    if (pos + 1 < len && isdigit(data[pos + 1]))
+        return ModsecuritySqliNumber(data, len, pos, tok);
+
+    return ModsecuritySqliPunct(data, len, pos, tok);
+}
+
+static const ModsecuritySqliScanFunc sqli_scanners[MODSECURITY_SQLI_CLASSES] =
+{
+    ModsecuritySqliWhite,           /* MODSECURITY_SQLI_WHITE */
+    ModsecuritySqliString,          /* MODSECURITY_SQLI_QUOTE */
+    ModsecuritySqliBacktick,        /* MODSECURITY_SQLI_BACKTICK */
+    ModsecuritySqliNumber,          /* MODSECURITY_SQLI_DIGIT */
+    ModsecuritySqliWord,            /* MODSECURITY_SQLI_WORD */
+    ModsecuritySqliOperator,        /* MODSECURITY_SQLI_OPERATOR */
+    ModsecuritySqliDash,            /* MODSECURITY_SQLI_DASH */
+    ModsecuritySqliSlash,           /* MODSECURITY_SQLI_SLASH */
+    ModsecuritySqliLineComment,     /* MODSECURITY_SQLI_HASH */
+    ModsecuritySqliVariable,        /* MODSECURITY_SQLI_VARIABLE */
+    ModsecuritySqliPunct,           /* MODSECURITY_SQLI_PUNCT */
+    ModsecuritySqliDot              /* MODSECURITY_SQLI_DOT */
+};
+
+/* Something an operator can apply to */
+static inline int ModsecuritySqliOperand(char type)
+{
+    return type == 's' || type == '1' || type == 'n' || type == 'v' || type == ')';
+}
+
+/*
+ * Fold a token into the fingerprint: comments count only at the very end,
+ * adjacent strings are one string and a sign belongs to its number.
+ */
+static void ModsecuritySqliPush(modsecurity_sqli_token_t *tokens, uint32_t *ntokens,
+        const modsecurity_sqli_token_t *tok)
+{
+    modsecurity_sqli_token_t *last;
+
+    if (*ntokens && tokens[*ntokens - 1].type == 'c')
+        (*ntokens)--;
+
+    last = *ntokens ? &tokens[*ntokens - 1] : NULL;
+
+    if (last != NULL && last->type == 's' && tok->type == 's')
+        return;
+
+    if (last != NULL && last->type == 'o' && tok->type == '1' && last->len == 1
+            && strchr("+-~!", last->data[0]) != NULL
+            && (*ntokens == 1 || !ModsecuritySqliOperand(tokens[*ntokens - 2].type)))
+        (*ntokens)--;
+
+    tokens[(*ntokens)++] = *tok;
+}
+
+/* Fingerprint of data as if it followed quote, 0 for none */
+static void ModsecuritySqliFingerprint(const uint8_t *data, uint32_t len, uint8_t quote, char *fingerprint)
+{
+    modsecurity_sqli_token_t tokens[MODSECURITY_SQLI_TOKENS + 1];
+    modsecurity_sqli_token_t tok;
+    uint32_t ntokens = 0, pos = 0, i;
+
+    if (quote)
+    {
+        pos = ModsecuritySqliQuoted(data, len, 0, quote, &tok);
+        ModsecuritySqliPush(tokens, &ntokens, &tok);
+    }
+
+    /* One token past the fingerprint, it can still fold the last one */
+    while (pos < len && ntokens <= MODSECURITY_SQLI_TOKENS)
+    {
+        tok.type = 0;
+        pos = sqli_scanners[sqli_classes[data[pos]]](data, len, pos, &tok);
+
+        if (tok.type)
+            ModsecuritySqliPush(tokens, &ntokens, &tok);
+    }
+
+    if (ntokens > MODSECURITY_SQLI_TOKENS)
+        ntokens = MODSECURITY_SQLI_TOKENS;
+
+    for (i = 0; i < ntokens; i++)
+        fingerprint[i] = tokens[i].type;
+
+    fingerprint[ntokens] = '\0';
+}
+
+static int ModsecuritySqliKnown(const char *fingerprint)
+{
+    uint64_t key = ModsecurityFingerprintKey(fingerprint);
+    uint32_t slot;
+
+    for (slot = ModsecurityFingerprintSlot(key); sqli_fingerprint_set[slot];
+            slot = (slot + 1) & (MODSECURITY_SQLI_FINGERPRINT_SLOTS - 1))
+    {
+        if (sqli_fingerprint_set[slot] == key)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Fills in the fingerprint that matched when given room for one */
+int ModsecurityDetectSqli(const uint8_t *data, uint32_t len, char *fingerprint)
+{
+    static const uint8_t quotes[] = { 0, '\'', '"' };
+    char found[MODSECURITY_SQLI_TOKENS + 1];
+    uint32_t i;
+
+    if (ModsecurityInjectionPlain(data, len))
+        return 0;
+
+    for (i = 0; i < sizeof(quotes); i++)
+    {
+        if (quotes[i] && memchr(data, quotes[i], len) == NULL)
+            continue;
+
+        ModsecuritySqliFingerprint(data, len, quotes[i], found);
+
+        if (ModsecuritySqliKnown(found))
+        {
+            if (fingerprint != NULL)
+                strcpy(fingerprint, found);
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static inline int ModsecurityXssSpace(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static int ModsecurityXssListed(const char **list, const uint8_t *data, uint32_t len)
+{
+    for (; *list != NULL; list++)
+    {
+        if (strlen(*list) == len && !strncasecmp(*list, (const char *) data, len))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Browsers drop leading control bytes and tabs or newlines inside a scheme */
+static int ModsecurityXssScheme(const uint8_t *data, uint32_t len)
+{
+    const char **scheme;
+    const char *want;
+    uint32_t i;
+
+    for (; len && *data <= 0x20; data++, len--);
+
+    for (scheme = xss_schemes; *scheme != NULL; scheme++)
+    {
+        for (want = *scheme, i = 0; *want && i < len; i++)
+        {
+            if (data[i] == '\t' || data[i] == '\n' || data[i] == '\r')
+                continue;
+
+            if (tolower(data[i]) != *want)
+                break;
+
+            want++;
+        }
+
+        if (*want == '\0')
+            return 1;
+    }
+
+    return 0;
+}
+
+static int ModsecurityXssAttribute(const uint8_t *name, uint32_t name_len, const uint8_t *value,
+        uint32_t value_len)
+{
+    /* Event handlers */
+    if (name_len >= 5 && (name[0] | 0x20) == 'o' && (name[1] | 0x20) == 'n')
+        return 1;
+
+    if (ModsecurityXssListed(xss_attributes, name, name_len))
+        return 1;
+
+    return ModsecurityXssListed(xss_url_attributes, name, name_len)
+        && ModsecurityXssScheme(value, value_len);
+}
+
+/* Attributes up to the end of the tag, pos is left past it */
+static int ModsecurityXssAttributes(const uint8_t *data, uint32_t len, uint32_t *pos)
+{
+    uint32_t i = *pos, name, name_len, value, value_len;
+    const uint8_t *end;
+
+    while (i < len)
+    {
+        while (i < len && (ModsecurityXssSpace(data[i]) || data[i] == '/'))
+            i++;
+
+        if (i >= len)
+            break;
+
+        if (data[i] == '>')
+        {
+            i++;
+            break;
+        }
+
+        for (name = i++; i < len && !ModsecurityXssSpace(data[i]) && data[i] != '/' && data[i] != '>'
+                && data[i] != '='; i++);
+
+        name_len = i - name;
+
+        while (i < len && ModsecurityXssSpace(data[i]))
+            i++;
+
+        /* Valueless attributes do no harm */
+        if (i >= len || data[i] != '=')
+            continue;
+
+        for (i++; i < len && ModsecurityXssSpace(data[i]); i++);
+
+        if (i < len && (data[i] == '"' || data[i] == '\'' || data[i] == '`'))
+        {
+            value = i + 1;
+            end = (const uint8_t *) memchr(data + value, data[i], len - value);
+            value_len = (end != NULL ? (uint32_t) (end - data) : len) - value;
+            i = end != NULL ? value + value_len + 1 : len;
+        }
+        else
+        {
+            for (value = i; i < len && !ModsecurityXssSpace(data[i]) && data[i] != '>'; i++);
+            value_len = i - value;
+        }
+
+        if (ModsecurityXssAttribute(data + name, name_len, data + value, value_len))
+            return 1;
+    }
+
+    *pos = i;
+
+    return 0;
+}
+
+/* A tag starting at the '<' at pos */
+static int ModsecurityXssTag(const uint8_t *data, uint32_t len, uint32_t *pos)
+{
+    uint32_t i = *pos + 1, name;
+    const uint8_t *end;
+
+    if (i >= len)
+    {
+        *pos = len;
+        return 0;
+    }
+
+    /* Comments, doctypes, processing instructions and end tags */
+    if (data[i] == '!' || data[i] == '?' || data[i] == '/')
+    {
+        end = (const uint8_t *) memchr(data + i, '>', len - i);
+        *pos = end != NULL ? (uint32_t) (end - data) + 1 : len;
+        return 0;
+    }
+
+    if (!isalpha(data[i]))
+    {
+        *pos = i;
+        return 0;
+    }
+
+    for (name = i; i < len && !ModsecurityXssSpace(data[i]) && data[i] != '/' && data[i] != '>'; i++);
+
+    if (ModsecurityXssListed(xss_tags, data + name, i - name))
+        return 1;
+
+    if (i - name >= 3 && (!strncasecmp((const char *) data + name, "svg", 3)
+                || !strncasecmp((const char *) data + name, "xsl", 3)))
+        return 1;
+
+    *pos = i;
+
+    return ModsecurityXssAttributes(data, len, pos);
+}
+
+int ModsecurityDetectXss(const uint8_t *data, uint32_t len)
+{
+    static const uint8_t quotes[] = { '"', '\'', '`' };
+    const uint8_t *lt, *end;
+    uint32_t pos, i;
+
+    if (ModsecurityInjectionPlain(data, len))
+        return 0;
+
+    for (pos = 0; (lt = (const uint8_t *) memchr(data + pos, '<', len - pos)) != NULL; )
+    {
+        pos = (uint32_t) (lt - data);
+
+        if (ModsecurityXssTag(data, len, &pos))
+            return 1;
+    }
+
+    /* From inside an attribute value, breaking out of it needs an attribute of our own */
+    if (memchr(data, '=', len) == NULL)
+        return 0;
+
+    for (pos = 0; pos < len && !ModsecurityXssSpace(data[pos]) && data[pos] != '>'; pos++);
+
+    if (ModsecurityXssAttributes(data, len, &pos))
+        return 1;
+
+    for (i = 0; i < sizeof(quotes); i++)
+    {
+        if ((end = (const uint8_t *) memchr(data, quotes[i], len)) == NULL)
+            continue;
+
+        pos = (uint32_t) (end - data) + 1;
+
+        if (ModsecurityXssAttributes(data, len, &pos))
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef MODSECURITY_INJECTION_H
+#define MODSECURITY_INJECTION_H
+
+#include "sf_types.h"
+
+/* Folded SQL tokens making up a fingerprint */
+#define MODSECURITY_SQLI_TOKENS  5
+
+void ModsecurityInjectionInit(void);
+int ModsecurityDetectSqli(const uint8_t *, uint32_t, char *);
+int ModsecurityDetectXss(const uint8_t *, uint32_t);
+
+#endif
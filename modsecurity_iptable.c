@@ -0,0 +1,410 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Address prefix tables for @ipMatch and @ipMatchFromFile. Prefixes are
+ * collected as the rule loads, then compiled into a multibit trie that
+ * consumes one address byte per node: a node is a bitmap of the byte
+ * values fully inside some prefix, a bitmap of those with longer prefixes
+ * below, and the index of its first child, the others following it in
+ * bitmap order. Runs of bytes every prefix below a node shares are kept in
+ * the node and compared in one go. A lookup reads at most one node per
+ * address byte whatever the number of prefixes, and the table is never
+ * written once compiled.
+ *
+ * Only whether an address is covered matters, so a prefix inside another
+ * is dropped and the rest never overlap.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "sf_dynamic_preprocessor.h"
+#include "spp_modsecurity.h"
+#include "modsecurity_iptable.h"
+
+#define MODSECURITY_IPTABLE_V4  0
+#define MODSECURITY_IPTABLE_V6  1
+
+typedef struct _modsecurity_ip_prefix
+{
+    uint8_t addr[16];
+    uint8_t bits;
+} modsecurity_ip_prefix_t;
+
+typedef struct _modsecurity_iptable_node
+{
+    uint64_t leaf[4];            /* byte values inside a prefix */
+    uint64_t child[4];           /* byte values with a longer prefix below */
+    uint32_t base;               /* node of the lowest child */
+    uint8_t rank[3];             /* children in the bitmap words before 1, 2, 3 */
+    uint8_t skip_len;
+    uint8_t skip[MODSECURITY_IPTABLE_SKIP];
+} modsecurity_iptable_node_t;
+
+struct _modsecurity_iptable
+{
+    modsecurity_ip_prefix_t *prefixes[2];   /* until compiled */
+    uint32_t nprefixes[2];
+    uint32_t capacity[2];
+    modsecurity_iptable_node_t *nodes;
+    uint32_t nnodes;
+    uint32_t node_capacity;
+    int32_t root[2];
+    uint8_t all[2];              /* holds a /0 */
+    uint32_t count;
+    uint32_t refs;
+};
+
+static const uint32_t iptable_len[2] = { 4, 16 };
+
+modsecurity_iptable_t *ModsecurityIptableNew(void)
+{
+    modsecurity_iptable_t *table;
+
+    if ((table = (modsecurity_iptable_t *) calloc(1, sizeof(*table))) == NULL)
+        return NULL;
+
+    table->root[0] = table->root[1] = -1;
+    table->refs = 1;
+
+    return table;
+}
+
+/* Address in text, without surrounding blanks, as 4 or 16 bytes */
+static int ModsecurityIptableParse(const uint8_t *data, uint32_t len, uint8_t *addr, int *family)
+{
+    char text[MODSECURITY_IPTABLE_TEXT];
+
+    while (len && isspace(*data))
+        data++, len--;
+
+    while (len && isspace(data[len - 1]))
+        len--;
+
+    if (len == 0 || len >= sizeof(text))
+        return MODSECURITY_FAILURE;
+
+    memcpy(text, data, len);
+    text[len] = '\0';
+
+    *family = memchr(text, ':', len) != NULL ? MODSECURITY_IPTABLE_V6 : MODSECURITY_IPTABLE_V4;
+
+    if (inet_pton(*family == MODSECURITY_IPTABLE_V6 ? AF_INET6 : AF_INET, text, addr) != 1)
+        return MODSECURITY_FAILURE;
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* One address or CIDR prefix */
+int ModsecurityIptableAdd(modsecurity_iptable_t *table, const char *text, uint32_t len)
+{
+    modsecurity_ip_prefix_t prefix;
+    const char *slash = (const char *) memchr(text, '/', len);
+    uint32_t bits, i;
+    char *end;
+    int family;
+
+    memset(&prefix, 0, sizeof(prefix));
+
+    if (ModsecurityIptableParse((const uint8_t *) text, slash ? (uint32_t) (slash - text) : len,
+                prefix.addr, &family) != MODSECURITY_SUCCESS)
+        return MODSECURITY_FAILURE;
+
+    bits = iptable_len[family] * 8;
+
+    if (slash != NULL)
+    {
+        if (slash + 1 == text + len || !isdigit((unsigned char) slash[1]))
+            return MODSECURITY_FAILURE;
+
+        bits = strtoul(slash + 1, &end, 10);
+
+        if (end != text + len || bits > iptable_len[family] * 8)
+            return MODSECURITY_FAILURE;
+    }
+
+    prefix.bits = (uint8_t) bits;
+
+    for (i = bits / 8; i < iptable_len[family]; i++)
+        prefix.addr[i] &= i == bits / 8 ? (uint8_t) (0xff00 >> (bits % 8)) : 0;
+
+    if (table->nprefixes[family] == table->capacity[family])
+    {
+        uint32_t capacity = table->capacity[family] ? table->capacity[family] * 2 : 16;
+        modsecurity_ip_prefix_t *prefixes = (modsecurity_ip_prefix_t *)
+            realloc(table->prefixes[family], capacity * sizeof(modsecurity_ip_prefix_t));
+
+        if (prefixes == NULL)
+            DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate address table\n");
+
+        table->prefixes[family] = prefixes;
+        table->capacity[family] = capacity;
+    }
+
+    table->prefixes[family][table->nprefixes[family]++] = prefix;
+
+    return MODSECURITY_SUCCESS;
+}
+
+static int ModsecurityPrefixCompare(const void *a, const void *b)
+{
+    const modsecurity_ip_prefix_t *pa = (const modsecurity_ip_prefix_t *) a;
+    const modsecurity_ip_prefix_t *pb = (const modsecurity_ip_prefix_t *) b;
+    int r = memcmp(pa->addr, pb->addr, sizeof(pa->addr));
+
+    return r ? r : (int) pa->bits - (int) pb->bits;
+}
+
+/* b lies inside a */
+static int ModsecurityPrefixCovers(const modsecurity_ip_prefix_t *a, const modsecurity_ip_prefix_t *b)
+{
+    uint32_t bytes = a->bits / 8, rest = a->bits % 8;
+
+    if (a->bits > b->bits || memcmp(a->addr, b->addr, bytes))
+        return 0;
+
+    return rest == 0 || !((a->addr[bytes] ^ b->addr[bytes]) & (0xff00 >> rest));
+}
+
+static uint32_t ModsecurityIptableNodes(modsecurity_iptable_t *table, uint32_t n)
+{
+    uint32_t first = table->nnodes;
+
+    if (table->nnodes + n > table->node_capacity)
+    {
+        uint32_t capacity = table->node_capacity ? table->node_capacity : 64;
+        modsecurity_iptable_node_t *nodes;
+
+        while (capacity < table->nnodes + n)
+            capacity *= 2;
+
+        nodes = (modsecurity_iptable_node_t *) realloc(table->nodes,
+                capacity * sizeof(modsecurity_iptable_node_t));
+
+        if (nodes == NULL)
+            DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate address table\n");
+
+        table->nodes = nodes;
+        table->node_capacity = capacity;
+    }
+
+    memset(&table->nodes[first], 0, n * sizeof(modsecurity_iptable_node_t));
+    table->nnodes += n;
+
+    return first;
+}
+
+/*
+ * Fill node slot from n sorted, disjoint prefixes that all agree on the
+ * first depth bytes and all go past them.
+ */
+static void ModsecurityIptableBuild(modsecurity_iptable_t *table, uint32_t slot,
+        const modsecurity_ip_prefix_t *prefixes, uint32_t n, uint32_t depth)
+{
+    modsecurity_iptable_node_t *node;
+    uint32_t i, j, v, end, skip, base, children = 0;
+    uint64_t leaf[4] = { 0 }, child[4] = { 0 };
+
+    /* Bytes fixed for all of them come first */
+    for (skip = 0; skip < MODSECURITY_IPTABLE_SKIP; skip++)
+    {
+        if (prefixes[0].addr[depth + skip] != prefixes[n - 1].addr[depth + skip])
+            break;
+
+        for (i = 0; i < n && prefixes[i].bits > 8 * (depth + skip + 1); i++);
+
+        if (i < n)
+            break;
+    }
+
+    depth += skip;
+
+    for (i = 0; i < n; i++)
+    {
+        v = prefixes[i].addr[depth];
+
+        if (prefixes[i].bits > 8 * (depth + 1))
+        {
+            if (!(child[v >> 6] & (1ULL << (v & 63))))
+                children++;
+
+            child[v >> 6] |= 1ULL << (v & 63);
+            continue;
+        }
+
+        for (end = v + (1U << (8 * (depth + 1) - prefixes[i].bits)); v < end; v++)
+            leaf[v >> 6] |= 1ULL << (v & 63);
+    }
+
+    base = children ? ModsecurityIptableNodes(table, children) : 0;
+
+    node = &table->nodes[slot];
+    memcpy(node->leaf, leaf, sizeof(leaf));
+    memcpy(node->child, child, sizeof(child));
+    node->base = base;
+    node->skip_len = (uint8_t) skip;
+    memcpy(node->skip, &prefixes[0].addr[depth - skip], skip);
+
+    node->rank[0] = (uint8_t) __builtin_popcountll(child[0]);
+    node->rank[1] = (uint8_t) (node->rank[0] + __builtin_popcountll(child[1]));
+    node->rank[2] = (uint8_t) (node->rank[1] + __builtin_popcountll(child[2]));
+
+    /* Children in byte order, which is also the order of the prefixes */
+    for (i = 0; i < n; i = j)
+    {
+        v = prefixes[i].addr[depth];
+
+        for (j = i + 1; j < n && prefixes[j].addr[depth] == v; j++);
+
+        if (prefixes[i].bits > 8 * (depth + 1))
+            ModsecurityIptableBuild(table, base++, &prefixes[i], j - i, depth + 1);
+    }
+}
+
+int ModsecurityIptableCompile(modsecurity_iptable_t *table)
+{
+    modsecurity_ip_prefix_t *prefixes;
+    uint32_t family, i, n;
+
+    for (family = 0; family < 2; family++)
+    {
+        prefixes = table->prefixes[family];
+
+        if (prefixes == NULL)
+            continue;
+
+        qsort(prefixes, table->nprefixes[family], sizeof(*prefixes), ModsecurityPrefixCompare);
+
+        for (i = 0, n = 0; i < table->nprefixes[family]; i++)
+        {
+            if (n == 0 || !ModsecurityPrefixCovers(&prefixes[n - 1], &prefixes[i]))
+                prefixes[n++] = prefixes[i];
+        }
+
+        table->count += n;
+
+        if (prefixes[0].bits == 0)
+            table->all[family] = 1;
+        else
+        {
+            table->root[family] = (int32_t) ModsecurityIptableNodes(table, 1);
+            ModsecurityIptableBuild(table, (uint32_t) table->root[family], prefixes, n, 0);
+        }
+
+        free(prefixes);
+        table->prefixes[family] = NULL;
+        table->nprefixes[family] = table->capacity[family] = 0;
+    }
+
+    return table->count ? MODSECURITY_SUCCESS : MODSECURITY_FAILURE;
+}
+
+static int ModsecurityIptableFind(const modsecurity_iptable_t *table, int family, const uint8_t *addr)
+{
+    const modsecurity_iptable_node_t *node;
+    int32_t slot = table->root[family];
+    uint32_t pos = 0, v, w;
+    uint64_t bit;
+
+    if (table->all[family])
+        return 1;
+
+    while (slot >= 0)
+    {
+        node = &table->nodes[slot];
+
+        if (node->skip_len)
+        {
+            if (memcmp(addr + pos, node->skip, node->skip_len))
+                return 0;
+
+            pos += node->skip_len;
+        }
+
+        v = addr[pos++];
+        w = v >> 6;
+        bit = 1ULL << (v & 63);
+
+        if (node->leaf[w] & bit)
+            return 1;
+
+        if (!(node->child[w] & bit))
+            return 0;
+
+        slot = (int32_t) (node->base + (w ? node->rank[w - 1] : 0)
+                + __builtin_popcountll(node->child[w] & (bit - 1)));
+    }
+
+    return 0;
+}
+
+/* Value is an address the table covers, IPv4-mapped IPv6 also as IPv4 */
+int ModsecurityIptableMatch(const modsecurity_iptable_t *table, const uint8_t *data, uint32_t len)
+{
+    static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    uint8_t addr[16];
+    int family;
+
+    if (ModsecurityIptableParse(data, len, addr, &family) != MODSECURITY_SUCCESS)
+        return 0;
+
+    if (ModsecurityIptableFind(table, family, addr))
+        return 1;
+
+    return family == MODSECURITY_IPTABLE_V6 && !memcmp(addr, mapped, sizeof(mapped))
+        && ModsecurityIptableFind(table, MODSECURITY_IPTABLE_V4, addr + sizeof(mapped));
+}
+
+void ModsecurityIptableRetain(modsecurity_iptable_t *table)
+{
+    table->refs++;
+}
+
+void ModsecurityIptableFree(modsecurity_iptable_t *table)
+{
+    if (table == NULL || --table->refs)
+        return;
+
+    free(table->prefixes[0]);
+    free(table->prefixes[1]);
+    free(table->nodes);
+    free(table);
+}
@@ -0,0 +1,21 @@
+#ifndef MODSECURITY_IPTABLE_H
+#define MODSECURITY_IPTABLE_H
+
+#include "sf_types.h"
+
+/* Longest textual address or prefix we parse */
+#define MODSECURITY_IPTABLE_TEXT  64
+
+/* Address bytes a node can match on the way down before its own */
+#define MODSECURITY_IPTABLE_SKIP  8
+
+typedef struct _modsecurity_iptable modsecurity_iptable_t;
+
+modsecurity_iptable_t *ModsecurityIptableNew(void);
+int ModsecurityIptableAdd(modsecurity_iptable_t *, const char *, uint32_t);
+int ModsecurityIptableCompile(modsecurity_iptable_t *);
+int ModsecurityIptableMatch(const modsecurity_iptable_t *, const uint8_t *, uint32_t);
+void ModsecurityIptableRetain(modsecurity_iptable_t *);
+void ModsecurityIptableFree(modsecurity_iptable_t *);
+
+#endif
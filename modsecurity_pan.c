@@ -0,0 +1,327 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Card numbers in a byte stream: runs of 13 to 19 digits, single spaces or
+ * dashes allowed between them, not glued to a word on either side. A bitmap
+ * of the digits in each 64 byte block is built with vector compares, blocks
+ * without digits are skipped whole and runs are cut out of the bitmap. Only
+ * runs of the right length are checked against issuer prefixes, and only
+ * those that pass get the Luhn checksum.
+ */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "modsecurity_pan.h"
+
+#define MODSECURITY_PAN_BLOCK  64
+
+/* Byte classes: no run starts right after BEFORE, no run may end on AFTER */
+#define PAN_BEFORE  0x01
+#define PAN_AFTER   0x02
+
+typedef struct _pan_issuer
+{
+    uint32_t low;
+    uint32_t high;
+    uint8_t prefix;             /* leading digits compared */
+    uint8_t min;
+    uint8_t max;
+} pan_issuer_t;
+
+static const pan_issuer_t pan_issuers[] =
+{
+    { 4, 4, 1, 13, 19 },            /* Visa */
+    { 51, 55, 2, 16, 16 },          /* Mastercard */
+    { 2221, 2720, 4, 16, 16 },
+    { 34, 34, 2, 15, 15 },          /* American Express */
+    { 37, 37, 2, 15, 15 },
+    { 6011, 6011, 4, 16, 19 },      /* Discover */
+    { 644, 649, 3, 16, 19 },
+    { 65, 65, 2, 16, 19 },
+    { 3528, 3589, 4, 16, 19 },      /* JCB */
+    { 300, 305, 3, 14, 19 },        /* Diners Club */
+    { 36, 36, 2, 14, 19 },
+    { 38, 39, 2, 16, 19 },
+    { 62, 62, 2, 16, 19 },          /* UnionPay */
+    { 50, 50, 2, 13, 19 },          /* Maestro */
+    { 56, 58, 2, 13, 19 },
+};
+
+/* Luhn: every second digit from the right is doubled, 9 taken off if over */
+static const uint8_t pan_double[10] = { 0, 2, 4, 6, 8, 1, 3, 5, 7, 9 };
+
+static uint8_t pan_class[256];
+
+static void PanClassInit(void)
+{
+    int c;
+
+    for (c = '0'; c <= '9'; c++)
+        pan_class[c] = PAN_BEFORE | PAN_AFTER;
+
+    for (c = 'A'; c <= 'Z'; c++)
+        pan_class[c] = pan_class[c + 'a' - 'A'] = PAN_BEFORE | PAN_AFTER;
+
+    pan_class['_'] = PAN_BEFORE | PAN_AFTER;
+
+    /* 0.4111111111111111 is a fraction, a card number may end a sentence */
+    pan_class['.'] = PAN_BEFORE;
+}
+
+/* Bit i set if byte i of the block is a digit */
+static inline uint64_t PanDigits(const uint8_t *data)
+{
+#if defined(__AVX2__)
+    const __m256i below = _mm256_set1_epi8('0' - 1);
+    const __m256i above = _mm256_set1_epi8('9' + 1);
+    __m256i x0 = _mm256_loadu_si256((const __m256i *) data);
+    __m256i x1 = _mm256_loadu_si256((const __m256i *) (data + 32));
+
+    /* Signed compares, bytes over 0x7f are negative and never digits */
+    return (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpgt_epi8(x0, below), _mm256_cmpgt_epi8(above, x0)))
+        | (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpgt_epi8(x1, below), _mm256_cmpgt_epi8(above, x1))) << 32;
+#elif defined(__SSE2__)
+    const __m128i below = _mm_set1_epi8('0' - 1);
+    const __m128i above = _mm_set1_epi8('9' + 1);
+    uint64_t digits = 0;
+    int i;
+
+    for (i = 0; i < MODSECURITY_PAN_BLOCK; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *) (data + i));
+
+        digits |= (uint64_t) _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(x, below),
+                    _mm_cmplt_epi8(x, above))) << i;
+    }
+
+    return digits;
+#else
+    uint64_t digits = 0;
+    int i;
+
+    for (i = 0; i < MODSECURITY_PAN_BLOCK; i++)
+        digits |= (uint64_t) ((uint8_t) (data[i] - '0') < 10) << i;
+
+    return digits;
+#endif
+}
+
+static inline uint64_t PanDigitsTail(const uint8_t *data, uint32_t len)
+{
+    uint64_t digits = 0;
+    uint32_t i;
+
+    for (i = 0; i < len; i++)
+        digits |= (uint64_t) ((uint8_t) (data[i] - '0') < 10) << i;
+
+    return digits;
+}
+
+/* Digits in a row from bit i on */
+static inline uint32_t PanRun(uint64_t digits, uint32_t i)
+{
+    uint64_t rest = ~(digits >> i);
+
+    return rest ? (uint32_t) __builtin_ctzll(rest) : MODSECURITY_PAN_BLOCK - i;
+}
+
+static int PanIssuer(const uint8_t *digits, uint32_t ndigits)
+{
+    uint32_t i, j, prefix;
+
+    for (i = 0; i < sizeof(pan_issuers) / sizeof(pan_issuers[0]); i++)
+    {
+        const pan_issuer_t *issuer = &pan_issuers[i];
+
+        if (ndigits < issuer->min || ndigits > issuer->max)
+            continue;
+
+        for (j = 0, prefix = 0; j < issuer->prefix; j++)
+            prefix = prefix * 10 + digits[j];
+
+        if (prefix >= issuer->low && prefix <= issuer->high)
+            return 1;
+    }
+
+    return 0;
+}
+
+static int PanLuhn(const uint8_t *digits, uint32_t ndigits)
+{
+    uint32_t sum = 0, i;
+
+    for (i = 0; i < ndigits; i++)
+        sum += ((ndigits - i) & 1) ? digits[i] : pan_double[digits[i]];
+
+    return sum % 10 == 0;
+}
+
+/* The current run is over, boundary is whether what follows allows a card */
+static uint32_t PanEnd(modsecurity_pan_t *pan, int boundary)
+{
+    int found = boundary && !(pan->flags & MODSECURITY_PAN_LONG)
+        && pan->ndigits >= MODSECURITY_PAN_MIN
+        && PanIssuer(pan->digits, pan->ndigits) && PanLuhn(pan->digits, pan->ndigits);
+
+    pan->ndigits = 0;
+    pan->flags = 0;
+
+    return found;
+}
+
+static uint32_t PanBlock(modsecurity_pan_t *pan, const uint8_t *data, uint32_t len, uint64_t digits)
+{
+    uint32_t found = 0, i = 0, run;
+    uint8_t c;
+
+    while (i < len)
+    {
+        if (pan->ndigits == 0)
+        {
+            uint64_t rest = digits >> i;
+            int word;
+
+            if (rest == 0)
+            {
+                pan->flags = (pan_class[data[len - 1]] & PAN_BEFORE) ? MODSECURITY_PAN_WORD : 0;
+                break;
+            }
+
+            i += __builtin_ctzll(rest);
+            word = i > 0 ? (pan_class[data[i - 1]] & PAN_BEFORE) : (pan->flags & MODSECURITY_PAN_WORD);
+
+            if (word)
+            {
+                /* Part of a longer token, skip the digits with it */
+                i += PanRun(digits, i);
+                pan->flags = MODSECURITY_PAN_WORD;
+                continue;
+            }
+
+            /* Too short and not going on past a separator, the common case */
+            run = PanRun(digits, i);
+
+            if (run < MODSECURITY_PAN_MIN && i + run < len
+                    && data[i + run] != ' ' && data[i + run] != '-')
+            {
+                i += run;
+                continue;
+            }
+
+            pan->flags = 0;
+        }
+
+        if ((digits >> i) & 1)
+        {
+            run = PanRun(digits, i);
+
+            for (; run > 0; run--, i++)
+            {
+                if (pan->ndigits == MODSECURITY_PAN_MAX)
+                {
+                    pan->flags |= MODSECURITY_PAN_LONG;
+                    i += run;
+                    break;
+                }
+
+                pan->digits[pan->ndigits++] = data[i] - '0';
+            }
+
+            pan->flags &= ~MODSECURITY_PAN_SEP;
+            continue;
+        }
+
+        c = data[i++];
+
+        if ((c == ' ' || c == '-') && !(pan->flags & MODSECURITY_PAN_SEP))
+        {
+            pan->flags |= MODSECURITY_PAN_SEP;
+            continue;
+        }
+
+        found += PanEnd(pan, (pan->flags & MODSECURITY_PAN_SEP) || !(pan_class[c] & PAN_AFTER));
+        pan->flags = (pan_class[c] & PAN_BEFORE) ? MODSECURITY_PAN_WORD : 0;
+    }
+
+    return found;
+}
+
+/* Card numbers ended in the data, a run still open at its end is kept */
+uint32_t ModsecurityPanScan(modsecurity_pan_t *pan, const uint8_t *data, uint32_t len)
+{
+    uint32_t found = 0, i, n;
+    uint64_t digits;
+
+    if (pan_class['0'] == 0)
+        PanClassInit();
+
+    for (i = 0; i < len; i += n)
+    {
+        n = len - i < MODSECURITY_PAN_BLOCK ? len - i : MODSECURITY_PAN_BLOCK;
+        digits = n == MODSECURITY_PAN_BLOCK ? PanDigits(data + i) : PanDigitsTail(data + i, n);
+
+        if (digits == 0 && pan->ndigits == 0)
+        {
+            pan->flags = (pan_class[data[i + n - 1]] & PAN_BEFORE) ? MODSECURITY_PAN_WORD : 0;
+            continue;
+        }
+
+        found += PanBlock(pan, data + i, n, digits);
+    }
+
+    return found;
+}
+
+/* End of the stream, a run still open ends here */
+uint32_t ModsecurityPanFlush(modsecurity_pan_t *pan)
+{
+    if (pan->ndigits == 0)
+    {
+        pan->flags = 0;
+        return 0;
+    }
+
+    return PanEnd(pan, 1);
+}
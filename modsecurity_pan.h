@@ -0,0 +1,26 @@
+#ifndef MODSECURITY_PAN_H
+#define MODSECURITY_PAN_H
+
+#include "sf_types.h"
+
+/* Digits in a card number (PAN) */
+#define MODSECURITY_PAN_MIN  13
+#define MODSECURITY_PAN_MAX  19
+
+/* Scan state flags */
+#define MODSECURITY_PAN_WORD  0x01  /* last byte ends a word, no run starts after it */
+#define MODSECURITY_PAN_SEP   0x02  /* last byte a separator inside a run */
+#define MODSECURITY_PAN_LONG  0x04  /* run is past MODSECURITY_PAN_MAX digits */
+
+/* A digit run can cross packets, what is left of it is kept here */
+typedef struct _modsecurity_pan
+{
+    uint8_t digits[MODSECURITY_PAN_MAX];
+    uint8_t ndigits;            /* 0 between runs */
+    uint8_t flags;
+} modsecurity_pan_t;
+
+uint32_t ModsecurityPanScan(modsecurity_pan_t *, const uint8_t *, uint32_t);
+uint32_t ModsecurityPanFlush(modsecurity_pan_t *);
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Positive security profiles. For each endpoint (method and path with
+ * numeric and hex id segments folded) we keep the names of the values
+ * seen in clean requests, their length range and the byte values they
+ * used. A request whose every value fits a trusted profile can skip
+ * the rules. Endpoints live in a fixed table, the least recently used
+ * one is replaced when it is full.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "modsecurity_profile.h"
+
+/* Path segments at least this long made of hex digits are ids */
+#define MODSECURITY_PROFILE_HEX_ID  8
+
+#define MODSECURITY_FNV_BASIS  0xcbf29ce484222325ULL
+#define MODSECURITY_FNV_PRIME  0x100000001b3ULL
+
+modsecurity_profile_stats_t modsecurity_profile_stats;
+
+modsecurity_profiles_t *ModsecurityProfilesNew(int mode, uint32_t size, uint32_t min_samples)
+{
+    modsecurity_profiles_t *profiles;
+    uint32_t i;
+
+    if ((profiles = (modsecurity_profiles_t *) calloc(1, sizeof(*profiles))) == NULL)
+        return NULL;
+
+    profiles->mode = mode;
+    profiles->min_samples = min_samples;
+    profiles->size = size;
+    profiles->head = profiles->tail = -1;
+
+    for (profiles->nbuckets = 16; profiles->nbuckets < size; profiles->nbuckets *= 2);
+
+    profiles->buckets = (int32_t *) malloc(profiles->nbuckets * sizeof(int32_t));
+    profiles->entries = (modsecurity_profile_t *) calloc(size, sizeof(modsecurity_profile_t));
+
+    if (profiles->buckets == NULL || profiles->entries == NULL)
+    {
+        ModsecurityProfilesFree(profiles);
+        return NULL;
+    }
+
+    for (i = 0; i < profiles->nbuckets; i++)
+        profiles->buckets[i] = -1;
+
+    return profiles;
+}
+
+void ModsecurityProfilesFree(modsecurity_profiles_t *profiles)
+{
+    if (profiles == NULL)
+        return;
+
+    free(profiles->buckets);
+    free(profiles->entries);
+    free(profiles);
+}
+
+static inline uint64_t ModsecurityProfileHash(uint64_t hash, const uint8_t *data, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ data[i]) * MODSECURITY_FNV_PRIME;
+
+    return hash;
+}
+
+/* A path segment that is an id, which every request to the endpoint varies */
+static int ModsecurityProfileIdSegment(const uint8_t *seg, uint32_t len)
+{
+    uint32_t i, digits = 0;
+
+    if (len == 0)
+        return 0;
+
+    for (i = 0; i < len; i++)
+    {
+        if (isdigit(seg[i]))
+            digits++;
+        else if (!isxdigit(seg[i]) && seg[i] != '-')
+            return 0;
+    }
+
+    return digits == len || len >= MODSECURITY_PROFILE_HEX_ID;
+}
+
+/* Endpoint of a request: method and path, id segments folded, never 0 */
+uint64_t ModsecurityProfileKey(const modsecurity_http_request_t *request)
+{
+    const uint8_t *p = request->uri.data, *end, *slash;
+    uint64_t hash = MODSECURITY_FNV_BASIS;
+    const uint8_t *q;
+
+    hash = ModsecurityProfileHash(hash, request->method.data, request->method.len);
+    hash = (hash ^ ' ') * MODSECURITY_FNV_PRIME;
+
+    if (p == NULL)
+        return hash | 1;
+
+    end = (q = memchr(p, '?', request->uri.len)) != NULL ? q : p + request->uri.len;
+
+    while (p < end)
+    {
+        if ((slash = memchr(p, '/', end - p)) == NULL)
+            slash = end;
+
+        if (ModsecurityProfileIdSegment(p, (uint32_t) (slash - p)))
+            hash = (hash ^ '#') * MODSECURITY_FNV_PRIME;
+        else
+            hash = ModsecurityProfileHash(hash, p, (uint32_t) (slash - p));
+
+        if (slash < end)
+            hash = (hash ^ '/') * MODSECURITY_FNV_PRIME;
+
+        p = slash + 1;
+    }
+
+    return hash ? hash : 1;
+}
+
+static void ModsecurityProfileUnlink(modsecurity_profiles_t *profiles, int32_t i)
+{
+    modsecurity_profile_t *entry = &profiles->entries[i];
+
+    if (entry->prev >= 0)
+        profiles->entries[entry->prev].next = entry->next;
+    else
+        profiles->head = entry->next;
+
+    if (entry->next >= 0)
+        profiles->entries[entry->next].prev = entry->prev;
+    else
+        profiles->tail = entry->prev;
+}
+
+static void ModsecurityProfilePush(modsecurity_profiles_t *profiles, int32_t i)
+{
+    modsecurity_profile_t *entry = &profiles->entries[i];
+
+    entry->prev = -1;
+    entry->next = profiles->head;
+
+    if (profiles->head >= 0)
+        profiles->entries[profiles->head].prev = i;
+    else
+        profiles->tail = i;
+
+    profiles->head = i;
+}
+
+/* Take the least recently used endpoint off its hash chain for reuse */
+static int32_t ModsecurityProfileEvict(modsecurity_profiles_t *profiles)
+{
+    int32_t i = profiles->tail, *link;
+    modsecurity_profile_t *entry = &profiles->entries[i];
+
+    for (link = &profiles->buckets[entry->key & (profiles->nbuckets - 1)]; *link != i;
+            link = &profiles->entries[*link].chain);
+
+    *link = entry->chain;
+    ModsecurityProfileUnlink(profiles, i);
+    modsecurity_profile_stats.evicted++;
+
+    return i;
+}
+
+/*
+ * The profile of an endpoint, now the most recently used one. With create
+ * an unknown endpoint gets an empty profile, otherwise NULL.
+ */
+modsecurity_profile_t *ModsecurityProfileFind(modsecurity_profiles_t *profiles, uint64_t key, int create)
+{
+    uint32_t bucket = key & (profiles->nbuckets - 1);
+    modsecurity_profile_t *entry;
+    int32_t i;
+
+    for (i = profiles->buckets[bucket]; i >= 0; i = entry->chain)
+    {
+        entry = &profiles->entries[i];
+
+        if (entry->key == key)
+            break;
+    }
+
+    if (i >= 0)
+    {
+        if (profiles->head != i)
+        {
+            ModsecurityProfileUnlink(profiles, i);
+            ModsecurityProfilePush(profiles, i);
+        }
+
+        return entry;
+    }
+
+    if (!create)
+        return NULL;
+
+    i = profiles->used < profiles->size ? (int32_t) profiles->used++ : ModsecurityProfileEvict(profiles);
+    entry = &profiles->entries[i];
+    memset(entry, 0, sizeof(*entry));
+    entry->key = key;
+    entry->chain = profiles->buckets[bucket];
+    profiles->buckets[bucket] = i;
+    ModsecurityProfilePush(profiles, i);
+
+    return entry;
+}
+
+static uint32_t ModsecurityProfileName(int kind, const modsecurity_buf_t *name)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t) kind;
+    uint32_t i;
+
+    for (i = 0; name != NULL && i < name->len; i++)
+        hash = (hash ^ (uint8_t) tolower(name->data[i])) * 16777619u;
+
+    return hash;
+}
+
+/* Whether every byte of a value is one the param has seen */
+static int ModsecurityProfileBytes(const modsecurity_profile_param_t *param, const modsecurity_buf_t *value)
+{
+    uint32_t i;
+
+    for (i = 0; i < value->len; i++)
+    {
+        if (!ModsecurityCharsetHas(&param->bytes, value->data[i]))
+            return 0;
+    }
+
+    return 1;
+}
+
+static modsecurity_profile_param_t *ModsecurityProfileParam(const modsecurity_profile_t *profile, int kind,
+        uint32_t name)
+{
+    const modsecurity_profile_param_t *params = profile->params;
+    uint32_t i, n = profile->nparams;
+
+    if (kind == MODSECURITY_PROFILE_HEADER || kind == MODSECURITY_PROFILE_COOKIE)
+    {
+        params = profile->fields;
+        n = profile->nfields;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (params[i].name == name)
+            return (modsecurity_profile_param_t *) &params[i];
+    }
+
+    return NULL;
+}
+
+/* Whether a value is one the profile has seen the like of */
+int ModsecurityProfileFits(const modsecurity_profile_t *profile, int kind, const modsecurity_buf_t *name,
+        const modsecurity_buf_t *value)
+{
+    const modsecurity_profile_param_t *param = ModsecurityProfileParam(profile, kind,
+            ModsecurityProfileName(kind, name));
+
+    return param != NULL && value->len >= param->min_len && value->len <= param->max_len
+        && ModsecurityProfileBytes(param, value);
+}
+
+void ModsecurityProfileLearn(modsecurity_profile_t *profile, int kind, const modsecurity_buf_t *name,
+        const modsecurity_buf_t *value)
+{
+    uint32_t hash = ModsecurityProfileName(kind, name);
+    modsecurity_profile_param_t *param = ModsecurityProfileParam(profile, kind, hash);
+    uint16_t len = value->len > UINT16_MAX ? UINT16_MAX : (uint16_t) value->len;
+    uint16_t *n = &profile->nparams, max = MODSECURITY_PROFILE_PARAMS;
+    modsecurity_profile_param_t *params = profile->params;
+    uint32_t i;
+
+    if (kind == MODSECURITY_PROFILE_HEADER || kind == MODSECURITY_PROFILE_COOKIE)
+    {
+        n = &profile->nfields;
+        max = MODSECURITY_PROFILE_FIELDS;
+        params = profile->fields;
+    }
+
+    if (param == NULL)
+    {
+        if (*n == max)
+        {
+            profile->flags |= MODSECURITY_PROFILE_FULL;
+            return;
+        }
+
+        param = &params[(*n)++];
+        param->name = hash;
+        param->min_len = param->max_len = len;
+        memset(&param->bytes, 0, sizeof(param->bytes));
+    }
+
+    if (len < param->min_len)
+        param->min_len = len;
+
+    if (len > param->max_len)
+        param->max_len = len;
+
+    for (i = 0; i < value->len; i++)
+        ModsecurityCharsetAdd(&param->bytes, value->data[i]);
+}
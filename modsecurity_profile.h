@@ -0,0 +1,88 @@
+#ifndef MODSECURITY_PROFILE_H
+#define MODSECURITY_PROFILE_H
+
+#include "sf_types.h"
+#include "modsecurity_http.h"
+#include "modsecurity_charset.h"
+
+/* Defaults */
+#define MODSECURITY_PROFILE_ENDPOINTS  1024
+#define MODSECURITY_PROFILE_SAMPLES    100     /* clean requests before a profile is trusted */
+
+/*
+ * Distinct values kept per endpoint, past either the endpoint is never
+ * fast: arguments and the body, headers and cookies
+ */
+#define MODSECURITY_PROFILE_PARAMS     32
+#define MODSECURITY_PROFILE_FIELDS     32
+
+/* Profiling modes */
+#define MODSECURITY_PROFILE_OFF        0
+#define MODSECURITY_PROFILE_LEARN      1
+#define MODSECURITY_PROFILE_ENFORCE    2
+
+/* Where a profiled value comes from */
+#define MODSECURITY_PROFILE_ARG        0
+#define MODSECURITY_PROFILE_HEADER     1
+#define MODSECURITY_PROFILE_COOKIE     2
+#define MODSECURITY_PROFILE_BODY       3
+
+/* Profile flags */
+#define MODSECURITY_PROFILE_FULL  0x01   /* more distinct values than we keep */
+
+typedef struct _modsecurity_profile_param
+{
+    uint32_t name;               /* hash of kind and name */
+    uint16_t min_len;
+    uint16_t max_len;
+    modsecurity_charset_t bytes; /* every byte value seen */
+} modsecurity_profile_param_t;
+
+typedef struct _modsecurity_profile
+{
+    uint64_t key;                /* normalized endpoint hash, 0 when free */
+    uint32_t samples;
+    uint16_t nparams;
+    uint16_t nfields;
+    uint8_t flags;
+    int32_t chain;               /* hash bucket */
+    int32_t prev;                /* LRU list, towards the most recent */
+    int32_t next;
+    modsecurity_profile_param_t params[MODSECURITY_PROFILE_PARAMS];     /* arguments and body */
+    modsecurity_profile_param_t fields[MODSECURITY_PROFILE_FIELDS];     /* headers and cookies */
+} modsecurity_profile_t;
+
+typedef struct _modsecurity_profiles
+{
+    int mode;
+    uint32_t min_samples;
+    uint32_t size;
+    uint32_t used;
+    uint32_t nbuckets;
+    int32_t *buckets;
+    int32_t head;                /* most recently used */
+    int32_t tail;                /* least recently used, evicted first */
+    modsecurity_profile_t *entries;
+} modsecurity_profiles_t;
+
+typedef struct _modsecurity_profile_stats
+{
+    uint64_t learned;            /* clean requests folded into a profile */
+    uint64_t fast;               /* requests that skipped the rules */
+    uint64_t would_fit;          /* learning mode, requests that would have */
+    uint64_t misfits;            /* requests a trusted profile did not cover */
+    uint64_t evicted;            /* endpoints dropped for newer ones */
+} modsecurity_profile_stats_t;
+
+extern modsecurity_profile_stats_t modsecurity_profile_stats;
+
+modsecurity_profiles_t *ModsecurityProfilesNew(int, uint32_t, uint32_t);
+void ModsecurityProfilesFree(modsecurity_profiles_t *);
+uint64_t ModsecurityProfileKey(const modsecurity_http_request_t *);
+modsecurity_profile_t *ModsecurityProfileFind(modsecurity_profiles_t *, uint64_t, int);
+int ModsecurityProfileFits(const modsecurity_profile_t *, int, const modsecurity_buf_t *,
+        const modsecurity_buf_t *);
+void ModsecurityProfileLearn(modsecurity_profile_t *, int, const modsecurity_buf_t *,
+        const modsecurity_buf_t *);
+
+#endif
@@ -0,0 +1,719 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Static check of @rx patterns for the shapes that make a backtracking
+ * matcher go exponential (or high polynomial) on a hostile input:
+ *
+ *   - a loop over a group whose body loops too and can split one input
+ *     several ways, (a+)+ or (\w+\s?)*, unless something the inner loop
+ *     cannot match has to sit between iterations, as in (\w+\s)+
+ *   - a loop over alternatives that can start with the same character,
+ *     (a|ab)* or (\w|\d)+
+ *   - two loops over overlapping characters back to back, \d+\d+ or .*.*
+ *
+ * It is a conservative walk over the pattern text, not a parser of the
+ * full PCRE syntax: anything it does not understand matches everything,
+ * which can only add findings. Possessive quantifiers and atomic groups
+ * do not backtrack and are never reported.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "modsecurity_charset.h"
+#include "modsecurity_redos.h"
+
+#define MODSECURITY_REDOS_PIECES  64
+#define MODSECURITY_REDOS_DEPTH   32
+
+/* What a sequence, alternation or atom can match, as far as we care */
+typedef struct _modsecurity_redos_info
+{
+    modsecurity_charset_t all;       /* any character it can consume */
+    modsecurity_charset_t first;     /* characters it can start with */
+    modsecurity_charset_t loops;     /* characters consumed by loops inside */
+    int nullable;
+    int looping;                     /* contains a backtracking loop */
+    int delimited;                   /* every iteration needs a char the loops can't take */
+    int overlap;                     /* alternatives share a first character */
+    int group;
+    int atomic;
+} modsecurity_redos_info_t;
+
+typedef struct _modsecurity_redos_ctx
+{
+    const char *pattern;
+    const char *p;
+    int nocase;
+    int depth;
+    uint32_t flags;
+    uint32_t offset;                 /* most severe hazard */
+} modsecurity_redos_ctx_t;
+
+static void ModsecurityRedosAlternation(modsecurity_redos_ctx_t *, modsecurity_redos_info_t *);
+
+static void ModsecurityRedosLiteral(modsecurity_redos_ctx_t *ctx, modsecurity_charset_t *set, uint8_t c)
+{
+    ModsecurityCharsetAdd(set, c);
+
+    if (ctx->nocase)
+    {
+        ModsecurityCharsetAdd(set, (uint8_t) tolower(c));
+        ModsecurityCharsetAdd(set, (uint8_t) toupper(c));
+    }
+}
+
+static int ModsecurityRedosIsWord(int c)
+{
+    return isalnum(c) || c == '_';
+}
+
+static void ModsecurityRedosHazard(modsecurity_redos_ctx_t *ctx, uint32_t flag, const char *at)
+{
+    uint32_t risk = ctx->flags & MODSECURITY_REDOS_RISK;
+
+    /* Flags are ordered by severity, lowest bit first */
+    if (risk == 0 || flag < (risk & -risk))
+        ctx->offset = (uint32_t) (at - ctx->pattern);
+
+    ctx->flags |= flag;
+}
+
+/*
+ * Escape after the backslash at ctx->p. Returns 0 for a zero width
+ * assertion, 1 when set holds what it matches.
+ */
+static int ModsecurityRedosEscape(modsecurity_redos_ctx_t *ctx, modsecurity_charset_t *set, int in_class)
+{
+    char c = *++ctx->p;
+
+    if (c == '\0')
+        return 0;
+
+    ctx->p++;
+
+    switch (c)
+    {
+        case 'd': ModsecurityCharsetClass(set, isdigit, 0); return 1;
+        case 'D': ModsecurityCharsetClass(set, isdigit, 1); return 1;
+        case 'w': ModsecurityCharsetClass(set, ModsecurityRedosIsWord, 0); return 1;
+        case 'W': ModsecurityCharsetClass(set, ModsecurityRedosIsWord, 1); return 1;
+        case 's': ModsecurityCharsetClass(set, isspace, 0); return 1;
+        case 'S': ModsecurityCharsetClass(set, isspace, 1); return 1;
+        case 'n': ModsecurityCharsetAdd(set, '\n'); return 1;
+        case 'r': ModsecurityCharsetAdd(set, '\r'); return 1;
+        case 't': ModsecurityCharsetAdd(set, '\t'); return 1;
+        case 'f': ModsecurityCharsetAdd(set, '\f'); return 1;
+        case 'e': ModsecurityCharsetAdd(set, 0x1b); return 1;
+        case 'a': ModsecurityCharsetAdd(set, 0x07); return 1;
+
+        case 'b':
+            if (in_class)
+            {
+                ModsecurityCharsetAdd(set, '\b');
+                return 1;
+            }
+            return 0;
+
+        case 'B': case 'A': case 'z': case 'Z': case 'G': case 'K':
+            return 0;
+
+        case 'x':
+        {
+            unsigned value = 0;
+            int n = 0;
+
+            if (*ctx->p == '{')
+            {
+                ctx->p++;
+
+                while (isxdigit((unsigned char) *ctx->p))
+                    value = value * 16 + (isdigit((unsigned char) *ctx->p) ? *ctx->p++ - '0'
+                            : (tolower((unsigned char) *ctx->p++) - 'a' + 10));
+
+                if (*ctx->p == '}')
+                    ctx->p++;
+            }
+            else
+            {
+                while (n++ < 2 && isxdigit((unsigned char) *ctx->p))
+                    value = value * 16 + (isdigit((unsigned char) *ctx->p) ? *ctx->p++ - '0'
+                            : (tolower((unsigned char) *ctx->p++) - 'a' + 10));
+            }
+
+            if (value > 0xff)
+                ModsecurityCharsetFill(set);
+            else
+                ModsecurityRedosLiteral(ctx, set, (uint8_t) value);
+
+            return 1;
+        }
+
+        case 'k': case 'g':
+            /* \k<name>, \g{n}: a back reference */
+            ctx->flags |= MODSECURITY_REDOS_NO_DFA;
+
+            if (*ctx->p == '<' || *ctx->p == '{' || *ctx->p == '\'')
+            {
+                while (*ctx->p && *ctx->p != '>' && *ctx->p != '}' && *ctx->p != '\'')
+                    ctx->p++;
+
+                if (*ctx->p)
+                    ctx->p++;
+            }
+            else
+            {
+                while (*ctx->p == '-' || isdigit((unsigned char) *ctx->p))
+                    ctx->p++;
+            }
+
+            ModsecurityCharsetFill(set);
+            return 1;
+
+        default:
+            break;
+    }
+
+    if (c >= '1' && c <= '9' && !in_class)
+    {
+        ctx->flags |= MODSECURITY_REDOS_NO_DFA;
+
+        while (isdigit((unsigned char) *ctx->p))
+            ctx->p++;
+
+        ModsecurityCharsetFill(set);
+        return 1;
+    }
+
+    if (isalnum((unsigned char) c))
+    {
+        /* \p{..}, \cX, octal and the rest: assume anything */
+        ModsecurityCharsetFill(set);
+        return 1;
+    }
+
+    ModsecurityRedosLiteral(ctx, set, (uint8_t) c);
+
+    return 1;
+}
+
+static const struct
+{
+    const char *name;
+    int (*is)(int);
+} redos_posix[] =
+{
+    { "alpha:]", isalpha }, { "digit:]", isdigit }, { "alnum:]", isalnum },
+    { "space:]", isspace }, { "upper:]", isupper }, { "lower:]", islower },
+    { "punct:]", ispunct }, { "xdigit:]", isxdigit }, { "word:]", ModsecurityRedosIsWord },
+    { NULL, NULL }
+};
+
+/* Character class, ctx->p on the opening bracket */
+static void ModsecurityRedosClass(modsecurity_redos_ctx_t *ctx, modsecurity_charset_t *set)
+{
+    modsecurity_charset_t class;
+    int negate = 0, first = 1, prev = -1, i;
+    uint8_t c;
+
+    memset(&class, 0, sizeof(class));
+    ctx->p++;
+
+    if (*ctx->p == '^')
+    {
+        negate = 1;
+        ctx->p++;
+    }
+
+    while (*ctx->p && (*ctx->p != ']' || first))
+    {
+        first = 0;
+
+        if (ctx->p[0] == '[' && ctx->p[1] == ':')
+        {
+            for (i = 0; redos_posix[i].name; i++)
+            {
+                if (!strncmp(ctx->p + 2, redos_posix[i].name, strlen(redos_posix[i].name)))
+                    break;
+            }
+
+            if (redos_posix[i].name)
+            {
+                ModsecurityCharsetClass(&class, redos_posix[i].is, 0);
+                ctx->p += 2 + strlen(redos_posix[i].name);
+            }
+            else
+            {
+                ModsecurityCharsetFill(&class);
+                ctx->p = strchr(ctx->p + 2, ']') ? strchr(ctx->p + 2, ']') + 1 : ctx->p + 2;
+            }
+
+            prev = -1;
+            continue;
+        }
+
+        if (*ctx->p == '\\')
+        {
+            modsecurity_charset_t escaped;
+
+            memset(&escaped, 0, sizeof(escaped));
+            ModsecurityRedosEscape(ctx, &escaped, 1);
+            ModsecurityCharsetUnion(&class, &escaped);
+            prev = -1;
+            continue;
+        }
+
+        c = (uint8_t) *ctx->p++;
+
+        if (c == '-' && prev >= 0 && *ctx->p && *ctx->p != ']')
+        {
+            uint8_t hi = (uint8_t) *ctx->p++;
+
+            for (i = prev; i <= hi; i++)
+                ModsecurityRedosLiteral(ctx, &class, (uint8_t) i);
+
+            prev = -1;
+            continue;
+        }
+
+        ModsecurityRedosLiteral(ctx, &class, c);
+        prev = c;
+    }
+
+    if (*ctx->p == ']')
+        ctx->p++;
+
+    if (negate)
+        ModsecurityCharsetInvert(&class);
+
+    ModsecurityCharsetUnion(set, &class);
+}
+
+/* Group, ctx->p on the opening parenthesis. Returns 0 for zero width ones. */
+static int ModsecurityRedosGroup(modsecurity_redos_ctx_t *ctx, modsecurity_redos_info_t *info)
+{
+    int zero_width = 0;
+
+    ctx->p++;
+
+    if (*ctx->p == '?')
+    {
+        ctx->p++;
+
+        switch (*ctx->p)
+        {
+            case '#':
+                while (*ctx->p && *ctx->p != ')')
+                    ctx->p++;
+                if (*ctx->p)
+                    ctx->p++;
+                return 0;
+
+            case ':': case '|':
+                ctx->p++;
+                break;
+
+            case '>':
+                ctx->p++;
+                info->atomic = 1;
+                break;
+
+            case '=': case '!':
+                ctx->p++;
+                zero_width = 1;
+                break;
+
+            case '<':
+                if (ctx->p[1] == '=' || ctx->p[1] == '!')
+                {
+                    ctx->p += 2;
+                    zero_width = 1;
+                    break;
+                }
+                /* (?<name> */
+                while (*ctx->p && *ctx->p != '>')
+                    ctx->p++;
+                if (*ctx->p)
+                    ctx->p++;
+                break;
+
+            case '\'':
+                ctx->p++;
+                while (*ctx->p && *ctx->p != '\'')
+                    ctx->p++;
+                if (*ctx->p)
+                    ctx->p++;
+                break;
+
+            case 'P':
+                if (ctx->p[1] == '<')
+                {
+                    while (*ctx->p && *ctx->p != '>')
+                        ctx->p++;
+                    if (*ctx->p)
+                        ctx->p++;
+                    break;
+                }
+                /* (?P=name), (?P>name) */
+                /* fall through */
+            case 'R': case '&': case '+': case '-':
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+                ctx->flags |= MODSECURITY_REDOS_NO_DFA;
+                while (*ctx->p && *ctx->p != ')')
+                    ctx->p++;
+                if (*ctx->p)
+                    ctx->p++;
+                ModsecurityCharsetFill(&info->all);
+                ModsecurityCharsetFill(&info->first);
+                return 1;
+
+            case '(':
+                ctx->flags |= MODSECURITY_REDOS_NO_DFA;
+                break;
+
+            default:
+                /* Option settings, (?i) or (?i:...) */
+                while (*ctx->p && *ctx->p != ')' && *ctx->p != ':')
+                {
+                    if (*ctx->p == 'i')
+                        ctx->nocase = 1;
+                    ctx->p++;
+                }
+
+                if (*ctx->p == ')')
+                {
+                    ctx->p++;
+                    return 0;
+                }
+
+                if (*ctx->p)
+                    ctx->p++;
+                break;
+        }
+    }
+
+    if (ctx->depth++ < MODSECURITY_REDOS_DEPTH)
+    {
+        ModsecurityRedosAlternation(ctx, info);
+    }
+    else
+    {
+        /* Too deep to bother, treat the rest of the group as opaque */
+        int level = 1;
+
+        while (*ctx->p && level)
+        {
+            if (*ctx->p == '\\' && ctx->p[1])
+                ctx->p++;
+            else if (*ctx->p == '(')
+                level++;
+            else if (*ctx->p == ')')
+                level--;
+
+            if (level)
+                ctx->p++;
+        }
+
+        ModsecurityCharsetFill(&info->all);
+        ModsecurityCharsetFill(&info->first);
+        ModsecurityCharsetFill(&info->loops);
+        info->looping = 1;
+    }
+
+    ctx->depth--;
+
+    if (*ctx->p == ')')
+        ctx->p++;
+
+    info->group = 1;
+
+    return !zero_width;
+}
+
+/* Quantifier after an atom, sets min and whether it loops without bound */
+static void ModsecurityRedosQuantifier(modsecurity_redos_ctx_t *ctx, int *optional, int *loops)
+{
+    const char *q = ctx->p;
+    unsigned long min = 1, max = 1;
+    char *end;
+
+    *optional = 0;
+    *loops = 0;
+
+    switch (*q)
+    {
+        case '*': min = 0; max = ~0UL; q++; break;
+        case '+': min = 1; max = ~0UL; q++; break;
+        case '?': min = 0; max = 1; q++; break;
+
+        case '{':
+            if (!isdigit((unsigned char) q[1]))
+                return;
+
+            min = max = strtoul(q + 1, &end, 10);
+
+            if (*end == ',')
+            {
+                if (isdigit((unsigned char) end[1]))
+                    max = strtoul(end + 1, &end, 10);
+                else
+                {
+                    max = ~0UL;
+                    end++;
+                }
+            }
+
+            if (*end != '}')
+                return;
+
+            q = end + 1;
+            break;
+
+        default:
+            return;
+    }
+
+    ctx->p = q;
+    *optional = min == 0;
+    *loops = max > MODSECURITY_REDOS_BOUND;
+
+    if (*ctx->p == '+')
+    {
+        /* Possessive, never gives anything back */
+        *loops = 0;
+        ctx->p++;
+    }
+    else if (*ctx->p == '?')
+    {
+        ctx->p++;
+    }
+}
+
+static void ModsecurityRedosSequence(modsecurity_redos_ctx_t *ctx, modsecurity_redos_info_t *seq)
+{
+    modsecurity_charset_t pieces[MODSECURITY_REDOS_PIECES];
+    modsecurity_charset_t prev_set;
+    int npieces = 0, first_open = 1, prev_loops = 0, i;
+
+    memset(seq, 0, sizeof(*seq));
+    memset(&prev_set, 0, sizeof(prev_set));
+
+    while (*ctx->p && *ctx->p != '|' && *ctx->p != ')')
+    {
+        modsecurity_redos_info_t atom;
+        const char *at = ctx->p;
+        int consumes = 1, optional, loops;
+
+        memset(&atom, 0, sizeof(atom));
+
+        switch (*ctx->p)
+        {
+            case '(':
+                consumes = ModsecurityRedosGroup(ctx, &atom);
+                break;
+
+            case '[':
+                ModsecurityRedosClass(ctx, &atom.all);
+                break;
+
+            case '\\':
+                if (ctx->p[1] == 'Q')
+                {
+                    ctx->p += 2;
+
+                    while (*ctx->p && !(ctx->p[0] == '\\' && ctx->p[1] == 'E'))
+                        ModsecurityRedosLiteral(ctx, &atom.all, (uint8_t) *ctx->p++);
+
+                    if (*ctx->p)
+                        ctx->p += 2;
+                }
+                else
+                {
+                    consumes = ModsecurityRedosEscape(ctx, &atom.all, 0);
+                }
+                break;
+
+            case '.':
+                ModsecurityCharsetFill(&atom.all);
+                ctx->p++;
+                break;
+
+            case '^': case '$':
+                consumes = 0;
+                ctx->p++;
+                break;
+
+            default:
+                ModsecurityRedosLiteral(ctx, &atom.all, (uint8_t) *ctx->p++);
+                break;
+        }
+
+        ModsecurityRedosQuantifier(ctx, &optional, &loops);
+
+        if (!consumes)
+            continue;
+
+        if (!atom.group)
+            atom.first = atom.all;
+
+        if (atom.atomic)
+            atom.looping = 0;
+
+        if (loops && atom.group && !atom.atomic)
+        {
+            if (atom.looping && !atom.delimited)
+                ModsecurityRedosHazard(ctx, MODSECURITY_REDOS_NESTED, at);
+
+            if (atom.overlap)
+                ModsecurityRedosHazard(ctx, MODSECURITY_REDOS_ALTERNATION, at);
+        }
+
+        if (loops && prev_loops && ModsecurityCharsetMeets(&prev_set, &atom.all))
+            ModsecurityRedosHazard(ctx, MODSECURITY_REDOS_ADJACENT, at);
+
+        if (loops)
+        {
+            prev_loops = 1;
+            prev_set = atom.all;
+            ModsecurityCharsetUnion(&seq->loops, &atom.all);
+            seq->looping = 1;
+        }
+        else if (!(optional || atom.nullable))
+        {
+            prev_loops = 0;
+        }
+
+        if (atom.looping)
+        {
+            ModsecurityCharsetUnion(&seq->loops, &atom.loops);
+            seq->looping = 1;
+        }
+
+        ModsecurityCharsetUnion(&seq->all, &atom.all);
+
+        if (first_open)
+            ModsecurityCharsetUnion(&seq->first, &atom.first);
+
+        if (!(optional || atom.nullable))
+        {
+            first_open = 0;
+
+            if (npieces < MODSECURITY_REDOS_PIECES)
+                pieces[npieces++] = atom.all;
+        }
+    }
+
+    seq->nullable = first_open;
+
+    /* Some required piece the loops cannot swallow separates iterations */
+    for (i = 0; i < npieces && !seq->delimited; i++)
+        seq->delimited = !ModsecurityCharsetMeets(&pieces[i], &seq->loops);
+}
+
+static void ModsecurityRedosAlternation(modsecurity_redos_ctx_t *ctx, modsecurity_redos_info_t *info)
+{
+    modsecurity_redos_info_t seq;
+    int branches = 0;
+
+    info->delimited = 1;
+
+    for (;;)
+    {
+        ModsecurityRedosSequence(ctx, &seq);
+
+        if (branches++ && ModsecurityCharsetMeets(&info->first, &seq.first))
+            info->overlap = 1;
+
+        ModsecurityCharsetUnion(&info->all, &seq.all);
+        ModsecurityCharsetUnion(&info->first, &seq.first);
+        ModsecurityCharsetUnion(&info->loops, &seq.loops);
+        info->nullable |= seq.nullable;
+        info->looping |= seq.looping;
+        info->delimited &= seq.delimited;
+
+        if (*ctx->p != '|')
+            break;
+
+        ctx->p++;
+    }
+}
+
+/*
+ * Returns MODSECURITY_REDOS_* flags for pattern; offset is set to where the
+ * most severe hazard starts.
+ */
+uint32_t ModsecurityRedosAnalyze(const char *pattern, uint32_t *offset)
+{
+    modsecurity_redos_ctx_t ctx;
+    modsecurity_redos_info_t info;
+
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&info, 0, sizeof(info));
+    ctx.pattern = ctx.p = pattern;
+
+    while (*ctx.p)
+    {
+        ModsecurityRedosAlternation(&ctx, &info);
+
+        /* Unbalanced ')', pcre will have refused it anyway */
+        if (*ctx.p)
+            ctx.p++;
+    }
+
+    if (offset != NULL)
+        *offset = ctx.offset;
+
+    return ctx.flags;
+}
+
+const char *ModsecurityRedosDescribe(uint32_t flags)
+{
+    if (flags & MODSECURITY_REDOS_NESTED)
+        return "nested quantifier";
+
+    if (flags & MODSECURITY_REDOS_ALTERNATION)
+        return "overlapping alternation under a quantifier";
+
+    if (flags & MODSECURITY_REDOS_ADJACENT)
+        return "adjacent overlapping quantifiers";
+
+    return "none";
+}
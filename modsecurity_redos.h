@@ -0,0 +1,25 @@
+#ifndef MODSECURITY_REDOS_H
+#define MODSECURITY_REDOS_H
+
+#include "sf_types.h"
+
+/* Backtracking hazards found in a pattern */
+#define MODSECURITY_REDOS_NESTED       0x01   /* (a+)+, quantified group over a quantifier */
+#define MODSECURITY_REDOS_ALTERNATION  0x02   /* (a|ab)*, overlapping branches under a loop */
+#define MODSECURITY_REDOS_ADJACENT     0x04   /* \s*\s*, overlapping loops back to back */
+#define MODSECURITY_REDOS_RISK         0x07
+
+/* Pattern features the DFA matcher does not support */
+#define MODSECURITY_REDOS_NO_DFA       0x80   /* back references, recursion, conditions */
+
+/* Bounded repeats above this count are treated as unbounded */
+#define MODSECURITY_REDOS_BOUND        16
+
+/* Match limit for risky patterns the DFA matcher can't take */
+#define MODSECURITY_REDOS_MATCH_LIMIT(limit) \
+    ((limit) / 10 > 100 ? (limit) / 10 : ((limit) < 100 ? (limit) : 100))
+
+uint32_t ModsecurityRedosAnalyze(const char *, uint32_t *);
+const char *ModsecurityRedosDescribe(uint32_t);
+
+#endif
@@ -0,0 +1,1543 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Backtracking free matcher for the part of PCRE most @rx patterns use:
+ * literals, classes, '.', groups, alternation, greedy or lazy repeats
+ * (bounded ones are expanded), ^ $ \A \z and (?i). Patterns with anything
+ * else (back references, lookaround, \b, atomic groups, possessive
+ * repeats, ...) are refused and stay with PCRE.
+ *
+ * The pattern becomes a Thompson NFA over byte classes. Searching walks a
+ * DFA whose states (sets of NFA nodes) are built the first time they are
+ * needed, into a cache of fixed size per pattern. When the cache fills up
+ * it is thrown away and rebuilding starts over; if that keeps happening
+ * within one search, the rest of the input is handled by simulating the
+ * NFA directly. Either way the cost is linear in the input.
+ *
+ * The caches and the node set buffers live in a scratch owned by the
+ * searching thread, keyed by a serial number every compiled pattern gets,
+ * so patterns shared between rule generations can be searched from the
+ * packet, reload and control threads at once. A scratch drops the caches
+ * of patterns it has not searched for a while (freed ones among them)
+ * whenever its table would otherwise have to grow.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "modsecurity_charset.h"
+#include "modsecurity_regex.h"
+
+/* NFA node types */
+#define MODSECURITY_REGEX_CHAR   0   /* one byte from sets[set] */
+#define MODSECURITY_REGEX_SPLIT  1
+#define MODSECURITY_REGEX_EMPTY  2
+#define MODSECURITY_REGEX_BOL    3   /* only at the start of the subject */
+#define MODSECURITY_REGEX_EOL    4   /* only at the end */
+#define MODSECURITY_REGEX_MATCH  5
+
+/* DFA state flags */
+#define MODSECURITY_REGEX_STATE_MATCH      0x01
+#define MODSECURITY_REGEX_STATE_DEAD       0x02
+#define MODSECURITY_REGEX_STATE_EOL_KNOWN  0x04
+#define MODSECURITY_REGEX_STATE_EOL_MATCH  0x08
+
+/* Cache flushes tolerated in one search before going to the NFA */
+#define MODSECURITY_REGEX_THRASH   4
+
+#define MODSECURITY_REGEX_MAX_REPEAT  1000
+#define MODSECURITY_REGEX_MAX_SETS    1024
+#define MODSECURITY_REGEX_DEPTH       64
+
+/* Initial slots of a scratch's cache table, kept at most half full */
+#define MODSECURITY_REGEX_SLOTS  64
+
+modsecurity_regex_stats_t modsecurity_regex_stats;
+
+static uint64_t modsecurity_regex_serial;
+
+typedef struct _modsecurity_regex_node
+{
+    uint8_t type;
+    uint16_t set;
+    int32_t out;
+    int32_t out1;                /* SPLIT only */
+} modsecurity_regex_node_t;
+
+/* A DFA state in the cache, followed by next[nclasses] and its NFA nodes */
+typedef struct _modsecurity_regex_state
+{
+    uint32_t hash;
+    int32_t chain;
+    uint32_t nnodes;
+    uint32_t flags;
+    int32_t next[];
+} modsecurity_regex_state_t;
+
+/* The DFA states one scratch has built for one pattern */
+typedef struct _modsecurity_regex_cache
+{
+    uint64_t serial;             /* of the pattern */
+    uint32_t sweep;              /* last sweep period it was searched in */
+    uint32_t size;
+    uint32_t used;
+    uint32_t nbuckets;
+    int32_t initial;             /* state at the start of the subject */
+    uint8_t data[];              /* hash buckets, then states */
+} modsecurity_regex_cache_t;
+
+struct _modsecurity_regex_scratch
+{
+    uint32_t list[4][MODSECURITY_REGEX_MAX_NODES];
+    uint32_t stack[2 * MODSECURITY_REGEX_MAX_NODES + 1];
+    uint32_t mark[MODSECURITY_REGEX_MAX_NODES];
+    uint32_t gen;
+
+    modsecurity_regex_cache_t **slots;  /* by serial, open addressing */
+    uint32_t nslots;
+    uint32_t ncaches;
+    uint32_t sweep;
+    modsecurity_regex_stats_t *stats;
+    modsecurity_regex_stats_t own;      /* when the caller keeps none */
+};
+
+struct _modsecurity_regex
+{
+    modsecurity_regex_node_t *nodes;
+    uint32_t nnodes;
+    int32_t start;
+    modsecurity_charset_t *sets;
+    uint32_t nsets;
+    uint8_t classmap[256];       /* byte to equivalence class */
+    uint8_t reps[256];           /* a byte of each class */
+    uint32_t nclasses;
+    uint32_t cache_size;         /* DFA budget of each scratch */
+    uint64_t serial;             /* names its caches in the scratches */
+};
+
+typedef struct _modsecurity_regex_frag
+{
+    int32_t start;
+    int32_t end;                 /* EMPTY node, out patched later */
+} modsecurity_regex_frag_t;
+
+typedef struct _modsecurity_regex_ctx
+{
+    const char *p;
+    int nocase;
+    int depth;
+    int error;
+    uint32_t nodes_cap;
+    uint32_t sets_cap;
+    modsecurity_regex_t *re;
+} modsecurity_regex_ctx_t;
+
+static int ModsecurityRegexAlternation(modsecurity_regex_ctx_t *, modsecurity_regex_frag_t *);
+
+static int32_t ModsecurityRegexNode(modsecurity_regex_ctx_t *ctx, uint8_t type, uint16_t set,
+        int32_t out, int32_t out1)
+{
+    modsecurity_regex_t *re = ctx->re;
+    modsecurity_regex_node_t *node;
+
+    if (re->nnodes == ctx->nodes_cap)
+    {
+        uint32_t cap = ctx->nodes_cap ? 2 * ctx->nodes_cap : 64;
+
+        if (cap > MODSECURITY_REGEX_MAX_NODES)
+            cap = MODSECURITY_REGEX_MAX_NODES;
+
+        if (re->nnodes == cap || (node = (modsecurity_regex_node_t *)
+                    realloc(re->nodes, cap * sizeof(*node))) == NULL)
+        {
+            ctx->error = 1;
+            return -1;
+        }
+
+        re->nodes = node;
+        ctx->nodes_cap = cap;
+    }
+
+    node = &re->nodes[re->nnodes];
+    node->type = type;
+    node->set = set;
+    node->out = out;
+    node->out1 = out1;
+
+    return (int32_t) re->nnodes++;
+}
+
+static int ModsecurityRegexSet(modsecurity_regex_ctx_t *ctx, const modsecurity_charset_t *set, uint16_t *index)
+{
+    modsecurity_regex_t *re = ctx->re;
+    modsecurity_charset_t *sets;
+    uint32_t i;
+
+    for (i = 0; i < re->nsets; i++)
+    {
+        if (!memcmp(&re->sets[i], set, sizeof(*set)))
+        {
+            *index = (uint16_t) i;
+            return 0;
+        }
+    }
+
+    if (re->nsets == ctx->sets_cap)
+    {
+        uint32_t cap = ctx->sets_cap ? 2 * ctx->sets_cap : 16;
+
+        if (re->nsets == MODSECURITY_REGEX_MAX_SETS
+                || (sets = (modsecurity_charset_t *) realloc(re->sets, cap * sizeof(*sets))) == NULL)
+            return -1;
+
+        re->sets = sets;
+        ctx->sets_cap = cap;
+    }
+
+    re->sets[re->nsets] = *set;
+    *index = (uint16_t) re->nsets++;
+
+    return 0;
+}
+
+static int ModsecurityRegexEmpty(modsecurity_regex_ctx_t *ctx, modsecurity_regex_frag_t *frag)
+{
+    frag->start = frag->end = ModsecurityRegexNode(ctx, MODSECURITY_REGEX_EMPTY, 0, -1, -1);
+
+    return frag->start < 0 ? -1 : 0;
+}
+
+/* A node of the given type followed by an open end */
+static int ModsecurityRegexSingle(modsecurity_regex_ctx_t *ctx, uint8_t type, uint16_t set,
+        modsecurity_regex_frag_t *frag)
+{
+    if ((frag->end = ModsecurityRegexNode(ctx, MODSECURITY_REGEX_EMPTY, 0, -1, -1)) < 0
+            || (frag->start = ModsecurityRegexNode(ctx, type, set, frag->end, -1)) < 0)
+        return -1;
+
+    return 0;
+}
+
+static void ModsecurityRegexFold(modsecurity_regex_ctx_t *ctx, modsecurity_charset_t *set)
+{
+    int c;
+
+    if (!ctx->nocase)
+        return;
+
+    for (c = 'A'; c <= 'Z'; c++)
+    {
+        if (ModsecurityCharsetHas(set, (uint8_t) c) || ModsecurityCharsetHas(set, (uint8_t) tolower(c)))
+        {
+            ModsecurityCharsetAdd(set, (uint8_t) c);
+            ModsecurityCharsetAdd(set, (uint8_t) tolower(c));
+        }
+    }
+}
+
+static int ModsecurityRegexChars(modsecurity_regex_ctx_t *ctx, modsecurity_charset_t *set,
+        modsecurity_regex_frag_t *frag)
+{
+    uint16_t index;
+
+    ModsecurityRegexFold(ctx, set);
+
+    if (ModsecurityRegexSet(ctx, set, &index) < 0)
+        return -1;
+
+    return ModsecurityRegexSingle(ctx, MODSECURITY_REGEX_CHAR, index, frag);
+}
+
+static void ModsecurityRegexConcat(modsecurity_regex_ctx_t *ctx, modsecurity_regex_frag_t *a,
+        const modsecurity_regex_frag_t *b)
+{
+    ctx->re->nodes[a->end].out = b->start;
+    a->end = b->end;
+}
+
+/* a|b */
+static int ModsecurityRegexEither(modsecurity_regex_ctx_t *ctx, modsecurity_regex_frag_t *a,
+        const modsecurity_regex_frag_t *b)
+{
+    int32_t split, end;
+
+    if ((end = ModsecurityRegexNode(ctx, MODSECURITY_REGEX_EMPTY, 0, -1, -1)) < 0
+            || (split = ModsecurityRegexNode(ctx, MODSECURITY_REGEX_SPLIT, 0, a->start, b->start)) < 0)
+        return -1;
+
+    ctx->re->nodes[a->end].out = end;
+    ctx->re->nodes[b->end].out = end;
+    a->start = split;
+    a->end = end;
+
+    return 0;
+}
+
+/* a* when loop is set, a? otherwise; a+ is a followed by a* sharing a's nodes */
+static int ModsecurityRegexRepeat(modsecurity_regex_ctx_t *ctx, modsecurity_regex_frag_t *a, int loop, int plus)
+{
+    int32_t split, end;
+
+    if ((end = ModsecurityRegexNode(ctx, MODSECURITY_REGEX_EMPTY, 0, -1, -1)) < 0
+            || (split = ModsecurityRegexNode(ctx, MODSECURITY_REGEX_SPLIT, 0, a->start, end)) < 0)
+        return -1;
+
+    ctx->re->nodes[a->end].out = loop ? split : end;
+
+    if (!plus)
+        a->start = split;
+
+    a->end = end;
+
+    return 0;
+}
+
+static int ModsecurityRegexIsWord(int c)
+{
+    return isalnum(c) || c == '_';
+}
+
+static int ModsecurityRegexIsHSpace(int c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static int ModsecurityRegexHex(int c)
+{
+    return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/*
+ * Escape after the backslash at ctx->p that stands for a set of bytes.
+ * Returns 1 with set filled, 0 if it is an anchor (type filled), -1 if
+ * we cannot do it.
+ */
+static int ModsecurityRegexEscape(modsecurity_regex_ctx_t *ctx, modsecurity_charset_t *set, uint8_t *type,
+        int in_class)
+{
+    unsigned value = 0;
+    char c = *++ctx->p;
+    int n;
+
+    if (c == '\0')
+        return -1;
+
+    ctx->p++;
+
+    switch (c)
+    {
+        case 'd': ModsecurityCharsetClass(set, isdigit, 0); return 1;
+        case 'D': ModsecurityCharsetClass(set, isdigit, 1); return 1;
+        case 'w': ModsecurityCharsetClass(set, ModsecurityRegexIsWord, 0); return 1;
+        case 'W': ModsecurityCharsetClass(set, ModsecurityRegexIsWord, 1); return 1;
+        case 's': ModsecurityCharsetClass(set, isspace, 0); return 1;
+        case 'S': ModsecurityCharsetClass(set, isspace, 1); return 1;
+        case 'h': ModsecurityCharsetClass(set, ModsecurityRegexIsHSpace, 0); return 1;
+        case 'H': ModsecurityCharsetClass(set, ModsecurityRegexIsHSpace, 1); return 1;
+        case 'n': ModsecurityCharsetAdd(set, '\n'); return 1;
+        case 'r': ModsecurityCharsetAdd(set, '\r'); return 1;
+        case 't': ModsecurityCharsetAdd(set, '\t'); return 1;
+        case 'f': ModsecurityCharsetAdd(set, '\f'); return 1;
+        case 'e': ModsecurityCharsetAdd(set, 0x1b); return 1;
+        case 'a': ModsecurityCharsetAdd(set, 0x07); return 1;
+
+        case 'b':
+            if (!in_class)
+                return -1;
+            ModsecurityCharsetAdd(set, '\b');
+            return 1;
+
+        case 'A':
+        case 'z':
+            if (in_class)
+                return -1;
+            *type = c == 'A' ? MODSECURITY_REGEX_BOL : MODSECURITY_REGEX_EOL;
+            return 0;
+
+        case 'c':
+            if (*ctx->p == '\0')
+                return -1;
+            ModsecurityCharsetAdd(set, (uint8_t) (toupper((unsigned char) *ctx->p++) ^ 0x40));
+            return 1;
+
+        case 'x':
+            if (*ctx->p == '{')
+            {
+                for (ctx->p++, n = 0; isxdigit((unsigned char) *ctx->p) && n < 8; ctx->p++, n++)
+                    value = value * 16 + ModsecurityRegexHex((unsigned char) *ctx->p);
+
+                if (*ctx->p != '}' || value > 0xff)
+                    return -1;
+
+                ctx->p++;
+            }
+            else
+            {
+                for (n = 0; n < 2 && isxdigit((unsigned char) *ctx->p); n++, ctx->p++)
+                    value = value * 16 + ModsecurityRegexHex((unsigned char) *ctx->p);
+            }
+
+            ModsecurityCharsetAdd(set, (uint8_t) value);
+            return 1;
+
+        case '0':
+            for (n = 0; n < 2 && *ctx->p >= '0' && *ctx->p <= '7'; n++, ctx->p++)
+                value = value * 8 + (*ctx->p - '0');
+
+            ModsecurityCharsetAdd(set, (uint8_t) value);
+            return 1;
+
+        default:
+            break;
+    }
+
+    /* Back references, \b, \p{..}, \Z, \G, ... */
+    if (isalnum((unsigned char) c))
+        return -1;
+
+    ModsecurityCharsetAdd(set, (uint8_t) c);
+
+    return 1;
+}
+
+static const struct
+{
+    const char *name;
+    int (*is)(int);
+} regex_posix[] =
+{
+    { "alpha:]", isalpha }, { "digit:]", isdigit }, { "alnum:]", isalnum },
+    { "space:]", isspace }, { "upper:]", isupper }, { "lower:]", islower },
+    { "punct:]", ispunct }, { "xdigit:]", isxdigit }, { "word:]", ModsecurityRegexIsWord },
+    { "cntrl:]", iscntrl }, { "print:]", isprint }, { "graph:]", isgraph },
+    { "blank:]", ModsecurityRegexIsHSpace },
+    { NULL, NULL }
+};
+
+/* Character class, ctx->p on the opening bracket */
+static int ModsecurityRegexClass(modsecurity_regex_ctx_t *ctx, modsecurity_charset_t *set)
+{
+    int negate = 0, first = 1, prev = -1, i;
+    uint8_t type;
+
+    ctx->p++;
+
+    if (*ctx->p == '^')
+    {
+        negate = 1;
+        ctx->p++;
+    }
+
+    for (;;)
+    {
+        if (*ctx->p == '\0')
+            return -1;
+
+        if (*ctx->p == ']' && !first)
+            break;
+
+        first = 0;
+
+        if (ctx->p[0] == '[' && ctx->p[1] == ':')
+        {
+            int posix_negate = ctx->p[2] == '^';
+            const char *name = ctx->p + 2 + posix_negate;
+
+            for (i = 0; regex_posix[i].name; i++)
+            {
+                if (!strncmp(name, regex_posix[i].name, strlen(regex_posix[i].name)))
+                    break;
+            }
+
+            if (regex_posix[i].name == NULL)
+                return -1;
+
+            ModsecurityCharsetClass(set, regex_posix[i].is, posix_negate);
+            ctx->p = name + strlen(regex_posix[i].name);
+            prev = -1;
+            continue;
+        }
+
+        if (*ctx->p == '\\')
+        {
+            modsecurity_charset_t escaped;
+
+            memset(&escaped, 0, sizeof(escaped));
+
+            if (ModsecurityRegexEscape(ctx, &escaped, &type, 1) != 1)
+                return -1;
+
+            ModsecurityCharsetUnion(set, &escaped);
+
+            /* A single byte escape can start a range */
+            prev = -1;
+
+            for (i = 0; i < 256; i++)
+            {
+                if (ModsecurityCharsetHas(&escaped, (uint8_t) i))
+                    prev = prev == -1 ? i : -2;
+            }
+
+            if (prev < 0)
+                prev = -1;
+
+            continue;
+        }
+
+        if (*ctx->p == '-' && prev >= 0 && ctx->p[1] != ']' && ctx->p[1] != '\0')
+        {
+            int hi;
+
+            ctx->p++;
+
+            if (*ctx->p == '\\')
+            {
+                modsecurity_charset_t escaped;
+
+                memset(&escaped, 0, sizeof(escaped));
+
+                if (ModsecurityRegexEscape(ctx, &escaped, &type, 1) != 1)
+                    return -1;
+
+                for (hi = -1, i = 0; i < 256; i++)
+                {
+                    if (ModsecurityCharsetHas(&escaped, (uint8_t) i))
+                        hi = hi == -1 ? i : -2;
+                }
+
+                if (hi < 0)
+                    return -1;
+            }
+            else
+            {
+                hi = (uint8_t) *ctx->p++;
+            }
+
+            if (hi < prev)
+                return -1;
+
+            for (i = prev; i <= hi; i++)
+                ModsecurityCharsetAdd(set, (uint8_t) i);
+
+            prev = -1;
+            continue;
+        }
+
+        prev = (uint8_t) *ctx->p++;
+        ModsecurityCharsetAdd(set, (uint8_t) prev);
+    }
+
+    ctx->p++;
+
+    /* [^a] under (?i) excludes A as well */
+    if (negate)
+    {
+        ModsecurityRegexFold(ctx, set);
+        ModsecurityCharsetInvert(set);
+    }
+
+    return 0;
+}
+
+/* Group, ctx->p on the opening parenthesis; option settings give an empty fragment */
+static int ModsecurityRegexGroup(modsecurity_regex_ctx_t *ctx, modsecurity_regex_frag_t *frag)
+{
+    int nocase = ctx->nocase, on = 1;
+
+    ctx->p++;
+
+    if (*ctx->p == '?')
+    {
+        ctx->p++;
+
+        if (*ctx->p == ':')
+        {
+            ctx->p++;
+        }
+        else if (*ctx->p == '#')
+        {
+            while (*ctx->p && *ctx->p != ')')
+                ctx->p++;
+
+            if (*ctx->p == '\0')
+                return -1;
+
+            ctx->p++;
+            return ModsecurityRegexEmpty(ctx, frag);
+        }
+        else if ((*ctx->p == '<' && isalpha((unsigned char) ctx->p[1]))
+                || (*ctx->p == 'P' && ctx->p[1] == '<') || *ctx->p == '\'')
+        {
+            /* Named capture, the name does not matter here */
+            char close = *ctx->p == '\'' ? '\'' : '>';
+
+            ctx->p += *ctx->p == 'P' ? 2 : 1;
+
+            while (*ctx->p && *ctx->p != close)
+                ctx->p++;
+
+            if (*ctx->p == '\0')
+                return -1;
+
+            ctx->p++;
+        }
+        else
+        {
+            /* Options: i, and s which the patterns are compiled with anyway */
+            for (; *ctx->p && *ctx->p != ')' && *ctx->p != ':'; ctx->p++)
+            {
+                if (*ctx->p == '-')
+                    on = 0;
+                else if (*ctx->p == 'i')
+                    ctx->nocase = on;
+                else if (*ctx->p != 's' || !on)
+                    return -1;
+            }
+
+            if (*ctx->p == '\0')
+                return -1;
+
+            if (*ctx->p++ == ')')
+                return ModsecurityRegexEmpty(ctx, frag);
+        }
+    }
+
+    if (++ctx->depth > MODSECURITY_REGEX_DEPTH || ModsecurityRegexAlternation(ctx, frag) < 0)
+        return -1;
+
+    ctx->depth--;
+
+    if (*ctx->p != ')')
+        return -1;
+
+    ctx->p++;
+    ctx->nocase = nocase;
+
+    return 0;
+}
+
+static int ModsecurityRegexAtom(modsecurity_regex_ctx_t *ctx, modsecurity_regex_frag_t *frag)
+{
+    modsecurity_charset_t set;
+    modsecurity_regex_frag_t next;
+    uint8_t type;
+    int rval;
+
+    memset(&set, 0, sizeof(set));
+
+    switch (*ctx->p)
+    {
+        case '(':
+            return ModsecurityRegexGroup(ctx, frag);
+
+        case '[':
+            if (ModsecurityRegexClass(ctx, &set) < 0)
+                return -1;
+            return ModsecurityRegexChars(ctx, &set, frag);
+
+        case '.':
+            ctx->p++;
+            ModsecurityCharsetFill(&set);
+            return ModsecurityRegexChars(ctx, &set, frag);
+
+        case '^':
+            ctx->p++;
+            return ModsecurityRegexSingle(ctx, MODSECURITY_REGEX_BOL, 0, frag);
+
+        case '$':
+            ctx->p++;
+            return ModsecurityRegexSingle(ctx, MODSECURITY_REGEX_EOL, 0, frag);
+
+        case '*': case '+': case '?':
+            return -1;
+
+        case '\\':
+            if (ctx->p[1] == 'Q')
+            {
+                ctx->p += 2;
+
+                if (ModsecurityRegexEmpty(ctx, frag) < 0)
+                    return -1;
+
+                for (; *ctx->p && !(ctx->p[0] == '\\' && ctx->p[1] == 'E'); ctx->p++)
+                {
+                    memset(&set, 0, sizeof(set));
+                    ModsecurityCharsetAdd(&set, (uint8_t) *ctx->p);
+
+                    if (ModsecurityRegexChars(ctx, &set, &next) < 0)
+                        return -1;
+
+                    ModsecurityRegexConcat(ctx, frag, &next);
+                }
+
+                if (*ctx->p)
+                    ctx->p += 2;
+
+                return 0;
+            }
+
+            if ((rval = ModsecurityRegexEscape(ctx, &set, &type, 0)) < 0)
+                return -1;
+
+            if (rval == 0)
+                return ModsecurityRegexSingle(ctx, type, 0, frag);
+
+            return ModsecurityRegexChars(ctx, &set, frag);
+
+        default:
+            ModsecurityCharsetAdd(&set, (uint8_t) *ctx->p++);
+            return ModsecurityRegexChars(ctx, &set, frag);
+    }
+}
+
+/* Quantifier at ctx->p, if any. max is -1 for no upper bound. */
+static int ModsecurityRegexQuantifier(modsecurity_regex_ctx_t *ctx, long *min, long *max)
+{
+    const char *q = ctx->p;
+    char *end;
+
+    switch (*q)
+    {
+        case '*': *min = 0; *max = -1; q++; break;
+        case '+': *min = 1; *max = -1; q++; break;
+        case '?': *min = 0; *max = 1; q++; break;
+
+        case '{':
+            if (!isdigit((unsigned char) q[1]))
+                return 0;
+
+            *min = *max = strtol(q + 1, &end, 10);
+
+            if (*end == ',')
+            {
+                if (isdigit((unsigned char) end[1]))
+                    *max = strtol(end + 1, &end, 10);
+                else
+                {
+                    *max = -1;
+                    end++;
+                }
+            }
+
+            if (*end != '}')
+                return 0;
+
+            q = end + 1;
+            break;
+
+        default:
+            return 0;
+    }
+
+    /* Lazy repeats match the same strings; possessive ones do not */
+    if (*q == '?')
+        q++;
+    else if (*q == '+')
+        return -1;
+
+    if (*min > MODSECURITY_REGEX_MAX_REPEAT || *max > MODSECURITY_REGEX_MAX_REPEAT
+            || (*max >= 0 && *max < *min))
+        return -1;
+
+    ctx->p = q;
+
+    return 1;
+}
+
+/* Atom and its quantifier; bounded repeats parse the atom again for each copy */
+static int ModsecurityRegexPiece(modsecurity_regex_ctx_t *ctx, modsecurity_regex_frag_t *frag)
+{
+    const char *atom = ctx->p, *after;
+    int nocase = ctx->nocase, rval;
+    modsecurity_regex_frag_t copy;
+    long min, max, i;
+
+    if (ModsecurityRegexAtom(ctx, frag) < 0)
+        return -1;
+
+    if ((rval = ModsecurityRegexQuantifier(ctx, &min, &max)) <= 0)
+        return rval;
+
+    if (min <= 1 && max == -1)
+        return ModsecurityRegexRepeat(ctx, frag, 1, min == 1);
+
+    if (min == 0 && max == 1)
+        return ModsecurityRegexRepeat(ctx, frag, 0, 0);
+
+    after = ctx->p;
+
+    /* frag is the first copy, x{0,m} makes it optional */
+    if (max == 0)
+        return ModsecurityRegexEmpty(ctx, frag);
+
+    if (min == 0 && ModsecurityRegexRepeat(ctx, frag, 0, 0) < 0)
+        return -1;
+
+    for (i = 1; i < (max == -1 ? (min > 1 ? min : 1) : max) || (max == -1 && i == min); i++)
+    {
+        ctx->p = atom;
+        ctx->nocase = nocase;
+
+        if (ModsecurityRegexAtom(ctx, &copy) < 0)
+            return -1;
+
+        if (i >= min && ModsecurityRegexRepeat(ctx, &copy, max == -1, 0) < 0)
+            return -1;
+
+        ModsecurityRegexConcat(ctx, frag, &copy);
+
+        if (i >= min && max == -1)
+            break;
+    }
+
+    ctx->p = after;
+
+    return 0;
+}
+
+static int ModsecurityRegexSequence(modsecurity_regex_ctx_t *ctx, modsecurity_regex_frag_t *frag)
+{
+    modsecurity_regex_frag_t piece;
+
+    if (ModsecurityRegexEmpty(ctx, frag) < 0)
+        return -1;
+
+    while (*ctx->p && *ctx->p != '|' && *ctx->p != ')')
+    {
+        if (ModsecurityRegexPiece(ctx, &piece) < 0)
+            return -1;
+
+        ModsecurityRegexConcat(ctx, frag, &piece);
+    }
+
+    return 0;
+}
+
+static int ModsecurityRegexAlternation(modsecurity_regex_ctx_t *ctx, modsecurity_regex_frag_t *frag)
+{
+    modsecurity_regex_frag_t branch;
+
+    if (ModsecurityRegexSequence(ctx, frag) < 0)
+        return -1;
+
+    while (*ctx->p == '|')
+    {
+        ctx->p++;
+
+        if (ModsecurityRegexSequence(ctx, &branch) < 0 || ModsecurityRegexEither(ctx, frag, &branch) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Split the bytes into classes no set of the pattern tells apart */
+static void ModsecurityRegexClasses(modsecurity_regex_t *re)
+{
+    int16_t ids[512];
+    uint8_t map[256];
+    uint32_t i, n = 1;
+    int b;
+
+    memset(re->classmap, 0, sizeof(re->classmap));
+
+    for (i = 0; i < re->nsets; i++)
+    {
+        memset(ids, 0xff, sizeof(ids));
+        n = 0;
+
+        for (b = 0; b < 256; b++)
+        {
+            int key = re->classmap[b] * 2 + (ModsecurityCharsetHas(&re->sets[i], (uint8_t) b) != 0);
+
+            if (ids[key] < 0)
+                ids[key] = (int16_t) n++;
+
+            map[b] = (uint8_t) ids[key];
+        }
+
+        memcpy(re->classmap, map, sizeof(map));
+    }
+
+    re->nclasses = n;
+
+    for (b = 255; b >= 0; b--)
+        re->reps[re->classmap[b]] = (uint8_t) b;
+}
+
+/*
+ * Compile pattern for the lazy DFA, with at most cache_size bytes of DFA
+ * states. Returns NULL if the pattern uses something we do not support.
+ */
+modsecurity_regex_t *ModsecurityRegexCompile(const char *pattern, uint32_t cache_size)
+{
+    modsecurity_regex_ctx_t ctx;
+    modsecurity_regex_frag_t frag;
+    modsecurity_regex_t *re;
+    int32_t match;
+
+    if ((re = (modsecurity_regex_t *) calloc(1, sizeof(*re))) == NULL)
+        return NULL;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.p = pattern;
+    ctx.re = re;
+    re->cache_size = cache_size;
+
+    if (ModsecurityRegexAlternation(&ctx, &frag) < 0 || *ctx.p != '\0' || ctx.error
+            || (match = ModsecurityRegexNode(&ctx, MODSECURITY_REGEX_MATCH, 0, -1, -1)) < 0)
+    {
+        ModsecurityRegexFree(re);
+        return NULL;
+    }
+
+    re->nodes[frag.end].out = match;
+    re->start = frag.start;
+
+    ModsecurityRegexClasses(re);
+    re->serial = __atomic_add_fetch(&modsecurity_regex_serial, 1, __ATOMIC_RELAXED);
+
+    return re;
+}
+
+/* Scratches still holding its caches drop them on their next sweep */
+void ModsecurityRegexFree(modsecurity_regex_t *re)
+{
+    if (re == NULL)
+        return;
+
+    free(re->sets);
+    free(re->nodes);
+    free(re);
+}
+
+/* stats is where its searches are counted, NULL if nobody looks */
+modsecurity_regex_scratch_t *ModsecurityRegexScratchNew(modsecurity_regex_stats_t *stats)
+{
+    modsecurity_regex_scratch_t *scratch;
+
+    if ((scratch = (modsecurity_regex_scratch_t *) calloc(1, sizeof(*scratch))) == NULL)
+        return NULL;
+
+    scratch->stats = stats ? stats : &scratch->own;
+
+    return scratch;
+}
+
+void ModsecurityRegexScratchFree(modsecurity_regex_scratch_t *scratch)
+{
+    uint32_t i;
+
+    if (scratch == NULL)
+        return;
+
+    for (i = 0; i < scratch->nslots; i++)
+        free(scratch->slots[i]);
+
+    free(scratch->slots);
+    free(scratch);
+}
+
+static inline void ModsecurityRegexGeneration(modsecurity_regex_scratch_t *scratch)
+{
+    if (++scratch->gen == 0)
+    {
+        memset(scratch->mark, 0, sizeof(scratch->mark));
+        scratch->gen = 1;
+    }
+}
+
+/* Add the nodes reachable from node without consuming input */
+static void ModsecurityRegexClosure(const modsecurity_regex_t *re, modsecurity_regex_scratch_t *scratch,
+        uint32_t *list, uint32_t *len, int32_t node, int bol, int eol)
+{
+    const modsecurity_regex_node_t *n;
+    uint32_t *stack = scratch->stack, *mark = scratch->mark;
+    uint32_t top = 0;
+    int32_t i;
+
+    stack[top++] = (uint32_t) node;
+
+    while (top > 0)
+    {
+        i = (int32_t) stack[--top];
+
+        if (mark[i] == scratch->gen)
+            continue;
+
+        mark[i] = scratch->gen;
+        n = &re->nodes[i];
+
+        switch (n->type)
+        {
+            case MODSECURITY_REGEX_CHAR:
+            case MODSECURITY_REGEX_MATCH:
+                list[(*len)++] = (uint32_t) i;
+                break;
+
+            case MODSECURITY_REGEX_EOL:
+                if (eol)
+                    stack[top++] = (uint32_t) n->out;
+                else
+                    list[(*len)++] = (uint32_t) i;
+                break;
+
+            case MODSECURITY_REGEX_BOL:
+                if (bol)
+                    stack[top++] = (uint32_t) n->out;
+                break;
+
+            case MODSECURITY_REGEX_SPLIT:
+                stack[top++] = (uint32_t) n->out1;
+                stack[top++] = (uint32_t) n->out;
+                break;
+
+            case MODSECURITY_REGEX_EMPTY:
+                stack[top++] = (uint32_t) n->out;
+                break;
+        }
+    }
+}
+
+/*
+ * Nodes after consuming byte c from the set from, plus a fresh start since
+ * a match may begin anywhere.
+ */
+static uint32_t ModsecurityRegexStep(const modsecurity_regex_t *re, modsecurity_regex_scratch_t *scratch,
+        const uint32_t *from, uint32_t nfrom, uint8_t c, uint32_t *to)
+{
+    const modsecurity_regex_node_t *n;
+    uint32_t i, len = 0;
+
+    ModsecurityRegexGeneration(scratch);
+
+    for (i = 0; i < nfrom; i++)
+    {
+        n = &re->nodes[from[i]];
+
+        if (n->type == MODSECURITY_REGEX_CHAR && ModsecurityCharsetHas(&re->sets[n->set], c))
+            ModsecurityRegexClosure(re, scratch, to, &len, n->out, 0, 0);
+    }
+
+    ModsecurityRegexClosure(re, scratch, to, &len, re->start, 0, 0);
+
+    return len;
+}
+
+static int ModsecurityRegexHasMatch(const modsecurity_regex_t *re, const uint32_t *list, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (re->nodes[list[i]].type == MODSECURITY_REGEX_MATCH)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Whether the set matches once the end of the subject is reached, bol for an empty subject */
+static int ModsecurityRegexAtEnd(const modsecurity_regex_t *re, modsecurity_regex_scratch_t *scratch,
+        const uint32_t *list, uint32_t nlist, int bol)
+{
+    uint32_t *end = scratch->list[3];
+    uint32_t i, len = 0;
+
+    ModsecurityRegexGeneration(scratch);
+
+    for (i = 0; i < nlist; i++)
+    {
+        if (re->nodes[list[i]].type == MODSECURITY_REGEX_EOL)
+            ModsecurityRegexClosure(re, scratch, end, &len, re->nodes[list[i]].out, bol, 1);
+    }
+
+    return ModsecurityRegexHasMatch(re, end, len);
+}
+
+/*
+ * Plain NFA simulation from the node set in list, which must not be list[1]
+ * or list[2]. bol when data is the whole subject.
+ */
+static int ModsecurityRegexNfa(const modsecurity_regex_t *re, modsecurity_regex_scratch_t *scratch,
+        const uint32_t *list, uint32_t len, const uint8_t *data, uint32_t size, int bol)
+{
+    uint32_t *cur = scratch->list[1], *next = scratch->list[2], *swap;
+    uint32_t i;
+
+    scratch->stats->nfa_fallbacks++;
+    memcpy(cur, list, len * sizeof(uint32_t));
+
+    for (i = 0; i < size; i++)
+    {
+        if (ModsecurityRegexHasMatch(re, cur, len))
+            return 1;
+
+        len = ModsecurityRegexStep(re, scratch, cur, len, data[i], next);
+        swap = cur;
+        cur = next;
+        next = swap;
+    }
+
+    return ModsecurityRegexHasMatch(re, cur, len)
+        || ModsecurityRegexAtEnd(re, scratch, cur, len, bol && size == 0);
+}
+
+static int ModsecurityRegexCompare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static inline modsecurity_regex_state_t *ModsecurityRegexState(modsecurity_regex_cache_t *cache, int32_t offset)
+{
+    return (modsecurity_regex_state_t *) (cache->data + offset);
+}
+
+static inline uint32_t *ModsecurityRegexStateNodes(const modsecurity_regex_t *re, modsecurity_regex_state_t *state)
+{
+    return (uint32_t *) &state->next[re->nclasses];
+}
+
+static void ModsecurityRegexFlush(modsecurity_regex_cache_t *cache)
+{
+    memset(cache->data, 0xff, cache->nbuckets * sizeof(int32_t));
+    cache->used = cache->nbuckets * sizeof(int32_t);
+    cache->initial = -1;
+}
+
+/*
+ * Put the caches searched since the last sweep in a table with room for
+ * one more, dropping the others.
+ */
+static int ModsecurityRegexSweep(modsecurity_regex_scratch_t *scratch)
+{
+    modsecurity_regex_cache_t **slots, *cache;
+    uint32_t nslots = scratch->nslots ? scratch->nslots : MODSECURITY_REGEX_SLOTS;
+    uint32_t i, j, kept = 0;
+
+    for (i = 0; i < scratch->nslots; i++)
+    {
+        if (scratch->slots[i] != NULL && scratch->slots[i]->sweep == scratch->sweep)
+            kept++;
+    }
+
+    while (2 * (kept + 1) > nslots)
+        nslots *= 2;
+
+    if ((slots = (modsecurity_regex_cache_t **) calloc(nslots, sizeof(*slots))) == NULL)
+        return -1;
+
+    for (i = 0; i < scratch->nslots; i++)
+    {
+        if ((cache = scratch->slots[i]) == NULL)
+            continue;
+
+        if (cache->sweep != scratch->sweep)
+        {
+            free(cache);
+            continue;
+        }
+
+        for (j = (uint32_t) cache->serial & (nslots - 1); slots[j] != NULL; j = (j + 1) & (nslots - 1));
+
+        slots[j] = cache;
+    }
+
+    free(scratch->slots);
+    scratch->slots = slots;
+    scratch->nslots = nslots;
+    scratch->ncaches = kept;
+    scratch->sweep++;
+
+    return 0;
+}
+
+/* This scratch's cache for the pattern, NULL if there cannot be one */
+static modsecurity_regex_cache_t *ModsecurityRegexCache(const modsecurity_regex_t *re,
+        modsecurity_regex_scratch_t *scratch)
+{
+    modsecurity_regex_cache_t *cache;
+    uint32_t nbuckets = 16, i;
+
+    if (scratch->nslots > 0)
+    {
+        for (i = (uint32_t) re->serial & (scratch->nslots - 1); (cache = scratch->slots[i]) != NULL;
+                i = (i + 1) & (scratch->nslots - 1))
+        {
+            if (cache->serial == re->serial)
+            {
+                cache->sweep = scratch->sweep;
+                return cache;
+            }
+        }
+    }
+
+    while (nbuckets * 512 < re->cache_size)
+        nbuckets *= 2;
+
+    if (re->cache_size < nbuckets * sizeof(int32_t) * 2)
+        return NULL;
+
+    if (2 * (scratch->ncaches + 1) > scratch->nslots && ModsecurityRegexSweep(scratch) < 0)
+        return NULL;
+
+    if ((cache = (modsecurity_regex_cache_t *) malloc(sizeof(*cache) + re->cache_size)) == NULL)
+        return NULL;
+
+    cache->serial = re->serial;
+    cache->sweep = scratch->sweep;
+    cache->size = re->cache_size;
+    cache->nbuckets = nbuckets;
+    ModsecurityRegexFlush(cache);
+
+    for (i = (uint32_t) re->serial & (scratch->nslots - 1); scratch->slots[i] != NULL;
+            i = (i + 1) & (scratch->nslots - 1));
+
+    scratch->slots[i] = cache;
+    scratch->ncaches++;
+
+    return cache;
+}
+
+/* Find or add the DFA state for a node set (sorted in place). -1 when the cache is full. */
+static int32_t ModsecurityRegexInsert(const modsecurity_regex_t *re, modsecurity_regex_scratch_t *scratch,
+        modsecurity_regex_cache_t *cache, uint32_t *list, uint32_t len)
+{
+    modsecurity_regex_state_t *state;
+    int32_t *buckets = (int32_t *) cache->data;
+    uint32_t hash = 2166136261u, size, i;
+    int32_t offset;
+
+    qsort(list, len, sizeof(uint32_t), ModsecurityRegexCompare);
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ list[i]) * 16777619u;
+
+    for (offset = buckets[hash & (cache->nbuckets - 1)]; offset >= 0; offset = state->chain)
+    {
+        state = ModsecurityRegexState(cache, offset);
+
+        if (state->hash == hash && state->nnodes == len
+                && !memcmp(ModsecurityRegexStateNodes(re, state), list, len * sizeof(uint32_t)))
+            return offset;
+    }
+
+    size = sizeof(modsecurity_regex_state_t) + (re->nclasses + len) * sizeof(int32_t);
+    size = (size + 7) & ~7;
+
+    if (size > cache->size - cache->used)
+        return -1;
+
+    offset = (int32_t) cache->used;
+    cache->used += size;
+    state = ModsecurityRegexState(cache, offset);
+    state->hash = hash;
+    state->nnodes = len;
+    state->flags = 0;
+
+    if (ModsecurityRegexHasMatch(re, list, len))
+        state->flags |= MODSECURITY_REGEX_STATE_MATCH;
+
+    if (len == 0)
+        state->flags |= MODSECURITY_REGEX_STATE_DEAD;
+
+    memset(state->next, 0xff, re->nclasses * sizeof(int32_t));
+    memcpy(ModsecurityRegexStateNodes(re, state), list, len * sizeof(uint32_t));
+
+    state->chain = buckets[hash & (cache->nbuckets - 1)];
+    buckets[hash & (cache->nbuckets - 1)] = offset;
+    scratch->stats->states++;
+
+    return offset;
+}
+
+/* Returns 1 if the pattern matches anywhere in data */
+int ModsecurityRegexMatch(const modsecurity_regex_t *re, modsecurity_regex_scratch_t *scratch,
+        const uint8_t *data, uint32_t len)
+{
+    modsecurity_regex_cache_t *cache;
+    modsecurity_regex_state_t *state;
+    uint32_t *list = scratch->list[0];
+    uint32_t nlist = 0, i, flushes = 0;
+    int32_t s, next;
+
+    if ((cache = ModsecurityRegexCache(re, scratch)) == NULL)
+    {
+        ModsecurityRegexGeneration(scratch);
+        ModsecurityRegexClosure(re, scratch, list, &nlist, re->start, 1, 0);
+
+        return ModsecurityRegexNfa(re, scratch, list, nlist, data, len, 1);
+    }
+
+    if (cache->initial < 0)
+    {
+        ModsecurityRegexGeneration(scratch);
+        ModsecurityRegexClosure(re, scratch, list, &nlist, re->start, 1, 0);
+
+        if ((cache->initial = ModsecurityRegexInsert(re, scratch, cache, list, nlist)) < 0)
+            return ModsecurityRegexNfa(re, scratch, list, nlist, data, len, 1);
+    }
+
+    for (s = cache->initial, i = 0; ; i++)
+    {
+        state = ModsecurityRegexState(cache, s);
+
+        if (state->flags & MODSECURITY_REGEX_STATE_MATCH)
+            return 1;
+
+        if (state->flags & MODSECURITY_REGEX_STATE_DEAD)
+            return 0;
+
+        if (i == len)
+            break;
+
+        if ((next = state->next[re->classmap[data[i]]]) < 0)
+        {
+            nlist = ModsecurityRegexStep(re, scratch, ModsecurityRegexStateNodes(re, state), state->nnodes,
+                    data[i], list);
+
+            if ((next = ModsecurityRegexInsert(re, scratch, cache, list, nlist)) >= 0)
+            {
+                state->next[re->classmap[data[i]]] = next;
+            }
+            else
+            {
+                /* Cache full: start it over, unless that is all we are doing */
+                if (++flushes > MODSECURITY_REGEX_THRASH)
+                    return ModsecurityRegexNfa(re, scratch, list, nlist, data + i + 1, len - i - 1, 0);
+
+                scratch->stats->flushes++;
+                ModsecurityRegexFlush(cache);
+
+                if ((next = ModsecurityRegexInsert(re, scratch, cache, list, nlist)) < 0)
+                    return ModsecurityRegexNfa(re, scratch, list, nlist, data + i + 1, len - i - 1, 0);
+            }
+        }
+
+        s = next;
+    }
+
+    /* The start state may also turn up later, where ^ no longer holds */
+    if (len == 0)
+        return ModsecurityRegexAtEnd(re, scratch, ModsecurityRegexStateNodes(re, state), state->nnodes, 1);
+
+    if (!(state->flags & MODSECURITY_REGEX_STATE_EOL_KNOWN))
+    {
+        state->flags |= MODSECURITY_REGEX_STATE_EOL_KNOWN;
+
+        if (ModsecurityRegexAtEnd(re, scratch, ModsecurityRegexStateNodes(re, state), state->nnodes, 0))
+            state->flags |= MODSECURITY_REGEX_STATE_EOL_MATCH;
+    }
+
+    return (state->flags & MODSECURITY_REGEX_STATE_EOL_MATCH) != 0;
+}
+
+/* Whether MATCH can be reached from the start without passing node skip */
+static int ModsecurityRegexReaches(const modsecurity_regex_t *re, modsecurity_regex_scratch_t *scratch,
+        uint32_t skip)
+{
+    const modsecurity_regex_node_t *n;
+    uint32_t top = 0;
+    int32_t i;
+
+    ModsecurityRegexGeneration(scratch);
+    scratch->mark[skip] = scratch->gen;
+    scratch->stack[top++] = (uint32_t) re->start;
+
+    while (top > 0)
+    {
+        i = (int32_t) scratch->stack[--top];
+
+        if (scratch->mark[i] == scratch->gen)
+            continue;
+
+        scratch->mark[i] = scratch->gen;
+        n = &re->nodes[i];
+
+        if (n->type == MODSECURITY_REGEX_MATCH)
+            return 1;
+
+        scratch->stack[top++] = (uint32_t) n->out;
+
+        if (n->type == MODSECURITY_REGEX_SPLIT)
+            scratch->stack[top++] = (uint32_t) n->out1;
+    }
+
+    return 0;
+}
+
+/* Whether some string of bytes from alphabet matches, anchors aside */
+int ModsecurityRegexAccepts(const modsecurity_regex_t *re, modsecurity_regex_scratch_t *scratch,
+        const modsecurity_charset_t *alphabet)
+{
+    const modsecurity_regex_node_t *n;
+    uint32_t top = 0;
+    int32_t i;
+
+    ModsecurityRegexGeneration(scratch);
+    scratch->stack[top++] = (uint32_t) re->start;
+
+    while (top > 0)
+    {
+        i = (int32_t) scratch->stack[--top];
+
+        if (scratch->mark[i] == scratch->gen)
+            continue;
+
+        scratch->mark[i] = scratch->gen;
+        n = &re->nodes[i];
+
+        if (n->type == MODSECURITY_REGEX_MATCH)
+            return 1;
+
+        if (n->type == MODSECURITY_REGEX_CHAR && !ModsecurityCharsetMeets(&re->sets[n->set], alphabet))
+            continue;
+
+        scratch->stack[top++] = (uint32_t) n->out;
+
+        if (n->type == MODSECURITY_REGEX_SPLIT)
+            scratch->stack[top++] = (uint32_t) n->out1;
+    }
+
+    return 0;
+}
+
+/*
+ * How much a required set is worth, lower is better: letters and digits
+ * are in most values, so sets holding any rank after those that do not.
+ */
+static uint32_t ModsecurityRegexScore(const modsecurity_charset_t *set)
+{
+    uint32_t score = 0;
+    int c, alnum = 0;
+
+    for (c = 0; c < 256; c++)
+    {
+        if (ModsecurityCharsetHas(set, (uint8_t) c))
+        {
+            score++;
+            alnum |= isalnum(c);
+        }
+    }
+
+    return score > 128 ? UINT32_MAX : alnum ? score + 256 : score;
+}
+
+/* Keep the best max of the candidates, sorted; returns the new count */
+static uint32_t ModsecurityRegexKeep(modsecurity_charset_t *sets, uint32_t *scores, uint32_t count,
+        uint32_t max, const modsecurity_charset_t *set, uint32_t score)
+{
+    uint32_t j;
+
+    if (score == UINT32_MAX || (count == max && score >= scores[count - 1]))
+        return count;
+
+    for (j = 0; j < count; j++)
+    {
+        if (!memcmp(&sets[j], set, sizeof(*set)))
+            return count;
+    }
+
+    if (count < max)
+        count++;
+
+    for (j = count - 1; j > 0 && scores[j - 1] > score; j--)
+    {
+        sets[j] = sets[j - 1];
+        scores[j] = scores[j - 1];
+    }
+
+    sets[j] = *set;
+    scores[j] = score;
+
+    return count;
+}
+
+/*
+ * Byte sets every match has to take a byte from, best first, at most max
+ * of them: the bytes a match can start with, and the set of each node all
+ * paths to a match go through. Sets of more than half the bytes tell us
+ * nothing and are left out, as are patterns too big to bother with.
+ */
+uint32_t ModsecurityRegexRequired(const modsecurity_regex_t *re, modsecurity_regex_scratch_t *scratch,
+        modsecurity_charset_t *sets, uint32_t max)
+{
+    uint32_t scores[MODSECURITY_REGEX_MAX_REQUIRED];
+    modsecurity_charset_t first;
+    uint32_t *list = scratch->list[0];
+    uint32_t i, count = 0, len = 0, score;
+
+    if (re->nnodes > MODSECURITY_REGEX_MAX_ANALYSIS)
+        return 0;
+
+    if (max > MODSECURITY_REGEX_MAX_REQUIRED)
+        max = MODSECURITY_REGEX_MAX_REQUIRED;
+
+    /* Anchors are let through, this only has to overestimate */
+    ModsecurityRegexGeneration(scratch);
+    ModsecurityRegexClosure(re, scratch, list, &len, re->start, 1, 1);
+    memset(&first, 0, sizeof(first));
+
+    for (i = 0; i < len && re->nodes[list[i]].type == MODSECURITY_REGEX_CHAR; i++)
+        ModsecurityCharsetUnion(&first, &re->sets[re->nodes[list[i]].set]);
+
+    if (i == len)
+        count = ModsecurityRegexKeep(sets, scores, count, max, &first, ModsecurityRegexScore(&first));
+
+    for (i = 0; i < re->nnodes; i++)
+    {
+        const modsecurity_charset_t *set = &re->sets[re->nodes[i].set];
+
+        if (re->nodes[i].type != MODSECURITY_REGEX_CHAR)
+            continue;
+
+        score = ModsecurityRegexScore(set);
+
+        if (score == UINT32_MAX || (count == max && score >= scores[count - 1])
+                || ModsecurityRegexReaches(re, scratch, i))
+            continue;
+
+        count = ModsecurityRegexKeep(sets, scores, count, max, set, score);
+    }
+
+    return count;
+}
@@ -0,0 +1,46 @@
+#ifndef MODSECURITY_REGEX_H
+#define MODSECURITY_REGEX_H
+
+#include "sf_types.h"
+#include "modsecurity_charset.h"
+
+/* Default DFA cache per pattern and thread, bytes */
+#define MODSECURITY_REGEX_CACHE      32768
+#define MODSECURITY_REGEX_CACHE_MIN  4096
+
+/* Largest NFA a pattern may compile to, bounded repeats included */
+#define MODSECURITY_REGEX_MAX_NODES  8192
+
+/* Required byte sets are only looked for in NFAs up to this size */
+#define MODSECURITY_REGEX_MAX_ANALYSIS  2048
+#define MODSECURITY_REGEX_MAX_REQUIRED  4
+
+typedef struct _modsecurity_regex modsecurity_regex_t;
+
+/*
+ * What searching needs to write: node set buffers and the DFA states built
+ * for each pattern. Compiled patterns are never written once compiled, so
+ * any number of threads may search them, each with a scratch of its own.
+ */
+typedef struct _modsecurity_regex_scratch modsecurity_regex_scratch_t;
+
+typedef struct _modsecurity_regex_stats
+{
+    uint64_t states;             /* DFA states built */
+    uint64_t flushes;            /* caches thrown away when full */
+    uint64_t nfa_fallbacks;      /* searches finished by NFA simulation */
+} modsecurity_regex_stats_t;
+
+/* Counts of the packet thread's searches */
+extern modsecurity_regex_stats_t modsecurity_regex_stats;
+
+modsecurity_regex_t *ModsecurityRegexCompile(const char *, uint32_t);
+int ModsecurityRegexMatch(const modsecurity_regex_t *, modsecurity_regex_scratch_t *, const uint8_t *, uint32_t);
+int ModsecurityRegexAccepts(const modsecurity_regex_t *, modsecurity_regex_scratch_t *, const modsecurity_charset_t *);
+uint32_t ModsecurityRegexRequired(const modsecurity_regex_t *, modsecurity_regex_scratch_t *,
+        modsecurity_charset_t *, uint32_t);
+void ModsecurityRegexFree(modsecurity_regex_t *);
+modsecurity_regex_scratch_t *ModsecurityRegexScratchNew(modsecurity_regex_stats_t *);
+void ModsecurityRegexScratchFree(modsecurity_regex_scratch_t *);
+
+#endif
@@ -0,0 +1,308 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Responses as a stream of content for scanners: heads are handed over as
+ * they are, bodies after chunking and content coding are undone, and a
+ * NULL piece marks where each head and body ends.
+ */
+
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "modsecurity_response.h"
+
+/* Gather a line, 1 when it is complete; the CR of a CRLF is dropped */
+static int ResponseLine(modsecurity_http_response_t *response, const uint8_t *data, uint32_t len,
+        uint32_t *used)
+{
+    const uint8_t *eol = memchr(data, '\n', len);
+    uint32_t n = eol ? (uint32_t) (eol - data) : len, room;
+
+    room = MODSECURITY_RESPONSE_LINE - response->line_len;
+    memcpy(response->line + response->line_len, data, n < room ? n : room);
+    response->line_len += n < room ? n : room;
+    *used = eol ? n + 1 : n;
+
+    if (eol == NULL)
+        return 0;
+
+    if (response->line_len > 0 && response->line[response->line_len - 1] == '\r')
+        response->line_len--;
+
+    return 1;
+}
+
+static int ResponseNameIs(const uint8_t *line, uint32_t len, const char *name, const uint8_t **value,
+        uint32_t *value_len)
+{
+    uint32_t n = strlen(name);
+    const uint8_t *p, *end = line + len;
+
+    if (len <= n || line[n] != ':' || strncasecmp((const char *) line, name, n))
+        return 0;
+
+    for (p = line + n + 1; p < end && (*p == ' ' || *p == '\t'); p++);
+
+    *value = p;
+    *value_len = end - p;
+
+    return 1;
+}
+
+static void ResponseHeader(modsecurity_http_response_t *response)
+{
+    const uint8_t *value;
+    uint32_t len, i;
+
+    if (ResponseNameIs(response->line, response->line_len, "Content-Length", &value, &len))
+    {
+        for (i = 0, response->body_left = 0; i < len && i < 15 && value[i] >= '0' && value[i] <= '9'; i++)
+            response->body_left = response->body_left * 10 + (value[i] - '0');
+
+        response->flags |= MODSECURITY_RESPONSE_LENGTH;
+    }
+    else if (ResponseNameIs(response->line, response->line_len, "Transfer-Encoding", &value, &len))
+    {
+        if (len >= 7 && !strncasecmp((const char *) value + len - 7, "chunked", 7))
+            response->flags |= MODSECURITY_RESPONSE_CHUNKED;
+    }
+    else if (ResponseNameIs(response->line, response->line_len, "Content-Encoding", &value, &len))
+    {
+        response->decoder.type = memchr(value, ',', len) ? MODSECURITY_DECODE_OTHER
+            : ModsecurityDecodeType(value, len);
+    }
+}
+
+/*
+ * Head done: 1xx, 204, 304 and the response to a HEAD have no body,
+ * otherwise the headers say how it is framed. A 1xx is not the response
+ * its request waits for.
+ */
+static void ResponseHeadEnd(modsecurity_http_response_t *response)
+{
+    int head = 0;
+
+    if (response->status / 100 != 1 && response->requests > 0)
+    {
+        head = response->heads & 1;
+        response->heads >>= 1;
+        response->requests--;
+    }
+
+    if (response->status / 100 == 1 || response->status == 204 || response->status == 304 || head)
+        response->state = MODSECURITY_RESPONSE_STATUS;
+    else if (response->flags & MODSECURITY_RESPONSE_CHUNKED)
+        response->state = MODSECURITY_RESPONSE_CHUNK_SIZE;
+    else if (response->flags & MODSECURITY_RESPONSE_LENGTH)
+        response->state = response->body_left ? MODSECURITY_RESPONSE_BODY : MODSECURITY_RESPONSE_STATUS;
+    else
+        response->state = MODSECURITY_RESPONSE_CLOSE;
+
+    if (response->state == MODSECURITY_RESPONSE_STATUS)
+        ModsecurityDecoderInit(&response->decoder, MODSECURITY_DECODE_NONE);
+}
+
+static void ResponseBody(modsecurity_http_response_t *response, modsecurity_arena_t *arena,
+        const modsecurity_decode_limits_t *limits, const uint8_t *data, uint32_t len,
+        ModsecurityDecodeFunc func, void *ctx)
+{
+    if (len == 0)
+        return;
+
+    if (limits->depth == 0 || response->decoder.type == MODSECURITY_DECODE_NONE
+            || response->decoder.type == MODSECURITY_DECODE_OTHER)
+        func(ctx, data, len);
+    else
+        ModsecurityDecode(&response->decoder, arena, limits, data, len, func, ctx);
+}
+
+static void ResponseBodyEnd(modsecurity_http_response_t *response, modsecurity_arena_t *arena,
+        ModsecurityDecodeFunc func, void *ctx)
+{
+    func(ctx, NULL, 0);
+    ModsecurityDecoderEnd(&response->decoder);
+    ModsecurityArenaReset(arena);
+    ModsecurityDecoderInit(&response->decoder, MODSECURITY_DECODE_NONE);
+    response->state = MODSECURITY_RESPONSE_STATUS;
+}
+
+/* A request went out, its response only has a head when it is a HEAD */
+void ModsecurityResponseRequest(modsecurity_http_response_t *response, const uint8_t *method, uint32_t len)
+{
+    if (response->requests < MODSECURITY_RESPONSE_HEADS && len == 4 && !memcmp(method, "HEAD", 4))
+        response->heads |= 1u << response->requests;
+
+    if (response->requests < UINT32_MAX)
+        response->requests++;
+}
+
+void ModsecurityResponseParse(modsecurity_http_response_t *response, modsecurity_arena_t *arena,
+        const modsecurity_decode_limits_t *limits, const uint8_t *data, uint32_t len,
+        ModsecurityDecodeFunc func, void *ctx)
+{
+    uint32_t used, i;
+    uint64_t size;
+    uint8_t c;
+
+    while (len > 0)
+    {
+        switch (response->state)
+        {
+            case MODSECURITY_RESPONSE_STATUS:
+            case MODSECURITY_RESPONSE_HEADERS:
+                if (!ResponseLine(response, data, len, &used))
+                    break;
+
+                func(ctx, data, used);
+
+                if (response->state == MODSECURITY_RESPONSE_HEADERS && response->line_len > 0)
+                {
+                    ResponseHeader(response);
+                }
+                else if (response->state == MODSECURITY_RESPONSE_HEADERS)
+                {
+                    func(ctx, NULL, 0);
+                    ResponseHeadEnd(response);
+                }
+                else if (response->line_len >= 12 && !memcmp(response->line, "HTTP/", 5))
+                {
+                    for (i = 5; i < response->line_len && response->line[i] != ' '; i++);
+
+                    for (response->status = 0, i++; i < response->line_len
+                            && response->line[i] >= '0' && response->line[i] <= '9'; i++)
+                        response->status = response->status * 10 + (response->line[i] - '0');
+
+                    response->flags = 0;
+                    response->body_left = 0;
+                    response->state = MODSECURITY_RESPONSE_HEADERS;
+                }
+                else if (response->line_len > 0)
+                {
+                    response->state = MODSECURITY_RESPONSE_RAW;
+                }
+
+                response->line_len = 0;
+                data += used;
+                len -= used;
+                continue;
+
+            case MODSECURITY_RESPONSE_BODY:
+            case MODSECURITY_RESPONSE_CHUNK_DATA:
+                used = response->body_left < len ? (uint32_t) response->body_left : len;
+                ResponseBody(response, arena, limits, data, used, func, ctx);
+                response->body_left -= used;
+                data += used;
+                len -= used;
+
+                if (response->body_left > 0)
+                    continue;
+
+                if (response->state == MODSECURITY_RESPONSE_BODY)
+                    ResponseBodyEnd(response, arena, func, ctx);
+                else
+                    response->state = MODSECURITY_RESPONSE_CHUNK_END;
+
+                continue;
+
+            case MODSECURITY_RESPONSE_CHUNK_SIZE:
+                if (!ResponseLine(response, data, len, &used))
+                    break;
+
+                for (i = 0, size = 0; i < response->line_len && i < 15; i++)
+                {
+                    c = response->line[i];
+
+                    if (c >= '0' && c <= '9')
+                        size = size * 16 + (c - '0');
+                    else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                        size = size * 16 + ((c | 0x20) - 'a' + 10);
+                    else
+                        break;
+                }
+
+                if (i == 0)
+                    response->state = MODSECURITY_RESPONSE_RAW;
+                else if (size == 0)
+                    response->state = MODSECURITY_RESPONSE_TRAILER;
+                else
+                    response->state = MODSECURITY_RESPONSE_CHUNK_DATA;
+
+                response->body_left = size;
+                response->line_len = 0;
+                data += used;
+                len -= used;
+                continue;
+
+            case MODSECURITY_RESPONSE_CHUNK_END:
+            case MODSECURITY_RESPONSE_TRAILER:
+                if (!ResponseLine(response, data, len, &used))
+                    break;
+
+                if (response->state == MODSECURITY_RESPONSE_CHUNK_END)
+                    response->state = MODSECURITY_RESPONSE_CHUNK_SIZE;
+                else if (response->line_len == 0)
+                    ResponseBodyEnd(response, arena, func, ctx);
+
+                response->line_len = 0;
+                data += used;
+                len -= used;
+                continue;
+
+            case MODSECURITY_RESPONSE_CLOSE:
+                ResponseBody(response, arena, limits, data, len, func, ctx);
+                return;
+
+            default:
+                func(ctx, data, len);
+                return;
+        }
+
+        /* A line runs past the data, what there is of it was kept */
+        if (response->state == MODSECURITY_RESPONSE_STATUS || response->state == MODSECURITY_RESPONSE_HEADERS)
+            func(ctx, data, len);
+
+        return;
+    }
+}
+
+/* The flow is gone with a body still decoding */
+void ModsecurityResponseEnd(modsecurity_http_response_t *response)
+{
+    ModsecurityDecoderEnd(&response->decoder);
+}
@@ -0,0 +1,52 @@
+#ifndef MODSECURITY_RESPONSE_H
+#define MODSECURITY_RESPONSE_H
+
+#include "sf_types.h"
+#include "modsecurity_arena.h"
+#include "modsecurity_decode.h"
+
+/* Status and header lines longer than this are cut, they only need parsing */
+#define MODSECURITY_RESPONSE_LINE  256
+
+/* Response parser states */
+#define MODSECURITY_RESPONSE_STATUS      0
+#define MODSECURITY_RESPONSE_HEADERS     1
+#define MODSECURITY_RESPONSE_BODY        2   /* Content-Length bytes */
+#define MODSECURITY_RESPONSE_CHUNK_SIZE  3
+#define MODSECURITY_RESPONSE_CHUNK_DATA  4
+#define MODSECURITY_RESPONSE_CHUNK_END   5
+#define MODSECURITY_RESPONSE_TRAILER     6
+#define MODSECURITY_RESPONSE_CLOSE       7   /* body runs to the end of the flow */
+#define MODSECURITY_RESPONSE_RAW         8   /* lost sync, passed through as is */
+
+/* Waiting requests told apart as HEADs, those pipelined behind them are taken for GETs */
+#define MODSECURITY_RESPONSE_HEADS  32
+
+/* Response flags */
+#define MODSECURITY_RESPONSE_CHUNKED     0x01
+#define MODSECURITY_RESPONSE_LENGTH      0x02
+
+/*
+ * Per flow response framing: just enough to find the bodies, undo chunking
+ * and content coding, and say where a head or body ends. Nothing but the
+ * current line is kept, and which of the requests sent were HEADs.
+ */
+typedef struct _modsecurity_http_response
+{
+    int state;
+    uint32_t flags;
+    uint32_t status;
+    uint64_t body_left;          /* Content-Length or chunk bytes still expected */
+    uint8_t line[MODSECURITY_RESPONSE_LINE];
+    uint32_t line_len;
+    modsecurity_decoder_t decoder;
+    uint32_t heads;              /* bit n: the nth request waiting is a HEAD */
+    uint32_t requests;           /* waiting for their response */
+} modsecurity_http_response_t;
+
+void ModsecurityResponseRequest(modsecurity_http_response_t *, const uint8_t *, uint32_t);
+void ModsecurityResponseParse(modsecurity_http_response_t *, modsecurity_arena_t *,
+        const modsecurity_decode_limits_t *, const uint8_t *, uint32_t, ModsecurityDecodeFunc, void *);
+void ModsecurityResponseEnd(modsecurity_http_response_t *);
+
+#endif
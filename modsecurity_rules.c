@@ -0,0 +1,1532 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Loader for the SecRule subset the engine understands:
+ *
+ *   SecRuleEngine On|Off|DetectionOnly
+ *   SecRule VARIABLES "[!]@op param" "id:N,phase:N,deny|pass,t:...,msg:'...'"
+ *   SecRuleRemoveById N|N-M ...
+ *   SecRuleDisableById N|N-M ...
+ *   SecRuleEnableById N|N-M ...
+ *
+ * Other Sec* directives and actions the engine has no use for (setvar,
+ * tag, severity, ...) are accepted and ignored so CRS style files load.
+ * Chained rules, collection counts and regex selectors are not supported.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pcre.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "sf_dynamic_preprocessor.h"
+#include "spp_modsecurity.h"
+#include "modsecurity_rules.h"
+#include "modsecurity_redos.h"
+#include "modsecurity_regex.h"
+#include "modsecurity_injection.h"
+#include "modsecurity_iptable.h"
+#include "modsecurity_conf.h"
+
+#define MODSECURITY_MAX_TOKENS   8
+
+/* Initial slots of the intern table, a power of two */
+#define MODSECURITY_INTERN_SLOTS 1024
+
+typedef struct _modsecurity_rules_ctx
+{
+    const char *file;
+    uint32_t line;
+    char *errbuf;
+    size_t errlen;
+    modsecurity_ruleset_t *ruleset;
+    uint32_t *slots;             /* string offsets + 1, 0 when free */
+    uint32_t nslots;
+    uint32_t nstrings;
+    const modsecurity_ruleset_t *live;  /* generation rules are carried from */
+    uint32_t *live_slots;        /* its rules by digest, index + 1 */
+    uint32_t nlive_slots;
+    modsecurity_rules_changes_t *changes;   /* NULL unless updating */
+    modsecurity_regex_scratch_t *scratch;   /* for the required sets */
+} modsecurity_rules_ctx_t;
+
+typedef struct _modsecurity_name_map
+{
+    const char *name;
+    uint32_t value;
+} modsecurity_name_map_t;
+
+static const modsecurity_name_map_t var_names[] =
+{
+    { "ARGS", MODSECURITY_VAR_ARGS },
+    { "ARGS_GET", MODSECURITY_VAR_ARGS_GET },
+    { "ARGS_POST", MODSECURITY_VAR_ARGS_POST },
+    { "ARGS_NAMES", MODSECURITY_VAR_ARGS_NAMES },
+    { "ARGS_GET_NAMES", MODSECURITY_VAR_ARGS_GET_NAMES },
+    { "ARGS_POST_NAMES", MODSECURITY_VAR_ARGS_POST_NAMES },
+    { "ARGS_COMBINED_SIZE", MODSECURITY_VAR_ARGS_COMBINED_SIZE },
+    { "QUERY_STRING", MODSECURITY_VAR_QUERY_STRING },
+    { "REQUEST_METHOD", MODSECURITY_VAR_REQUEST_METHOD },
+    { "REQUEST_URI", MODSECURITY_VAR_REQUEST_URI },
+    { "REQUEST_FILENAME", MODSECURITY_VAR_REQUEST_URI },
+    { "REQUEST_URI_RAW", MODSECURITY_VAR_REQUEST_URI_RAW },
+    { "REQUEST_LINE", MODSECURITY_VAR_REQUEST_LINE },
+    { "REQUEST_HEADERS", MODSECURITY_VAR_REQUEST_HEADERS },
+    { "REQUEST_HEADERS_NAMES", MODSECURITY_VAR_REQUEST_HEADERS_NAMES },
+    { "REQUEST_COOKIES", MODSECURITY_VAR_REQUEST_COOKIES },
+    { "REQUEST_COOKIES_NAMES", MODSECURITY_VAR_REQUEST_COOKIES_NAMES },
+    { "REQUEST_BODY", MODSECURITY_VAR_REQUEST_BODY },
+    { "REMOTE_ADDR", MODSECURITY_VAR_REMOTE_ADDR },
+    { "FULL_REQUEST", MODSECURITY_VAR_FULL_REQUEST },
+    { NULL, 0 }
+};
+
+static const modsecurity_name_map_t op_names[] =
+{
+    { "rx", MODSECURITY_OP_RX },
+    { "contains", MODSECURITY_OP_CONTAINS },
+    { "streq", MODSECURITY_OP_STREQ },
+    { "beginsWith", MODSECURITY_OP_BEGINSWITH },
+    { "endsWith", MODSECURITY_OP_ENDSWITH },
+    { "pm", MODSECURITY_OP_PM },
+    { "eq", MODSECURITY_OP_EQ },
+    { "gt", MODSECURITY_OP_GT },
+    { "lt", MODSECURITY_OP_LT },
+    { "ge", MODSECURITY_OP_GE },
+    { "le", MODSECURITY_OP_LE },
+    { "unconditionalMatch", MODSECURITY_OP_UNCONDITIONAL },
+    { "detectSQLi", MODSECURITY_OP_DETECTSQLI },
+    { "detectXSS", MODSECURITY_OP_DETECTXSS },
+    { "ipMatch", MODSECURITY_OP_IPMATCH },
+    { "ipMatchFromFile", MODSECURITY_OP_IPMATCHFROMFILE },
+    { "ipMatchF", MODSECURITY_OP_IPMATCHFROMFILE },
+    { "validateByteRange", MODSECURITY_OP_VALIDATEBYTERANGE },
+    { NULL, 0 }
+};
+
+static const modsecurity_name_map_t transform_names[] =
+{
+    { "lowercase", MODSECURITY_T_LOWERCASE },
+    { "urlDecode", MODSECURITY_T_URLDECODE },
+    { "urlDecodeUni", MODSECURITY_T_URLDECODE },
+    { "compressWhitespace", MODSECURITY_T_COMPRESSWHITESPACE },
+    { "removeNulls", MODSECURITY_T_REMOVENULLS },
+    { "trim", MODSECURITY_T_TRIM },
+    { NULL, 0 }
+};
+
+static int ModsecurityRulesError(modsecurity_rules_ctx_t *ctx, const char *fmt, ...)
+{
+    size_t n;
+    va_list ap;
+
+    n = snprintf(ctx->errbuf, ctx->errlen, "%s:%u: ", ctx->file, ctx->line);
+
+    if (n < ctx->errlen)
+    {
+        va_start(ap, fmt);
+        vsnprintf(ctx->errbuf + n, ctx->errlen - n, fmt, ap);
+        va_end(ap);
+    }
+
+    return MODSECURITY_FAILURE;
+}
+
+static int ModsecurityRulesLookup(const modsecurity_name_map_t *map, const char *name, size_t len,
+        uint32_t *value)
+{
+    for (; map->name != NULL; map++)
+    {
+        if (strlen(map->name) == len && !strncasecmp(map->name, name, len))
+        {
+            *value = map->value;
+            return MODSECURITY_SUCCESS;
+        }
+    }
+
+    return MODSECURITY_FAILURE;
+}
+
+static inline uint32_t ModsecurityRulesHash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261U;
+
+    while (len--)
+        h = (h ^ (uint8_t) *s++) * 16777619U;
+
+    return h;
+}
+
+static void ModsecurityRulesInternGrow(modsecurity_rules_ctx_t *ctx)
+{
+    uint32_t nslots = ctx->nslots ? ctx->nslots * 2 : MODSECURITY_INTERN_SLOTS;
+    uint32_t *slots = (uint32_t *) calloc(nslots, sizeof(uint32_t));
+    uint32_t i, j;
+    const char *s;
+
+    if (slots == NULL)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+    for (i = 0; i < ctx->nslots; i++)
+    {
+        if (ctx->slots[i] == 0)
+            continue;
+
+        s = ctx->ruleset->strings + ctx->slots[i] - 1;
+
+        for (j = ModsecurityRulesHash(s, strlen(s)) & (nslots - 1); slots[j]; j = (j + 1) & (nslots - 1));
+
+        slots[j] = ctx->slots[i];
+    }
+
+    free(ctx->slots);
+    ctx->slots = slots;
+    ctx->nslots = nslots;
+}
+
+/*
+ * The one copy of a string in the ruleset's pool. Rules only ever read
+ * their strings, so equal ones (file names, messages, header names) are
+ * shared and freed with the ruleset.
+ */
+static char *ModsecurityRulesIntern(modsecurity_rules_ctx_t *ctx, const char *s, size_t len)
+{
+    modsecurity_ruleset_t *ruleset = ctx->ruleset;
+    uint32_t i;
+    char *copy;
+
+    if (2 * (ctx->nstrings + 1) > ctx->nslots)
+        ModsecurityRulesInternGrow(ctx);
+
+    for (i = ModsecurityRulesHash(s, len) & (ctx->nslots - 1); ctx->slots[i]; i = (i + 1) & (ctx->nslots - 1))
+    {
+        copy = ruleset->strings + ctx->slots[i] - 1;
+
+        if (!strncmp(copy, s, len) && copy[len] == '\0')
+            return copy;
+    }
+
+    if (len + 1 > ruleset->strings_size - ruleset->strings_used)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+    copy = ruleset->strings + ruleset->strings_used;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+
+    ctx->slots[i] = ruleset->strings_used + 1;
+    ctx->nstrings++;
+    ruleset->strings_used += len + 1;
+
+    return copy;
+}
+
+/* A directive's tokens, as they were lexed, hashed together */
+static uint64_t ModsecurityRulesDigest(char **tokens, int n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    const char *s;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        for (s = tokens[i]; ; s++)
+        {
+            h = (h ^ (uint8_t) *s) * 1099511628211ULL;
+
+            if (*s == '\0')
+                break;
+        }
+    }
+
+    return h;
+}
+
+/*
+ * Index the live generation's rules by digest. Rules reading an address
+ * file are left out, the file may have changed since.
+ */
+static void ModsecurityRulesCarryFrom(modsecurity_rules_ctx_t *ctx, const modsecurity_ruleset_t *live)
+{
+    uint32_t nslots = 16, i, j;
+
+    while (nslots < 2 * live->count)
+        nslots *= 2;
+
+    if ((ctx->live_slots = (uint32_t *) calloc(nslots, sizeof(uint32_t))) == NULL)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+    ctx->live = live;
+    ctx->nlive_slots = nslots;
+
+    for (i = 0; i < live->count; i++)
+    {
+        if (live->rules[i].op == MODSECURITY_OP_IPMATCHFROMFILE)
+            continue;
+
+        for (j = (uint32_t) live->rules[i].digest & (nslots - 1); ctx->live_slots[j]; j = (j + 1) & (nslots - 1));
+
+        ctx->live_slots[j] = i + 1;
+    }
+}
+
+static const modsecurity_rule_t *ModsecurityRulesCarried(modsecurity_rules_ctx_t *ctx, uint64_t digest)
+{
+    const modsecurity_rule_t *rule;
+    uint32_t i, mask = ctx->nlive_slots - 1;
+
+    if (ctx->live_slots == NULL)
+        return NULL;
+
+    for (i = (uint32_t) digest & mask; ctx->live_slots[i]; i = (i + 1) & mask)
+    {
+        rule = &ctx->live->rules[ctx->live_slots[i] - 1];
+
+        if (rule->digest == digest)
+            return rule;
+    }
+
+    return NULL;
+}
+
+/*
+ * Copy a rule of another generation into this one. The compiled operator
+ * is shared and counted; strings are interned again so every generation
+ * only points into its own pool.
+ */
+static void ModsecurityRulesCarry(modsecurity_rules_ctx_t *ctx, modsecurity_rule_t *rule,
+        const modsecurity_rule_t *from)
+{
+    uint32_t i;
+
+    *rule = *from;
+    rule->carried = 1;
+
+    /* Reloads and control socket updates each build on their own thread */
+    __atomic_add_fetch(rule->refs, 1, __ATOMIC_RELAXED);
+
+    rule->param = ModsecurityRulesIntern(ctx, from->param, from->param_len);
+    rule->file = ModsecurityRulesIntern(ctx, from->file, strlen(from->file));
+
+    if (from->msg != NULL)
+        rule->msg = ModsecurityRulesIntern(ctx, from->msg, strlen(from->msg));
+
+    for (i = 0; i < rule->ntargets; i++)
+    {
+        if (from->targets[i].name != NULL)
+            rule->targets[i].name = ModsecurityRulesIntern(ctx, from->targets[i].name,
+                    strlen(from->targets[i].name));
+    }
+
+    if (from->nphrases == 0)
+        return;
+
+    if ((rule->phrases = (char **) malloc(from->nphrases * sizeof(char *))) == NULL)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+    for (i = 0; i < rule->nphrases; i++)
+        rule->phrases[i] = ModsecurityRulesIntern(ctx, from->phrases[i], strlen(from->phrases[i]));
+}
+
+static int ModsecurityRulesTargets(modsecurity_rules_ctx_t *ctx, modsecurity_rule_t *rule, char *vars)
+{
+    char *var, *save = NULL, *colon;
+    size_t len;
+
+    for (var = strtok_r(vars, "|", &save); var != NULL; var = strtok_r(NULL, "|", &save))
+    {
+        /* Exclusions only narrow what is inspected; inspect it all instead */
+        if (*var == '!')
+            continue;
+
+        if (*var == '&')
+            return ModsecurityRulesError(ctx, "collection counts are not supported");
+
+        if (rule->ntargets == MODSECURITY_MAX_TARGETS)
+            return ModsecurityRulesError(ctx, "too many variables");
+
+        colon = strchr(var, ':');
+        len = colon ? (size_t) (colon - var) : strlen(var);
+
+        if (ModsecurityRulesLookup(var_names, var, len, &rule->targets[rule->ntargets].var)
+                != MODSECURITY_SUCCESS)
+            return ModsecurityRulesError(ctx, "unknown variable %.*s", (int) len, var);
+
+        /* A /regex/ selector is treated as the whole collection */
+        if (colon != NULL && colon[1] != '\0' && colon[1] != '/')
+            rule->targets[rule->ntargets].name = ModsecurityRulesIntern(ctx, colon + 1, strlen(colon + 1));
+
+        rule->ntargets++;
+    }
+
+    if (rule->ntargets == 0)
+        return ModsecurityRulesError(ctx, "no variables");
+
+    return MODSECURITY_SUCCESS;
+}
+
+static int ModsecurityRulesCompileRx(modsecurity_rules_ctx_t *ctx, modsecurity_rule_t *rule,
+        const modsecurity_ruleset_t *ruleset)
+{
+    uint32_t match_limit = ruleset->match_limit;
+    modsecurity_regex_t *regex;
+    const char *error = NULL;
+    int offset = 0;
+    pcre_extra *extra;
+    int study = 0;
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+    study = PCRE_STUDY_JIT_COMPILE;
+#endif
+
+    rule->re = pcre_compile(rule->param, PCRE_DOTALL | PCRE_DOLLAR_ENDONLY, &error, &offset, NULL);
+
+    if (rule->re == NULL)
+        return ModsecurityRulesError(ctx, "bad regex at offset %d: %s", offset, error);
+
+    extra = pcre_study((pcre *) rule->re, study, &error);
+
+    if (extra == NULL)
+    {
+        if ((extra = (pcre_extra *) pcre_malloc(sizeof(pcre_extra))) == NULL)
+            DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+        memset(extra, 0, sizeof(*extra));
+    }
+
+    /*
+     * PCRE stays the reference for syntax errors, but whatever the lazy DFA
+     * can do it does. Of the rest, patterns that can backtrack
+     * catastrophically go to pcre_dfa_exec, which cannot; those using what
+     * it lacks get a tighter match limit.
+     */
+    if ((regex = ModsecurityRegexCompile(rule->param, ruleset->regex_cache)) != NULL)
+    {
+        if (ctx->scratch == NULL && (ctx->scratch = ModsecurityRegexScratchNew(NULL)) == NULL)
+            DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate regex scratch\n");
+
+        rule->nrequired = (uint8_t) ModsecurityRegexRequired(regex, ctx->scratch, rule->required,
+                MODSECURITY_RULE_REQUIRED);
+    }
+
+    if (ruleset->regex_cache)
+        rule->regex = regex;
+    else
+        ModsecurityRegexFree(regex);
+
+    rule->redos = ModsecurityRedosAnalyze(rule->param, &rule->redos_offset);
+
+    if ((rule->redos & MODSECURITY_REDOS_RISK) && rule->regex == NULL)
+    {
+        if (rule->redos & MODSECURITY_REDOS_NO_DFA)
+            match_limit = MODSECURITY_REDOS_MATCH_LIMIT(match_limit);
+        else
+            rule->dfa = 1;
+    }
+
+    extra->flags |= PCRE_EXTRA_MATCH_LIMIT | PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+    extra->match_limit = match_limit;
+    extra->match_limit_recursion = match_limit;
+    rule->re_extra = extra;
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* @validateByteRange: byte values and ranges such as 9,10,13,32-126 */
+static int ModsecurityRulesByteRange(modsecurity_rules_ctx_t *ctx, modsecurity_rule_t *rule)
+{
+    modsecurity_charset_t allowed;
+    const char *item = rule->param;
+    unsigned long from, to;
+    uint32_t ranges = 0;
+    char *end;
+
+    memset(&allowed, 0, sizeof(allowed));
+
+    while (*item)
+    {
+        while (isspace((unsigned char) *item) || *item == ',')
+            item++;
+
+        if (*item == '\0')
+            break;
+
+        if (!isdigit((unsigned char) *item))
+            return ModsecurityRulesError(ctx, "bad byte range %s", item);
+
+        from = to = strtoul(item, &end, 10);
+
+        if (*end == '-')
+        {
+            if (!isdigit((unsigned char) end[1]))
+                return ModsecurityRulesError(ctx, "bad byte range %s", item);
+
+            to = strtoul(end + 1, &end, 10);
+        }
+
+        if (from > to || to > 255 || (*end != '\0' && *end != ',' && !isspace((unsigned char) *end)))
+            return ModsecurityRulesError(ctx, "bad byte range %s", item);
+
+        for (; from <= to; from++)
+            ModsecurityCharsetAdd(&allowed, (uint8_t) from);
+
+        item = end;
+        ranges++;
+    }
+
+    if (ranges == 0)
+        return ModsecurityRulesError(ctx, "@validateByteRange needs at least one range");
+
+    ModsecurityCharsetLut(&allowed, &rule->allowed);
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* @ipMatch: addresses and CIDR prefixes separated by commas */
+static int ModsecurityRulesIpMatch(modsecurity_rules_ctx_t *ctx, modsecurity_rule_t *rule)
+{
+    modsecurity_iptable_t *table;
+    const char *item = rule->param, *end;
+    size_t len;
+
+    if ((table = ModsecurityIptableNew()) == NULL)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate address table\n");
+
+    rule->iptable = table;
+
+    for (; *item; item = *end ? end + 1 : end)
+    {
+        end = item + strcspn(item, ",");
+
+        while (item < end && isspace((unsigned char) *item))
+            item++;
+
+        for (len = end - item; len && isspace((unsigned char) item[len - 1]); len--);
+
+        if (len && ModsecurityIptableAdd(table, item, len) != MODSECURITY_SUCCESS)
+            return ModsecurityRulesError(ctx, "bad address %.*s", (int) len, item);
+    }
+
+    if (ModsecurityIptableCompile(table) != MODSECURITY_SUCCESS)
+        return ModsecurityRulesError(ctx, "@ipMatch needs at least one address");
+
+    return MODSECURITY_SUCCESS;
+}
+
+/*
+ * @ipMatchFromFile: one address or prefix per line, # starts a comment.
+ * A relative path is taken from the rule file's directory. Rules naming
+ * the same file share one table.
+ */
+static int ModsecurityRulesIpFile(modsecurity_rules_ctx_t *ctx, modsecurity_rule_t *rule,
+        const modsecurity_ruleset_t *ruleset)
+{
+    modsecurity_iptable_t *table;
+    const char *slash = strrchr(ctx->file, '/');
+    char path[PATH_MAX], line[MODSECURITY_IPTABLE_TEXT * 2], *item, *end;
+    uint32_t i, lineno = 0;
+    FILE *fp;
+    int rc = MODSECURITY_SUCCESS;
+
+    if (rule->param[0] == '\0')
+        return ModsecurityRulesError(ctx, "@ipMatchFromFile needs a file");
+
+    if (rule->param[0] == '/' || slash == NULL)
+        snprintf(path, sizeof(path), "%s", rule->param);
+    else
+        snprintf(path, sizeof(path), "%.*s/%s", (int) (slash - ctx->file), ctx->file, rule->param);
+
+    for (i = 0; i < ruleset->count; i++)
+    {
+        if (ruleset->rules[i].op == MODSECURITY_OP_IPMATCHFROMFILE
+                && !strcmp(ruleset->rules[i].param, rule->param))
+        {
+            rule->iptable = ruleset->rules[i].iptable;
+            ModsecurityIptableRetain((modsecurity_iptable_t *) rule->iptable);
+            return MODSECURITY_SUCCESS;
+        }
+    }
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return ModsecurityRulesError(ctx, "%s: %s", path, strerror(errno));
+
+    if ((table = ModsecurityIptableNew()) == NULL)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate address table\n");
+
+    rule->iptable = table;
+
+    while (rc == MODSECURITY_SUCCESS && fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        for (item = line; isspace((unsigned char) *item); item++);
+        for (end = item + strlen(item); end > item && isspace((unsigned char) end[-1]); end--);
+
+        if (end > item && ModsecurityIptableAdd(table, item, end - item) != MODSECURITY_SUCCESS)
+            rc = ModsecurityRulesError(ctx, "%s:%u: bad address %.*s", path, lineno, (int) (end - item), item);
+    }
+
+    fclose(fp);
+
+    if (rc == MODSECURITY_SUCCESS && ModsecurityIptableCompile(table) != MODSECURITY_SUCCESS)
+        rc = ModsecurityRulesError(ctx, "%s: no addresses", path);
+
+    return rc;
+}
+
+static int ModsecurityRulesOperator(modsecurity_rules_ctx_t *ctx, modsecurity_rule_t *rule,
+        char *op, const modsecurity_ruleset_t *ruleset)
+{
+    uint32_t value;
+    char *name, *param, *word, *save = NULL, *end;
+    size_t len;
+
+    if (*op == '!')
+    {
+        rule->negated = 1;
+        op++;
+    }
+
+    if (*op == '@')
+    {
+        name = op + 1;
+        len = strcspn(name, " \t");
+        param = name + len;
+
+        while (*param == ' ' || *param == '\t')
+            param++;
+
+        if (ModsecurityRulesLookup(op_names, name, len, &value) != MODSECURITY_SUCCESS)
+            return ModsecurityRulesError(ctx, "unsupported operator @%.*s", (int) len, name);
+
+        rule->op = (uint8_t) value;
+    }
+    else
+    {
+        rule->op = MODSECURITY_OP_RX;
+        param = op;
+    }
+
+    rule->param_len = strlen(param);
+    rule->param = ModsecurityRulesIntern(ctx, param, rule->param_len);
+
+    switch (rule->op)
+    {
+        case MODSECURITY_OP_RX:
+            return ModsecurityRulesCompileRx(ctx, rule, ruleset);
+
+        case MODSECURITY_OP_PM:
+            /* The operator is still in the lexer's scratch, split it there */
+            for (word = strtok_r(param, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save))
+            {
+                char **phrases = (char **) realloc(rule->phrases, (rule->nphrases + 1) * sizeof(char *));
+
+                if (phrases == NULL)
+                    DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+                for (end = word; *end; end++)
+                    *end = tolower((unsigned char) *end);
+
+                rule->phrases = phrases;
+                rule->phrases[rule->nphrases++] = ModsecurityRulesIntern(ctx, word, end - word);
+            }
+
+            if (rule->nphrases == 0)
+                return ModsecurityRulesError(ctx, "@pm needs at least one phrase");
+            break;
+
+        case MODSECURITY_OP_EQ:
+        case MODSECURITY_OP_GT:
+        case MODSECURITY_OP_LT:
+        case MODSECURITY_OP_GE:
+        case MODSECURITY_OP_LE:
+            errno = 0;
+            rule->number = strtoll(param, &end, 10);
+
+            if (errno || end == param || *end != '\0')
+                return ModsecurityRulesError(ctx, "bad number %s", param);
+            break;
+
+        case MODSECURITY_OP_DETECTSQLI:
+        case MODSECURITY_OP_DETECTXSS:
+            ModsecurityInjectionInit();
+            break;
+
+        case MODSECURITY_OP_VALIDATEBYTERANGE:
+            return ModsecurityRulesByteRange(ctx, rule);
+
+        case MODSECURITY_OP_IPMATCH:
+            return ModsecurityRulesIpMatch(ctx, rule);
+
+        case MODSECURITY_OP_IPMATCHFROMFILE:
+            return ModsecurityRulesIpFile(ctx, rule, ruleset);
+
+        default:
+            break;
+    }
+
+    return MODSECURITY_SUCCESS;
+}
+
+static int ModsecurityRulesAction(modsecurity_rules_ctx_t *ctx, modsecurity_rule_t *rule,
+        char *name, char *value)
+{
+    uint32_t transform;
+    char *end;
+
+    if (!strcasecmp(name, "id"))
+    {
+        rule->id = value ? strtoul(value, &end, 10) : 0;
+
+        if (rule->id == 0 || *end != '\0')
+            return ModsecurityRulesError(ctx, "bad rule id");
+    }
+    else if (!strcasecmp(name, "phase"))
+    {
+        if (value == NULL)
+            return ModsecurityRulesError(ctx, "missing phase");
+
+        if (!strcmp(value, "1"))
+            rule->phase = MODSECURITY_PHASE_REQUEST_HEADERS;
+        else if (!strcmp(value, "2") || !strcasecmp(value, "request"))
+            rule->phase = MODSECURITY_PHASE_REQUEST_BODY;
+        else
+            return ModsecurityRulesError(ctx, "unsupported phase %s", value);
+    }
+    else if (!strcasecmp(name, "deny") || !strcasecmp(name, "block") || !strcasecmp(name, "drop"))
+    {
+        rule->action = MODSECURITY_ACTION_DENY;
+    }
+    else if (!strcasecmp(name, "pass") || !strcasecmp(name, "allow"))
+    {
+        rule->action = MODSECURITY_ACTION_PASS;
+    }
+    else if (!strcasecmp(name, "log"))
+    {
+        rule->log = 1;
+    }
+    else if (!strcasecmp(name, "nolog"))
+    {
+        rule->log = 0;
+    }
+    else if (!strcasecmp(name, "msg"))
+    {
+        rule->msg = ModsecurityRulesIntern(ctx, value ? value : "", value ? strlen(value) : 0);
+    }
+    else if (!strcasecmp(name, "t"))
+    {
+        if (value == NULL)
+            return ModsecurityRulesError(ctx, "missing transformation");
+
+        if (!strcasecmp(value, "none"))
+        {
+            rule->ntransforms = 0;
+        }
+        else if (ModsecurityRulesLookup(transform_names, value, strlen(value), &transform)
+                != MODSECURITY_SUCCESS)
+        {
+            return ModsecurityRulesError(ctx, "unsupported transformation %s", value);
+        }
+        else if (rule->ntransforms == MODSECURITY_MAX_TRANSFORMS)
+        {
+            return ModsecurityRulesError(ctx, "too many transformations");
+        }
+        else
+        {
+            rule->transforms[rule->ntransforms++] = (uint8_t) transform;
+        }
+    }
+    else if (!strcasecmp(name, "chain"))
+    {
+        return ModsecurityRulesError(ctx, "chained rules are not supported");
+    }
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* Actions are comma separated name[:value], values may be 'quoted' */
+static int ModsecurityRulesActions(modsecurity_rules_ctx_t *ctx, modsecurity_rule_t *rule, char *actions)
+{
+    char *p = actions, *name, *value, *out;
+
+    while (*p != '\0')
+    {
+        while (*p == ',' || isspace((unsigned char) *p))
+            p++;
+
+        if (*p == '\0')
+            break;
+
+        name = p;
+        value = NULL;
+
+        while (*p != '\0' && *p != ':' && *p != ',')
+            p++;
+
+        if (*p == ':')
+        {
+            *p++ = '\0';
+
+            while (isspace((unsigned char) *p))
+                p++;
+
+            if (*p == '\'')
+            {
+                value = out = ++p;
+
+                while (*p != '\0' && *p != '\'')
+                {
+                    if (*p == '\\' && p[1] == '\'')
+                        p++;
+
+                    *out++ = *p++;
+                }
+
+                if (*p != '\'')
+                    return ModsecurityRulesError(ctx, "unterminated quote in actions");
+
+                p++;
+                *out = '\0';
+            }
+            else
+            {
+                value = p;
+
+                while (*p != '\0' && *p != ',')
+                    p++;
+            }
+        }
+
+        if (*p == ',')
+            *p++ = '\0';
+
+        if (ModsecurityRulesAction(ctx, rule, name, value) != MODSECURITY_SUCCESS)
+            return MODSECURITY_FAILURE;
+    }
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* Add the bytes of a literal operand a match must contain, the rarer looking ones first */
+static void ModsecurityRulesRequiredBytes(modsecurity_rule_t *rule)
+{
+    const uint8_t *param = (const uint8_t *) rule->param;
+    modsecurity_charset_t seen;
+    uint32_t i;
+    int alnum;
+
+    memset(&seen, 0, sizeof(seen));
+
+    for (alnum = 0; alnum <= 1; alnum++)
+    {
+        for (i = 0; i < rule->param_len && rule->nrequired < MODSECURITY_RULE_REQUIRED; i++)
+        {
+            if ((isalnum(param[i]) != 0) != alnum || ModsecurityCharsetHas(&seen, param[i]))
+                continue;
+
+            ModsecurityCharsetAdd(&seen, param[i]);
+            memset(&rule->required[rule->nrequired], 0, sizeof(modsecurity_charset_t));
+            ModsecurityCharsetAdd(&rule->required[rule->nrequired++], param[i]);
+        }
+    }
+}
+
+/*
+ * Work out the byte sets a transformed value has to meet for the operator
+ * to have any chance, so the engine can skip the rule without running it.
+ * @rx sets come from the pattern, see ModsecurityRulesCompileRx.
+ */
+static void ModsecurityRulesRequired(modsecurity_rule_t *rule)
+{
+    modsecurity_charset_t *set = &rule->required[0];
+    const char *phrase, *pick;
+    uint32_t i;
+
+    switch (rule->op)
+    {
+        case MODSECURITY_OP_CONTAINS:
+        case MODSECURITY_OP_STREQ:
+        case MODSECURITY_OP_BEGINSWITH:
+        case MODSECURITY_OP_ENDSWITH:
+            ModsecurityRulesRequiredBytes(rule);
+            break;
+
+        /* One byte of any phrase, either case */
+        case MODSECURITY_OP_PM:
+            memset(set, 0, sizeof(*set));
+            rule->nrequired = rule->nphrases != 0;
+
+            for (i = 0; i < rule->nphrases; i++)
+            {
+                phrase = rule->phrases[i];
+
+                for (pick = phrase; *pick && isalnum((unsigned char) *pick); pick++);
+
+                if (*pick == '\0')
+                    pick = phrase;
+
+                if (*pick == '\0')
+                {
+                    rule->nrequired = 0;
+                    break;
+                }
+
+                ModsecurityCharsetAdd(set, (uint8_t) *pick);
+                ModsecurityCharsetAdd(set, (uint8_t) toupper((unsigned char) *pick));
+            }
+            break;
+
+        /* Any byte outside the allowed ones */
+        case MODSECURITY_OP_VALIDATEBYTERANGE:
+            *set = rule->allowed.set;
+            ModsecurityCharsetInvert(set);
+            rule->nrequired = 1;
+            break;
+
+        /* Letters and digits alone never make an injection */
+        case MODSECURITY_OP_DETECTSQLI:
+        case MODSECURITY_OP_DETECTXSS:
+            memset(set, 0, sizeof(*set));
+
+            for (i = 0; i < 256; i++)
+            {
+                if (!isalnum(i))
+                    ModsecurityCharsetAdd(set, (uint8_t) i);
+            }
+
+            rule->nrequired = 1;
+            break;
+
+        default:
+            break;
+    }
+
+    /* A negated rule fires on exactly the values that lack them */
+    if (rule->negated)
+        rule->nrequired = 0;
+}
+
+/*
+ * Strings belong to the ruleset's pool and go with it, the compiled
+ * operator with the last generation holding the rule.
+ */
+static void ModsecurityRuleFree(modsecurity_rule_t *rule)
+{
+    free(rule->phrases);
+
+    if (rule->refs != NULL && __atomic_sub_fetch(rule->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    free(rule->refs);
+    ModsecurityRegexFree((modsecurity_regex_t *) rule->regex);
+    ModsecurityIptableFree((modsecurity_iptable_t *) rule->iptable);
+
+    if (rule->re_extra != NULL)
+        pcre_free_study((pcre_extra *) rule->re_extra);
+
+    if (rule->re != NULL)
+        pcre_free(rule->re);
+}
+
+/* One id or id range of SecRuleRemoveById and the like */
+static int ModsecurityRulesRange(modsecurity_rules_ctx_t *ctx, const char *item, uint32_t *from, uint32_t *to)
+{
+    unsigned long first, last;
+    char *end;
+
+    first = last = strtoul(item, &end, 10);
+
+    if (*end == '-')
+        last = strtoul(end + 1, &end, 10);
+
+    if (*end != '\0' || first == 0 || first > last || last > UINT32_MAX)
+        return ModsecurityRulesError(ctx, "bad rule id %s", item);
+
+    *from = (uint32_t) first;
+    *to = (uint32_t) last;
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* SecRuleRemoveById: ids and id ranges, separated by spaces or commas */
+static int ModsecurityRulesRemove(modsecurity_rules_ctx_t *ctx, modsecurity_ruleset_t *ruleset, char *ids)
+{
+    char *item, *save = NULL;
+    uint32_t from, to, i, n;
+
+    for (item = strtok_r(ids, " \t,", &save); item != NULL; item = strtok_r(NULL, " \t,", &save))
+    {
+        if (ModsecurityRulesRange(ctx, item, &from, &to) != MODSECURITY_SUCCESS)
+            return MODSECURITY_FAILURE;
+
+        for (i = n = 0; i < ruleset->count; i++)
+        {
+            if (ruleset->rules[i].id >= from && ruleset->rules[i].id <= to)
+            {
+                ModsecurityRuleFree(&ruleset->rules[i]);
+
+                if (ctx->changes != NULL)
+                    ctx->changes->removed++;
+            }
+            else
+            {
+                ruleset->rules[n++] = ruleset->rules[i];
+            }
+        }
+
+        ruleset->count = n;
+    }
+
+    return MODSECURITY_SUCCESS;
+}
+
+/*
+ * SecRuleDisableById and SecRuleEnableById: the rules stay where they
+ * are, only their flag changes. The engine may be reading it, so it is
+ * written atomically; without apply the ids are only checked.
+ */
+static int ModsecurityRulesDisable(modsecurity_rules_ctx_t *ctx, modsecurity_ruleset_t *ruleset, char *ids,
+        uint8_t disabled, int apply)
+{
+    char *item, *save = NULL;
+    uint32_t from, to, i;
+
+    for (item = strtok_r(ids, " \t,", &save); item != NULL; item = strtok_r(NULL, " \t,", &save))
+    {
+        if (ModsecurityRulesRange(ctx, item, &from, &to) != MODSECURITY_SUCCESS)
+            return MODSECURITY_FAILURE;
+
+        for (i = 0; apply && i < ruleset->count; i++)
+        {
+            if (ruleset->rules[i].id < from || ruleset->rules[i].id > to
+                    || ruleset->rules[i].disabled == disabled)
+                continue;
+
+            __atomic_store_n(&ruleset->rules[i].disabled, disabled, __ATOMIC_RELAXED);
+
+            if (ctx->changes == NULL)
+                continue;
+
+            if (disabled)
+                ctx->changes->disabled++;
+            else
+                ctx->changes->enabled++;
+        }
+    }
+
+    return MODSECURITY_SUCCESS;
+}
+
+/*
+ * Keep the rule just built at the end of the rules. When updating, one
+ * whose id is taken replaces that rule in its place instead.
+ */
+static void ModsecurityRulesPlace(modsecurity_rules_ctx_t *ctx, modsecurity_ruleset_t *ruleset)
+{
+    modsecurity_rule_t *rule = &ruleset->rules[ruleset->count];
+    uint32_t i;
+
+    if (ctx->changes == NULL)
+    {
+        ruleset->count++;
+        return;
+    }
+
+    for (i = 0; i < ruleset->count; i++)
+    {
+        if (ruleset->rules[i].id == rule->id)
+        {
+            ModsecurityRuleFree(&ruleset->rules[i]);
+            ruleset->rules[i] = *rule;
+            ctx->changes->replaced++;
+            return;
+        }
+    }
+
+    ruleset->count++;
+    ctx->changes->added++;
+}
+
+static int ModsecurityRulesDirective(modsecurity_rules_ctx_t *ctx, modsecurity_ruleset_t *ruleset,
+        char **tokens, int n)
+{
+    const modsecurity_rule_t *from;
+    modsecurity_rule_t *rule;
+    uint64_t digest;
+    uint8_t disabled;
+    int i;
+
+    if (!strcasecmp(tokens[0], "SecRuleEngine"))
+    {
+        if (n != 2)
+            return ModsecurityRulesError(ctx, "SecRuleEngine needs one argument");
+
+        if (!strcasecmp(tokens[1], "On"))
+            ruleset->engine = MODSECURITY_ENGINE_ON;
+        else if (!strcasecmp(tokens[1], "Off"))
+            ruleset->engine = MODSECURITY_ENGINE_OFF;
+        else if (!strcasecmp(tokens[1], "DetectionOnly"))
+            ruleset->engine = MODSECURITY_ENGINE_DETECTION_ONLY;
+        else
+            return ModsecurityRulesError(ctx, "bad SecRuleEngine %s", tokens[1]);
+
+        return MODSECURITY_SUCCESS;
+    }
+
+    if (!strcasecmp(tokens[0], "SecRuleRemoveById"))
+    {
+        if (n < 2)
+            return ModsecurityRulesError(ctx, "SecRuleRemoveById needs rule ids");
+
+        for (i = 1; i < n; i++)
+        {
+            if (ModsecurityRulesRemove(ctx, ruleset, tokens[i]) != MODSECURITY_SUCCESS)
+                return MODSECURITY_FAILURE;
+        }
+
+        return MODSECURITY_SUCCESS;
+    }
+
+    if (!strcasecmp(tokens[0], "SecRuleDisableById") || !strcasecmp(tokens[0], "SecRuleEnableById"))
+    {
+        if (n < 2)
+            return ModsecurityRulesError(ctx, "%s needs rule ids", tokens[0]);
+
+        disabled = !strcasecmp(tokens[0], "SecRuleDisableById");
+
+        for (i = 1; i < n; i++)
+        {
+            if (ModsecurityRulesDisable(ctx, ruleset, tokens[i], disabled, 1) != MODSECURITY_SUCCESS)
+                return MODSECURITY_FAILURE;
+        }
+
+        return MODSECURITY_SUCCESS;
+    }
+
+    if (strcasecmp(tokens[0], "SecRule"))
+    {
+        if (!strncasecmp(tokens[0], "Sec", 3))
+            return MODSECURITY_SUCCESS;
+
+        return ModsecurityRulesError(ctx, "unknown directive %s", tokens[0]);
+    }
+
+    if (n < 3 || n > 4)
+        return ModsecurityRulesError(ctx, "SecRule needs variables, an operator and actions");
+
+    /* Taken before the tokens are split up in place */
+    digest = ModsecurityRulesDigest(tokens, n);
+
+    if (ruleset->count == ruleset->capacity)
+    {
+        uint32_t capacity = ruleset->capacity ? ruleset->capacity * 2 : 64;
+        modsecurity_rule_t *rules = (modsecurity_rule_t *)
+            realloc(ruleset->rules, capacity * sizeof(modsecurity_rule_t));
+
+        if (rules == NULL)
+            DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+        ruleset->rules = rules;
+        ruleset->capacity = capacity;
+    }
+
+    rule = &ruleset->rules[ruleset->count];
+
+    /* The same directive as a live rule compiles to the same rule */
+    if ((from = ModsecurityRulesCarried(ctx, digest)) != NULL)
+    {
+        ModsecurityRulesCarry(ctx, rule, from);
+        rule->disabled = 0;
+        rule->file = ModsecurityRulesIntern(ctx, ctx->file, strlen(ctx->file));
+        rule->line = ctx->line;
+        ModsecurityRulesPlace(ctx, ruleset);
+        return MODSECURITY_SUCCESS;
+    }
+
+    memset(rule, 0, sizeof(*rule));
+
+    if ((rule->refs = (uint32_t *) malloc(sizeof(uint32_t))) == NULL)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+    *rule->refs = 1;
+    rule->digest = digest;
+    rule->phase = MODSECURITY_PHASE_REQUEST_BODY;
+    rule->action = MODSECURITY_ACTION_PASS;
+    rule->log = 1;
+    rule->file = ModsecurityRulesIntern(ctx, ctx->file, strlen(ctx->file));
+    rule->line = ctx->line;
+
+    if (ModsecurityRulesTargets(ctx, rule, tokens[1]) != MODSECURITY_SUCCESS
+            || ModsecurityRulesOperator(ctx, rule, tokens[2], ruleset) != MODSECURITY_SUCCESS
+            || (n == 4 && ModsecurityRulesActions(ctx, rule, tokens[3]) != MODSECURITY_SUCCESS))
+    {
+        ModsecurityRuleFree(rule);
+        return MODSECURITY_FAILURE;
+    }
+
+    if (rule->id == 0)
+    {
+        ModsecurityRuleFree(rule);
+        return ModsecurityRulesError(ctx, "rule has no id");
+    }
+
+    ModsecurityRulesRequired(rule);
+    ModsecurityRulesPlace(ctx, ruleset);
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* Stable sort by phase so each phase is one contiguous run */
+static int ModsecurityRulesByPhase(modsecurity_ruleset_t *ruleset)
+{
+    modsecurity_rule_t *sorted;
+    uint32_t i, n = 0;
+    int phase;
+
+    if (ruleset->count == 0)
+        return MODSECURITY_SUCCESS;
+
+    if ((sorted = (modsecurity_rule_t *) malloc(ruleset->count * sizeof(modsecurity_rule_t))) == NULL)
+        return MODSECURITY_FAILURE;
+
+    for (phase = MODSECURITY_PHASE_REQUEST_HEADERS; phase <= MODSECURITY_PHASE_MAX; phase++)
+    {
+        ruleset->phase_start[phase] = n;
+
+        for (i = 0; i < ruleset->count; i++)
+        {
+            if (ruleset->rules[i].phase == phase)
+                sorted[n++] = ruleset->rules[i];
+        }
+    }
+
+    ruleset->phase_start[MODSECURITY_PHASE_MAX + 1] = n;
+
+    free(ruleset->rules);
+    ruleset->rules = sorted;
+    ruleset->capacity = ruleset->count;
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* Apply every directive conf has to the ruleset */
+static int ModsecurityRulesParse(modsecurity_rules_ctx_t *ctx, modsecurity_conf_t *conf,
+        modsecurity_ruleset_t *ruleset)
+{
+    char *tokens[MODSECURITY_MAX_TOKENS];
+    int n;
+
+    while ((n = ModsecurityConfNext(conf, tokens, MODSECURITY_MAX_TOKENS)) != MODSECURITY_CONF_END)
+    {
+        /* Errors point at the first line of a continued directive */
+        ctx->line = conf->line;
+
+        if (n == MODSECURITY_CONF_BAD_QUOTE)
+            return ModsecurityRulesError(ctx, "bad quoting");
+
+        if (n == MODSECURITY_CONF_TOO_MANY)
+            return ModsecurityRulesError(ctx, "too many arguments");
+
+        if (n == MODSECURITY_CONF_TOO_LONG)
+            return ModsecurityRulesError(ctx, "directive too long");
+
+        if (ModsecurityRulesDirective(ctx, ruleset, tokens, n) != MODSECURITY_SUCCESS)
+            return MODSECURITY_FAILURE;
+    }
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* Sort the rules by phase and sum up what the engine needs to know of them */
+static void ModsecurityRulesFinish(modsecurity_ruleset_t *ruleset)
+{
+    const modsecurity_rule_t *rule;
+    uint32_t i, t;
+
+    if (ModsecurityRulesByPhase(ruleset) != MODSECURITY_SUCCESS)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+    ruleset->vars = 0;
+    ruleset->carried = 0;
+
+    for (i = 0; i < ruleset->count; i++)
+    {
+        rule = &ruleset->rules[i];
+        ruleset->carried += rule->carried;
+
+        for (t = 0; t < rule->ntargets; t++)
+            ruleset->vars |= rule->targets[t].var;
+    }
+}
+
+static modsecurity_ruleset_t *ModsecurityRulesNew(modsecurity_rules_ctx_t *ctx, size_t strings_size)
+{
+    static uint64_t generation;
+    modsecurity_ruleset_t *ruleset;
+
+    if ((ruleset = (modsecurity_ruleset_t *) calloc(1, sizeof(*ruleset))) == NULL
+            || (ruleset->strings = (char *) malloc(strings_size)) == NULL)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+    ruleset->strings_size = strings_size;
+    ruleset->generation = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+    ctx->ruleset = ruleset;
+
+    return ruleset;
+}
+
+/*
+ * Load a rules file. It is mapped and lexed in place (ModsecurityConfNext);
+ * only rules, compiled operators and the string pool are allocated.
+ * regex_cache is the lazy DFA budget per @rx pattern, 0 to use PCRE only.
+ * Given the live generation, loaded with the same limits and judged safe
+ * against the same bytes, rules whose directive did not change are
+ * carried over from it rather than compiled again.
+ * On error NULL is returned and errbuf says where and why.
+ */
+modsecurity_ruleset_t *ModsecurityRulesLoad(const char *path, uint32_t match_limit,
+        uint32_t regex_cache, const modsecurity_ruleset_t *live, char *errbuf, size_t errlen)
+{
+    modsecurity_rules_ctx_t ctx;
+    modsecurity_ruleset_t *ruleset;
+    modsecurity_conf_t conf;
+    int rc;
+
+    if (ModsecurityConfOpen(&conf, path, errbuf, errlen) != MODSECURITY_SUCCESS)
+        return NULL;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.file = path;
+    ctx.errbuf = errbuf;
+    ctx.errlen = errlen;
+
+    /* A rule's strings come out of its directive, the @pm phrases twice */
+    ruleset = ModsecurityRulesNew(&ctx, 2 * (conf.size + 1) + strlen(path) + 1);
+    ruleset->match_limit = match_limit ? match_limit : MODSECURITY_PCRE_MATCH_LIMIT;
+    ruleset->regex_cache = regex_cache;
+
+    if (live != NULL && live->match_limit == ruleset->match_limit && live->regex_cache == regex_cache)
+    {
+        ModsecurityRulesCarryFrom(&ctx, live);
+        ruleset->safe = live->safe;
+    }
+
+    rc = ModsecurityRulesParse(&ctx, &conf, ruleset);
+
+    ModsecurityConfClose(&conf);
+    ModsecurityRegexScratchFree(ctx.scratch);
+    free(ctx.slots);
+    free(ctx.live_slots);
+
+    if (rc != MODSECURITY_SUCCESS)
+    {
+        ModsecurityRulesFree(ruleset);
+        return NULL;
+    }
+
+    ModsecurityRulesFinish(ruleset);
+
+    return ruleset;
+}
+
+/*
+ * The generation after live: its rules, then the directives in text on
+ * top. A SecRule whose id is taken replaces that rule where it stands,
+ * any other is added, and SecRuleRemoveById drops rules. Only the new
+ * rules are compiled, the rest share their operators with live, so the
+ * two generations can be freed in either order. name stands in for a
+ * file name in errors.
+ */
+modsecurity_ruleset_t *ModsecurityRulesUpdate(const modsecurity_ruleset_t *live, const char *name,
+        const char *text, size_t len, modsecurity_rules_changes_t *changes, char *errbuf, size_t errlen)
+{
+    modsecurity_rules_ctx_t ctx;
+    modsecurity_ruleset_t *ruleset;
+    modsecurity_conf_t conf;
+    uint32_t i;
+    int rc;
+
+    memset(changes, 0, sizeof(*changes));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.file = name;
+    ctx.errbuf = errbuf;
+    ctx.errlen = errlen;
+    ctx.changes = changes;
+
+    ruleset = ModsecurityRulesNew(&ctx, live->strings_used + 2 * (len + 1) + strlen(name) + 1);
+    ruleset->engine = live->engine;
+    ruleset->match_limit = live->match_limit;
+    ruleset->regex_cache = live->regex_cache;
+    ruleset->safe = live->safe;
+
+    if (live->count > 0)
+    {
+        if ((ruleset->rules = (modsecurity_rule_t *) malloc(live->count * sizeof(modsecurity_rule_t))) == NULL)
+            DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate rule\n");
+
+        for (i = 0; i < live->count; i++)
+            ModsecurityRulesCarry(&ctx, &ruleset->rules[i], &live->rules[i]);
+
+        ruleset->count = ruleset->capacity = live->count;
+    }
+
+    ModsecurityConfText(&conf, text, len);
+    rc = ModsecurityRulesParse(&ctx, &conf, ruleset);
+
+    ModsecurityConfClose(&conf);
+    ModsecurityRegexScratchFree(ctx.scratch);
+    free(ctx.slots);
+
+    if (rc != MODSECURITY_SUCCESS)
+    {
+        ModsecurityRulesFree(ruleset);
+        return NULL;
+    }
+
+    ModsecurityRulesFinish(ruleset);
+
+    return ruleset;
+}
+
+/*
+ * Apply text to live in place when it only disables and enables rules,
+ * so a toggle neither copies nor swaps the rules. Returns 0 when text
+ * holds anything else, it then takes ModsecurityRulesUpdate. The caller
+ * holds the lock every writer of the rules takes.
+ */
+int ModsecurityRulesToggle(modsecurity_ruleset_t *live, const char *name, const char *text, size_t len,
+        modsecurity_rules_changes_t *changes, char *errbuf, size_t errlen)
+{
+    char *tokens[MODSECURITY_MAX_TOKENS];
+    modsecurity_rules_ctx_t ctx;
+    modsecurity_conf_t conf;
+    int n, i, apply, toggles = 0;
+
+    memset(changes, 0, sizeof(*changes));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.file = name;
+    ctx.errbuf = errbuf;
+    ctx.errlen = errlen;
+    ctx.changes = changes;
+
+    /* Every id is checked before the first rule changes */
+    for (apply = 0; apply <= 1; apply++)
+    {
+        ModsecurityConfText(&conf, text, len);
+
+        while ((n = ModsecurityConfNext(&conf, tokens, MODSECURITY_MAX_TOKENS)) != MODSECURITY_CONF_END)
+        {
+            ctx.line = conf.line;
+
+            if (n < 0 || (strcasecmp(tokens[0], "SecRuleDisableById")
+                        && strcasecmp(tokens[0], "SecRuleEnableById")))
+            {
+                ModsecurityConfClose(&conf);
+                return 0;
+            }
+
+            if (n < 2)
+            {
+                ModsecurityConfClose(&conf);
+                return ModsecurityRulesError(&ctx, "%s needs rule ids", tokens[0]);
+            }
+
+            for (i = 1; i < n; i++)
+            {
+                if (ModsecurityRulesDisable(&ctx, live, tokens[i], !strcasecmp(tokens[0], "SecRuleDisableById"),
+                            apply) != MODSECURITY_SUCCESS)
+                {
+                    ModsecurityConfClose(&conf);
+                    return MODSECURITY_FAILURE;
+                }
+            }
+
+            toggles++;
+        }
+
+        ModsecurityConfClose(&conf);
+
+        if (toggles == 0)
+            return 0;
+    }
+
+    return MODSECURITY_SUCCESS;
+}
+
+/* Log the rules whose patterns risk catastrophic backtracking, and what was done about it */
+uint32_t ModsecurityRulesReport(const modsecurity_ruleset_t *ruleset)
+{
+    const modsecurity_rule_t *rule;
+    uint32_t i, risky = 0;
+
+    for (i = 0; i < ruleset->count; i++)
+    {
+        rule = &ruleset->rules[i];
+
+        if (!(rule->redos & MODSECURITY_REDOS_RISK))
+            continue;
+
+        _dpd.logMsg("   ReDoS risk: rule %u (%s:%u): %s at offset %u, %s\n", rule->id, rule->file,
+                rule->line, ModsecurityRedosDescribe(rule->redos), rule->redos_offset,
+                rule->regex ? "using the lazy DFA" : rule->dfa ? "using the DFA matcher" : "match limit lowered");
+        risky++;
+    }
+
+    return risky;
+}
+
+void ModsecurityRulesFree(modsecurity_ruleset_t *ruleset)
+{
+    uint32_t i;
+
+    if (ruleset == NULL)
+        return;
+
+    for (i = 0; i < ruleset->count; i++)
+        ModsecurityRuleFree(&ruleset->rules[i]);
+
+    free(ruleset->rules);
+    free(ruleset->strings);
+    free(ruleset);
+}
@@ -0,0 +1,160 @@
+#ifndef MODSECURITY_RULES_H
+#define MODSECURITY_RULES_H
+
+#include "sf_types.h"
+#include "modsecurity_charset.h"
+
+/* Variables a rule can target */
+#define MODSECURITY_VAR_ARGS             0x0001
+#define MODSECURITY_VAR_ARGS_NAMES       0x0002
+#define MODSECURITY_VAR_QUERY_STRING     0x0004
+#define MODSECURITY_VAR_REQUEST_METHOD   0x0008
+#define MODSECURITY_VAR_REQUEST_URI      0x0010
+#define MODSECURITY_VAR_REQUEST_URI_RAW  0x0020
+#define MODSECURITY_VAR_REQUEST_HEADERS  0x0040
+#define MODSECURITY_VAR_REQUEST_COOKIES  0x0080
+#define MODSECURITY_VAR_REQUEST_BODY     0x0100
+#define MODSECURITY_VAR_REMOTE_ADDR      0x0200
+#define MODSECURITY_VAR_ARGS_GET         0x0400
+#define MODSECURITY_VAR_ARGS_GET_NAMES   0x0800
+#define MODSECURITY_VAR_ARGS_POST        0x1000
+#define MODSECURITY_VAR_ARGS_POST_NAMES  0x2000
+#define MODSECURITY_VAR_REQUEST_HEADERS_NAMES  0x4000
+#define MODSECURITY_VAR_REQUEST_COOKIES_NAMES  0x8000
+#define MODSECURITY_VAR_ARGS_COMBINED_SIZE     0x10000
+#define MODSECURITY_VAR_REQUEST_LINE           0x20000
+#define MODSECURITY_VAR_FULL_REQUEST           0x40000
+
+/* Variables that need urlencoded bodies split into ARGS_POST */
+#define MODSECURITY_VARS_FORM (MODSECURITY_VAR_ARGS | MODSECURITY_VAR_ARGS_NAMES \
+        | MODSECURITY_VAR_ARGS_POST | MODSECURITY_VAR_ARGS_POST_NAMES | MODSECURITY_VAR_ARGS_COMBINED_SIZE)
+
+/* Operators */
+#define MODSECURITY_OP_RX          0
+#define MODSECURITY_OP_CONTAINS    1
+#define MODSECURITY_OP_STREQ       2
+#define MODSECURITY_OP_BEGINSWITH  3
+#define MODSECURITY_OP_ENDSWITH    4
+#define MODSECURITY_OP_PM          5
+#define MODSECURITY_OP_EQ          6
+#define MODSECURITY_OP_GT          7
+#define MODSECURITY_OP_LT          8
+#define MODSECURITY_OP_GE          9
+#define MODSECURITY_OP_LE          10
+#define MODSECURITY_OP_UNCONDITIONAL 11
+#define MODSECURITY_OP_DETECTSQLI  12
+#define MODSECURITY_OP_DETECTXSS   13
+#define MODSECURITY_OP_IPMATCH     14
+#define MODSECURITY_OP_IPMATCHFROMFILE 15
+#define MODSECURITY_OP_VALIDATEBYTERANGE 16
+
+/* Transformations */
+#define MODSECURITY_T_LOWERCASE            0
+#define MODSECURITY_T_URLDECODE            1
+#define MODSECURITY_T_COMPRESSWHITESPACE   2
+#define MODSECURITY_T_REMOVENULLS          3
+#define MODSECURITY_T_TRIM                 4
+
+/* Disruptive actions */
+#define MODSECURITY_ACTION_PASS    0
+#define MODSECURITY_ACTION_DENY    1
+
+/* SecRuleEngine */
+#define MODSECURITY_ENGINE_ON              0
+#define MODSECURITY_ENGINE_OFF             1
+#define MODSECURITY_ENGINE_DETECTION_ONLY  2
+
+#define MODSECURITY_PHASE_REQUEST_HEADERS  1
+#define MODSECURITY_PHASE_REQUEST_BODY     2
+#define MODSECURITY_PHASE_MAX              2
+
+#define MODSECURITY_MAX_TARGETS      16
+#define MODSECURITY_MAX_TRANSFORMS   8
+
+/* Byte sets a value must meet before a rule is worth running */
+#define MODSECURITY_RULE_REQUIRED    4
+
+/* Default PCRE match limit, as SecPcreMatchLimit */
+#define MODSECURITY_PCRE_MATCH_LIMIT 1500
+
+typedef struct _modsecurity_target
+{
+    uint32_t var;
+    char *name;                  /* REQUEST_HEADERS:name, ARGS:name, NULL for all */
+} modsecurity_target_t;
+
+typedef struct _modsecurity_rule
+{
+    uint32_t id;
+    uint8_t phase;
+    uint8_t action;
+    uint8_t op;
+    uint8_t negated;
+    uint8_t log;
+    uint8_t ntransforms;
+    uint8_t transforms[MODSECURITY_MAX_TRANSFORMS];
+    uint16_t ntargets;
+    modsecurity_target_t targets[MODSECURITY_MAX_TARGETS];
+    char *param;                 /* operator argument */
+    uint32_t param_len;
+    int64_t number;              /* numeric operators */
+    void *re;                    /* @rx, pcre */
+    void *re_extra;
+    uint32_t redos;              /* MODSECURITY_REDOS_* found in the pattern */
+    uint32_t redos_offset;
+    int dfa;                     /* match with pcre_dfa_exec, no backtracking */
+    void *regex;                 /* lazy DFA, NULL if the pattern needs PCRE */
+    modsecurity_charset_t required[MODSECURITY_RULE_REQUIRED];  /* after transformation */
+    uint8_t nrequired;
+    uint8_t safe_skip;           /* never matches a value of safe bytes only */
+    void *iptable;               /* @ipMatch, @ipMatchFromFile, may be shared */
+    modsecurity_charset_lut_t allowed;  /* @validateByteRange */
+    char **phrases;              /* @pm, lowercased */
+    uint32_t nphrases;
+    char *msg;
+    char *file;
+    uint32_t line;
+    uint64_t digest;             /* of the directive, see ModsecurityRulesLoad */
+    uint32_t *refs;              /* generations sharing the compiled operator */
+    uint8_t carried;             /* compiled for an earlier generation */
+    uint8_t disabled;            /* skipped, flipped in place by ModsecurityRulesToggle */
+} modsecurity_rule_t;
+
+typedef struct _modsecurity_ruleset
+{
+    modsecurity_rule_t *rules;   /* phase 1 rules first, then phase 2, file order */
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t phase_start[MODSECURITY_PHASE_MAX + 2];
+    int engine;
+    uint32_t vars;               /* every variable some rule targets */
+    uint32_t match_limit;
+    uint32_t regex_cache;
+    modsecurity_charset_t safe;  /* see ModsecurityEngineSafe */
+    char *strings;               /* every string the rules point to, interned */
+    size_t strings_size;
+    size_t strings_used;
+    uint32_t carried;            /* rules shared with the generation before */
+    uint64_t generation;         /* tells rulesets apart, their addresses get reused */
+} modsecurity_ruleset_t;
+
+/* What ModsecurityRulesUpdate or ModsecurityRulesToggle changed */
+typedef struct _modsecurity_rules_changes
+{
+    uint32_t added;
+    uint32_t replaced;
+    uint32_t removed;
+    uint32_t disabled;
+    uint32_t enabled;
+} modsecurity_rules_changes_t;
+
+modsecurity_ruleset_t *ModsecurityRulesLoad(const char *, uint32_t, uint32_t, const modsecurity_ruleset_t *,
+        char *, size_t);
+modsecurity_ruleset_t *ModsecurityRulesUpdate(const modsecurity_ruleset_t *, const char *, const char *, size_t,
+        modsecurity_rules_changes_t *, char *, size_t);
+int ModsecurityRulesToggle(modsecurity_ruleset_t *, const char *, const char *, size_t,
+        modsecurity_rules_changes_t *, char *, size_t);
+uint32_t ModsecurityRulesReport(const modsecurity_ruleset_t *);
+void ModsecurityRulesFree(modsecurity_ruleset_t *);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tail sampling tracer. Every transaction keeps its per stage costs in its
+ * session; only those slower than trace_threshold are pushed into a fixed
+ * ring. A writer thread drains the ring to the trace file so the packet
+ * thread never blocks on I/O. When the ring is full the record is dropped
+ * and counted, the packet path never waits for the writer.
+ */
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "sf_snort_packet.h"
+#include "sf_dynamic_preprocessor.h"
+#include "spp_modsecurity.h"
+#include "modsecurity_trace.h"
+
+#define MODSECURITY_TRACE_POLL_US 100000
+
+typedef struct _modsecurity_trace_ring
+{
+    modsecurity_trace_t *slots;
+    uint32_t mask;
+    uint32_t head;               /* written by the packet thread */
+    uint32_t tail;               /* written by the writer thread */
+    FILE *fp;
+    pthread_t thread;
+    int running;
+} modsecurity_trace_ring_t;
+
+static modsecurity_trace_ring_t trace_ring;
+modsecurity_trace_stats_t modsecurity_trace_stats;
+
+static const char *stage_names[MODSECURITY_STAGE_MAX] =
+{
+    "head",
+    "body",
+    "phase1",
+    "phase2"
+};
+
+void ModsecurityTraceBegin(modsecurity_trace_t *trace, SFSnortPacket *packet)
+{
+    memset(trace, 0, sizeof(*trace));
+
+    trace->flags = MODSECURITY_TRACE_ACTIVE;
+    trace->ts.tv_sec = packet->pkt_header->ts.tv_sec;
+    trace->ts.tv_usec = packet->pkt_header->ts.tv_usec;
+    trace->src = *GET_SRC_IP(packet);
+    trace->dst = *GET_DST_IP(packet);
+    trace->src_port = packet->src_port;
+    trace->dst_port = packet->dst_port;
+}
+
+/* Keep the most expensive rules of the transaction */
+void ModsecurityTraceRule(modsecurity_trace_t *trace, uint32_t id, uint64_t ns)
+{
+    modsecurity_trace_rule_t *cheapest = &trace->rules[0];
+    int i;
+
+    if (!(trace->flags & MODSECURITY_TRACE_ACTIVE))
+        return;
+
+    for (i = 0; i < MODSECURITY_TRACE_TOP_RULES; i++)
+    {
+        if (trace->rules[i].id == id)
+        {
+            trace->rules[i].ns += ns;
+            return;
+        }
+
+        if (trace->rules[i].ns < cheapest->ns)
+            cheapest = &trace->rules[i];
+    }
+
+    if (ns > cheapest->ns)
+    {
+        cheapest->id = id;
+        cheapest->ns = ns;
+    }
+}
+
+static uint32_t ModsecurityTraceHash(const modsecurity_buf_t *buf)
+{
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+
+    for (i = 0; i < buf->len; i++)
+        hash = (hash ^ buf->data[i]) * 16777619u;
+
+    return hash;
+}
+
+/*
+ * Close the transaction's trace. Anything at or over the threshold (in
+ * microseconds) is queued for the writer.
+ */
+void ModsecurityTraceEnd(modsecurity_trace_t *trace, uint32_t threshold, const modsecurity_buf_t *uri)
+{
+    uint32_t head;
+
+    if (!(trace->flags & MODSECURITY_TRACE_ACTIVE))
+        return;
+
+    trace->flags &= ~MODSECURITY_TRACE_ACTIVE;
+
+    if (trace_ring.slots == NULL || trace->total_ns < (uint64_t) threshold * 1000)
+        return;
+
+    head = trace_ring.head;
+
+    if (head - __atomic_load_n(&trace_ring.tail, __ATOMIC_ACQUIRE) > trace_ring.mask)
+    {
+        modsecurity_trace_stats.dropped++;
+        return;
+    }
+
+    trace->uri_hash = ModsecurityTraceHash(uri);
+    trace_ring.slots[head & trace_ring.mask] = *trace;
+    __atomic_store_n(&trace_ring.head, head + 1, __ATOMIC_RELEASE);
+
+    modsecurity_trace_stats.logged++;
+}
+
+static void ModsecurityTraceWrite(FILE *fp, const modsecurity_trace_t *trace)
+{
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    int i;
+
+    sfip_ntop(&trace->src, src, sizeof(src));
+    sfip_ntop(&trace->dst, dst, sizeof(dst));
+
+    fprintf(fp, "%lu.%06lu %s:%u -> %s:%u uri=%08x total=" STDu64 "us",
+            (unsigned long) trace->ts.tv_sec, (unsigned long) trace->ts.tv_usec,
+            src, trace->src_port, dst, trace->dst_port, trace->uri_hash,
+            trace->total_ns / 1000);
+
+    for (i = 0; i < MODSECURITY_STAGE_MAX; i++)
+        fprintf(fp, " %s=" STDu64 "us", stage_names[i], trace->stage_ns[i] / 1000);
+
+    for (i = 0; i < MODSECURITY_TRACE_TOP_RULES; i++)
+    {
+        if (trace->rules[i].id)
+            fprintf(fp, " rule:%u=" STDu64 "us", trace->rules[i].id, trace->rules[i].ns / 1000);
+    }
+
+    if (trace->flags & MODSECURITY_TRACE_PARTIAL)
+        fputs(" partial", fp);
+
+    if (trace->flags & MODSECURITY_TRACE_ABORTED)
+        fputs(" aborted", fp);
+
+    fputc('\n', fp);
+}
+
+static void ModsecurityTraceDrain(void)
+{
+    uint32_t head = __atomic_load_n(&trace_ring.head, __ATOMIC_ACQUIRE);
+    uint32_t tail = trace_ring.tail;
+
+    if (tail == head)
+        return;
+
+    while (tail != head)
+    {
+        ModsecurityTraceWrite(trace_ring.fp, &trace_ring.slots[tail & trace_ring.mask]);
+        tail++;
+    }
+
+    __atomic_store_n(&trace_ring.tail, tail, __ATOMIC_RELEASE);
+    fflush(trace_ring.fp);
+}
+
+static void *ModsecurityTraceWriter(void *arg)
+{
+    while (__atomic_load_n(&trace_ring.running, __ATOMIC_ACQUIRE))
+    {
+        ModsecurityTraceDrain();
+        usleep(MODSECURITY_TRACE_POLL_US);
+    }
+
+    ModsecurityTraceDrain();
+
+    return NULL;
+}
+
+/*
+ * Open the trace file and start the writer. The ring holds at least size
+ * records, rounded up to a power of two, and at most
+ * MODSECURITY_TRACE_RING_MAX. Only one tracer runs per process.
+ */
+int ModsecurityTraceStart(const char *path, uint32_t size)
+{
+    uint32_t slots = 1;
+
+    if (trace_ring.slots != NULL)
+        return MODSECURITY_SUCCESS;
+
+    while (slots < size && slots < MODSECURITY_TRACE_RING_MAX)
+        slots <<= 1;
+
+    if ((trace_ring.fp = fopen(path, "a")) == NULL)
+        return MODSECURITY_FAILURE;
+
+    trace_ring.slots = (modsecurity_trace_t *) calloc(slots, sizeof(modsecurity_trace_t));
+
+    if (trace_ring.slots == NULL)
+    {
+        fclose(trace_ring.fp);
+        return MODSECURITY_FAILURE;
+    }
+
+    trace_ring.mask = slots - 1;
+    trace_ring.head = trace_ring.tail = 0;
+    trace_ring.running = 1;
+
+    if (pthread_create(&trace_ring.thread, NULL, ModsecurityTraceWriter, NULL) != 0)
+    {
+        free(trace_ring.slots);
+        trace_ring.slots = NULL;
+        fclose(trace_ring.fp);
+        return MODSECURITY_FAILURE;
+    }
+
+    return MODSECURITY_SUCCESS;
+}
+
+void ModsecurityTraceStop(void)
+{
+    if (trace_ring.slots == NULL)
+        return;
+
+    __atomic_store_n(&trace_ring.running, 0, __ATOMIC_RELEASE);
+    pthread_join(trace_ring.thread, NULL);
+
+    fclose(trace_ring.fp);
+    free(trace_ring.slots);
+    trace_ring.slots = NULL;
+}
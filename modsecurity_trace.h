@@ -0,0 +1,81 @@
+#ifndef MODSECURITY_TRACE_H
+#define MODSECURITY_TRACE_H
+
+#include <time.h>
+
+#include "sf_types.h"
+#include "sf_snort_packet.h"
+#include "sf_ip.h"
+#include "modsecurity_http.h"
+
+/* Transaction stages, each accumulates the time spent in it */
+#define MODSECURITY_STAGE_HEAD     0   /* request line and headers */
+#define MODSECURITY_STAGE_BODY     1   /* request body */
+#define MODSECURITY_STAGE_PHASE1   2   /* request header rules */
+#define MODSECURITY_STAGE_PHASE2   3   /* request body rules */
+#define MODSECURITY_STAGE_MAX      4
+
+#define MODSECURITY_TRACE_TOP_RULES  3
+#define MODSECURITY_TRACE_RING       1024
+#define MODSECURITY_TRACE_RING_MAX   (1 << 20)
+#define MODSECURITY_TRACE_FILE       "modsecurity_trace.log"
+
+/* Trace flags */
+#define MODSECURITY_TRACE_ACTIVE     0x01
+#define MODSECURITY_TRACE_PARTIAL    0x02
+#define MODSECURITY_TRACE_ABORTED    0x04
+
+typedef struct _modsecurity_trace_rule
+{
+    uint32_t id;
+    uint64_t ns;
+} modsecurity_trace_rule_t;
+
+/* Per transaction trace, also the record written to the trace file */
+typedef struct _modsecurity_trace
+{
+    struct timeval ts;           /* packet time the transaction started */
+    sfaddr_t src;
+    sfaddr_t dst;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t flags;
+    uint32_t uri_hash;
+    uint64_t total_ns;
+    uint64_t stage_ns[MODSECURITY_STAGE_MAX];
+    modsecurity_trace_rule_t rules[MODSECURITY_TRACE_TOP_RULES];
+} modsecurity_trace_t;
+
+typedef struct _modsecurity_trace_stats
+{
+    uint64_t logged;
+    uint64_t dropped;            /* ring full */
+} modsecurity_trace_stats_t;
+
+extern modsecurity_trace_stats_t modsecurity_trace_stats;
+
+static inline uint64_t ModsecurityTraceNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void ModsecurityTraceStage(modsecurity_trace_t *trace, int stage, uint64_t ns)
+{
+    if (!(trace->flags & MODSECURITY_TRACE_ACTIVE))
+        return;
+
+    trace->stage_ns[stage] += ns;
+    trace->total_ns += ns;
+}
+
+void ModsecurityTraceBegin(modsecurity_trace_t *, SFSnortPacket *);
+void ModsecurityTraceRule(modsecurity_trace_t *, uint32_t, uint64_t);
+void ModsecurityTraceEnd(modsecurity_trace_t *, uint32_t, const modsecurity_buf_t *);
+int ModsecurityTraceStart(const char *, uint32_t);
+void ModsecurityTraceStop(void);
+
+#endif
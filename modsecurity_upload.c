@@ -0,0 +1,507 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Files in multipart/form-data request bodies. The body is walked as it
+ * streams by, looking for the delimiter with KMP so that one split across
+ * segments needs no copy: the bytes held while it might be one are the
+ * delimiter's own. File part bytes are fed to SHA-256 (OpenSSL picks the
+ * SHA extensions when the CPU has them) and the finished digest is looked
+ * up in a sorted file of known bad digests, mapped read only.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "sf_types.h"
+#include "sf_dynamic_preprocessor.h"
+#include "spp_modsecurity.h"
+#include "modsecurity_upload.h"
+
+struct _modsecurity_hashes
+{
+    const uint8_t *map;
+    size_t size;
+    uint64_t count;
+};
+
+typedef struct _upload_type
+{
+    const char *magic;
+    uint32_t len;
+    const char *msg;            /* alert text for a known bad one */
+} upload_type_t;
+
+static const upload_type_t upload_types[] =
+{
+    { "MZ", 2, "(spp_modsecurity) known bad upload: PE executable" },
+    { "\x7f" "ELF", 4, "(spp_modsecurity) known bad upload: ELF executable" },
+    { "\xcf\xfa\xed\xfe", 4, "(spp_modsecurity) known bad upload: Mach-O executable" },
+    { "\xce\xfa\xed\xfe", 4, "(spp_modsecurity) known bad upload: Mach-O executable" },
+    { "\xca\xfe\xba\xbe", 4, "(spp_modsecurity) known bad upload: Mach-O or Java class" },
+    { "#!", 2, "(spp_modsecurity) known bad upload: script" },
+    { "%PDF-", 5, "(spp_modsecurity) known bad upload: PDF document" },
+    { "\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1", 8, "(spp_modsecurity) known bad upload: OLE document" },
+    { "PK\x03\x04", 4, "(spp_modsecurity) known bad upload: ZIP archive" },
+    { "Rar!\x1a\x07", 6, "(spp_modsecurity) known bad upload: RAR archive" },
+    { "7z\xbc\xaf\x27\x1c", 6, "(spp_modsecurity) known bad upload: 7-Zip archive" },
+    { "\x1f\x8b", 2, "(spp_modsecurity) known bad upload: gzip archive" },
+    { "\x89PNG\r\n\x1a\n", 8, "(spp_modsecurity) known bad upload: PNG image" },
+    { "\xff\xd8\xff", 3, "(spp_modsecurity) known bad upload: JPEG image" },
+    { "GIF8", 4, "(spp_modsecurity) known bad upload: GIF image" },
+};
+
+static const char *UploadMsg(const modsecurity_upload_t *upload)
+{
+    uint32_t i;
+
+    for (i = 0; i < sizeof(upload_types) / sizeof(upload_types[0]); i++)
+    {
+        if (upload->size >= upload_types[i].len
+                && !memcmp(upload->magic, upload_types[i].magic, upload_types[i].len))
+            return upload_types[i].msg;
+    }
+
+    return NULL;
+}
+
+/* Value of a header parameter such as boundary=, quoted or not */
+static const uint8_t *UploadParam(const uint8_t *p, const uint8_t *end, const char *name, uint32_t *len)
+{
+    uint32_t n = strlen(name);
+    const uint8_t *value;
+
+    for (; p + n < end; p++)
+    {
+        if ((p[-1] != ';' && p[-1] != ' ' && p[-1] != '\t') || strncasecmp((const char *) p, name, n)
+                || p[n] != '=')
+            continue;
+
+        value = p + n + 1;
+
+        if (value < end && *value == '"')
+        {
+            for (p = ++value; p < end && *p != '"'; p++);
+        }
+        else
+        {
+            for (p = value; p < end && *p != ';' && *p != ' ' && *p != '\t'; p++);
+        }
+
+        *len = p - value;
+        return value;
+    }
+
+    return NULL;
+}
+
+static void UploadLineReset(modsecurity_upload_t *upload)
+{
+    upload->line_len = 0;
+    upload->line_cut = 0;
+    upload->filename = 0;
+}
+
+/* Content-Type from the request head, multipart/form-data with a usable boundary */
+int ModsecurityUploadStart(modsecurity_upload_t *upload, const modsecurity_buf_t *header)
+{
+    const uint8_t *p = header->data, *end = header->data + header->len, *eol, *boundary = NULL;
+    uint32_t len = 0, i, k;
+
+    upload->state = MODSECURITY_UPLOAD_OFF;
+
+    for (; p < end; p = eol + 1)
+    {
+        if ((eol = memchr(p, '\n', end - p)) == NULL)
+            eol = end;
+
+        if (eol - p < 13 || strncasecmp((const char *) p, "Content-Type:", 13))
+            continue;
+
+        for (p += 13; p < eol && (*p == ' ' || *p == '\t'); p++);
+
+        if (eol - p < 19 || strncasecmp((const char *) p, "multipart/form-data", 19))
+            return MODSECURITY_FAILURE;
+
+        boundary = UploadParam(p + 19, eol[-1] == '\r' ? eol - 1 : eol, "boundary", &len);
+        break;
+    }
+
+    if (boundary == NULL || len == 0 || len > MODSECURITY_UPLOAD_BOUNDARY)
+        return MODSECURITY_FAILURE;
+
+    memcpy(upload->delim, "\r\n--", 4);
+    memcpy(upload->delim + 4, boundary, len);
+    upload->delim_len = len + 4;
+
+    /* fail[i]: longest proper border of the first i delimiter bytes */
+    upload->fail[0] = upload->fail[1] = 0;
+
+    for (i = 1, k = 0; i < upload->delim_len; i++)
+    {
+        while (k > 0 && upload->delim[i] != upload->delim[k])
+            k = upload->fail[k];
+
+        if (upload->delim[i] == upload->delim[k])
+            k++;
+
+        upload->fail[i + 1] = k;
+    }
+
+    /* The first delimiter needs no CRLF in front */
+    upload->match = 2;
+    UploadLineReset(upload);
+    upload->file = 0;
+    upload->state = MODSECURITY_UPLOAD_PREAMBLE;
+
+    return MODSECURITY_SUCCESS;
+}
+
+static void UploadContent(modsecurity_upload_t *upload, const uint8_t *data, uint32_t len)
+{
+    uint32_t n;
+
+    if (upload->sha == NULL || len == 0)
+        return;
+
+    if (upload->size < MODSECURITY_UPLOAD_MAGIC)
+    {
+        n = MODSECURITY_UPLOAD_MAGIC - (uint32_t) upload->size;
+        memcpy(upload->magic + upload->size, data, n < len ? n : len);
+    }
+
+    EVP_DigestUpdate((EVP_MD_CTX *) upload->sha, data, len);
+    upload->size += len;
+}
+
+static void UploadFileStart(modsecurity_upload_t *upload)
+{
+    EVP_MD_CTX *sha = EVP_MD_CTX_new();
+
+    if (sha == NULL)
+        return;
+
+    if (!EVP_DigestInit_ex(sha, EVP_sha256(), NULL))
+    {
+        EVP_MD_CTX_free(sha);
+        return;
+    }
+
+    upload->sha = sha;
+    upload->size = 0;
+}
+
+static void UploadFileEnd(modsecurity_upload_t *upload, ModsecurityUploadFunc found, void *ctx)
+{
+    modsecurity_upload_file_t file;
+
+    if (upload->sha == NULL)
+        return;
+
+    if (EVP_DigestFinal_ex((EVP_MD_CTX *) upload->sha, file.digest, NULL))
+    {
+        file.size = upload->size;
+        file.msg = UploadMsg(upload);
+        found(ctx, &file);
+    }
+
+    EVP_MD_CTX_free((EVP_MD_CTX *) upload->sha);
+    upload->sha = NULL;
+}
+
+/*
+ * A part header line: only whether a Content-Disposition names a file
+ * matters. One too long to keep whole names a file if "filename" shows
+ * anywhere in it, so padding the name in front cannot hide the file.
+ */
+static void UploadHeader(modsecurity_upload_t *upload)
+{
+    const uint8_t *line = upload->line, *end = upload->line + upload->line_len;
+    uint32_t len;
+
+    if (upload->line_len < 20 || strncasecmp((const char *) line, "Content-Disposition:", 20))
+        return;
+
+    if (upload->line_cut)
+    {
+        if (upload->filename == sizeof("filename") - 1)
+            upload->file = 1;
+
+        return;
+    }
+
+    if (UploadParam(line + 20, end, "filename", &len) != NULL
+            || UploadParam(line + 20, end, "filename*", &len) != NULL)
+        upload->file = 1;
+}
+
+/*
+ * A line of part headers or of what follows a delimiter, 1 when it ends.
+ * The first MODSECURITY_UPLOAD_LINE bytes are kept; header lines are also
+ * searched for "filename" as they pass, for the ones that do not fit.
+ */
+static int UploadLine(modsecurity_upload_t *upload, uint8_t c)
+{
+    static const char filename[] = "filename";
+
+    if (c != '\n')
+    {
+        if (upload->line_len < MODSECURITY_UPLOAD_LINE)
+            upload->line[upload->line_len++] = c;
+        else
+            upload->line_cut++;
+
+        /* No repeated prefix in the word, a mismatch only restarts it */
+        if (upload->state == MODSECURITY_UPLOAD_HEADERS && upload->filename < sizeof(filename) - 1)
+        {
+            if (tolower(c) == filename[upload->filename])
+                upload->filename++;
+            else
+                upload->filename = tolower(c) == filename[0];
+        }
+
+        return 0;
+    }
+
+    if (upload->line_len > 0 && upload->line[upload->line_len - 1] == '\r'
+            && upload->line_len < MODSECURITY_UPLOAD_LINE)
+        upload->line_len--;
+
+    return 1;
+}
+
+void ModsecurityUploadData(modsecurity_upload_t *upload, const uint8_t *data, uint32_t len,
+        ModsecurityUploadFunc found, void *ctx)
+{
+    const uint8_t *end = data + len, *cr;
+    uint32_t m;
+
+    while (data < end)
+    {
+        switch (upload->state)
+        {
+            case MODSECURITY_UPLOAD_PREAMBLE:
+            case MODSECURITY_UPLOAD_DATA:
+                /* Nothing held, everything up to the next CR is content */
+                if (upload->match == 0)
+                {
+                    if ((cr = memchr(data, '\r', end - data)) == NULL)
+                        cr = end;
+
+                    UploadContent(upload, data, cr - data);
+                    data = cr;
+
+                    if (data == end)
+                        break;
+                }
+
+                for (m = upload->match; m > 0 && upload->delim[m] != *data; m = upload->fail[m])
+                    UploadContent(upload, upload->delim, m - upload->fail[m]);
+
+                if (upload->delim[m] == *data)
+                    m++;
+                else
+                    UploadContent(upload, data, 1);
+
+                data++;
+                upload->match = m;
+
+                if (m < upload->delim_len)
+                    break;
+
+                UploadFileEnd(upload, found, ctx);
+                upload->match = 0;
+                UploadLineReset(upload);
+                upload->state = MODSECURITY_UPLOAD_DELIMITER;
+                break;
+
+            case MODSECURITY_UPLOAD_DELIMITER:
+                if (!UploadLine(upload, *data++))
+                {
+                    if (upload->line_len == 2 && upload->line[0] == '-' && upload->line[1] == '-')
+                        upload->state = MODSECURITY_UPLOAD_DONE;
+
+                    break;
+                }
+
+                UploadLineReset(upload);
+                upload->file = 0;
+                upload->state = MODSECURITY_UPLOAD_HEADERS;
+                break;
+
+            case MODSECURITY_UPLOAD_HEADERS:
+                if (!UploadLine(upload, *data++))
+                    break;
+
+                if (upload->line_len > 0)
+                {
+                    UploadHeader(upload);
+                    UploadLineReset(upload);
+                    break;
+                }
+
+                if (upload->file)
+                    UploadFileStart(upload);
+
+                upload->state = MODSECURITY_UPLOAD_DATA;
+                break;
+
+            default:
+                return;
+        }
+    }
+}
+
+/* The request is over, a file part still open is dropped unhashed */
+void ModsecurityUploadEnd(modsecurity_upload_t *upload)
+{
+    if (upload->sha != NULL)
+    {
+        EVP_MD_CTX_free((EVP_MD_CTX *) upload->sha);
+        upload->sha = NULL;
+    }
+
+    upload->state = MODSECURITY_UPLOAD_OFF;
+}
+
+/* Raw SHA-256 digests back to back, ascending, as `sort -u | xxd -r -p` makes */
+modsecurity_hashes_t *ModsecurityHashesLoad(const char *path, char *error, size_t errlen)
+{
+    modsecurity_hashes_t *hashes;
+    struct stat st;
+    uint64_t i;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    {
+        snprintf(error, errlen, "%s: %s", path, strerror(errno));
+
+        if (fd >= 0)
+            close(fd);
+
+        return NULL;
+    }
+
+    if (st.st_size == 0 || st.st_size % MODSECURITY_UPLOAD_DIGEST)
+    {
+        snprintf(error, errlen, "%s: not a list of SHA-256 digests", path);
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        snprintf(error, errlen, "%s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if ((hashes = (modsecurity_hashes_t *) calloc(1, sizeof(*hashes))) == NULL)
+    {
+        snprintf(error, errlen, "out of memory");
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    hashes->map = (const uint8_t *) map;
+    hashes->size = st.st_size;
+    hashes->count = st.st_size / MODSECURITY_UPLOAD_DIGEST;
+
+    /* An unsorted list would quietly miss, check it once */
+    for (i = 1; i < hashes->count; i++)
+    {
+        if (memcmp(hashes->map + (i - 1) * MODSECURITY_UPLOAD_DIGEST,
+                    hashes->map + i * MODSECURITY_UPLOAD_DIGEST, MODSECURITY_UPLOAD_DIGEST) >= 0)
+        {
+            snprintf(error, errlen, "%s: digest %lu out of order", path, (unsigned long) i + 1);
+            ModsecurityHashesFree(hashes);
+            return NULL;
+        }
+    }
+
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    return hashes;
+}
+
+uint64_t ModsecurityHashesCount(const modsecurity_hashes_t *hashes)
+{
+    return hashes->count;
+}
+
+int ModsecurityHashesHas(const modsecurity_hashes_t *hashes, const uint8_t *digest)
+{
+    uint64_t low = 0, high = hashes->count, mid;
+    int cmp;
+
+    while (low < high)
+    {
+        mid = low + (high - low) / 2;
+        cmp = memcmp(digest, hashes->map + mid * MODSECURITY_UPLOAD_DIGEST, MODSECURITY_UPLOAD_DIGEST);
+
+        if (cmp == 0)
+            return 1;
+
+        if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+
+    return 0;
+}
+
+void ModsecurityHashesFree(modsecurity_hashes_t *hashes)
+{
+    if (hashes == NULL)
+        return;
+
+    munmap((void *) hashes->map, hashes->size);
+    free(hashes);
+}
@@ -0,0 +1,64 @@
+#ifndef MODSECURITY_UPLOAD_H
+#define MODSECURITY_UPLOAD_H
+
+#include "sf_types.h"
+#include "modsecurity_http.h"
+
+#define MODSECURITY_UPLOAD_BOUNDARY  70     /* RFC 2046 */
+#define MODSECURITY_UPLOAD_DELIM     (MODSECURITY_UPLOAD_BOUNDARY + 4)
+#define MODSECURITY_UPLOAD_LINE      256    /* part header line kept, see UploadLine */
+#define MODSECURITY_UPLOAD_MAGIC     16     /* leading file bytes kept to tell the type */
+#define MODSECURITY_UPLOAD_DIGEST    32     /* SHA-256 */
+
+/* Multipart states */
+#define MODSECURITY_UPLOAD_OFF       0      /* not a multipart body */
+#define MODSECURITY_UPLOAD_PREAMBLE  1
+#define MODSECURITY_UPLOAD_DELIMITER 2      /* rest of a delimiter line */
+#define MODSECURITY_UPLOAD_HEADERS   3
+#define MODSECURITY_UPLOAD_DATA      4
+#define MODSECURITY_UPLOAD_DONE      5      /* close delimiter seen */
+
+/* A file part that has ended */
+typedef struct _modsecurity_upload_file
+{
+    uint8_t digest[MODSECURITY_UPLOAD_DIGEST];
+    uint64_t size;
+    const char *msg;            /* alert text naming the type its leading bytes show */
+} modsecurity_upload_file_t;
+
+typedef void (*ModsecurityUploadFunc)(void *, const modsecurity_upload_file_t *);
+
+/*
+ * Per request multipart state. Part data is never kept: file parts go
+ * through SHA-256 as they pass, everything else is dropped.
+ */
+typedef struct _modsecurity_upload
+{
+    int state;
+    uint8_t delim[MODSECURITY_UPLOAD_DELIM];        /* CRLF--boundary */
+    uint8_t fail[MODSECURITY_UPLOAD_DELIM + 1];     /* KMP fallbacks */
+    uint32_t delim_len;
+    uint32_t match;             /* delimiter bytes matched so far */
+    uint8_t line[MODSECURITY_UPLOAD_LINE];
+    uint32_t line_len;
+    uint32_t line_cut;          /* bytes of the line past the buffer */
+    uint32_t filename;          /* "filename" bytes matched on the line */
+    int file;                   /* part headers named a filename */
+    uint8_t magic[MODSECURITY_UPLOAD_MAGIC];
+    uint64_t size;
+    void *sha;                  /* EVP_MD_CTX, in a file part only */
+} modsecurity_upload_t;
+
+typedef struct _modsecurity_hashes modsecurity_hashes_t;
+
+int ModsecurityUploadStart(modsecurity_upload_t *, const modsecurity_buf_t *);
+void ModsecurityUploadData(modsecurity_upload_t *, const uint8_t *, uint32_t,
+        ModsecurityUploadFunc, void *);
+void ModsecurityUploadEnd(modsecurity_upload_t *);
+
+modsecurity_hashes_t *ModsecurityHashesLoad(const char *, char *, size_t);
+uint64_t ModsecurityHashesCount(const modsecurity_hashes_t *);
+int ModsecurityHashesHas(const modsecurity_hashes_t *, const uint8_t *);
+void ModsecurityHashesFree(modsecurity_hashes_t *);
+
+#endif
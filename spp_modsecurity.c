@@ -36,6 +36,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -44,10 +46,17 @@
 #include "sf_types.h"
 #include "sf_snort_packet.h"
 #include "stream_api.h"
+#include "session_api.h"
 #include "sf_dynamic_preprocessor.h"
 #include "snort_debug.h"
 #include "preprocids.h"
 #include "spp_modsecurity.h"
+#include "modsecurity_http.h"
+#include "modsecurity_trace.h"
+#include "modsecurity_rules.h"
+#include "modsecurity_engine.h"
+#include "modsecurity_canary.h"
+#include "modsecurity_regex.h"
 #include "sf_preproc_info.h"
 
 #include "profiler.h"
@@ -66,6 +75,19 @@ PreprocStats modsecurityPerfStats;
 static tSfPolicyUserContextId modsecurity_context_id = NULL;
 //static modsecurity_config_t *modsecurity_eval_config = NULL;
 
+/* Preprocessor stats */
+static modsecurity_stats_t modsecurity_stats;
+
+/* What the packet thread's rule evaluation writes */
+static modsecurity_engine_scratch_t *modsecurity_scratch = NULL;
+
+/*
+ * Held, off the packet thread, while a generation of rules is built from
+ * the live one or a replaced one freed, so neither goes away underneath
+ * the other, and by the reload swap while it replaces the live policies.
+ */
+static pthread_mutex_t modsecurity_rules_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* Target-based app ID */
 #ifdef TARGET_BASED
 int16_t modsecurity_app_id = SFTARGET_UNKNOWN_PROTOCOL;
@@ -73,8 +95,17 @@ int16_t modsecurity_app_id = SFTARGET_UNKNOWN_PROTOCOL;
 
 /* Func Prototypes */
 static void ModsecurityInit(struct _SnortConfig *, char *);
-static void ModsecurityProcess(void *, void *);
-static modsecurity_config_t *ModsecurityParse(char *);
+static modsecurity_config_t *ModsecurityParse(char *, const modsecurity_config_t *);
+static void ModsecurityAddPreproc(struct _SnortConfig *, modsecurity_config_t *);
+static int ModsecurityCheckConfig(struct _SnortConfig *);
+static int ModsecurityInspectable(SFSnortPacket *);
+static void ModsecurityPrintStats(int);
+static void ModsecuritySessionFree(void *);
+static void ModsecurityAlert(void *, const modsecurity_rule_t *);
+static void ModsecurityCleanExit(int, void *);
+static void ModsecurityStartTrace(modsecurity_config_t *);
+static void ModsecurityFreeConfig(modsecurity_config_t *);
+static int ModsecurityFreePolicyConfig(tSfPolicyUserContextId, tSfPolicyId, void *);
 
 #ifdef SNORT_RELOAD
 static void ModsecurityReload(struct _SnortConfig *, char *, void **);
@@ -83,6 +114,12 @@ static void *ModsecurityReloadSwap(struct _SnortConfig *, void *);
 static void ModsecurityReloadSwapFree(void *);
 #endif
 
+#ifdef CONTROL_SOCKET
+static int ModsecurityControlUpdate(uint16_t, const uint8_t *, uint32_t, void **, char *, int);
+static int ModsecurityControlSwap(uint16_t, void *, void **);
+static void ModsecurityControlFree(uint16_t, void *, struct _THREAD_ELEMENT *, ControlDataSendFunc);
+#endif
+
 void ModsecuritySetup(void)
 {
 #ifndef SNORT_RELOAD
@@ -106,13 +143,28 @@ static void ModsecurityInit(struct _SnortConfig *sc, char *args)
         modsecurity_context_id = sfPolicyConfigCreate();
         if (modsecurity_context_id == NULL)
             DynamicPreprocessorFatalMessage("Could not allocate configuration struct.\n");
+
+        if ((modsecurity_scratch = ModsecurityEngineScratchNew(&modsecurity_engine_stats,
+                        &modsecurity_regex_stats)) == NULL)
+            DynamicPreprocessorFatalMessage("Modsecurity: Could not allocate engine scratch\n");
+
+        _dpd.registerPreprocStats("modsecurity", ModsecurityPrintStats);
+        _dpd.addPreprocConfCheck(sc, ModsecurityCheckConfig);
+        _dpd.addPreprocExit(sc, ModsecurityCleanExit, NULL, PRIORITY_LAST, PP_MODSECURITY);
+#ifdef CONTROL_SOCKET
+        if (_dpd.controlSocketRegisterHandler(CS_TYPE_MODSECURITY_RULES, ModsecurityControlUpdate,
+                    ModsecurityControlSwap, ModsecurityControlFree))
+            _dpd.errMsg("Modsecurity: Could not register the control socket rule updates\n");
+#endif
     }
 
-    config = ModsecurityParse(args);
+    config = ModsecurityParse(args, NULL);
     sfPolicyUserPolicySet(modsecurity_context_id, policy_id);
     sfPolicyUserDataSetCurrent(modsecurity_context_id, config);
 
-    _dpd.addPreproc(sc, ModsecurityProcess, PRIORITY_TRANSPORT, 0, PROTO_BIT__TCP | PROTO_BIT__UDP);
+    ModsecurityStartTrace(config);
+
+    ModsecurityAddPreproc(sc, config);
 #ifdef PERF_PROFILING
     _dpd.addPreprocProfileFunc("modsecurity", (void *) &modsecurityPerfStats, 0, _dpd.totalPerfStats, NULL);
 #endif
@@ -120,137 +172,1829 @@ static void ModsecurityInit(struct _SnortConfig *sc, char *args)
     DEBUG_WRAP(DebugMessage(DEBUG_PLUGIN, "Preprocessor: Modsecurity is initialized\n"));
 }
 
-static modsecurity_config_t *ModsecurityParse(char *args)
+/* Value of a numeric option, taken from the next token */
+static uint32_t ModsecurityParseUint(const char *option)
+{
+    char *arg = strtok(NULL, CONF_SEPARATORS);
+    char *end;
+    unsigned long value;
+
+    if (arg == NULL)
+        DynamicPreprocessorFatalMessage("Modsecurity: Missing value for %s\n", option);
+
+    value = strtoul(arg, &end, 10);
+
+    if (*end != '\0' || *arg == '-' || value > UINT32_MAX)
+        DynamicPreprocessorFatalMessage("Modsecurity: Bad value %s for %s\n", arg, option);
+
+    return (uint32_t) value;
+}
+
+/* Byte set in [] class syntax without the brackets: a-z ranges, a - first or last is literal */
+static int ModsecurityParseCharset(const char *arg, modsecurity_charset_t *set)
+{
+    const uint8_t *p = (const uint8_t *) arg;
+    int c;
+
+    memset(set, 0, sizeof(*set));
+
+    for (; *p; p++)
+    {
+        if (p[1] == '-' && p[2] != '\0')
+        {
+            if (p[2] < p[0])
+                return MODSECURITY_FAILURE;
+
+            for (c = p[0]; c <= p[2]; c++)
+                ModsecurityCharsetAdd(set, (uint8_t) c);
+
+            p += 2;
+            continue;
+        }
+
+        ModsecurityCharsetAdd(set, *p);
+    }
+
+    return MODSECURITY_SUCCESS;
+}
+
+/*
+ * Rules of the running configuration a reload may carry unchanged rules
+ * over from: only if they were judged against the same safe bytes, the
+ * loader checks the rest.
+ */
+static const modsecurity_ruleset_t *ModsecurityCarryRules(const modsecurity_config_t *config,
+        const modsecurity_config_t *live, const modsecurity_ruleset_t *ruleset)
+{
+    if (live == NULL || live->safe_values != config->safe_values
+            || memcmp(&live->safe_charset, &config->safe_charset, sizeof(config->safe_charset)))
+        return NULL;
+
+    return ruleset;
+}
+
+static modsecurity_config_t *ModsecurityParse(char *args, const modsecurity_config_t *live)
 {
     char *arg;
-    //char *argEnd;
     int port = 0;
     modsecurity_config_t *config = (modsecurity_config_t *) calloc(1, sizeof(modsecurity_config_t));
 
     if (config == NULL)
         DynamicPreprocessorFatalMessage("Could not allocate configuration struct.\n");
 
-    config->ports = 80;
-    arg = strtok(args, " ");
+    config->ports = MODSECURITY_PORT;
+    config->trace_ring = MODSECURITY_TRACE_RING;
+    config->request_body_limit = MODSECURITY_BODY_LIMIT;
+    config->pcre_match_limit = MODSECURITY_PCRE_MATCH_LIMIT;
+    config->regex_cache_size = MODSECURITY_REGEX_CACHE;
+    config->safe_values = 1;
+    config->profile_endpoints = MODSECURITY_PROFILE_ENDPOINTS;
+    config->profile_min_samples = MODSECURITY_PROFILE_SAMPLES;
+    ModsecurityParseCharset(MODSECURITY_SAFE_CHARSET, &config->safe_charset);
+    config->canary_time = MODSECURITY_CANARY_TIME;
+    config->shadow_sample = MODSECURITY_SHADOW_SAMPLE;
+    config->decompress.depth = MODSECURITY_DECODE_DEPTH_DEFAULT;
+    config->decompress.ratio = MODSECURITY_DECODE_RATIO_DEFAULT;
+    config->decompress_memory = MODSECURITY_DECODE_MEMORY_DEFAULT;
+    arg = strtok(args, CONF_SEPARATORS);
 
-    if (arg && !strcasecmp("port", arg))
+    while (arg != NULL)
     {
-        arg = strtok(NULL, " ");
+        if (!strcasecmp("port", arg))
+        {
+            arg = strtok(NULL, CONF_SEPARATORS);
+
+            if (!arg)
+                DynamicPreprocessorFatalMessage("Modsecurity: Missing port\n");
+
+            port = atoi(arg);
+
+            if (port < 0 || port > MAX_PORTS)
+            {
+                DynamicPreprocessorFatalMessage("Bad port %d.\n", port);
+            }
+
+            config->ports = port;
+        }
+        else if (!strcasecmp("http_inspect_buffers", arg))
+        {
+            config->http_inspect_buffers = 1;
+        }
+        else if (!strcasecmp("publish_http_buffers", arg))
+        {
+            config->publish_http_buffers = 1;
+        }
+        else if (!strcasecmp("client_only", arg))
+        {
+            config->client_only = 1;
+        }
+        else if (!strcasecmp("trace_threshold", arg))
+        {
+            config->trace_threshold = ModsecurityParseUint(arg);
+        }
+        else if (!strcasecmp("trace_file", arg))
+        {
+            if ((arg = strtok(NULL, CONF_SEPARATORS)) == NULL)
+                DynamicPreprocessorFatalMessage("Modsecurity: Missing value for trace_file\n");
+
+            free(config->trace_file);
+
+            if ((config->trace_file = strdup(arg)) == NULL)
+                DynamicPreprocessorFatalMessage("Could not allocate configuration struct.\n");
+        }
+        else if (!strcasecmp("trace_ring", arg))
+        {
+            config->trace_ring = ModsecurityParseUint(arg);
+
+            if (config->trace_ring == 0 || config->trace_ring > MODSECURITY_TRACE_RING_MAX)
+                DynamicPreprocessorFatalMessage("Modsecurity: trace_ring must be between 1 and %u\n",
+                        MODSECURITY_TRACE_RING_MAX);
+        }
+        else if (!strcasecmp("rules", arg))
+        {
+            if ((arg = strtok(NULL, CONF_SEPARATORS)) == NULL)
+                DynamicPreprocessorFatalMessage("Modsecurity: Missing value for rules\n");
+
+            free(config->rules_file);
+
+            if ((config->rules_file = strdup(arg)) == NULL)
+                DynamicPreprocessorFatalMessage("Could not allocate configuration struct.\n");
+        }
+        else if (!strcasecmp("shadow_rules", arg))
+        {
+            if ((arg = strtok(NULL, CONF_SEPARATORS)) == NULL)
+                DynamicPreprocessorFatalMessage("Modsecurity: Missing value for shadow_rules\n");
 
-        if (!arg)
+            free(config->shadow_rules_file);
+
+            if ((config->shadow_rules_file = strdup(arg)) == NULL)
+                DynamicPreprocessorFatalMessage("Could not allocate configuration struct.\n");
+        }
+        else if (!strcasecmp("shadow_sample", arg))
+        {
+            config->shadow_sample = ModsecurityParseUint(arg);
+
+            if (config->shadow_sample == 0)
+                DynamicPreprocessorFatalMessage("Modsecurity: shadow_sample must be at least 1\n");
+        }
+        else if (!strcasecmp("request_body_limit", arg))
+        {
+            config->request_body_limit = ModsecurityParseUint(arg);
+        }
+        else if (!strcasecmp("pcre_match_limit", arg))
+        {
+            config->pcre_match_limit = ModsecurityParseUint(arg);
+
+            if (config->pcre_match_limit == 0)
+                DynamicPreprocessorFatalMessage("Modsecurity: pcre_match_limit must be at least 1\n");
+        }
+        else if (!strcasecmp("regex_cache_size", arg))
+        {
+            config->regex_cache_size = ModsecurityParseUint(arg);
+
+            if (config->regex_cache_size && config->regex_cache_size < MODSECURITY_REGEX_CACHE_MIN)
+                DynamicPreprocessorFatalMessage("Modsecurity: regex_cache_size must be 0 or at least %u\n",
+                        MODSECURITY_REGEX_CACHE_MIN);
+        }
+        else if (!strcasecmp("safe_charset", arg))
+        {
+            if ((arg = strtok(NULL, CONF_SEPARATORS)) == NULL)
+                DynamicPreprocessorFatalMessage("Modsecurity: Missing value for safe_charset\n");
+
+            config->safe_values = strcasecmp(arg, "none") != 0;
+
+            if (config->safe_values && ModsecurityParseCharset(arg, &config->safe_charset) != MODSECURITY_SUCCESS)
+                DynamicPreprocessorFatalMessage("Modsecurity: Bad value %s for safe_charset\n", arg);
+        }
+        else if (!strcasecmp("profile", arg))
+        {
+            if ((arg = strtok(NULL, CONF_SEPARATORS)) == NULL)
+                DynamicPreprocessorFatalMessage("Modsecurity: Missing value for profile\n");
+
+            if (!strcasecmp("learn", arg))
+                config->profile = MODSECURITY_PROFILE_LEARN;
+            else if (!strcasecmp("enforce", arg))
+                config->profile = MODSECURITY_PROFILE_ENFORCE;
+            else if (!strcasecmp("off", arg))
+                config->profile = MODSECURITY_PROFILE_OFF;
+            else
+                DynamicPreprocessorFatalMessage("Modsecurity: Bad value %s for profile\n", arg);
+        }
+        else if (!strcasecmp("profile_endpoints", arg))
+        {
+            config->profile_endpoints = ModsecurityParseUint(arg);
+
+            if (config->profile_endpoints == 0)
+                DynamicPreprocessorFatalMessage("Modsecurity: profile_endpoints must be at least 1\n");
+        }
+        else if (!strcasecmp("profile_min_samples", arg))
+        {
+            config->profile_min_samples = ModsecurityParseUint(arg);
+        }
+        else if (!strcasecmp("canary_factor", arg))
+        {
+            char *end;
+
+            if ((arg = strtok(NULL, CONF_SEPARATORS)) == NULL)
+                DynamicPreprocessorFatalMessage("Modsecurity: Missing value for canary_factor\n");
+
+            config->canary_factor = strtod(arg, &end);
+
+            if (*end != '\0' || config->canary_factor < 0
+                    || (config->canary_factor > 0 && config->canary_factor < 1))
+                DynamicPreprocessorFatalMessage("Modsecurity: Bad value %s for canary_factor\n", arg);
+        }
+        else if (!strcasecmp("canary_time", arg))
+        {
+            config->canary_time = ModsecurityParseUint(arg);
+        }
+        else if (!strcasecmp("client_flow_depth", arg))
         {
-            port = 80;
-            _dpd.logMsg("Undefined port, using default port.\n");
-            //DynamicPreprocessorFatalMessage("Modsecurity: Missing port\n");
+            config->flow_depth[MODSECURITY_DIR_CLIENT] = ModsecurityParseUint(arg);
         }
+        else if (!strcasecmp("server_flow_depth", arg))
+        {
+            config->flow_depth[MODSECURITY_DIR_SERVER] = ModsecurityParseUint(arg);
+        }
+        else if (!strcasecmp("response_pan_sid", arg))
+        {
+            config->response_pan_sid = ModsecurityParseUint(arg);
+        }
+        else if (!strcasecmp("decompress_depth", arg))
+        {
+            config->decompress.depth = ModsecurityParseUint(arg);
+        }
+        else if (!strcasecmp("decompress_ratio", arg))
+        {
+            config->decompress.ratio = ModsecurityParseUint(arg);
+        }
+        else if (!strcasecmp("decompress_memory", arg))
+        {
+            config->decompress_memory = ModsecurityParseUint(arg);
+
+            if (config->decompress_memory < MODSECURITY_DECODE_MEMORY_MIN)
+                DynamicPreprocessorFatalMessage("Modsecurity: decompress_memory must be at least %u\n",
+                        MODSECURITY_DECODE_MEMORY_MIN);
+        }
+        else if (!strcasecmp("upload_hashes", arg))
+        {
+            if ((arg = strtok(NULL, CONF_SEPARATORS)) == NULL)
+                DynamicPreprocessorFatalMessage("Modsecurity: Missing value for upload_hashes\n");
 
-        port = atoi(arg);
+            free(config->upload_hashes_file);
 
-        if (port < 0 || port > MAX_PORTS)
+            if ((config->upload_hashes_file = strdup(arg)) == NULL)
+                DynamicPreprocessorFatalMessage("Could not allocate configuration struct.\n");
+        }
+        else if (!strcasecmp("upload_hash_sid", arg))
+        {
+            config->upload_hash_sid = ModsecurityParseUint(arg);
+        }
+        else
         {
-            DynamicPreprocessorFatalMessage("Bad port %d.\n", port);
+            DynamicPreprocessorFatalMessage("Modsecurity: Invalid option %s\n", arg);
         }
 
-        config->ports = port;
+        arg = strtok(NULL, CONF_SEPARATORS);
+    }
+
+    _dpd.logMsg("   Port: %d\n", config->ports);
+    if (config->http_inspect_buffers && config->publish_http_buffers)
+        DynamicPreprocessorFatalMessage("Modsecurity: http_inspect_buffers and publish_http_buffers "
+                "are mutually exclusive\n");
+
+    _dpd.logMsg("   HTTP buffers: %s\n", config->http_inspect_buffers ? "http_inspect" :
+            config->publish_http_buffers ? "published" : "none");
+    if (config->trace_threshold)
+        _dpd.logMsg("   Trace: transactions over %uus to %s, %u records buffered\n",
+                config->trace_threshold, config->trace_file ? config->trace_file : MODSECURITY_TRACE_FILE,
+                config->trace_ring);
+    else
+        _dpd.logMsg("   Trace: off\n");
+    _dpd.logMsg("   Inspection: %s\n", config->client_only ? "client only" : "both directions");
+    _dpd.logMsg("   Client flow depth: %u%s\n", config->flow_depth[MODSECURITY_DIR_CLIENT],
+            config->flow_depth[MODSECURITY_DIR_CLIENT] ? "" : " (unlimited)");
+    _dpd.logMsg("   Server flow depth: %u%s\n", config->flow_depth[MODSECURITY_DIR_SERVER],
+            config->flow_depth[MODSECURITY_DIR_SERVER] ? "" : " (unlimited)");
+
+    if (config->response_pan_sid && config->client_only)
+        DynamicPreprocessorFatalMessage("Modsecurity: response_pan_sid needs responses, "
+                "not client_only\n");
+
+    if (config->response_pan_sid)
+        _dpd.logMsg("   Response card numbers: alert %u:%u\n", GENERATOR_SPP_MODSECURITY,
+                config->response_pan_sid);
+    else
+        _dpd.logMsg("   Response card numbers: off\n");
+
+    if (config->response_pan_sid && config->decompress.depth)
+        _dpd.logMsg("   Response decoding: gzip, deflate, br, zstd; %u bytes deep, ratio %u, %u bytes of state\n",
+                config->decompress.depth, config->decompress.ratio, config->decompress_memory);
+    else if (config->response_pan_sid)
+        _dpd.logMsg("   Response decoding: off\n");
+
+    if (config->upload_hashes_file != NULL)
+    {
+        char error[256];
+
+        if (config->upload_hash_sid == 0)
+            DynamicPreprocessorFatalMessage("Modsecurity: upload_hashes needs upload_hash_sid\n");
+
+        config->upload_hashes = ModsecurityHashesLoad(config->upload_hashes_file, error, sizeof(error));
+
+        if (config->upload_hashes == NULL)
+            DynamicPreprocessorFatalMessage("Modsecurity: %s\n", error);
+
+        _dpd.logMsg("   Upload hashes: " STDu64 " from %s, alert %u:%u\n",
+                ModsecurityHashesCount(config->upload_hashes), config->upload_hashes_file,
+                GENERATOR_SPP_MODSECURITY, config->upload_hash_sid);
+    }
+    else
+    {
+        _dpd.logMsg("   Upload hashes: off\n");
+    }
+
+    if (config->rules_file != NULL)
+    {
+        char error[256];
+        uint64_t start = ModsecurityTraceNow();
+
+        config->ruleset = ModsecurityRulesLoad(config->rules_file, config->pcre_match_limit,
+                config->regex_cache_size, ModsecurityCarryRules(config, live, live ? live->ruleset : NULL),
+                error, sizeof(error));
+
+        if (config->ruleset == NULL)
+            DynamicPreprocessorFatalMessage("Modsecurity: %s\n", error);
+
+        _dpd.logMsg("   Rules: %u from %s in %u ms, %u unchanged carried over\n", config->ruleset->count,
+                config->rules_file, (uint32_t) ((ModsecurityTraceNow() - start) / 1000000),
+                config->ruleset->carried);
+        ModsecurityRulesReport(config->ruleset);
+
+        if (config->safe_values)
+            _dpd.logMsg("   Safe values: %u rules skipped for them\n",
+                    ModsecurityEngineSafe(config->ruleset, &config->safe_charset));
+        else
+            _dpd.logMsg("   Safe values: off\n");
+
+        _dpd.logMsg("   Request body limit: %u\n", config->request_body_limit);
+        _dpd.logMsg("   PCRE match limit: %u\n", config->pcre_match_limit);
+
+        if (config->regex_cache_size)
+            _dpd.logMsg("   Regex DFA cache: %u bytes per pattern\n", config->regex_cache_size);
+        else
+            _dpd.logMsg("   Regex DFA cache: off\n");
+    }
+    else
+    {
+        _dpd.logMsg("   Rules: none\n");
+    }
+
+    if (config->shadow_rules_file != NULL)
+    {
+        char error[256];
+
+        config->shadow_ruleset = ModsecurityRulesLoad(config->shadow_rules_file,
+                config->pcre_match_limit, config->regex_cache_size,
+                ModsecurityCarryRules(config, live, live ? live->shadow_ruleset : NULL), error, sizeof(error));
 
-        _dpd.logMsg("   Port: %d\n", config->ports);
+        if (config->shadow_ruleset == NULL)
+            DynamicPreprocessorFatalMessage("Modsecurity: %s\n", error);
+
+        _dpd.logMsg("   Shadow rules: %u from %s, one in %u transactions\n",
+                config->shadow_ruleset->count, config->shadow_rules_file, config->shadow_sample);
+        ModsecurityRulesReport(config->shadow_ruleset);
+
+        if (config->safe_values)
+            ModsecurityEngineSafe(config->shadow_ruleset, &config->safe_charset);
+    }
+
+    if (config->profile != MODSECURITY_PROFILE_OFF && config->ruleset != NULL)
+    {
+        config->profiles = ModsecurityProfilesNew(config->profile, config->profile_endpoints,
+                config->profile_min_samples);
+
+        if (config->profiles == NULL)
+            DynamicPreprocessorFatalMessage("Could not allocate configuration struct.\n");
+
+        _dpd.logMsg("   Profiles: %s, %u endpoints, trusted after %u clean requests\n",
+                config->profile == MODSECURITY_PROFILE_ENFORCE ? "enforce" : "learn",
+                config->profile_endpoints, config->profile_min_samples);
     }
     else
     {
-        _dpd.logMsg("   Port: %d\n", config->ports);
-        //DynamicPreprocessorFatalMessage("Modsecurity: Invalid option %s\n", arg ? arg : "(missing port)");
+        _dpd.logMsg("   Profiles: off\n");
     }
 
+    if (config->canary_factor > 0)
+        _dpd.logMsg("   Reload canary: %.2fx for %ums\n", config->canary_factor, config->canary_time);
+    else
+        _dpd.logMsg("   Reload canary: off\n");
+
     return config;
 }
 
-static void ModsecurityProcess(void *pkt, void *context)
+/*
+ * Start the slow transaction tracer for the first configuration that asks
+ * for it. Relative trace files go in Snort's log directory.
+ */
+static void ModsecurityStartTrace(modsecurity_config_t *config)
 {
-    SFSnortPacket *packet = (SFSnortPacket *) pkt;
-    modsecurity_config_t *config;
-    PROFILE_VARS;
+    const char *file = config->trace_file ? config->trace_file : MODSECURITY_TRACE_FILE;
+    char path[PATH_MAX];
 
-    sfPolicyUserPolicySet(modsecurity_context_id, _dpd.getNapRuntimePolicy());
-    config = (modsecurity_config_t *) sfPolicyUserDataGetCurrent(modsecurity_context_id);
+    if (config->trace_threshold == 0)
+        return;
 
-    if(!IsTCP(packet)) return;
+    if (file[0] == '/')
+        snprintf(path, sizeof(path), "%s", file);
+    else
+        snprintf(path, sizeof(path), "%s/%s", _dpd.getLogDirectory(), file);
 
+    if (ModsecurityTraceStart(path, config->trace_ring) != MODSECURITY_SUCCESS)
+        DynamicPreprocessorFatalMessage("Modsecurity: Could not start trace to %s\n", path);
+}
+
+static void ModsecurityFreeConfig(modsecurity_config_t *config)
+{
     if (config == NULL)
         return;
 
-    PREPROC_PROFILE_START(modsecurityPerfStats);
+    ModsecurityRulesFree(config->ruleset);
+    ModsecurityRulesFree(config->shadow_ruleset);
+    ModsecurityProfilesFree(config->profiles);
+    ModsecurityHashesFree(config->upload_hashes);
+    free(config->upload_hashes_file);
+    free(config->rules_file);
+    free(config->shadow_rules_file);
+    free(config->trace_file);
+    free(config);
+}
 
-    if (packet->src_port == config->ports)
-    {
-        /* Check source port */
-        _dpd.logMsg("Modsecurity Src Port Found: %d\n", packet->src_port);
+static int ModsecurityFreePolicyConfig(tSfPolicyUserContextId context_id, tSfPolicyId policy_id, void *data)
+{
+    sfPolicyUserDataClear(context_id, policy_id);
+    ModsecurityFreeConfig((modsecurity_config_t *) data);
 
-        PREPROC_PROFILE_END(modsecurityPerfStats);
-        return;
-    }
+    return 0;
+}
 
-    if (packet->dst_port == config->ports)
-    {
-        _dpd.logMsg("Modsecurity Dst Port Found: %d\n", packet->dst_port);
+static void ModsecurityCleanExit(int signal, void *data)
+{
+    ModsecurityTraceStop();
 
-        PREPROC_PROFILE_END(modsecurityPerfStats);
+    if (modsecurity_context_id == NULL)
         return;
+
+    sfPolicyUserDataFreeIterate(modsecurity_context_id, ModsecurityFreePolicyConfig);
+    sfPolicyConfigDelete(modsecurity_context_id);
+    modsecurity_context_id = NULL;
+
+    ModsecurityEngineScratchFree(modsecurity_scratch);
+    modsecurity_scratch = NULL;
+}
+
+static int ModsecurityCheckPolicyConfig(struct _SnortConfig *sc, tSfPolicyUserContextId context_id,
+        tSfPolicyId policy_id, void *data)
+{
+    modsecurity_config_t *config = (modsecurity_config_t *) data;
+
+    _dpd.setParserPolicy(sc, policy_id);
+
+    if (config->http_inspect_buffers && !_dpd.isPreprocEnabled(sc, PP_HTTPINSPECT))
+    {
+        _dpd.errMsg("Modsecurity: http_inspect must be enabled to use http_inspect_buffers\n");
+        return MODSECURITY_FAILURE;
     }
 
-    PREPROC_PROFILE_END(modsecurityPerfStats);
+    if (config->publish_http_buffers && _dpd.isPreprocEnabled(sc, PP_HTTPINSPECT))
+        _dpd.logMsg("WARNING: Modsecurity: http_inspect is enabled and will overwrite "
+                "the published HTTP buffers\n");
+
+    return 0;
 }
 
-#ifdef SNORT_RELOAD
-static void ModsecurityReload(struct _SnortConfig *sc, char *args, void **new_config)
+static int ModsecurityCheckConfig(struct _SnortConfig *sc)
 {
-    tSfPolicyUserContextId modsecurity_swap_config = (tSfPolicyUserContextId) *new_config;
-    modsecurity_config_t *config;
-    tSfPolicyId policy_id = _dpd.getParserPolicy(sc);
+    if (sfPolicyUserDataIterate(sc, modsecurity_context_id, ModsecurityCheckPolicyConfig))
+        return MODSECURITY_FAILURE;
 
-    _dpd.logMsg("Modsecurity dynamic preprocessor configuration\n");
+    return 0;
+}
+
+/*
+ * Decide whether this packet carries bytes we have not seen yet. Rebuilt
+ * PDUs (and PAF aligned full PDUs) are always inspected. A raw segment that
+ * stream queued for reassembly in its direction will be handed to us again
+ * inside a rebuilt PDU, so it is skipped; raw segments are only inspected
+ * when reassembly is off for the direction they travel in.
+ */
+static int ModsecurityInspectable(SFSnortPacket *packet)
+{
+    char dir;
 
-    modsecurity_swap_config = sfPolicyConfigCreate();
+    if (PacketHasPAFPayload(packet))
+        return 1;
 
-    if (modsecurity_swap_config == NULL)
-        DynamicPreprocessorFatalMessage("Could not allocate configuration struct\n");
+    if (packet->stream_session == NULL || !(packet->flags & FLAG_STREAM_INSERT))
+        return 1;
 
-    config = ModsecurityParse(args);
-    sfPolicyUserPolicySet(modsecurity_swap_config, policy_id);
-    sfPolicyUserDataSetCurrent(modsecurity_swap_config, config);
+    dir = (packet->flags & FLAG_FROM_CLIENT) ? SSN_DIR_FROM_CLIENT : SSN_DIR_FROM_SERVER;
 
-    DEBUG_WRAP(DebugMessage(DEBUG_PLUGIN, "Preprocessor: Modsecurity is initialized\n"););
+    return !(_dpd.streamAPI->get_reassembly_direction(packet->stream_session) & dir);
 }
 
-static int ModsecurityReloadVerify(struct _SnortConfig *sc, void *swap_config)
+/* Rule match callback: alert with the rule id as sid */
+static void ModsecurityAlert(void *context, const modsecurity_rule_t *rule)
 {
-    if (!_dpd.isPreprocEnabled(sc, PP_STREAM))
+    _dpd.alertAdd(GENERATOR_SPP_MODSECURITY, rule->id, 1, 0, 3,
+            rule->msg ? rule->msg : "(spp_modsecurity) rule match", 0);
+}
+
+/*
+ * Denies only come out of the engine with SecRuleEngine On. Inline the flow
+ * is dropped and reset; passive, the alert is all we can do. Either way the
+ * rest of the flow is not inspected.
+ */
+static void ModsecurityDeny(SFSnortPacket *packet, modsecurity_config_t *config, modsecurity_flow_t *flow)
+{
+    if (flow != NULL)
+        flow->flags |= MODSECURITY_SESSION_BLOCKED;
+
+    if (!_dpd.inlineMode())
+        return;
+
+    modsecurity_stats.blocked++;
+    _dpd.inlineDropAndReset(packet);
+}
+
+/*
+ * A client_only session whose buffers were published to Snort, released
+ * when the next packet comes in and detection is done with them
+ */
+static struct
+{
+    void *ssn;
+    modsecurity_session_t *session;
+} modsecurity_release;
+
+static void ModsecuritySessionFree(void *data)
+{
+    modsecurity_session_t *session = (modsecurity_session_t *) data;
+
+    if (session == NULL)
+        return;
+
+    /* Only the flow is left of a released session */
+    if (((modsecurity_flow_t *) data)->flags & MODSECURITY_SESSION_RELEASED)
     {
-        _dpd.errMsg("Streaming & reassembly must be enabled for example preprocessor\n");
-        return MODSECURITY_FAILURE;
+        free(data);
+        return;
     }
 
-    return MODSECURITY_SUCCESS;
+    if (session == modsecurity_release.session)
+        modsecurity_release.session = NULL;
+
+    ModsecurityUploadEnd(&session->upload);
+    ModsecurityResponseEnd(&session->response);
+    ModsecurityArenaFree(&session->arena);
+    ModsecurityArenaFree(&session->response_arena);
+    free(session);
 }
 
-static void *ModsecurityReloadSwap(struct _SnortConfig *sc, void *swap_config)
+/* Arena a transaction may need, sized for what the rules look at */
+static uint32_t ModsecurityTxArenaSize(const modsecurity_ruleset_t *ruleset, uint32_t body_limit)
 {
-    tSfPolicyUserContextId modsecurity_context_swap_config = (tSfPolicyUserContextId) swap_config;
-    tSfPolicyUserContextId old_config = modsecurity_context_id;
+    uint32_t size = MODSECURITY_ARENA_TX + body_limit;
 
-    if (modsecurity_context_swap_config == NULL) return NULL;
+    if (ruleset == NULL)
+        return 0;
 
-    modsecurity_context_id = modsecurity_context_swap_config;
+    if (ruleset->vars & MODSECURITY_VARS_FORM)
+        size += MODSECURITY_ARENA_FORM + body_limit;
 
-    return (void *) old_config;
+    if (ruleset->vars & (MODSECURITY_VAR_REQUEST_LINE | MODSECURITY_VAR_FULL_REQUEST))
+        size += MODSECURITY_HTTP_MAX_HEADER;
+
+    if (ruleset->vars & MODSECURITY_VAR_FULL_REQUEST)
+        size += MODSECURITY_HTTP_MAX_HEADER + body_limit;
+
+    return size;
 }
 
-static void ModsecurityReloadSwapFree(void *data)
+static void ModsecuritySessionInit(modsecurity_session_t *session, modsecurity_config_t *config)
 {
-    tSfPolicyUserContextId config = (tSfPolicyUserContextId) data;
+    uint32_t size = MODSECURITY_ARENA_SIZE;
 
-    if (data == NULL) return;
+    size += ModsecurityTxArenaSize(config->ruleset, config->request_body_limit);
+    size += ModsecurityTxArenaSize(config->shadow_ruleset, config->request_body_limit);
 
-    //sfPolicyUserDataFreeIterate(config, ModsecurityReloadSwap);
-    sfPolicyConfigDelete(config);
+    /* The published head of a PDU's first request stays while the next ones parse */
+    if (config->publish_http_buffers)
+        size += MODSECURITY_ARENA_SIZE;
+
+    if (config->ruleset != NULL)
+    {
+        session->tx.body_limit = config->request_body_limit;
+        session->tx.on_match = ModsecurityAlert;
+    }
+
+    session->tx.scratch = session->shadow.scratch = modsecurity_scratch;
+
+    ModsecurityArenaInit(&session->arena, size);
+    ModsecurityHttpParserInit(&session->parser, &session->arena);
+    ModsecurityArenaInit(&session->response_arena, config->decompress_memory);
+}
+
+/*
+ * Per flow state hangs off the stream session. Packets without one (no
+ * stream, or a midstream pickup stream did not track) get a scratch session
+ * that does not outlive the packet.
+ */
+static modsecurity_session_t *ModsecurityGetSession(SFSnortPacket *packet, modsecurity_config_t *config)
+{
+    static modsecurity_session_t scratch;
+    modsecurity_session_t *session;
+    modsecurity_flow_t *flow;
+
+    if (packet->stream_session == NULL)
+    {
+        ModsecurityUploadEnd(&scratch.upload);
+        ModsecurityResponseEnd(&scratch.response);
+        ModsecurityArenaFree(&scratch.arena);
+        ModsecurityArenaFree(&scratch.response_arena);
+        memset(&scratch, 0, sizeof(scratch));
+        ModsecuritySessionInit(&scratch, config);
+        return &scratch;
+    }
+
+    flow = (modsecurity_flow_t *) _dpd.sessionAPI->get_application_data(packet->stream_session, PP_MODSECURITY);
+
+    if (flow != NULL && !(flow->flags & MODSECURITY_SESSION_RELEASED))
+        return (modsecurity_session_t *) flow;
+
+    if ((session = (modsecurity_session_t *) calloc(1, sizeof(*session))) == NULL)
+        return NULL;
+
+    /* A released flow picks up where it left off, its stub goes */
+    if (flow != NULL)
+    {
+        session->flow = *flow;
+        session->flow.flags &= ~MODSECURITY_SESSION_RELEASED;
+    }
+
+    ModsecuritySessionInit(session, config);
+    _dpd.sessionAPI->set_application_data(packet->stream_session, PP_MODSECURITY,
+            session, ModsecuritySessionFree);
+
+    return session;
+}
+
+/*
+ * Give back a client_only session between requests. Setting the stream
+ * session data frees what it replaces. A flow that was blocked or counts a
+ * flow depth keeps that much in a stub; one that cannot have it keeps the
+ * session, less its arena.
+ */
+static void ModsecurityRelease(void *ssn, modsecurity_session_t *session)
+{
+    modsecurity_flow_t *flow;
+
+    if (!(session->flow.flags & (MODSECURITY_SESSION_BLOCKED | MODSECURITY_SESSION_DEPTH_DONE(0)
+                    | MODSECURITY_SESSION_DEPTH_DONE(1)))
+            && session->flow.inspected[0] == 0 && session->flow.inspected[1] == 0)
+    {
+        _dpd.sessionAPI->set_application_data(ssn, PP_MODSECURITY, NULL, NULL);
+        return;
+    }
+
+    if ((flow = (modsecurity_flow_t *) malloc(sizeof(*flow))) == NULL)
+    {
+        ModsecurityArenaFree(&session->arena);
+        return;
+    }
+
+    *flow = session->flow;
+    flow->flags &= ~MODSECURITY_SESSION_SHADOW;
+    flow->flags |= MODSECURITY_SESSION_RELEASED;
+    _dpd.sessionAPI->set_application_data(ssn, PP_MODSECURITY, flow, ModsecuritySessionFree);
+}
+
+/* Detection is done with the last packet, what it was given can go */
+static void ModsecurityReleasePending(void)
+{
+    modsecurity_session_t *session = modsecurity_release.session;
+
+    if (session == NULL)
+        return;
+
+    modsecurity_release.session = NULL;
+    ModsecurityRelease(modsecurity_release.ssn, session);
+}
+
+/*
+ * Run the client side of the PDU through the request parser. A PDU may end
+ * a request, start the next one or carry several pipelined ones; only the
+ * first head and body segment go into Snort's buffers, as http_inspect does.
+ */
+static MODSECURITY_INLINE void ModsecurityRequestEvents(modsecurity_config_t *config,
+        modsecurity_session_t *session, uint32_t events, const uint32_t path)
+{
+    if (events & MODSECURITY_HTTP_EV_HEADERS)
+        modsecurity_stats.requests++;
+
+    /* The response parser needs to know which responses answer a HEAD */
+    if ((path & MODSECURITY_PATH_RESPONSES) && (events & MODSECURITY_HTTP_EV_HEADERS))
+        ModsecurityResponseRequest(&session->response, session->parser.request.method.data,
+                session->parser.request.method.len);
+
+    if (events & MODSECURITY_HTTP_EV_GAP)
+    {
+        if (events & MODSECURITY_HTTP_EV_DONE)
+        {
+            modsecurity_stats.partial_requests++;
+            session->trace.flags |= MODSECURITY_TRACE_PARTIAL;
+        }
+        else
+        {
+            modsecurity_stats.aborted_requests++;
+            session->trace.flags |= MODSECURITY_TRACE_ABORTED;
+        }
+    }
+    else if (events & MODSECURITY_HTTP_EV_ERROR)
+    {
+        modsecurity_stats.parse_errors++;
+    }
+
+    if ((path & MODSECURITY_PATH_TRACE) && (events & (MODSECURITY_HTTP_EV_DONE | MODSECURITY_HTTP_EV_ERROR)))
+        ModsecurityTraceEnd(&session->trace, config->trace_threshold, &session->parser.request.raw_uri);
+}
+
+/* One in shadow_sample transactions also goes through the shadow rules */
+static int ModsecurityShadowSample(modsecurity_config_t *config)
+{
+    static uint32_t count;
+
+    if (config->shadow_ruleset == NULL || ++count < config->shadow_sample)
+        return 0;
+
+    count = 0;
+
+    return 1;
+}
+
+static void ModsecurityShadowVerdict(int live, int shadow)
+{
+    modsecurity_stats.shadow_sampled++;
+
+    if (live == MODSECURITY_ACTION_DENY && shadow != MODSECURITY_ACTION_DENY)
+        modsecurity_stats.shadow_live_only++;
+    else if (shadow == MODSECURITY_ACTION_DENY && live != MODSECURITY_ACTION_DENY)
+        modsecurity_stats.shadow_only++;
+}
+
+/*
+ * Feed a parser step to the live rules and, for sampled transactions, to
+ * the shadow rules. The shadow verdict is only compared with the live one
+ * once the request is done or the live rules denied it. Returns the live
+ * verdict.
+ */
+static MODSECURITY_INLINE int ModsecurityRules(modsecurity_config_t *config, modsecurity_session_t *session,
+        uint32_t events, const uint32_t path)
+{
+    int verdict = MODSECURITY_ACTION_PASS, shadow;
+    uint64_t start = 0;
+
+    if (!(path & MODSECURITY_PATH_SHADOW))
+    {
+        if (config->ruleset == NULL)
+            return verdict;
+
+        session->tx.trace = (path & MODSECURITY_PATH_TRACE) ? &session->trace : NULL;
+        session->tx.profiles = config->profiles;
+
+        return ModsecurityEngineStep(config->ruleset, &session->tx, &session->parser, events);
+    }
+
+    if ((events & MODSECURITY_HTTP_EV_HEADERS) && ModsecurityShadowSample(config))
+    {
+        session->flow.flags |= MODSECURITY_SESSION_SHADOW;
+        session->shadow.flags |= MODSECURITY_TX_SHADOW;
+        session->shadow.body_limit = config->request_body_limit;
+    }
+    else if (events & MODSECURITY_HTTP_EV_HEADERS)
+    {
+        session->flow.flags &= ~MODSECURITY_SESSION_SHADOW;
+    }
+
+    if (config->shadow_ruleset == NULL)
+        session->flow.flags &= ~MODSECURITY_SESSION_SHADOW;
+
+    if (session->flow.flags & MODSECURITY_SESSION_SHADOW)
+        start = ModsecurityTraceNow();
+
+    if (config->ruleset != NULL)
+    {
+        session->tx.trace = (path & MODSECURITY_PATH_TRACE) ? &session->trace : NULL;
+        session->tx.profiles = config->profiles;
+        verdict = ModsecurityEngineStep(config->ruleset, &session->tx, &session->parser, events);
+    }
+
+    if (!(session->flow.flags & MODSECURITY_SESSION_SHADOW))
+        return verdict;
+
+    modsecurity_stats.shadow_live_ns += ModsecurityTraceNow() - start;
+
+    start = ModsecurityTraceNow();
+    shadow = ModsecurityEngineStep(config->shadow_ruleset, &session->shadow, &session->parser, events);
+    modsecurity_stats.shadow_ns += ModsecurityTraceNow() - start;
+
+    if ((events & MODSECURITY_HTTP_EV_DONE) || verdict == MODSECURITY_ACTION_DENY)
+    {
+        ModsecurityShadowVerdict(verdict, shadow);
+        session->flow.flags &= ~MODSECURITY_SESSION_SHADOW;
+    }
+    else if (events & (MODSECURITY_HTTP_EV_ERROR | MODSECURITY_HTTP_EV_GAP))
+    {
+        session->flow.flags &= ~MODSECURITY_SESSION_SHADOW;
+    }
+
+    return verdict;
+}
+
+/* REMOTE_ADDR for the rules, the client being the sender of a request packet */
+static void ModsecurityRemoteAddr(SFSnortPacket *packet, char *text, modsecurity_buf_t *addr)
+{
+    sfip_ntop(GET_SRC_IP(packet), text, INET6_ADDRSTRLEN);
+    addr->data = (const uint8_t *) text;
+    addr->len = strlen(text);
+}
+
+/* One parser step, timed into the transaction's trace when tracing is on */
+static MODSECURITY_INLINE uint32_t ModsecurityParseStep(SFSnortPacket *packet, modsecurity_session_t *session,
+        const uint8_t *data, uint32_t len, uint32_t *events, const uint32_t path)
+{
+    modsecurity_http_parser_t *parser = &session->parser;
+    int idle = ModsecurityHttpParserIdle(parser);
+    int stage = MODSECURITY_STAGE_BODY;
+    uint64_t start;
+    uint32_t used;
+
+    if (!(path & MODSECURITY_PATH_TRACE))
+        return ModsecurityHttpParse(parser, data, len, events);
+
+    if (idle || parser->state == MODSECURITY_HTTP_STATE_HEADERS)
+        stage = MODSECURITY_STAGE_HEAD;
+
+    start = ModsecurityTraceNow();
+    used = ModsecurityHttpParse(parser, data, len, events);
+
+    if (idle && ((*events & MODSECURITY_HTTP_EV_HEADERS) || !ModsecurityHttpParserIdle(parser)))
+        ModsecurityTraceBegin(&session->trace, packet);
+
+    ModsecurityTraceStage(&session->trace, stage, ModsecurityTraceNow() - start);
+
+    return used;
+}
+
+/* Upload callback: alert on a file whose digest is on the bad list */
+static void ModsecurityUploadFile(void *context, const modsecurity_upload_file_t *file)
+{
+    modsecurity_upload_ctx_t *ctx = (modsecurity_upload_ctx_t *) context;
+
+    modsecurity_stats.upload_files++;
+
+    if (!ModsecurityHashesHas(ctx->config->upload_hashes, file->digest))
+        return;
+
+    modsecurity_stats.upload_bad++;
+    ctx->bad++;
+
+    _dpd.alertAdd(GENERATOR_SPP_MODSECURITY, ctx->config->upload_hash_sid, 1, 0, 3,
+            file->msg ? file->msg : MODSECURITY_UPLOAD_MSG, 0);
+}
+
+/* Files in a multipart request body, hashed as the body segments go by */
+static int ModsecurityInspectUpload(modsecurity_config_t *config, modsecurity_upload_t *upload,
+        const modsecurity_http_request_t *request, uint32_t events)
+{
+    modsecurity_upload_ctx_t ctx;
+
+    ctx.config = config;
+    ctx.bad = 0;
+
+    if (events & MODSECURITY_HTTP_EV_HEADERS)
+    {
+        ModsecurityUploadEnd(upload);
+        ModsecurityUploadStart(upload, &request->header);
+    }
+
+    if ((events & MODSECURITY_HTTP_EV_BODY) && upload->state != MODSECURITY_UPLOAD_OFF)
+        ModsecurityUploadData(upload, request->body.data, request->body.len, ModsecurityUploadFile, &ctx);
+
+    if (events & (MODSECURITY_HTTP_EV_DONE | MODSECURITY_HTTP_EV_ERROR | MODSECURITY_HTTP_EV_GAP))
+        ModsecurityUploadEnd(upload);
+
+    return ctx.bad ? MODSECURITY_ACTION_DENY : MODSECURITY_ACTION_PASS;
+}
+
+static MODSECURITY_INLINE void ModsecurityInspectRequest(SFSnortPacket *packet, modsecurity_config_t *config,
+        modsecurity_session_t *session, uint32_t len, const uint32_t path)
+{
+    const uint8_t *data = packet->payload;
+    uint32_t used, events, published = 0;
+    int verdict = MODSECURITY_ACTION_PASS;
+
+    if (session->remote_addr[0] == '\0')
+    {
+        ModsecurityRemoteAddr(packet, session->remote_addr, &session->tx.remote_addr);
+        session->shadow.remote_addr = session->tx.remote_addr;
+    }
+
+    /* A hole in front of this PDU ends whatever request was in progress */
+    if (packet->stream_session != NULL && (packet->flags & FLAG_REBUILT_STREAM)
+            && (_dpd.streamAPI->missing_in_reassembled(packet->stream_session,
+                    SSN_DIR_FROM_CLIENT) & SSN_MISSING_BEFORE))
+    {
+        events = ModsecurityHttpGap(&session->parser);
+        verdict = ModsecurityRules(config, session, events, path);
+
+        if (path & MODSECURITY_PATH_UPLOADS)
+            ModsecurityInspectUpload(config, &session->upload, &session->parser.request, events);
+
+        ModsecurityRequestEvents(config, session, events, path);
+
+        if (verdict == MODSECURITY_ACTION_DENY)
+        {
+            ModsecurityDeny(packet, config, &session->flow);
+            return;
+        }
+    }
+
+    while (len > 0)
+    {
+        used = ModsecurityParseStep(packet, session, data, len, &events, path);
+
+        if (path & MODSECURITY_PATH_PUBLISH)
+        {
+            ModsecurityHttpPublish(&session->parser, events & ~published);
+            published |= events;
+        }
+
+        verdict = ModsecurityRules(config, session, events, path);
+
+        if ((path & MODSECURITY_PATH_UPLOADS) && ModsecurityInspectUpload(config, &session->upload,
+                    &session->parser.request, events) == MODSECURITY_ACTION_DENY)
+            verdict = MODSECURITY_ACTION_DENY;
+
+        ModsecurityRequestEvents(config, session, events, path);
+
+        if (verdict == MODSECURITY_ACTION_DENY)
+        {
+            ModsecurityDeny(packet, config, &session->flow);
+            break;
+        }
+
+        if (used == 0)
+            break;
+
+        data += used;
+        len -= used;
+    }
+
+    ModsecurityHttpParserRetain(&session->parser);
+    ModsecurityTxRetain(&session->tx);
+    ModsecurityTxRetain(&session->shadow);
+
+    /*
+     * No response is coming, the request was the whole transaction: release
+     * the session, with the next packet when Snort's buffers point into it.
+     * One resyncing after a gap keeps its parser and only frees the arena.
+     */
+    if (config->client_only && ModsecurityHttpParserIdle(&session->parser))
+    {
+        if (packet->stream_session == NULL || session->parser.state != MODSECURITY_HTTP_STATE_IDLE)
+        {
+            if (!published)
+                ModsecurityArenaFree(&session->arena);
+        }
+        else if (published)
+        {
+            modsecurity_release.ssn = packet->stream_session;
+            modsecurity_release.session = session;
+        }
+        else
+        {
+            ModsecurityRelease(packet->stream_session, session);
+        }
+    }
+}
+
+/* Both phases at once on a whole request */
+static int ModsecurityEvalRequest(modsecurity_config_t *config, const modsecurity_ruleset_t *ruleset,
+        const modsecurity_http_request_t *request, const modsecurity_buf_t *remote_addr,
+        modsecurity_arena_t *arena, uint32_t flags)
+{
+    modsecurity_tx_t tx;
+
+    memset(&tx, 0, sizeof(tx));
+    tx.flags = flags;
+    tx.body_limit = config->request_body_limit;
+    tx.scratch = modsecurity_scratch;
+    ModsecurityTxInit(&tx, request, arena);
+    tx.on_match = (flags & MODSECURITY_TX_SHADOW) ? NULL : ModsecurityAlert;
+    tx.body = request->body;
+    tx.remote_addr = *remote_addr;
+
+    if (tx.body.len > config->request_body_limit)
+        tx.body.len = config->request_body_limit;
+
+    if (!(flags & MODSECURITY_TX_SHADOW))
+        tx.profiles = config->profiles;
+
+    return ModsecurityEngineRequest(ruleset, &tx);
+}
+
+/* http_inspect hands us whole requests, live and shadow rules run back to back */
+static MODSECURITY_INLINE int ModsecurityInspectBuffers(SFSnortPacket *packet, modsecurity_config_t *config,
+        const modsecurity_http_request_t *request, const uint32_t path)
+{
+    static modsecurity_arena_t arena;
+    char text[INET6_ADDRSTRLEN];
+    modsecurity_buf_t remote_addr;
+    int verdict = MODSECURITY_ACTION_PASS, shadow;
+    int sampled = (path & MODSECURITY_PATH_SHADOW) && ModsecurityShadowSample(config);
+    uint32_t size = MODSECURITY_ARENA_SIZE
+        + ModsecurityTxArenaSize(config->ruleset, config->request_body_limit)
+        + ModsecurityTxArenaSize(config->shadow_ruleset, config->request_body_limit);
+    uint64_t start = 0;
+
+    /* Policies and reloads may need more than the arena was made for, it only grows */
+    if (size > arena.size)
+    {
+        ModsecurityArenaFree(&arena);
+        ModsecurityArenaInit(&arena, size);
+    }
+
+    ModsecurityArenaReset(&arena);
+    ModsecurityRemoteAddr(packet, text, &remote_addr);
+
+    if (sampled)
+        start = ModsecurityTraceNow();
+
+    if (config->ruleset != NULL)
+        verdict = ModsecurityEvalRequest(config, config->ruleset, request, &remote_addr, &arena, 0);
+
+    if (!sampled)
+        return verdict;
+
+    modsecurity_stats.shadow_live_ns += ModsecurityTraceNow() - start;
+
+    start = ModsecurityTraceNow();
+    shadow = ModsecurityEvalRequest(config, config->shadow_ruleset, request, &remote_addr,
+            &arena, MODSECURITY_TX_SHADOW);
+    modsecurity_stats.shadow_ns += ModsecurityTraceNow() - start;
+
+    ModsecurityShadowVerdict(verdict, shadow);
+
+    return verdict;
+}
+
+/*
+ * Count this PDU against the flow depth of its direction and return how
+ * many of its bytes are still to be inspected. Once the depth is reached
+ * the direction is handed back to stream: reassembly is turned off, so the
+ * rest of a large transfer costs neither reassembly nor a parser call, and
+ * later raw segments are dropped by the early check in ModsecurityProcess.
+ */
+static uint32_t ModsecurityFlowDepth(SFSnortPacket *packet, modsecurity_config_t *config,
+        modsecurity_flow_t *flow, int dir)
+{
+    uint32_t depth = config->flow_depth[dir];
+    uint32_t len = packet->payload_size;
+
+    if (depth == 0 || packet->stream_session == NULL)
+        return len;
+
+    if (len < depth - flow->inspected[dir])
+    {
+        flow->inspected[dir] += len;
+        return len;
+    }
+
+    len = depth - flow->inspected[dir];
+    flow->inspected[dir] = depth;
+    flow->flags |= MODSECURITY_SESSION_DEPTH_DONE(dir);
+
+    _dpd.streamAPI->set_reassembly(packet->stream_session, STREAM_FLPOLICY_IGNORE,
+            dir == MODSECURITY_DIR_CLIENT ? SSN_DIR_FROM_CLIENT : SSN_DIR_FROM_SERVER,
+            STREAM_FLPOLICY_SET_ABSOLUTE);
+
+    modsecurity_stats.depth_reached[dir]++;
+
+    return len;
+}
+
+/* Response content callback: heads as they are, bodies decoded, NULL where either ends */
+static void ModsecurityResponseContent(void *context, const uint8_t *data, uint32_t len)
+{
+    modsecurity_response_ctx_t *ctx = (modsecurity_response_ctx_t *) context;
+
+    if (data == NULL)
+        ctx->found += ModsecurityPanFlush(ctx->pan);
+    else
+        ctx->found += ModsecurityPanScan(ctx->pan, data, len);
+}
+
+/*
+ * Responses are scanned for card numbers as they come, heads included and
+ * bodies after chunking and content coding are undone. A number split
+ * across packets is carried over in the session.
+ */
+static void ModsecurityInspectResponse(SFSnortPacket *packet, modsecurity_config_t *config,
+        modsecurity_session_t *session, uint32_t len)
+{
+    modsecurity_response_ctx_t ctx;
+
+    ctx.pan = &session->pan;
+    ctx.found = 0;
+
+    ModsecurityResponseParse(&session->response, &session->response_arena, &config->decompress,
+            packet->payload, len, ModsecurityResponseContent, &ctx);
+
+    if (packet->stream_session == NULL)
+        ctx.found += ModsecurityPanFlush(&session->pan);
+
+    if (ctx.found == 0)
+        return;
+
+    modsecurity_stats.response_pans += ctx.found;
+    _dpd.alertAdd(GENERATOR_SPP_MODSECURITY, config->response_pan_sid, 1, 0, 3, MODSECURITY_PAN_MSG, 0);
+}
+
+/*
+ * The packet path, built once per MODSECURITY_PATH_* combination with path
+ * a constant, so what a configuration does not use is compiled out rather
+ * than tested on every packet. ModsecurityPath picks the one to add.
+ */
+static MODSECURITY_INLINE void ModsecurityProcessPath(void *pkt, void *context, const uint32_t path)
+{
+    SFSnortPacket *packet = (SFSnortPacket *) pkt;
+    modsecurity_config_t *config;
+    modsecurity_session_t *session = NULL;
+    modsecurity_flow_t *flow = NULL;
+    modsecurity_http_request_t request;
+    static modsecurity_upload_t upload;     /* http_inspect hands over whole bodies */
+    uint32_t len;
+    int dir;
+    PROFILE_VARS;
+
+    ModsecurityReleasePending();
+
+    sfPolicyUserPolicySet(modsecurity_context_id, _dpd.getNapRuntimePolicy());
+    config = (modsecurity_config_t *) sfPolicyUserDataGetCurrent(modsecurity_context_id);
+
+    if(!IsTCP(packet)) return;
+
+    if (config == NULL || packet->payload_size == 0)
+        return;
+
+    if (packet->src_port == config->ports)
+        dir = MODSECURITY_DIR_SERVER;
+    else if (packet->dst_port == config->ports)
+        dir = MODSECURITY_DIR_CLIENT;
+    else
+        return;
+
+    /* Client only: never look up or allocate anything for responses */
+    if (dir == MODSECURITY_DIR_SERVER && config->client_only)
+        return;
+
+    PREPROC_PROFILE_START(modsecurityPerfStats);
+
+    if (packet->stream_session != NULL)
+        flow = (modsecurity_flow_t *) _dpd.sessionAPI->get_application_data(packet->stream_session, PP_MODSECURITY);
+
+    if (flow != NULL && (flow->flags & MODSECURITY_SESSION_BLOCKED))
+    {
+        PREPROC_PROFILE_END(modsecurityPerfStats);
+        return;
+    }
+
+    if (flow != NULL && (flow->flags & MODSECURITY_SESSION_DEPTH_DONE(dir)))
+    {
+        modsecurity_stats.depth_skipped++;
+
+        PREPROC_PROFILE_END(modsecurityPerfStats);
+        return;
+    }
+
+    if (!ModsecurityInspectable(packet))
+    {
+        modsecurity_stats.raw_skipped++;
+
+        PREPROC_PROFILE_END(modsecurityPerfStats);
+        return;
+    }
+
+    if (PacketHasPAFPayload(packet))
+        modsecurity_stats.pdus++;
+    else
+        modsecurity_stats.raw_segments++;
+
+    len = packet->payload_size;
+
+    if ((path & MODSECURITY_PATH_DEPTH) && config->flow_depth[dir] && packet->stream_session != NULL)
+    {
+        if (flow == NULL)
+        {
+            if ((session = ModsecurityGetSession(packet, config)) == NULL)
+            {
+                PREPROC_PROFILE_END(modsecurityPerfStats);
+                return;
+            }
+
+            flow = &session->flow;
+        }
+
+        len = ModsecurityFlowDepth(packet, config, flow, dir);
+    }
+
+    if (flow != NULL && !(flow->flags & MODSECURITY_SESSION_RELEASED))
+        session = (modsecurity_session_t *) flow;
+
+    modsecurity_stats.bytes[dir] += len;
+
+    if (config->http_inspect_buffers)
+    {
+        if (dir == MODSECURITY_DIR_CLIENT && ModsecurityHttpFromInspect(&request))
+        {
+            modsecurity_stats.http_inspect_requests++;
+
+            if ((path & MODSECURITY_PATH_RESPONSES) && session == NULL
+                    && (session = ModsecurityGetSession(packet, config)) != NULL)
+                flow = &session->flow;
+
+            if ((path & MODSECURITY_PATH_RESPONSES) && session != NULL)
+                ModsecurityResponseRequest(&session->response, request.method.data, request.method.len);
+
+            if ((config->ruleset != NULL || config->shadow_ruleset != NULL)
+                    && ModsecurityInspectBuffers(packet, config, &request, path) == MODSECURITY_ACTION_DENY)
+                ModsecurityDeny(packet, config, flow);
+            else if ((path & MODSECURITY_PATH_UPLOADS) && ModsecurityInspectUpload(config, &upload, &request,
+                        MODSECURITY_HTTP_EV_HEADERS | MODSECURITY_HTTP_EV_BODY | MODSECURITY_HTTP_EV_DONE)
+                    == MODSECURITY_ACTION_DENY)
+                ModsecurityDeny(packet, config, flow);
+        }
+    }
+    else if (dir == MODSECURITY_DIR_CLIENT)
+    {
+        if (session == NULL)
+            session = ModsecurityGetSession(packet, config);
+
+        if (session != NULL)
+            ModsecurityInspectRequest(packet, config, session, len, path);
+    }
+
+    if ((path & MODSECURITY_PATH_RESPONSES) && dir == MODSECURITY_DIR_SERVER)
+    {
+        if (session == NULL)
+            session = ModsecurityGetSession(packet, config);
+
+        if (session != NULL)
+            ModsecurityInspectResponse(packet, config, session, len);
+    }
+
+    DEBUG_WRAP(DebugMessage(DEBUG_PLUGIN, "Modsecurity: %u bytes from %s\n",
+                len, dir == MODSECURITY_DIR_CLIENT ? "client" : "server"););
+
+    PREPROC_PROFILE_END(modsecurityPerfStats);
+}
+
+#define MODSECURITY_PROCESS(path) \
+    static void ModsecurityProcess##path(void *pkt, void *context) \
+    { \
+        ModsecurityProcessPath(pkt, context, path); \
+    }
+
+MODSECURITY_PROCESS(0)
+MODSECURITY_PROCESS(1)
+MODSECURITY_PROCESS(2)
+MODSECURITY_PROCESS(3)
+MODSECURITY_PROCESS(4)
+MODSECURITY_PROCESS(5)
+MODSECURITY_PROCESS(6)
+MODSECURITY_PROCESS(7)
+MODSECURITY_PROCESS(8)
+MODSECURITY_PROCESS(9)
+MODSECURITY_PROCESS(10)
+MODSECURITY_PROCESS(11)
+MODSECURITY_PROCESS(12)
+MODSECURITY_PROCESS(13)
+MODSECURITY_PROCESS(14)
+MODSECURITY_PROCESS(15)
+MODSECURITY_PROCESS(16)
+MODSECURITY_PROCESS(17)
+MODSECURITY_PROCESS(18)
+MODSECURITY_PROCESS(19)
+MODSECURITY_PROCESS(20)
+MODSECURITY_PROCESS(21)
+MODSECURITY_PROCESS(22)
+MODSECURITY_PROCESS(23)
+MODSECURITY_PROCESS(24)
+MODSECURITY_PROCESS(25)
+MODSECURITY_PROCESS(26)
+MODSECURITY_PROCESS(27)
+MODSECURITY_PROCESS(28)
+MODSECURITY_PROCESS(29)
+MODSECURITY_PROCESS(30)
+MODSECURITY_PROCESS(31)
+MODSECURITY_PROCESS(32)
+MODSECURITY_PROCESS(33)
+MODSECURITY_PROCESS(34)
+MODSECURITY_PROCESS(35)
+MODSECURITY_PROCESS(36)
+MODSECURITY_PROCESS(37)
+MODSECURITY_PROCESS(38)
+MODSECURITY_PROCESS(39)
+MODSECURITY_PROCESS(40)
+MODSECURITY_PROCESS(41)
+MODSECURITY_PROCESS(42)
+MODSECURITY_PROCESS(43)
+MODSECURITY_PROCESS(44)
+MODSECURITY_PROCESS(45)
+MODSECURITY_PROCESS(46)
+MODSECURITY_PROCESS(47)
+MODSECURITY_PROCESS(48)
+MODSECURITY_PROCESS(49)
+MODSECURITY_PROCESS(50)
+MODSECURITY_PROCESS(51)
+MODSECURITY_PROCESS(52)
+MODSECURITY_PROCESS(53)
+MODSECURITY_PROCESS(54)
+MODSECURITY_PROCESS(55)
+MODSECURITY_PROCESS(56)
+MODSECURITY_PROCESS(57)
+MODSECURITY_PROCESS(58)
+MODSECURITY_PROCESS(59)
+MODSECURITY_PROCESS(60)
+MODSECURITY_PROCESS(61)
+MODSECURITY_PROCESS(62)
+MODSECURITY_PROCESS(63)
+
+/* Indexed by MODSECURITY_PATH_* */
+static void (* const modsecurity_process[MODSECURITY_PATH_VARIANTS])(void *, void *) =
+{
+    ModsecurityProcess0, ModsecurityProcess1, ModsecurityProcess2, ModsecurityProcess3,
+    ModsecurityProcess4, ModsecurityProcess5, ModsecurityProcess6, ModsecurityProcess7,
+    ModsecurityProcess8, ModsecurityProcess9, ModsecurityProcess10, ModsecurityProcess11,
+    ModsecurityProcess12, ModsecurityProcess13, ModsecurityProcess14, ModsecurityProcess15,
+    ModsecurityProcess16, ModsecurityProcess17, ModsecurityProcess18, ModsecurityProcess19,
+    ModsecurityProcess20, ModsecurityProcess21, ModsecurityProcess22, ModsecurityProcess23,
+    ModsecurityProcess24, ModsecurityProcess25, ModsecurityProcess26, ModsecurityProcess27,
+    ModsecurityProcess28, ModsecurityProcess29, ModsecurityProcess30, ModsecurityProcess31,
+    ModsecurityProcess32, ModsecurityProcess33, ModsecurityProcess34, ModsecurityProcess35,
+    ModsecurityProcess36, ModsecurityProcess37, ModsecurityProcess38, ModsecurityProcess39,
+    ModsecurityProcess40, ModsecurityProcess41, ModsecurityProcess42, ModsecurityProcess43,
+    ModsecurityProcess44, ModsecurityProcess45, ModsecurityProcess46, ModsecurityProcess47,
+    ModsecurityProcess48, ModsecurityProcess49, ModsecurityProcess50, ModsecurityProcess51,
+    ModsecurityProcess52, ModsecurityProcess53, ModsecurityProcess54, ModsecurityProcess55,
+    ModsecurityProcess56, ModsecurityProcess57, ModsecurityProcess58, ModsecurityProcess59,
+    ModsecurityProcess60, ModsecurityProcess61, ModsecurityProcess62, ModsecurityProcess63
+};
+
+/* The packet path a configuration needs, see ModsecurityProcessPath */
+static uint32_t ModsecurityPath(const modsecurity_config_t *config)
+{
+    uint32_t path = 0;
+
+    if (config->trace_threshold)
+        path |= MODSECURITY_PATH_TRACE;
+
+    if (config->shadow_ruleset != NULL)
+        path |= MODSECURITY_PATH_SHADOW;
+
+    if (config->response_pan_sid)
+        path |= MODSECURITY_PATH_RESPONSES;
+
+    if (config->upload_hashes != NULL)
+        path |= MODSECURITY_PATH_UPLOADS;
+
+    if (config->publish_http_buffers)
+        path |= MODSECURITY_PATH_PUBLISH;
+
+    if (config->flow_depth[MODSECURITY_DIR_CLIENT] || config->flow_depth[MODSECURITY_DIR_SERVER])
+        path |= MODSECURITY_PATH_DEPTH;
+
+    return path;
+}
+
+/*
+ * Buffers from http_inspect are only there once it has seen the packet, so
+ * in that mode we have to run after it instead of at transport priority.
+ */
+static void ModsecurityAddPreproc(struct _SnortConfig *sc, modsecurity_config_t *config)
+{
+    uint16_t priority = PRIORITY_TRANSPORT;
+
+    if (config->http_inspect_buffers)
+        priority = PRIORITY_APPLICATION + 1;
+
+    _dpd.addPreproc(sc, modsecurity_process[ModsecurityPath(config)], priority, PP_MODSECURITY,
+            PROTO_BIT__TCP | PROTO_BIT__UDP);
+}
+
+/* Shadow rules next to the live ones, and the shadow rules that cost the most */
+static void ModsecurityPrintShadowStats(void)
+{
+    const modsecurity_ruleset_t *ruleset = NULL;
+    const modsecurity_config_t *config = NULL;
+    const modsecurity_rule_stats_t *stats;
+    uint32_t top[MODSECURITY_SHADOW_TOP_RULES];
+    uint32_t ntop = 0, i, j, k;
+
+    _dpd.logMsg("  Shadow transactions sampled:     " STDu64 "\n", modsecurity_stats.shadow_sampled);
+    _dpd.logMsg("  Live rules time on samples:      " STDu64 " ns\n", modsecurity_stats.shadow_live_ns);
+    _dpd.logMsg("  Shadow rules time on samples:    " STDu64 " ns\n", modsecurity_stats.shadow_ns);
+    _dpd.logMsg("  Denied by live rules only:       " STDu64 "\n", modsecurity_stats.shadow_live_only);
+    _dpd.logMsg("  Denied by shadow rules only:     " STDu64 "\n", modsecurity_stats.shadow_only);
+
+    if (modsecurity_context_id != NULL)
+        config = (const modsecurity_config_t *) sfPolicyUserDataGetCurrent(modsecurity_context_id);
+
+    /* Kept by the packet thread's scratch, this runs between its packets */
+    if (config == NULL || (ruleset = config->shadow_ruleset) == NULL
+            || (stats = ModsecurityEngineRuleStats(modsecurity_scratch, ruleset)) == NULL)
+        return;
+
+    /* Insertion into a short sorted list, it only runs when stats are printed */
+    for (i = 0; i < ruleset->count; i++)
+    {
+        if (stats[i].evals == 0)
+            continue;
+
+        for (j = 0; j < ntop && stats[top[j]].ns >= stats[i].ns; j++);
+
+        if (j == MODSECURITY_SHADOW_TOP_RULES)
+            continue;
+
+        if (ntop < MODSECURITY_SHADOW_TOP_RULES)
+            ntop++;
+
+        for (k = ntop - 1; k > j; k--)
+            top[k] = top[k - 1];
+
+        top[j] = i;
+    }
+
+    for (i = 0; i < ntop; i++)
+    {
+        _dpd.logMsg("  Shadow rule %-10u " STDu64 " ns in " STDu64 " evals, " STDu64 " matches\n",
+                ruleset->rules[top[i]].id, stats[top[i]].ns, stats[top[i]].evals, stats[top[i]].matches);
+    }
+}
+
+static void ModsecurityPrintStats(int exiting)
+{
+    _dpd.logMsg("Modsecurity Preprocessor Statistics\n");
+    _dpd.logMsg("  Reassembled PDUs inspected:      " STDu64 "\n", modsecurity_stats.pdus);
+    _dpd.logMsg("  Raw segments inspected:          " STDu64 "\n", modsecurity_stats.raw_segments);
+    _dpd.logMsg("  Raw segments left to reassembly: " STDu64 "\n", modsecurity_stats.raw_skipped);
+    _dpd.logMsg("  Client bytes inspected:          " STDu64 "\n", modsecurity_stats.bytes[MODSECURITY_DIR_CLIENT]);
+    _dpd.logMsg("  Server bytes inspected:          " STDu64 "\n", modsecurity_stats.bytes[MODSECURITY_DIR_SERVER]);
+    _dpd.logMsg("  Requests from http_inspect:      " STDu64 "\n", modsecurity_stats.http_inspect_requests);
+    _dpd.logMsg("  Requests parsed:                 " STDu64 "\n", modsecurity_stats.requests);
+    _dpd.logMsg("  Request parse errors:            " STDu64 "\n", modsecurity_stats.parse_errors);
+    _dpd.logMsg("  Requests cut short by a gap:     " STDu64 "\n", modsecurity_stats.partial_requests);
+    _dpd.logMsg("  Requests aborted by a gap:       " STDu64 "\n", modsecurity_stats.aborted_requests);
+    _dpd.logMsg("  Slow transactions traced:        " STDu64 "\n", modsecurity_trace_stats.logged);
+    _dpd.logMsg("  Slow transactions not traced:    " STDu64 "\n", modsecurity_trace_stats.dropped);
+    _dpd.logMsg("  Client flow depth reached:       " STDu64 "\n", modsecurity_stats.depth_reached[MODSECURITY_DIR_CLIENT]);
+    _dpd.logMsg("  Server flow depth reached:       " STDu64 "\n", modsecurity_stats.depth_reached[MODSECURITY_DIR_SERVER]);
+    _dpd.logMsg("  Packets past flow depth:         " STDu64 "\n", modsecurity_stats.depth_skipped);
+    _dpd.logMsg("  Rule matches:                    " STDu64 "\n", modsecurity_engine_stats.matches);
+    _dpd.logMsg("  Requests denied:                 " STDu64 "\n", modsecurity_engine_stats.denied);
+    _dpd.logMsg("  Flows blocked:                   " STDu64 "\n", modsecurity_stats.blocked);
+    _dpd.logMsg("  Card numbers in responses:       " STDu64 "\n", modsecurity_stats.response_pans);
+    _dpd.logMsg("  Response bodies gzip:            " STDu64 "\n", modsecurity_decode_stats.bodies[MODSECURITY_DECODE_GZIP]);
+    _dpd.logMsg("  Response bodies deflate:         " STDu64 "\n", modsecurity_decode_stats.bodies[MODSECURITY_DECODE_DEFLATE]);
+    _dpd.logMsg("  Response bodies br:              " STDu64 "\n", modsecurity_decode_stats.bodies[MODSECURITY_DECODE_BROTLI]);
+    _dpd.logMsg("  Response bodies zstd:            " STDu64 "\n", modsecurity_decode_stats.bodies[MODSECURITY_DECODE_ZSTD]);
+    _dpd.logMsg("  Decompress depth reached:        " STDu64 "\n", modsecurity_decode_stats.depth_reached);
+    _dpd.logMsg("  Decompress ratio exceeded:       " STDu64 "\n", modsecurity_decode_stats.ratio_exceeded);
+    _dpd.logMsg("  Decompress errors:               " STDu64 "\n", modsecurity_decode_stats.errors);
+    _dpd.logMsg("  Uploaded files hashed:           " STDu64 "\n", modsecurity_stats.upload_files);
+    _dpd.logMsg("  Known bad uploads:               " STDu64 "\n", modsecurity_stats.upload_bad);
+    _dpd.logMsg("  PCRE match limit hits:           " STDu64 "\n", modsecurity_engine_stats.rx_limit_hits);
+    _dpd.logMsg("  DFA matcher fallbacks:           " STDu64 "\n", modsecurity_engine_stats.rx_dfa_fallbacks);
+    _dpd.logMsg("  Values skipped by prefilter:     " STDu64 "\n", modsecurity_engine_stats.prefiltered);
+    _dpd.logMsg("  Safe values skipped:             " STDu64 "\n", modsecurity_engine_stats.safe_skipped);
+    _dpd.logMsg("  Forms cut short:                 " STDu64 "\n", modsecurity_engine_stats.forms_truncated);
+    _dpd.logMsg("  Regex DFA states built:          " STDu64 "\n", modsecurity_regex_stats.states);
+    _dpd.logMsg("  Regex DFA cache flushes:         " STDu64 "\n", modsecurity_regex_stats.flushes);
+    _dpd.logMsg("  Regex NFA fallbacks:             " STDu64 "\n", modsecurity_regex_stats.nfa_fallbacks);
+
+    if (modsecurity_profile_stats.learned)
+    {
+        _dpd.logMsg("  Profiled clean requests:         " STDu64 "\n", modsecurity_profile_stats.learned);
+        _dpd.logMsg("  Requests on the fast path:       " STDu64 "\n", modsecurity_profile_stats.fast);
+        _dpd.logMsg("  Requests fitting, learning only: " STDu64 "\n", modsecurity_profile_stats.would_fit);
+        _dpd.logMsg("  Requests not fitting a profile:  " STDu64 "\n", modsecurity_profile_stats.misfits);
+        _dpd.logMsg("  Endpoint profiles evicted:       " STDu64 "\n", modsecurity_profile_stats.evicted);
+    }
+
+    if (modsecurity_stats.shadow_sampled)
+        ModsecurityPrintShadowStats();
+}
+
+#ifdef SNORT_RELOAD
+static void ModsecurityReload(struct _SnortConfig *sc, char *args, void **new_config)
+{
+    tSfPolicyUserContextId modsecurity_swap_config = (tSfPolicyUserContextId) *new_config;
+    modsecurity_config_t *config, *live = NULL;
+    tSfPolicyId policy_id = _dpd.getParserPolicy(sc);
+
+    _dpd.logMsg("Modsecurity dynamic preprocessor configuration\n");
+
+    if (modsecurity_context_id != NULL)
+        live = (modsecurity_config_t *) sfPolicyUserDataGet(modsecurity_context_id, policy_id);
+
+    /* Called once per policy, they all go into the same context */
+    if (modsecurity_swap_config == NULL)
+    {
+        modsecurity_swap_config = sfPolicyConfigCreate();
+
+        if (modsecurity_swap_config == NULL)
+            DynamicPreprocessorFatalMessage("Could not allocate configuration struct\n");
+
+        *new_config = (void *) modsecurity_swap_config;
+    }
+
+    pthread_mutex_lock(&modsecurity_rules_lock);
+    config = ModsecurityParse(args, live);
+    pthread_mutex_unlock(&modsecurity_rules_lock);
+
+    sfPolicyUserPolicySet(modsecurity_swap_config, policy_id);
+    sfPolicyUserDataSetCurrent(modsecurity_swap_config, config);
+
+    ModsecurityStartTrace(config);
+
+    ModsecurityAddPreproc(sc, config);
+
+    DEBUG_WRAP(DebugMessage(DEBUG_PLUGIN, "Preprocessor: Modsecurity is initialized\n"););
+}
+
+/*
+ * Time the new rules against the ones running now on the canary corpus
+ * and refuse the reload if they are more than canary_factor slower. The
+ * rules lock keeps a control socket update from freeing the running rules
+ * while the canary uses them.
+ */
+static int ModsecurityCanaryPolicy(struct _SnortConfig *sc, tSfPolicyUserContextId context_id,
+        tSfPolicyId policy_id, void *data)
+{
+    modsecurity_config_t *config = (modsecurity_config_t *) data;
+    modsecurity_config_t *live = NULL;
+    const modsecurity_ruleset_t *running = NULL;
+    modsecurity_canary_result_t result;
+    int k, rval = MODSECURITY_SUCCESS;
+
+    if (config->canary_factor == 0 || config->ruleset == NULL)
+        return 0;
+
+    pthread_mutex_lock(&modsecurity_rules_lock);
+
+    if (modsecurity_context_id != NULL)
+        live = (modsecurity_config_t *) sfPolicyUserDataGet(modsecurity_context_id, policy_id);
+
+    if (live != NULL && (running = live->ruleset) != NULL)
+        rval = ModsecurityCanaryRun(running, config->ruleset, config->canary_time,
+                config->request_body_limit, &result);
+
+    pthread_mutex_unlock(&modsecurity_rules_lock);
+
+    if (running == NULL)
+        return 0;
+
+    if (rval != MODSECURITY_SUCCESS)
+    {
+        _dpd.errMsg("Modsecurity: Could not run the reload canary\n");
+        return MODSECURITY_FAILURE;
+    }
+
+    _dpd.logMsg("Modsecurity: canary %u runs, p50 %lluns -> %lluns, p99 %lluns -> %lluns, "
+            "%u verdicts changed\n", result.runs,
+            (unsigned long long) result.p50[0], (unsigned long long) result.p50[1],
+            (unsigned long long) result.p99[0], (unsigned long long) result.p99[1], result.differ);
+
+    for (k = 0; k < 2; k++)
+    {
+        uint64_t before = k ? result.p99[0] : result.p50[0];
+        uint64_t after = k ? result.p99[1] : result.p50[1];
+
+        if (after > before * config->canary_factor && after - before > MODSECURITY_CANARY_FLOOR_NS)
+        {
+            _dpd.errMsg("Modsecurity: %s rules are %.1fx slower at p%d (%lluns vs %lluns), "
+                    "over canary_factor %.2f\n", config->rules_file,
+                    before ? (double) after / before : 0.0, k ? 99 : 50,
+                    (unsigned long long) after, (unsigned long long) before, config->canary_factor);
+            return MODSECURITY_FAILURE;
+        }
+    }
+
+    return 0;
+}
+
+static int ModsecurityReloadVerify(struct _SnortConfig *sc, void *swap_config)
+{
+    if (!_dpd.isPreprocEnabled(sc, PP_STREAM))
+    {
+        _dpd.errMsg("Streaming & reassembly must be enabled for example preprocessor\n");
+        return MODSECURITY_FAILURE;
+    }
+
+    if (swap_config == NULL)
+        return MODSECURITY_SUCCESS;
+
+    /* The reloaded configuration, the running one was checked when it was loaded */
+    if (sfPolicyUserDataIterate(sc, (tSfPolicyUserContextId) swap_config, ModsecurityCheckPolicyConfig))
+        return MODSECURITY_FAILURE;
+
+    if (sfPolicyUserDataIterate(sc, (tSfPolicyUserContextId) swap_config, ModsecurityCanaryPolicy))
+        return MODSECURITY_FAILURE;
+
+    return MODSECURITY_SUCCESS;
+}
+
+static void *ModsecurityReloadSwap(struct _SnortConfig *sc, void *swap_config)
+{
+    tSfPolicyUserContextId modsecurity_context_swap_config = (tSfPolicyUserContextId) swap_config;
+    tSfPolicyUserContextId old_config = modsecurity_context_id;
+
+    if (modsecurity_context_swap_config == NULL) return NULL;
+
+    pthread_mutex_lock(&modsecurity_rules_lock);
+    modsecurity_context_id = modsecurity_context_swap_config;
+    pthread_mutex_unlock(&modsecurity_rules_lock);
+
+    return (void *) old_config;
+}
+
+static void ModsecurityReloadSwapFree(void *data)
+{
+    tSfPolicyUserContextId config = (tSfPolicyUserContextId) data;
+
+    if (data == NULL) return;
+
+    pthread_mutex_lock(&modsecurity_rules_lock);
+    sfPolicyUserDataFreeIterate(config, ModsecurityFreePolicyConfig);
+    sfPolicyConfigDelete(config);
+    pthread_mutex_unlock(&modsecurity_rules_lock);
+}
+#endif
+
+#ifdef CONTROL_SOCKET
+/*
+ * Rule updates over the control socket: the directives sent are applied
+ * on top of every policy's live rules (ModsecurityRulesUpdate). The next
+ * generations are built here, off the packet thread, then swapped in
+ * between two packets by ModsecurityControlSwap. Directives that only
+ * disable or enable rules flip them in place (ModsecurityRulesToggle)
+ * and leave nothing to swap.
+ */
+static int ModsecurityControlUpdate(uint16_t type, const uint8_t *data, uint32_t length, void **new_context,
+        char *status, int status_len)
+{
+    tSfPolicyUserContextId context_id;
+    modsecurity_update_t *updates = NULL, *update;
+    modsecurity_rules_changes_t changes, total;
+    modsecurity_config_t *config;
+    modsecurity_ruleset_t *ruleset;
+    uint64_t start = ModsecurityTraceNow();
+    tSfPolicyId policy_id;
+    int toggled = 0, rc;
+    char error[256];
+
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&modsecurity_rules_lock);
+    context_id = modsecurity_context_id;
+
+    for (policy_id = 0; context_id != NULL && policy_id < context_id->numAllocatedPolicies; policy_id++)
+    {
+        config = (modsecurity_config_t *) sfPolicyUserDataGet(context_id, policy_id);
+
+        if (config == NULL || config->ruleset == NULL)
+            continue;
+
+        ruleset = NULL;
+
+        if ((rc = ModsecurityRulesToggle(config->ruleset, "control socket", (const char *) data, length,
+                        &changes, error, sizeof(error))) == 0)
+            ruleset = ModsecurityRulesUpdate(config->ruleset, "control socket", (const char *) data, length,
+                    &changes, error, sizeof(error));
+
+        if (rc == MODSECURITY_FAILURE || (rc == 0 && ruleset == NULL))
+        {
+            pthread_mutex_unlock(&modsecurity_rules_lock);
+            snprintf(status, status_len, "Modsecurity: %s", error);
+            ModsecurityControlFree(type, updates, NULL, NULL);
+            return -1;
+        }
+
+        total.added += changes.added;
+        total.replaced += changes.replaced;
+        total.removed += changes.removed;
+        total.disabled += changes.disabled;
+        total.enabled += changes.enabled;
+
+        if (ruleset == NULL)
+        {
+            toggled = 1;
+            continue;
+        }
+
+        if (config->safe_values)
+            ModsecurityEngineSafe(ruleset, &config->safe_charset);
+
+        if ((update = (modsecurity_update_t *) calloc(1, sizeof(*update))) == NULL)
+            DynamicPreprocessorFatalMessage("Could not allocate configuration struct.\n");
+
+        update->policy_id = policy_id;
+        update->base = config->ruleset;
+        update->ruleset = ruleset;
+        update->next = updates;
+        updates = update;
+    }
+
+    pthread_mutex_unlock(&modsecurity_rules_lock);
+
+    if (updates == NULL && !toggled)
+    {
+        snprintf(status, status_len, "Modsecurity: no rules to update");
+        return -1;
+    }
+
+    snprintf(status, status_len, "Modsecurity: rules updated, %u added, %u replaced, %u removed, "
+            "%u disabled, %u enabled in %u us", total.added, total.replaced, total.removed, total.disabled,
+            total.enabled, (uint32_t) ((ModsecurityTraceNow() - start) / 1000));
+    _dpd.logMsg("%s\n", status);
+
+    *new_context = updates;
+
+    return 0;
+}
+
+/*
+ * On the packet thread, between packets: nothing is inspecting with the
+ * rules swapped out. Reloads, canaries and other updates read the live
+ * rules from their own threads, so the swap takes their lock.
+ */
+static int ModsecurityControlSwap(uint16_t type, void *new_context, void **old_context)
+{
+    modsecurity_update_t *update;
+    modsecurity_ruleset_t *ruleset;
+    modsecurity_config_t *config;
+
+    pthread_mutex_lock(&modsecurity_rules_lock);
+
+    for (update = (modsecurity_update_t *) new_context; update != NULL; update = update->next)
+    {
+        if (modsecurity_context_id == NULL)
+            break;
+
+        config = (modsecurity_config_t *) sfPolicyUserDataGet(modsecurity_context_id, update->policy_id);
+
+        /* A reload got in first, what was built on the rules it replaced goes */
+        if (config == NULL || config->ruleset != update->base)
+            continue;
+
+        ruleset = config->ruleset;
+        config->ruleset = update->ruleset;
+        update->ruleset = ruleset;
+    }
+
+    pthread_mutex_unlock(&modsecurity_rules_lock);
+
+    *old_context = new_context;
+
+    return 0;
+}
+
+/* The replaced generations, or the ones never swapped in */
+static void ModsecurityControlFree(uint16_t type, void *old_context, struct _THREAD_ELEMENT *te,
+        ControlDataSendFunc send)
+{
+    modsecurity_update_t *update = (modsecurity_update_t *) old_context, *next;
+
+    pthread_mutex_lock(&modsecurity_rules_lock);
+
+    for (; update != NULL; update = next)
+    {
+        next = update->next;
+        ModsecurityRulesFree(update->ruleset);
+        free(update);
+    }
+
+    pthread_mutex_unlock(&modsecurity_rules_lock);
 }
 #endif
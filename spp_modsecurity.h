@@ -1,22 +1,208 @@
 #ifndef SPP_MODSECURITY_H
 #define SPP_MODSECURITY_H
 
+#include <netinet/in.h>
+
 #include "sf_types.h"
 #include "sfPolicy.h"
 #include "sfPolicyUserData.h"
+#include "modsecurity_arena.h"
+#include "modsecurity_http.h"
+#include "modsecurity_trace.h"
+#include "modsecurity_rules.h"
+#include "modsecurity_engine.h"
+#include "modsecurity_pan.h"
+#include "modsecurity_upload.h"
+#include "modsecurity_response.h"
 
 #define MAX_PORTS 65536
+
+/* Preprocessor id used for registration and session data */
+#ifndef PP_MODSECURITY
+#define PP_MODSECURITY 60
+#endif
 extern DynamicPreprocessorData _dpd;
 
+/* Generator id of rule match alerts, the sid is the rule id */
+#ifndef GENERATOR_SPP_MODSECURITY
+#define GENERATOR_SPP_MODSECURITY 155
+#endif
+
+/* Control socket command carrying rule directives to apply on top of the live rules */
+#ifndef CS_TYPE_MODSECURITY_RULES
+#define CS_TYPE_MODSECURITY_RULES 0x1F00
+#endif
+
+/* Values made only of these are what most rules never match */
+#define MODSECURITY_SAFE_CHARSET "A-Za-z0-9_.-"
+
+#define MODSECURITY_PAN_MSG "(spp_modsecurity) card number in response"
+#define MODSECURITY_UPLOAD_MSG "(spp_modsecurity) known bad upload"
+
 /* NOTE: Snort can't strip ssl */
 #define MODSECURITY_PORT 80
 
+#define CONF_SEPARATORS " \t\n\r,"
+
+/* Per flow arena: buffered request head plus decoded values */
+#define MODSECURITY_ARENA_SIZE (2 * MODSECURITY_HTTP_MAX_HEADER)
+
+/* Default shadow sampling, one transaction in this many */
+#define MODSECURITY_SHADOW_SAMPLE 100
+
+/* Shadow rules reported by cost in the statistics */
+#define MODSECURITY_SHADOW_TOP_RULES 10
+
+/*
+ * Collections split out of a request for the rules, on top of the above.
+ * Each transaction also takes request_body_limit for the body, and more
+ * for the variables only some rulesets use (ModsecurityTxArenaSize).
+ */
+#define MODSECURITY_ARENA_TX \
+    ((MODSECURITY_MAX_ARGS * 2 + MODSECURITY_MAX_HEADERS) * sizeof(modsecurity_pair_t))
+
+/* ARGS_POST, on top of request_body_limit decoded bytes */
+#define MODSECURITY_ARENA_FORM \
+    (MODSECURITY_MAX_ARGS * sizeof(modsecurity_pair_t) + MODSECURITY_FORM_CARRY)
+
+/*
+ * Packet path variants: the features that add work to the packets of a
+ * configuration using them, fixed when the preprocessor is added for it
+ * (ModsecurityPath), at init and on every reload. Still tested per packet:
+ * http_inspect_buffers and client_only, which choose which part of the
+ * path runs rather than add to it, preprocessor profiling, which Snort's
+ * own macros test so it follows profiling being turned on and off, and
+ * inline mode, only looked at when a flow is blocked.
+ */
+#define MODSECURITY_PATH_TRACE      0x01    /* slow transaction trace */
+#define MODSECURITY_PATH_SHADOW     0x02    /* shadow rules sampling */
+#define MODSECURITY_PATH_RESPONSES  0x04    /* response inspection */
+#define MODSECURITY_PATH_UPLOADS    0x08    /* upload hashing */
+#define MODSECURITY_PATH_PUBLISH    0x10    /* publish Snort's HTTP buffers */
+#define MODSECURITY_PATH_DEPTH      0x20    /* a flow depth in either direction */
+#define MODSECURITY_PATH_VARIANTS   64
+
+/* Inlined into each packet path variant, whatever the optimization level */
+#define MODSECURITY_INLINE inline __attribute__((always_inline))
+
 /* Preprocessor configuration */
 typedef struct _modsecurity_config
 {
     int ports;
+    int http_inspect_buffers;   /* read requests from http_inspect */
+    int publish_http_buffers;   /* fill Snort's HTTP buffers from our parser */
+    uint32_t flow_depth[2];     /* bytes inspected per direction, 0 = all */
+    int client_only;            /* asymmetric tap, no responses expected */
+    uint32_t trace_threshold;   /* trace transactions slower than this, usec */
+    uint32_t trace_ring;        /* slow transaction records buffered */
+    char *trace_file;
+    char *rules_file;
+    modsecurity_ruleset_t *ruleset;     /* NULL without rules */
+    uint32_t request_body_limit;        /* body bytes phase 2 rules see */
+    uint32_t pcre_match_limit;
+    uint32_t regex_cache_size;  /* lazy DFA bytes per @rx, 0 = PCRE only */
+    int safe_values;            /* skip rules that cannot match safe_charset values */
+    modsecurity_charset_t safe_charset;
+    int profile;                /* MODSECURITY_PROFILE_* */
+    uint32_t profile_endpoints;
+    uint32_t profile_min_samples;
+    modsecurity_profiles_t *profiles;
+    char *shadow_rules_file;
+    modsecurity_ruleset_t *shadow_ruleset;  /* measured, never enforced */
+    uint32_t shadow_sample;     /* one in this many transactions */
+    double canary_factor;       /* reject reloads this much slower, 0 = off */
+    uint32_t canary_time;       /* msec */
+    uint32_t response_pan_sid;  /* alert on card numbers in responses, 0 = off */
+    modsecurity_decode_limits_t decompress;     /* depth 0 leaves codings alone */
+    uint32_t decompress_memory; /* decoder arena per flow */
+    char *upload_hashes_file;
+    modsecurity_hashes_t *upload_hashes;    /* NULL unless uploads are hashed */
+    uint32_t upload_hash_sid;
 } modsecurity_config_t;
 
+/* A policy's next generation of rules, from a control socket update */
+typedef struct _modsecurity_update
+{
+    tSfPolicyId policy_id;
+    modsecurity_ruleset_t *base;        /* live rules it was built on */
+    modsecurity_ruleset_t *ruleset;     /* swapped for base, so then the old rules */
+    struct _modsecurity_update *next;
+} modsecurity_update_t;
+
+/* Traffic direction, as seen from the configured port */
+#define MODSECURITY_DIR_CLIENT 0
+#define MODSECURITY_DIR_SERVER 1
+
+typedef struct _modsecurity_stats
+{
+    uint64_t pdus;          /* rebuilt or PAF aligned PDUs inspected */
+    uint64_t raw_segments;  /* raw segments inspected, reassembly off */
+    uint64_t raw_skipped;   /* raw segments left to reassembly */
+    uint64_t bytes[2];      /* bytes inspected, per direction */
+    uint64_t http_inspect_requests;
+    uint64_t requests;
+    uint64_t parse_errors;
+    uint64_t partial_requests;  /* body cut short by a reassembly gap */
+    uint64_t aborted_requests;  /* head cut short by a reassembly gap */
+    uint64_t depth_reached[2];  /* flows handed back to stream, per direction */
+    uint64_t depth_skipped;     /* packets seen past the flow depth */
+    uint64_t blocked;           /* flows dropped on a deny */
+    uint64_t shadow_sampled;    /* transactions also run through the shadow rules */
+    uint64_t shadow_live_ns;    /* live rules on those transactions */
+    uint64_t shadow_ns;         /* shadow rules on those transactions */
+    uint64_t shadow_live_only;  /* denied by the live rules only */
+    uint64_t shadow_only;       /* denied by the shadow rules only */
+    uint64_t response_pans;     /* card numbers seen in responses */
+    uint64_t upload_files;      /* file parts hashed */
+    uint64_t upload_bad;        /* of those, on the bad list */
+} modsecurity_stats_t;
+
+/* Per flow state, stored as stream session data */
+#define MODSECURITY_SESSION_DEPTH_DONE(dir)  (0x01 << (dir))
+#define MODSECURITY_SESSION_BLOCKED          0x04
+#define MODSECURITY_SESSION_SHADOW           0x08   /* transaction sampled for the shadow rules */
+#define MODSECURITY_SESSION_RELEASED         0x10   /* only the flow is left, see ModsecurityRelease */
+
+/*
+ * What a flow keeps for its life. It starts every session, and is all that
+ * is left of one client_only releases between requests when the flow was
+ * blocked or counts a flow depth.
+ */
+typedef struct _modsecurity_flow
+{
+    uint32_t flags;
+    uint32_t inspected[2];      /* bytes counted against the flow depth */
+} modsecurity_flow_t;
+
+typedef struct _modsecurity_session
+{
+    modsecurity_flow_t flow;    /* first, the stream session data points at either */
+    modsecurity_arena_t arena;
+    modsecurity_http_parser_t parser;
+    modsecurity_trace_t trace;
+    modsecurity_tx_t tx;
+    modsecurity_tx_t shadow;
+    char remote_addr[INET6_ADDRSTRLEN];     /* REMOTE_ADDR */
+    modsecurity_http_response_t response;
+    modsecurity_arena_t response_arena;     /* decoder state, reset per body */
+    modsecurity_pan_t pan;      /* response card number scan */
+    modsecurity_upload_t upload;
+} modsecurity_session_t;
+
+/* What the response content callback needs, per call */
+typedef struct _modsecurity_response_ctx
+{
+    modsecurity_pan_t *pan;
+    uint32_t found;
+} modsecurity_response_ctx_t;
+
+/* What the upload callback needs, per call */
+typedef struct _modsecurity_upload_ctx
+{
+    modsecurity_config_t *config;
+    uint32_t bad;
+} modsecurity_upload_ctx_t;
+
 #define MODSECURITY_SUCCESS 1
 #define MODSECURITY_FAILURE (-1)
 
@@ -0,0 +1,259 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Request parser behaviour: pipelined requests come out one by one and
+ * the same however the stream is cut into PDUs, and a reassembly gap
+ * ends the request it falls in without losing the ones after it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sf_types.h"
+#include "sf_dynamic_preprocessor.h"
+#include "spp_modsecurity.h"
+#include "modsecurity_http.h"
+
+DynamicPreprocessorData _dpd;
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+/* What the parser made of the requests of a stream, one line each */
+typedef struct _transcript
+{
+    char text[4096];
+    size_t len;
+    uint32_t events;             /* every event seen */
+} transcript_t;
+
+static void Append(transcript_t *t, const char *fmt, const uint8_t *data, uint32_t len)
+{
+    t->len += snprintf(t->text + t->len, sizeof(t->text) - t->len, fmt, (int) len, (const char *) data);
+}
+
+static void Events(transcript_t *t, const modsecurity_http_parser_t *parser, uint32_t events)
+{
+    const modsecurity_http_request_t *request = &parser->request;
+
+    t->events |= events;
+
+    if (events & MODSECURITY_HTTP_EV_HEADERS)
+    {
+        Append(t, "%.*s ", request->method.data, request->method.len);
+        Append(t, "%.*s", request->uri.data, request->uri.len);
+    }
+
+    if (events & MODSECURITY_HTTP_EV_BODY)
+        Append(t, " [%.*s]", request->body.data, request->body.len);
+
+    if (events & MODSECURITY_HTTP_EV_GAP)
+        Append(t, " gap", NULL, 0);
+
+    if (events & MODSECURITY_HTTP_EV_ERROR)
+        Append(t, " error", NULL, 0);
+
+    if (events & MODSECURITY_HTTP_EV_DONE)
+        Append(t, " done\n", NULL, 0);
+}
+
+/* One PDU, parsed to the end, then kept as a stream preprocessor would */
+static void Pdu(modsecurity_http_parser_t *parser, transcript_t *t, const uint8_t *data, uint32_t len)
+{
+    uint32_t used, events;
+
+    while (len > 0)
+    {
+        used = ModsecurityHttpParse(parser, data, len, &events);
+        Events(t, parser, events);
+
+        if (used == 0)
+            break;
+
+        data += used;
+        len -= used;
+    }
+
+    ModsecurityHttpParserRetain(parser);
+}
+
+static void PduText(modsecurity_http_parser_t *parser, transcript_t *t, const char *text)
+{
+    Pdu(parser, t, (const uint8_t *) text, strlen(text));
+}
+
+/* The stream in PDUs of the given sizes, the last one taking the rest; a copy each, as packets are freed */
+static void Stream(transcript_t *t, const char *stream, const uint32_t *cuts, uint32_t ncuts)
+{
+    modsecurity_http_parser_t parser;
+    modsecurity_arena_t arena;
+    uint32_t len = strlen(stream), off = 0, n, i;
+    uint8_t *pdu;
+
+    memset(t, 0, sizeof(*t));
+    ModsecurityArenaInit(&arena, 65536);
+    ModsecurityHttpParserInit(&parser, &arena);
+
+    for (i = 0; off < len; i++)
+    {
+        n = i < ncuts && cuts[i] < len - off ? cuts[i] : len - off;
+        pdu = (uint8_t *) malloc(n);
+        memcpy(pdu, stream + off, n);
+        Pdu(&parser, t, pdu, n);
+        memset(pdu, 'Z', n);
+        free(pdu);
+        off += n;
+    }
+
+    ModsecurityArenaFree(&arena);
+}
+
+/* Where a body comes in pieces depends on the cuts, so only its bytes are compared */
+static void Join(transcript_t *t)
+{
+    size_t i;
+
+    for (i = 0; i + 2 < t->len; i++)
+    {
+        if (t->text[i] == ']' && t->text[i + 1] == ' ' && t->text[i + 2] == '[')
+        {
+            memmove(t->text + i, t->text + i + 3, t->len - i - 2);
+            t->len -= 3;
+        }
+    }
+}
+
+static const char *pipelined =
+    "GET /a?x=1 HTTP/1.1\r\nHost: h\r\n\r\n"
+    "POST /b HTTP/1.1\r\nHost: h\r\nContent-Length: 5\r\n\r\nhello"
+    "POST /c HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n2;x=y\r\nde\r\n0\r\nT: 1\r\n\r\n"
+    "HEAD /d HTTP/1.1\r\n\r\n";
+
+static void TestPipelined(void)
+{
+    transcript_t whole, joined, cut;
+    uint32_t cuts[256], i;
+
+    Stream(&whole, pipelined, NULL, 0);
+
+    CHECK(!strcmp(whole.text,
+                "GET /a?x=1 done\n"
+                "POST /b [hello] done\n"
+                "POST /c [abc] [de] done\n"
+                "HEAD /d done\n"));
+    CHECK(!(whole.events & (MODSECURITY_HTTP_EV_ERROR | MODSECURITY_HTTP_EV_GAP)));
+
+    /* Byte by byte: bodies come in pieces, the requests are the same */
+    for (i = 0; i < 256; i++)
+        cuts[i] = 1;
+
+    Stream(&cut, pipelined, cuts, 256);
+    CHECK(!strcmp(cut.text,
+                "GET /a?x=1 done\n"
+                "POST /b [h] [e] [l] [l] [o] done\n"
+                "POST /c [a] [b] [c] [d] [e] done\n"
+                "HEAD /d done\n"));
+
+    /* Cut in two anywhere */
+    joined = whole;
+    Join(&joined);
+
+    for (i = 1; i < strlen(pipelined); i++)
+    {
+        cuts[0] = i;
+        Stream(&cut, pipelined, cuts, 1);
+
+        Join(&cut);
+        CHECK(!strcmp(cut.text, joined.text));
+    }
+}
+
+static void TestGaps(void)
+{
+    modsecurity_http_parser_t parser;
+    modsecurity_arena_t arena;
+    transcript_t t;
+    uint32_t events;
+
+    memset(&t, 0, sizeof(t));
+    ModsecurityArenaInit(&arena, 65536);
+    ModsecurityHttpParserInit(&parser, &arena);
+
+    /* In a body: the request is done, only part of it seen */
+    PduText(&parser, &t, "POST /e HTTP/1.1\r\nContent-Length: 100\r\n\r\nabc");
+    events = ModsecurityHttpGap(&parser);
+    Events(&t, &parser, events);
+    CHECK((events & (MODSECURITY_HTTP_EV_GAP | MODSECURITY_HTTP_EV_DONE))
+            == (MODSECURITY_HTTP_EV_GAP | MODSECURITY_HTTP_EV_DONE));
+    CHECK(parser.flags & MODSECURITY_HTTP_PARTIAL);
+
+    /* The rest of that body is skipped up to the next request line */
+    PduText(&parser, &t, "rest of the body\r\nmore\nGET /f HTTP/1.1\r\n\r\n");
+
+    /* In a head: the request is dropped, as malformed */
+    PduText(&parser, &t, "GET /g HTTP/1.1\r\nHost: a");
+    events = ModsecurityHttpGap(&parser);
+    Events(&t, &parser, events);
+    CHECK((events & (MODSECURITY_HTTP_EV_GAP | MODSECURITY_HTTP_EV_DONE)) == MODSECURITY_HTTP_EV_GAP);
+
+    PduText(&parser, &t, "ers: x\r\n\r\nPUT /h HTTP/1.1\r\nContent-Length: 2\r\n\r\nok");
+
+    /* Between requests: nothing to end */
+    events = ModsecurityHttpGap(&parser);
+    CHECK(events == 0);
+    PduText(&parser, &t, "GET /i HTTP/1.1\r\n\r\n");
+
+    CHECK(!strcmp(t.text,
+                "POST /e [abc] gap done\n"
+                "GET /f done\n"
+                " gap error"
+                "PUT /h [ok] done\n"
+                "GET /i done\n"));
+
+    ModsecurityArenaFree(&arena);
+}
+
+int main(void)
+{
+    TestPipelined();
+    TestGaps();
+
+    if (failures)
+        fprintf(stderr, "test_http: %d failed\n", failures);
+
+    return failures != 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The regex matcher against PCRE: every pattern it takes must match
+ * exactly the subjects PCRE matches with the options @rx compiles with,
+ * PCRE_DOTALL and PCRE_DOLLAR_ENDONLY, also with a cache so small the
+ * search keeps flushing it and falls back to the NFA. Patterns it cannot
+ * match without backtracking must be refused.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pcre.h>
+
+#include "sf_types.h"
+#include "modsecurity_regex.h"
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static const char *patterns[] =
+{
+    "abc", "a.c", "a[bc]d", "[^a-c]x", "[a-c-]", "[]a]", "[\\]a]", "x[\\d\\s]y",
+    "\\d+", "\\D\\W\\S", "\\w{2,}", "a{3}", "a{2,4}b", "(?:ab){2,}", "a{0,2}$", "a*?b", "a+?b",
+    "a|bc|", "(a|bc)+d", "(?:a|b)*c", "((a)|b)?c",
+    "^ab", "ab$", "^$", "^a.*z$", "\\Aab", "ab\\z", "^(?:a|b\\n)+$",
+    "(?i)AbC", "(?i)[a-c]+x", "(?i)^GET\\s+/", "\\x41\\x62", "\\t\\r\\n", "\\.\\*\\+\\?",
+    "union\\s+select", "<script[^>]*>", "(?:\\.\\./)+etc/passwd", "[\\x80-\\xff]{2}", ".{5}",
+    "a.b", "a\\nb", "$", "x*", "(?:x|y|z){3}\\d?$",
+    "a[ab]{10}x", "(?:a|b)*a(?:a|b){12}$",    /* more DFA states than a small cache holds */
+};
+
+/* PCRE backtracks for these, they stay with it */
+static const char *refused[] =
+{
+    "(a)\\1", "a(?=b)", "a(?!b)", "(?<=a)b", "\\bword\\b", "(?>a+)b", "a++b", "(?m)^a",
+};
+
+static const char *subjects[] =
+{
+    "", "a", "ab", "abc", "xabcx", "abd", "acd", "dx", "-", "]", "x1y", "x y", "x\ty", "123", "a1_",
+    "aaa", "aaab", "aab", "ababab", "aa", "aa\n", "a\n", "b", "bc", "bcbcd", "aabc", "c", "bc\n",
+    "ab\n", "a\nb", "\n", "b\nab\n", "az", "a\nz", "a\nz\n", "ABC", "xAbCx", "bCX", "get  /x", "Ab",
+    "\t\r\n", ".*+?", "1 UNION   select 2", "union\nselect", "<script src=x>", "<scrip>",
+    "../../etc/passwd", "\xc3\xa9t\xc3\xa9", "a.b", "xyz", "zzz1", "yyy\n", "xxxxx",
+};
+
+static int Pcre(pcre *re, const char *subject, uint32_t len)
+{
+    int ovector[30];
+
+    return pcre_exec(re, NULL, subject, (int) len, 0, 0, ovector, 30) >= 0;
+}
+
+/* Subjects made of the bytes that matter to most patterns */
+static uint32_t Random(char *subject, uint32_t max, const char *bytes)
+{
+    uint32_t len = rand() % max, n = strlen(bytes), i;
+
+    for (i = 0; i < len; i++)
+        subject[i] = bytes[rand() % n];
+
+    subject[len] = '\0';
+
+    return len;
+}
+
+static void Compare(const char *pattern, modsecurity_regex_scratch_t *scratch, uint32_t cache)
+{
+    modsecurity_regex_t *regex;
+    const char *error;
+    char subject[4200];
+    uint32_t i, len;
+    int offset;
+    pcre *re;
+
+    re = pcre_compile(pattern, PCRE_DOTALL | PCRE_DOLLAR_ENDONLY, &error, &offset, NULL);
+    regex = ModsecurityRegexCompile(pattern, cache);
+
+    CHECK(re != NULL && regex != NULL);
+
+    if (re == NULL || regex == NULL)
+    {
+        fprintf(stderr, "  pattern %s\n", pattern);
+        ModsecurityRegexFree(regex);
+        return;
+    }
+
+    for (i = 0; i < sizeof(subjects) / sizeof(subjects[0]); i++)
+    {
+        len = strlen(subjects[i]);
+
+        if (ModsecurityRegexMatch(regex, scratch, (const uint8_t *) subjects[i], len) != Pcre(re, subjects[i], len))
+        {
+            fprintf(stderr, "  pattern %s subject \"%s\"\n", pattern, subjects[i]);
+            failures++;
+        }
+    }
+
+    /* Short ones of many bytes, then long ones that walk through many states */
+    for (i = 0; i < 300; i++)
+    {
+        if (i < 280)
+            len = Random(subject, 24, "abcxyzAB1 _-.\n\t/");
+        else
+            len = Random(subject, sizeof(subject) - 1, "aab\nx");
+
+        if (ModsecurityRegexMatch(regex, scratch, (const uint8_t *) subject, len) != Pcre(re, subject, len))
+        {
+            fprintf(stderr, "  pattern %s random subject of %u bytes\n", pattern, len);
+            failures++;
+        }
+    }
+
+    ModsecurityRegexFree(regex);
+    pcre_free(re);
+}
+
+int main(void)
+{
+    modsecurity_regex_stats_t stats;
+    modsecurity_regex_scratch_t *scratch;
+    uint32_t i;
+
+    memset(&stats, 0, sizeof(stats));
+    scratch = ModsecurityRegexScratchNew(&stats);
+
+    srand(1);
+
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+    {
+        Compare(patterns[i], scratch, MODSECURITY_REGEX_CACHE);
+        Compare(patterns[i], scratch, MODSECURITY_REGEX_CACHE_MIN);
+    }
+
+    /* The small cache did run out, the NFA did take over */
+    CHECK(stats.flushes > 0 && stats.nfa_fallbacks > 0);
+
+    for (i = 0; i < sizeof(refused) / sizeof(refused[0]); i++)
+        CHECK(ModsecurityRegexCompile(refused[i], MODSECURITY_REGEX_CACHE) == NULL);
+
+    ModsecurityRegexScratchFree(scratch);
+
+    if (failures)
+        fprintf(stderr, "test_regex: %d failed\n", failures);
+
+    return failures != 0;
+}
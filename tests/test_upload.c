@@ -0,0 +1,193 @@
+/*
+ * vim:sw=4 ts=4:et sta
+ *
+ *
+ * Copyright (c) 2016, Fakhri Zulkifli <mohdfakhrizulkifli at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * * Neither the name of spp_modsecurity nor the names of its
+ *   contributors may be used to endorse or promote products derived from
+ *   this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Multipart upload behaviour: every file part is hashed whole and only
+ * file parts are, wherever the body is cut into segments, delimiters and
+ * part headers included, and bytes that only start like a delimiter stay
+ * part of the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "sf_types.h"
+#include "sf_dynamic_preprocessor.h"
+#include "spp_modsecurity.h"
+#include "modsecurity_upload.h"
+
+DynamicPreprocessorData _dpd;
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+#define MAX_FILES 4
+
+typedef struct _files
+{
+    modsecurity_upload_file_t file[MAX_FILES];
+    int count;
+} files_t;
+
+static void File(void *context, const modsecurity_upload_file_t *file)
+{
+    files_t *files = (files_t *) context;
+
+    if (files->count < MAX_FILES)
+        files->file[files->count] = *file;
+
+    files->count++;
+}
+
+static void Digest(const char *data, uint8_t *digest)
+{
+    EVP_Digest(data, strlen(data), digest, NULL, EVP_sha256(), NULL);
+}
+
+static const char *header =
+    "POST /upload HTTP/1.1\r\n"
+    "Host: h\r\n"
+    "Content-Type: multipart/form-data; boundary=\"----xYz\"\r\n"
+    "\r\n";
+
+/* Two files around a field, the second holding what falls short of a delimiter */
+static const char *first = "GIF89a first file\r\n";
+static const char *second = "line\r\n------xY\r\n-----xYz not the end\r\n--\r\n------x";
+
+static char body[1024];
+
+static void Body(void)
+{
+    snprintf(body, sizeof(body),
+            "preamble\r\n"
+            "------xYz\r\n"
+            "Content-Disposition: form-data; name=\"a\"; filename=\"a.gif\"\r\n"
+            "Content-Type: image/gif\r\n"
+            "\r\n"
+            "%s"
+            "\r\n------xYz\r\n"
+            "Content-Disposition: form-data; name=\"field\"\r\n"
+            "\r\n"
+            "not a file"
+            "\r\n------xYz\r\n"
+            "content-disposition: form-data; name=b; FILENAME=b.txt\r\n"
+            "\r\n"
+            "%s"
+            "\r\n------xYz--\r\n"
+            "epilogue",
+            first, second);
+}
+
+/* The body in segments cut at the given offsets, each one a copy of its own */
+static void Upload(files_t *files, const uint32_t *cuts, int ncuts)
+{
+    modsecurity_upload_t upload;
+    modsecurity_buf_t head;
+    uint32_t len = strlen(body), off = 0, end;
+    uint8_t *segment;
+    int i;
+
+    memset(&upload, 0, sizeof(upload));
+    memset(files, 0, sizeof(*files));
+    head.data = (const uint8_t *) header;
+    head.len = strlen(header);
+
+    CHECK(ModsecurityUploadStart(&upload, &head) == MODSECURITY_SUCCESS);
+
+    for (i = 0; i <= ncuts; i++)
+    {
+        end = i < ncuts ? cuts[i] : len;
+        segment = (uint8_t *) malloc(end - off + 1);
+        memcpy(segment, body + off, end - off);
+        ModsecurityUploadData(&upload, segment, end - off, File, files);
+        free(segment);
+        off = end;
+    }
+
+    CHECK(upload.state == MODSECURITY_UPLOAD_DONE);
+    ModsecurityUploadEnd(&upload);
+}
+
+static int Same(const files_t *files)
+{
+    uint8_t digest[2][MODSECURITY_UPLOAD_DIGEST];
+
+    Digest(first, digest[0]);
+    Digest(second, digest[1]);
+
+    return files->count == 2
+        && files->file[0].size == strlen(first) && !memcmp(files->file[0].digest, digest[0], sizeof(digest[0]))
+        && files->file[1].size == strlen(second) && !memcmp(files->file[1].digest, digest[1], sizeof(digest[1]));
+}
+
+int main(void)
+{
+    uint32_t cuts[2], len, i, j;
+    files_t files;
+
+    Body();
+    len = strlen(body);
+
+    Upload(&files, NULL, 0);
+    CHECK(Same(&files));
+    CHECK(files.count == 2 && files.file[0].msg != NULL);
+
+    /* One cut anywhere, in a delimiter or a part header as much as in a file */
+    for (i = 1; i < len; i++)
+    {
+        cuts[0] = i;
+        Upload(&files, cuts, 1);
+        CHECK(Same(&files));
+    }
+
+    /* Two cuts close together, a delimiter spread over three segments */
+    for (i = 1; i < len; i++)
+    {
+        for (j = i + 1; j < len && j < i + MODSECURITY_UPLOAD_DELIM; j++)
+        {
+            cuts[0] = i;
+            cuts[1] = j;
+            Upload(&files, cuts, 2);
+            CHECK(Same(&files));
+        }
+    }
+
+    if (failures)
+        fprintf(stderr, "test_upload: %d failed\n", failures);
+
+    return failures != 0;
+}